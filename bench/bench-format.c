@@ -0,0 +1,434 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+/* Micro-benchmarks of the formatting and parsing hot path. Every case runs over the same synthetic journal
+ * entries and reports the time, the heap allocations and, where perf events are available, the CPU cycles
+ * spent per message.
+ *
+ * The destinations have no server, so protocol_send() returns as soon as the message is formatted. The
+ * serialize case copies the formatted message into one buffer, like the TCP send queue does.
+ *
+ * Usage: bench-format [MESSAGES [CASE...]] */
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "alloc-util.h"
+#include "fd-util.h"
+#include "io-util.h"
+#include "macro.h"
+#include "netlog-journal.h"
+#include "netlog-manager.h"
+#include "netlog-protocol.h"
+#include "parse-util.h"
+#include "string-util.h"
+#include "strv.h"
+#include "time-util.h"
+
+#define BENCH_ENTRIES           1024U
+#define BENCH_DEFAULT_MESSAGES  1000000U
+
+/* Run before measuring, so that buffers grown on the first messages don't count */
+#define BENCH_WARMUP_MESSAGES   BENCH_ENTRIES
+
+typedef struct BenchEntry {
+        /* The entry as sd_journal_enumerate_data() returns it */
+        char **data;
+
+        int severity;
+        int facility;
+        struct timeval tv;
+        const char *identifier;
+        const char *message;
+        const char *hostname;
+        const char *pid;
+        const char *structured_data;
+        const char *msgid;
+} BenchEntry;
+
+typedef struct Bench {
+        Manager manager;
+        Destination rfc5424;
+        Destination rfc5425;
+        Destination rfc3164;
+
+        BenchEntry entries[BENCH_ENTRIES];
+
+        OutputBuffer output;
+        uint64_t n_bytes;
+} Bench;
+
+typedef struct BenchCase {
+        const char *name;
+        int (*run)(Bench *b, const BenchEntry *e, uint64_t i);
+        bool bytes;
+} BenchCase;
+
+/* Counts allocations by interposing the allocator of libc */
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+
+static uint64_t n_allocations;
+
+void *malloc(size_t size) {
+        n_allocations++;
+        return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+        n_allocations++;
+        return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+        n_allocations++;
+        return __libc_realloc(p, size);
+}
+
+static int cycles_open(void) {
+        struct perf_event_attr attr = {
+                .type = PERF_TYPE_HARDWARE,
+                .size = sizeof(struct perf_event_attr),
+                .config = PERF_COUNT_HW_CPU_CYCLES,
+                .disabled = 1,
+                .exclude_kernel = 1,
+                .exclude_hv = 1,
+        };
+        int fd;
+
+        fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0)
+                return -errno;
+
+        return fd;
+}
+
+static uint64_t random_next(uint64_t *state) {
+        /* Entries only need to differ, and to be the same on every run */
+        *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return *state >> 33;
+}
+
+_printf_(2, 3)
+static int bench_entry_add(BenchEntry *e, const char *format, ...) {
+        va_list ap;
+        char *s;
+        int r;
+
+        va_start(ap, format);
+        r = vasprintf(&s, format, ap);
+        va_end(ap);
+        if (r < 0)
+                return -ENOMEM;
+
+        return strv_consume(&e->data, s);
+}
+
+static int bench_entry_init(BenchEntry *e, uint64_t *state, unsigned i) {
+        static const char *const units[] = {
+                "sshd.service", "cron.service", "nginx.service", "postgresql.service", "systemd-logind.service",
+        };
+        static const char filler[] =
+                "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut "
+                "labore et dolore magna aliqua. Ut enim ad minim veniam, quis nostrud exercitation ullamco "
+                "laboris nisi ut aliquip ex ea commodo consequat. Duis aute irure dolor in reprehenderit in "
+                "voluptate velit esse cillum dolore eu fugiat nulla pariatur. Excepteur sint occaecat cupidatat.";
+        const char *unit = units[random_next(state) % ELEMENTSOF(units)];
+        size_t message_len = 32 + random_next(state) % (sizeof(filler) - 32);
+        unsigned pid = 100 + random_next(state) % 30000;
+        char **d;
+        int r;
+
+        e->severity = random_next(state) % 8;
+        e->facility = 3;
+        e->tv = (struct timeval) {
+                .tv_sec = 1700000000 + i / 16,
+                .tv_usec = random_next(state) % USEC_PER_SEC,
+        };
+
+        r = bench_entry_add(e, "_BOOT_ID=%032" PRIx64, random_next(state));
+        if (r >= 0)
+                r = bench_entry_add(e, "_MACHINE_ID=c7d0f2a4e3b84b5d9a3f6e1b2c4d5e6f");
+        if (r >= 0)
+                r = bench_entry_add(e, "_HOSTNAME=bench-host.example.com");
+        if (r >= 0)
+                r = bench_entry_add(e, "_TRANSPORT=journal");
+        if (r >= 0)
+                r = bench_entry_add(e, "PRIORITY=%i", e->severity);
+        if (r >= 0)
+                r = bench_entry_add(e, "SYSLOG_FACILITY=3");
+        if (r >= 0)
+                r = bench_entry_add(e, "SYSLOG_IDENTIFIER=%.*s", (int) (strchr(unit, '.') - unit), unit);
+        if (r >= 0)
+                r = bench_entry_add(e, "_PID=%u", pid);
+        if (r >= 0)
+                r = bench_entry_add(e, "_UID=0");
+        if (r >= 0)
+                r = bench_entry_add(e, "_GID=0");
+        if (r >= 0)
+                r = bench_entry_add(e, "_SYSTEMD_CGROUP=/system.slice/%s", unit);
+        if (r >= 0)
+                r = bench_entry_add(e, "_SYSTEMD_UNIT=%s", unit);
+        if (r >= 0)
+                r = bench_entry_add(e, "_SYSTEMD_SLICE=system.slice");
+        if (r >= 0)
+                r = bench_entry_add(e, "CODE_LINE=%" PRIu64, random_next(state) % 5000);
+        if (r >= 0)
+                r = bench_entry_add(e, "_SOURCE_REALTIME_TIMESTAMP=%" PRIu64,
+                                    (uint64_t) e->tv.tv_sec * USEC_PER_SEC + e->tv.tv_usec);
+        if (r >= 0)
+                r = bench_entry_add(e, "MESSAGE=%.*s", (int) message_len, filler);
+
+        /* Some entries carry the optional syslog fields too */
+        if (r >= 0 && i % 8 == 0)
+                r = bench_entry_add(e, "SYSLOG_MSGID=ID47");
+        if (r >= 0 && i % 8 == 0)
+                r = bench_entry_add(e, "SYSLOG_STRUCTURED_DATA=[exampleSDID@32473 iut=\"3\" eventSource=\"Application\"]");
+        if (r < 0)
+                return r;
+
+        STRV_FOREACH(d, e->data) {
+                const char *v = strchr(*d, '=') + 1;
+
+                if (startswith(*d, "SYSLOG_IDENTIFIER="))
+                        e->identifier = v;
+                else if (startswith(*d, "MESSAGE="))
+                        e->message = v;
+                else if (startswith(*d, "_HOSTNAME="))
+                        e->hostname = v;
+                else if (startswith(*d, "_PID="))
+                        e->pid = v;
+                else if (startswith(*d, "SYSLOG_STRUCTURED_DATA="))
+                        e->structured_data = v;
+                else if (startswith(*d, "SYSLOG_MSGID="))
+                        e->msgid = v;
+        }
+
+        return 0;
+}
+
+static int bench_run_timestamp(Bench *b, const BenchEntry *e, uint64_t i) {
+        char buf[FORMAT_TIMESTAMP_MAX];
+
+        format_rfc3339_timestamp(&e->tv, buf, sizeof(buf));
+        return 0;
+}
+
+static int bench_run_timestamp_cached(Bench *b, const BenchEntry *e, uint64_t i) {
+        char buf[FORMAT_TIMESTAMP_MAX];
+
+        format_rfc3339_timestamp_cached(&b->manager.timestamp_cache, &e->tv, buf, sizeof(buf));
+        return 0;
+}
+
+static int bench_run_parse(Bench *b, const BenchEntry *e, uint64_t i) {
+        JournalFields f;
+        char **d;
+        int r;
+
+        journal_fields_reset(&b->manager, &f);
+
+        STRV_FOREACH(d, e->data) {
+                r = journal_parse_data(&b->manager, &f, *d, strlen(*d));
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+static int bench_run_format(Destination *d, const BenchEntry *e) {
+        int r;
+
+        if (d->log_format == SYSLOG_TRANSMISSION_LOG_FORMAT_RFC_3164)
+                r = format_rfc3164(d, e->severity, e->facility, e->identifier, e->message, e->hostname, e->pid,
+                                   &e->tv);
+        else
+                r = format_rfc5424(d, e->severity, e->facility, e->identifier, e->message, e->hostname, e->pid,
+                                   &e->tv, e->structured_data, e->msgid);
+
+        /* Nothing to send it to */
+        return r == -ENOTCONN ? 0 : r;
+}
+
+static int bench_run_rfc5424(Bench *b, const BenchEntry *e, uint64_t i) {
+        return bench_run_format(&b->rfc5424, e);
+}
+
+static int bench_run_rfc5425(Bench *b, const BenchEntry *e, uint64_t i) {
+        return bench_run_format(&b->rfc5425, e);
+}
+
+static int bench_run_rfc3164(Bench *b, const BenchEntry *e, uint64_t i) {
+        return bench_run_format(&b->rfc3164, e);
+}
+
+static int bench_run_serialize(Bench *b, const BenchEntry *e, uint64_t i) {
+        size_t start;
+        int r;
+
+        /* Start over every now and then, as if the batch had been sent */
+        if (b->output.size > 64U * 1024U)
+                b->output.size = 0;
+
+        start = b->output.size;
+
+        r = format_message(&b->rfc5424, &b->manager.timestamp_cache, &b->output, e->severity, e->facility,
+                           e->identifier, e->message, e->hostname, e->pid, &e->tv, e->structured_data, e->msgid);
+        if (r < 0)
+                return r;
+
+        b->n_bytes += b->output.size - start;
+
+        return 0;
+}
+
+static const BenchCase bench_cases[] = {
+        { "rfc3339-timestamp",        bench_run_timestamp,        false },
+        { "rfc3339-timestamp-cached", bench_run_timestamp_cached, false },
+        { "parse-fields",             bench_run_parse,            false },
+        { "rfc5424",                  bench_run_rfc5424,          false },
+        { "rfc5425",                  bench_run_rfc5425,          false },
+        { "rfc3164",                  bench_run_rfc3164,          false },
+        { "rfc5424-serialize",        bench_run_serialize,        true  },
+};
+
+static int bench_case(Bench *b, const BenchCase *c, uint64_t n_messages, int cycles_fd) {
+        uint64_t allocations, cycles = 0;
+        nsec_t start, elapsed;
+        int r;
+
+        for (uint64_t i = 0; i < BENCH_WARMUP_MESSAGES; i++) {
+                r = c->run(b, &b->entries[i % BENCH_ENTRIES], i);
+                if (r < 0)
+                        return r;
+        }
+
+        b->n_bytes = 0;
+        allocations = n_allocations;
+
+        if (cycles_fd >= 0) {
+                (void) ioctl(cycles_fd, PERF_EVENT_IOC_RESET, 0);
+                (void) ioctl(cycles_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+
+        start = now_nsec(CLOCK_MONOTONIC);
+
+        for (uint64_t i = 0; i < n_messages; i++) {
+                r = c->run(b, &b->entries[i % BENCH_ENTRIES], i);
+                if (r < 0)
+                        return r;
+        }
+
+        elapsed = now_nsec(CLOCK_MONOTONIC) - start;
+
+        if (cycles_fd >= 0) {
+                (void) ioctl(cycles_fd, PERF_EVENT_IOC_DISABLE, 0);
+                if (read(cycles_fd, &cycles, sizeof(cycles)) != sizeof(cycles))
+                        cycles = 0;
+        }
+
+        allocations = n_allocations - allocations;
+
+        printf("%-26s %10" PRIu64 " %10.1f %11.3f",
+               c->name, n_messages, (double) elapsed / n_messages, (double) allocations / n_messages);
+
+        if (cycles_fd >= 0)
+                printf(" %11.1f", (double) cycles / n_messages);
+        else
+                printf(" %11s", "-");
+
+        if (c->bytes)
+                printf(" %10.1f\n", (double) b->n_bytes / n_messages);
+        else
+                printf(" %10s\n", "-");
+
+        return 0;
+}
+
+static void bench_done(Bench *b) {
+        for (size_t i = 0; i < ELEMENTSOF(b->entries); i++)
+                strv_free(b->entries[i].data);
+
+        free(b->manager.entry_buffer);
+        output_buffer_done(&b->manager.output);
+        output_buffer_done(&b->output);
+        free(b);
+}
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(Bench*, bench_done);
+
+int main(int argc, char *argv[]) {
+        _cleanup_(bench_donep) Bench *b = NULL;
+        _cleanup_close_ int cycles_fd = -1;
+        unsigned n_messages = BENCH_DEFAULT_MESSAGES;
+        uint64_t state = 1;
+        int r;
+
+        if (argc > 1) {
+                r = safe_atou(argv[1], &n_messages);
+                if (r < 0 || n_messages == 0) {
+                        fprintf(stderr, "Invalid number of messages: %s\n", argv[1]);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        b = new0(Bench, 1);
+        if (!b)
+                return EXIT_FAILURE;
+
+        b->rfc5424 = (Destination) {
+                .manager = &b->manager,
+                .name = (char *) "rfc5424",
+                .protocol = SYSLOG_TRANSMISSION_PROTOCOL_TCP,
+                .log_format = SYSLOG_TRANSMISSION_LOG_FORMAT_RFC_5424,
+        };
+        b->rfc5425 = (Destination) {
+                .manager = &b->manager,
+                .name = (char *) "rfc5425",
+                .protocol = SYSLOG_TRANSMISSION_PROTOCOL_TLS,
+                .log_format = SYSLOG_TRANSMISSION_LOG_FORMAT_RFC_5425,
+        };
+        b->rfc3164 = (Destination) {
+                .manager = &b->manager,
+                .name = (char *) "rfc3164",
+                .protocol = SYSLOG_TRANSMISSION_PROTOCOL_UDP,
+                .log_format = SYSLOG_TRANSMISSION_LOG_FORMAT_RFC_3164,
+        };
+
+        for (unsigned i = 0; i < BENCH_ENTRIES; i++) {
+                r = bench_entry_init(&b->entries[i], &state, i);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to generate entries: %s\n", strerror(-r));
+                        return EXIT_FAILURE;
+                }
+        }
+
+        cycles_fd = cycles_open();
+        if (cycles_fd < 0)
+                fprintf(stderr, "CPU cycles not counted, perf events unavailable: %s\n", strerror(-cycles_fd));
+
+        printf("%-26s %10s %10s %11s %11s %10s\n", "case", "messages", "ns/msg", "allocs/msg", "cycles/msg", "bytes/msg");
+
+        for (size_t i = 0; i < ELEMENTSOF(bench_cases); i++) {
+                const BenchCase *c = &bench_cases[i];
+
+                if (argc > 2 && !strv_contains(argv + 2, c->name))
+                        continue;
+
+                r = bench_case(b, c, n_messages, cycles_fd);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to run %s: %s\n", c->name, strerror(-r));
+                        return EXIT_FAILURE;
+                }
+        }
+
+        return EXIT_SUCCESS;
+}
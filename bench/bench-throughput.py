@@ -0,0 +1,583 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: LGPL-2.1-or-later
+"""End-to-end throughput benchmark of systemd-netlogd.
+
+Writes a synthetic journal directory with systemd-journal-remote, forwards it
+with systemd-netlogd (Directory=) to a collector stand-in on localhost, and
+reports per protocol and log format:
+
+  - messages and bytes per second, from the first to the last message of the
+    backlog arriving at the collector,
+  - CPU time the daemon spent per message while sending the backlog,
+  - p50/p99 latency of entries written at a fixed rate once the backlog was
+    sent, from handing them to the journal writer until they arrived.
+
+The collector counts and validates every message: the syslog header of the
+log format, the RFC 5425 octet count, the length of the message, and that
+every entry arrived once and in order. TLS and DTLS use a throwaway
+self-signed certificate. The DTLS collector is openssl s_server.
+
+Needs root, as systemd-netlogd drops privileges to systemd-journal-netlog.
+"""
+
+import argparse
+import grp
+import os
+import pwd
+import re
+import secrets
+import selectors
+import shutil
+import socket
+import ssl
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+PROTOCOLS = ('udp', 'tcp', 'tls', 'dtls')
+FORMATS = ('rfc5424', 'rfc3164', 'rfc5425')
+
+# RFC 5425 framing only makes sense on streams
+STREAM_PROTOCOLS = ('tcp', 'tls')
+
+IDENTIFIER = 'netlogd-bench'
+MARKER = IDENTIFIER.encode() + b' '
+NETLOG_USER = 'systemd-journal-netlog'
+
+# Not exported by the socket module
+SO_RCVBUFFORCE = getattr(socket, 'SO_RCVBUFFORCE', 33)
+
+BODY_RE = re.compile(rb'netlogd-bench (\d+) (\d+) x*')
+RFC5424_RE = re.compile(rb'<(\d{1,3})>1 \S+ \S+ \S+ \S+ \S+ (?:-|\[.*?\]) (.*)', re.S)
+RFC3164_RE = re.compile(rb'<(\d{1,3})>\d{4}-\d\d-\d\dT\S+ \S+ [^:]+: (.*)', re.S)
+SYSLOG_START_RE = re.compile(rb'<\d{1,3}>(?:1 |\d{4}-\d\d-\d\dT)')
+
+
+def message_body(seq, sent_us, width):
+    body = '%s %d %d ' % (IDENTIFIER, seq, sent_us)
+    return body + 'x' * max(width - len(body), 0)
+
+
+def export_entry(seq, realtime_us, sent_us, boot_id, args):
+    """One entry in the journal export format, as systemd-journal-remote reads it"""
+    fields = [
+        '__REALTIME_TIMESTAMP=%d' % realtime_us,
+        '__MONOTONIC_TIMESTAMP=%d' % (seq + 1),
+        '_BOOT_ID=' + boot_id,
+        '_HOSTNAME=bench-host',
+        '_TRANSPORT=journal',
+        '_PID=4242',
+        'PRIORITY=6',
+        'SYSLOG_FACILITY=3',
+        'SYSLOG_IDENTIFIER=' + IDENTIFIER,
+    ]
+    fields += ['BENCH_FIELD_%d=%s' % (i, 'y' * args.field_width) for i in range(args.fields)]
+    fields.append('MESSAGE=' + message_body(seq, sent_us, args.width))
+
+    return '\n'.join(fields) + '\n\n'
+
+
+class JournalWriter:
+    """Feeds entries to systemd-journal-remote, which writes them to one journal file"""
+
+    def __init__(self, args, path):
+        self.args = args
+        self.boot_id = secrets.token_hex(16)
+        self.process = subprocess.Popen([args.journal_remote, '--output=' + path, '--split-mode=none', '-'],
+                                        stdin=subprocess.PIPE)
+
+    def write(self, entries):
+        self.process.stdin.write(''.join(entries).encode())
+        self.process.stdin.flush()
+
+    def close(self):
+        self.process.stdin.close()
+        if self.process.wait() != 0:
+            sys.exit('%s failed with %d' % (self.args.journal_remote, self.process.returncode))
+
+
+def generate_journal(args, directory):
+    writer = JournalWriter(args, os.path.join(directory, 'backlog.journal'))
+    start = int(time.time() * 1000000) - args.messages
+    batch = []
+
+    for seq in range(args.messages):
+        batch.append(export_entry(seq, start + seq, 0, writer.boot_id, args))
+        if len(batch) == 1000:
+            writer.write(batch)
+            batch = []
+
+    writer.write(batch)
+    writer.close()
+
+
+class Sink:
+    """Collects whatever arrives with the time it arrived, parsed only after the run"""
+
+    def __init__(self):
+        self.chunks = []
+        self.count = 0
+        self.stopping = False
+        self.thread = threading.Thread(target=self.run, daemon=True)
+
+    def received(self, stream, data):
+        self.chunks.append((stream, time.time(), data))
+        self.count += data.count(MARKER)
+
+    def start(self):
+        self.thread.start()
+
+    def stop(self):
+        self.stopping = True
+        self.thread.join()
+
+
+class DatagramSink(Sink):
+    def __init__(self):
+        super().__init__()
+        self.socket = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.socket.setsockopt(socket.SOL_SOCKET, SO_RCVBUFFORCE, 64 * 1024 * 1024)
+        self.socket.bind(('127.0.0.1', 0))
+        self.socket.settimeout(0.2)
+        self.port = self.socket.getsockname()[1]
+
+    def run(self):
+        while not self.stopping:
+            try:
+                data = self.socket.recv(65536)
+            except socket.timeout:
+                continue
+            self.received(None, data)
+
+        self.socket.close()
+
+
+class StreamSink(Sink):
+    def __init__(self, context=None):
+        super().__init__()
+        self.context = context
+        self.listener = socket.socket()
+        self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.listener.bind(('127.0.0.1', 0))
+        self.listener.listen(16)
+        self.port = self.listener.getsockname()[1]
+        self.n_connections = 0
+
+    def run(self):
+        selector = selectors.DefaultSelector()
+        selector.register(self.listener, selectors.EVENT_READ)
+
+        while not self.stopping:
+            for key, _ in selector.select(0.2):
+                if key.fileobj is self.listener:
+                    conn, _ = self.listener.accept()
+                    if self.context:
+                        conn = self.context.wrap_socket(conn, server_side=True)
+                    self.n_connections += 1
+                    selector.register(conn, selectors.EVENT_READ, self.n_connections)
+                    continue
+
+                try:
+                    data = key.fileobj.recv(1024 * 1024)
+                except (ssl.SSLWantReadError, BlockingIOError):
+                    continue
+                except OSError:
+                    data = b''
+                if not data:
+                    selector.unregister(key.fileobj)
+                    key.fileobj.close()
+                    continue
+
+                self.received(key.data, data)
+
+        for key in list(selector.get_map().values()):
+            key.fileobj.close()
+
+
+class DtlsSink(Sink):
+    def __init__(self, certificate, key):
+        super().__init__()
+        with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as s:
+            s.bind(('127.0.0.1', 0))
+            self.port = s.getsockname()[1]
+
+        # stdin is kept open, s_server stops reading once it hits the end of it
+        self.process = subprocess.Popen(['openssl', 's_server', '-dtls', '-quiet',
+                                         '-accept', '127.0.0.1:%d' % self.port,
+                                         '-cert', certificate, '-key', key],
+                                        stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+
+    def run(self):
+        fd = self.process.stdout.fileno()
+        while True:
+            data = os.read(fd, 1024 * 1024)
+            if not data:
+                break
+            self.received(None, data)
+
+    def stop(self):
+        self.process.terminate()
+        self.process.wait()
+        super().stop()
+
+
+def split_messages(sink, protocol, log_format):
+    """Splits what the sink received into (time, message) in the order it arrived"""
+    messages = []
+    buffers = {}
+
+    for stream, t, data in sink.chunks:
+        if protocol == 'udp':
+            messages.append((t, data))
+            continue
+
+        buf = buffers.get(stream, b'') + data
+
+        if log_format == 'rfc5425':
+            while True:
+                space = buf.find(b' ')
+                if space < 0:
+                    break
+                try:
+                    length = int(buf[:space])
+                except ValueError:
+                    # Lost track of the framing, the rest of the stream is invalid
+                    messages.append((t, buf))
+                    buf = b''
+                    break
+                if len(buf) < space + 1 + length:
+                    break
+                messages.append((t, buf[space + 1:space + 1 + length]))
+                buf = buf[space + 1 + length:]
+        elif protocol == 'dtls':
+            # s_server writes the records back to back, split at every syslog header
+            starts = [m.start() for m in SYSLOG_START_RE.finditer(buf)]
+            for begin, end in zip(starts, starts[1:]):
+                messages.append((t, buf[begin:end]))
+            buf = buf[starts[-1]:] if starts else buf
+        else:
+            lines = buf.split(b'\n')
+            messages += [(t, line) for line in lines[:-1]]
+            buf = lines[-1]
+
+        buffers[stream] = buf
+
+    # Whatever is left of the streams: the last DTLS record, or truncated messages
+    for buf in buffers.values():
+        if buf:
+            messages.append((sink.chunks[-1][1], buf))
+
+    return messages
+
+
+def validate(message, log_format, width):
+    """Returns (sequence number, send time) of a valid benchmark message, None for others, raises on
+    invalid ones"""
+    m = (RFC3164_RE if log_format == 'rfc3164' else RFC5424_RE).fullmatch(message.rstrip(b'\n'))
+    if not m:
+        raise ValueError('bad syslog header')
+
+    if MARKER not in m.group(2):
+        return None
+
+    body = BODY_RE.fullmatch(m.group(2))
+    if not body:
+        raise ValueError('bad message')
+    if width and len(body.group(0)) != max(width, len(MARKER)):
+        raise ValueError('message of %d bytes, expected %d' % (len(body.group(0)), width))
+
+    return int(body.group(1)), int(body.group(2))
+
+
+def percentile(values, p):
+    if not values:
+        return None
+    values = sorted(values)
+    return values[min(int(len(values) * p), len(values) - 1)]
+
+
+def process_cpu_seconds(pid):
+    with open('/proc/%d/stat' % pid) as f:
+        fields = f.read().rsplit(')', 1)[1].split()
+    # utime and stime, the 14th and 15th field, of all threads
+    return (int(fields[11]) + int(fields[12])) / os.sysconf('SC_CLK_TCK')
+
+
+def wait_for(sink, daemon, expected, idle_timeout):
+    last, last_change = -1, time.monotonic()
+
+    while expected is None or sink.count < expected:
+        if daemon.poll() is not None:
+            sys.exit('systemd-netlogd exited with %d, see its log' % daemon.returncode)
+
+        if sink.count != last:
+            last, last_change = sink.count, time.monotonic()
+        elif time.monotonic() - last_change > idle_timeout:
+            break
+
+        time.sleep(0.05)
+
+
+def write_paced(args, directory, name, first_seq):
+    writer = JournalWriter(args, os.path.join(directory, name + '.journal'))
+    interval = 1.0 / args.rate
+    start = time.monotonic()
+
+    for i in range(args.paced):
+        delay = start + i * interval - time.monotonic()
+        if delay > 0:
+            time.sleep(delay)
+
+        now = int(time.time() * 1000000)
+        writer.write([export_entry(first_seq + i, now, now, writer.boot_id, args)])
+
+    writer.close()
+    return os.path.join(directory, name + '.journal')
+
+
+def write_config(path, args, journal_dir, protocol, log_format, port):
+    lines = [
+        '[Network]',
+        'Directory=' + journal_dir,
+        'Address=127.0.0.1:%d' % port,
+        'Protocol=' + protocol,
+        'LogFormat=' + log_format,
+        'Workers=%d' % args.workers,
+        'CatchUpThresholdSec=0',
+    ]
+    if protocol in ('tls', 'dtls'):
+        lines.append('TLSCertificateAuthMode=no')
+
+    with open(path, 'w') as f:
+        f.write('\n'.join(lines + args.option) + '\n')
+
+
+def run(args, workdir, journal_dir, protocol, log_format, tls_files):
+    name = '%s-%s' % (protocol, log_format)
+
+    if protocol == 'udp':
+        sink = DatagramSink()
+    elif protocol == 'tcp':
+        sink = StreamSink()
+    elif protocol == 'tls':
+        context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+        context.load_cert_chain(*tls_files)
+        sink = StreamSink(context)
+    else:
+        sink = DtlsSink(*tls_files)
+    sink.start()
+
+    config = os.path.join(workdir, name + '.conf')
+    write_config(config, args, journal_dir, protocol, log_format, sink.port)
+
+    state_dir = os.path.join(workdir, 'state-' + name)
+    os.mkdir(state_dir)
+    user = pwd.getpwnam(NETLOG_USER)
+    os.chown(state_dir, user.pw_uid, user.pw_gid)
+
+    with open(os.path.join(workdir, name + '.log'), 'w') as log:
+        daemon = subprocess.Popen([args.netlogd, '--config=' + config, '--save-state=' + os.path.join(state_dir, 'state')],
+                                  stdout=log, stderr=log,
+                                  env=dict(os.environ, SYSTEMD_LOG_TARGET='console', SYSTEMD_LOG_COLOR='0'))
+
+        wait_for(sink, daemon, args.messages if not args.directory else None, args.idle_timeout)
+        cpu = process_cpu_seconds(daemon.pid)
+        backlog = sink.count
+
+        paced = None
+        if args.paced > 0 and not args.directory:
+            paced = write_paced(args, journal_dir, name, args.messages)
+            wait_for(sink, daemon, backlog + args.paced, args.idle_timeout)
+
+        daemon.terminate()
+        daemon.wait()
+
+    sink.stop()
+
+    if paced:
+        os.unlink(paced)
+
+    return analyze(args, name, split_messages(sink, protocol, log_format), log_format, cpu)
+
+
+def analyze(args, name, messages, log_format, cpu):
+    seen = set()
+    invalid = foreign = duplicates = reordered = 0
+    backlog_times, backlog_bytes, latencies = [], 0, []
+    last_seq = -1
+    error = None
+
+    for t, message in messages:
+        try:
+            parsed = validate(message, log_format, args.width if not args.directory else 0)
+        except ValueError as e:
+            invalid += 1
+            error = error or '%s: %r' % (e, message[:120])
+            continue
+
+        if parsed is None:
+            foreign += 1
+            backlog_times.append(t)
+            backlog_bytes += len(message)
+            continue
+
+        seq, sent_us = parsed
+        if seq in seen:
+            duplicates += 1
+            continue
+        seen.add(seq)
+
+        if seq < last_seq:
+            reordered += 1
+        last_seq = max(last_seq, seq)
+
+        if sent_us:
+            latencies.append(t - sent_us / 1000000)
+        else:
+            backlog_times.append(t)
+            backlog_bytes += len(message)
+
+    n = len(backlog_times)
+    duration = backlog_times[-1] - backlog_times[0] if n > 1 else 0
+    expected = 0 if args.directory else args.messages + (args.paced if latencies or args.paced else 0)
+
+    return {
+        'name': name,
+        'received': len(messages),
+        'invalid': invalid,
+        'foreign': foreign,
+        'duplicates': duplicates,
+        'reordered': reordered,
+        'missing': max(expected - len(seen), 0),
+        'msgs_per_sec': n / duration if duration else None,
+        'bytes_per_sec': backlog_bytes / duration if duration else None,
+        'cpu_us_per_msg': cpu * 1000000 / n if n else None,
+        'p50_ms': percentile(latencies, 0.5) * 1000 if latencies else None,
+        'p99_ms': percentile(latencies, 0.99) * 1000 if latencies else None,
+        'error': error,
+    }
+
+
+def report(results):
+    def fmt(value, spec):
+        return '-' if value is None else spec % value
+
+    print('%-16s %9s %7s %7s %7s %10s %9s %9s %9s %10s' % (
+        'run', 'received', 'invalid', 'missing', 'dup', 'msgs/s', 'MB/s', 'p50 ms', 'p99 ms', 'cpu us/msg'))
+
+    for r in results:
+        print('%-16s %9d %7d %7d %7d %10s %9s %9s %9s %10s' % (
+            r['name'], r['received'], r['invalid'], r['missing'], r['duplicates'],
+            fmt(r['msgs_per_sec'], '%.0f'),
+            fmt(r['bytes_per_sec'] and r['bytes_per_sec'] / 1000000, '%.2f'),
+            fmt(r['p50_ms'], '%.2f'), fmt(r['p99_ms'], '%.2f'),
+            fmt(r['cpu_us_per_msg'], '%.2f')))
+
+    for r in results:
+        if r['reordered']:
+            print('%s: %d messages out of order' % (r['name'], r['reordered']))
+        if r['foreign']:
+            print('%s: %d messages not written by the benchmark' % (r['name'], r['foreign']))
+        if r['error']:
+            print('%s: first invalid message: %s' % (r['name'], r['error']))
+
+
+def make_certificate(workdir):
+    certificate, key = os.path.join(workdir, 'cert.pem'), os.path.join(workdir, 'key.pem')
+    subprocess.run(['openssl', 'req', '-x509', '-newkey', 'ec', '-pkeyopt', 'ec_paramgen_curve:prime256v1',
+                    '-nodes', '-days', '1', '-subj', '/CN=localhost', '-keyout', key, '-out', certificate],
+                   check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    return certificate, key
+
+
+def parse_list(value, choices):
+    items = value.split(',')
+    for item in items:
+        if item not in choices:
+            raise argparse.ArgumentTypeError('%s is not one of %s' % (item, ', '.join(choices)))
+    return items
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--netlogd', default='/usr/lib/systemd/systemd-netlogd',
+                        help='systemd-netlogd binary to run (default: %(default)s)')
+    parser.add_argument('--journal-remote',
+                        default=shutil.which('systemd-journal-remote') or '/usr/lib/systemd/systemd-journal-remote',
+                        help='systemd-journal-remote binary writing the journal (default: %(default)s)')
+    parser.add_argument('--directory',
+                        help='forward this journal directory instead of writing one, without latency measurement')
+    parser.add_argument('--messages', type=int, default=200000,
+                        help='entries in the backlog (default: %(default)s)')
+    parser.add_argument('--width', type=int, default=128,
+                        help='length of MESSAGE= in bytes (default: %(default)s)')
+    parser.add_argument('--fields', type=int, default=8,
+                        help='further fields per entry, not forwarded (default: %(default)s)')
+    parser.add_argument('--field-width', type=int, default=32,
+                        help='length of the further fields in bytes (default: %(default)s)')
+    parser.add_argument('--paced', type=int, default=2000,
+                        help='entries written at --rate after the backlog for measuring latency (default: %(default)s)')
+    parser.add_argument('--rate', type=float, default=1000,
+                        help='entries per second written for measuring latency (default: %(default)s)')
+    parser.add_argument('--protocols', type=lambda v: parse_list(v, PROTOCOLS), default=list(PROTOCOLS),
+                        help='comma separated (default: %s)' % ','.join(PROTOCOLS))
+    parser.add_argument('--formats', type=lambda v: parse_list(v, FORMATS), default=list(FORMATS),
+                        help='comma separated, rfc5425 is only used with tcp and tls (default: %s)' % ','.join(FORMATS))
+    parser.add_argument('--workers', type=int, default=0,
+                        help='Workers= of the daemon (default: %(default)s)')
+    parser.add_argument('--option', action='append', default=[],
+                        help='further line for the [Network] section, e.g. CheckpointEntries=4096')
+    parser.add_argument('--idle-timeout', type=float, default=5,
+                        help='seconds without new messages after which a run ends (default: %(default)s)')
+    parser.add_argument('--keep', action='store_true',
+                        help='keep the journal, configuration and logs of the daemon')
+    return parser.parse_args()
+
+
+def main():
+    args = parse_args()
+
+    if os.geteuid() != 0:
+        sys.exit('Needs to run as root, systemd-netlogd drops privileges to %s.' % NETLOG_USER)
+    if not args.directory and not os.access(args.journal_remote, os.X_OK):
+        sys.exit('%s not found, install it or pass --directory=.' % args.journal_remote)
+
+    workdir = tempfile.mkdtemp(prefix='netlogd-bench-')
+    os.chmod(workdir, 0o711)
+
+    try:
+        journal_dir = args.directory
+        if not journal_dir:
+            # Journal files are created readable by their group only
+            journal_dir = os.path.join(workdir, 'journal')
+            os.mkdir(journal_dir)
+            os.chown(journal_dir, 0, grp.getgrnam(NETLOG_USER).gr_gid)
+            os.chmod(journal_dir, 0o2750)
+
+            start = time.monotonic()
+            generate_journal(args, journal_dir)
+            print('Wrote %d entries in %.1fs.' % (args.messages, time.monotonic() - start), file=sys.stderr)
+
+        tls_files = make_certificate(workdir) if {'tls', 'dtls'} & set(args.protocols) else None
+
+        results = []
+        for protocol in args.protocols:
+            for log_format in args.formats:
+                if log_format == 'rfc5425' and protocol not in STREAM_PROTOCOLS:
+                    continue
+
+                print('Running %s %s...' % (protocol, log_format), file=sys.stderr)
+                results.append(run(args, workdir, journal_dir, protocol, log_format, tls_files))
+
+        report(results)
+    finally:
+        if args.keep:
+            print('Kept %s.' % workdir, file=sys.stderr)
+        else:
+            shutil.rmtree(workdir)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,140 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <limits.h>
+
+#include "netlog-compress.h"
+
+#include "alloc-util.h"
+#include "log.h"
+#include "string-table.h"
+
+static const char *const compression_table[_COMPRESSION_MAX] = {
+        [COMPRESSION_NO]   = "no",
+        [COMPRESSION_ZLIB] = "zlib",
+};
+
+DEFINE_STRING_TABLE_LOOKUP_WITH_BOOLEAN(compression, Compression, COMPRESSION_ZLIB);
+
+#if HAVE_ZLIB
+static int compressor_deflate(Compressor *c, const void *data, size_t size, int flush) {
+        assert(c);
+        assert(c->initialized);
+        assert(data || size == 0);
+        assert(size <= UINT_MAX);
+
+        c->stream.next_in = (Bytef *) data;
+        c->stream.avail_in = size;
+
+        /* The input is taken as a whole, and with a flush all of the output is collected */
+        do {
+                size_t before;
+                int r;
+
+                if (!GREEDY_REALLOC(c->output, c->output_allocated, c->output_size + COMPRESSOR_CHUNK_SIZE))
+                        return -ENOMEM;
+
+                c->stream.next_out = (Bytef *) c->output + c->output_size;
+                c->stream.avail_out = c->output_allocated - c->output_size;
+                before = c->stream.avail_out;
+
+                r = deflate(&c->stream, flush);
+                if (r == Z_STREAM_ERROR)
+                        return -EIO;
+
+                c->output_size += before - c->stream.avail_out;
+                c->n_out += before - c->stream.avail_out;
+        } while (c->stream.avail_in > 0 || c->stream.avail_out == 0);
+
+        return 0;
+}
+
+int compressor_write(Compressor *c, unsigned level, const struct iovec *iovec, unsigned n_iovec) {
+        int r;
+
+        assert(c);
+        assert(iovec || n_iovec == 0);
+
+        /* Every connection starts a new stream, the server expects the header first */
+        if (!c->initialized) {
+                c->stream = (z_stream) {};
+
+                r = deflateInit(&c->stream, level);
+                if (r == Z_MEM_ERROR)
+                        return -ENOMEM;
+                if (r != Z_OK)
+                        return -EINVAL;
+
+                c->initialized = true;
+        }
+
+        for (unsigned i = 0; i < n_iovec; i++) {
+                r = compressor_deflate(c, iovec[i].iov_base, iovec[i].iov_len, Z_NO_FLUSH);
+                if (r < 0)
+                        return r;
+
+                c->pending += iovec[i].iov_len;
+                c->n_in += iovec[i].iov_len;
+        }
+
+        return 0;
+}
+
+int compressor_flush(Compressor *c) {
+        int r;
+
+        assert(c);
+
+        if (!c->initialized || c->pending == 0)
+                return 0;
+
+        /* Ends with an empty stored block, everything up to here can be decompressed while the dictionary
+         * is kept for the messages to come */
+        r = compressor_deflate(c, NULL, 0, Z_SYNC_FLUSH);
+        if (r < 0)
+                return r;
+
+        c->pending = 0;
+        return 0;
+}
+
+void compressor_reset(Compressor *c) {
+        assert(c);
+
+        if (c->initialized)
+                (void) deflateEnd(&c->stream);
+
+        c->initialized = false;
+        c->output_size = 0;
+        c->pending = 0;
+}
+#else
+int compressor_write(Compressor *c, unsigned level, const struct iovec *iovec, unsigned n_iovec) {
+        return -EOPNOTSUPP;
+}
+
+int compressor_flush(Compressor *c) {
+        return 0;
+}
+
+void compressor_reset(Compressor *c) {
+        assert(c);
+
+        c->output_size = 0;
+        c->pending = 0;
+}
+#endif
+
+size_t compressor_pending(const Compressor *c) {
+        assert(c);
+
+        return c->pending + c->output_size;
+}
+
+void compressor_free(Compressor *c) {
+        assert(c);
+
+        compressor_reset(c);
+
+        c->output = mfree(c->output);
+        c->output_allocated = 0;
+}
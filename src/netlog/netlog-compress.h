@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+#pragma once
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#if HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "macro.h"
+
+#define DEFAULT_COMPRESSION_LEVEL 6U
+#define COMPRESSION_LEVEL_MAX     9U
+
+/* Compressed output is handed to the connection once this much came together, a TLS record worth */
+#define COMPRESSOR_CHUNK_SIZE (16U * 1024U)
+
+typedef enum Compression {
+        COMPRESSION_NO,
+        COMPRESSION_ZLIB,
+        _COMPRESSION_MAX,
+        _COMPRESSION_INVALID = -EINVAL,
+} Compression;
+
+/* A zlib stream spanning all messages sent over a connection, so that repetitions across messages are
+ * compressed too. Flushing the stream makes the messages so far decompressible by the server without ending
+ * it. */
+typedef struct Compressor {
+#if HAVE_ZLIB
+        z_stream stream;
+#endif
+        bool initialized;
+
+        /* Compressed output not handed to the connection yet */
+        char *output;
+        size_t output_size;
+        size_t output_allocated;
+
+        /* Bytes taken since the stream was flushed last, part of them may still sit in the stream */
+        size_t pending;
+
+        uint64_t n_in;
+        uint64_t n_out;
+} Compressor;
+
+int compressor_write(Compressor *c, unsigned level, const struct iovec *iovec, unsigned n_iovec);
+int compressor_flush(Compressor *c);
+size_t compressor_pending(const Compressor *c);
+void compressor_reset(Compressor *c);
+void compressor_free(Compressor *c);
+
+const char *compression_to_string(Compression v) _const_;
+Compression compression_from_string(const char *s) _pure_;
@@ -1,13 +1,19 @@
 /* SPDX-License-Identifier: LGPL-2.1-or-later */
 
-#include <resolv.h>
+#include <sys/un.h>
+#include <unistd.h>
 
+#include "alloc-util.h"
 #include "conf-parser.h"
 #include "def.h"
 #include "extract-word.h"
 #include "in-addr-util.h"
 #include "netlog-conf.h"
+#include "netlog-destination.h"
+#include "netlog-journal.h"
+#include "netlog-worker.h"
 #include "parse-util.h"
+#include "path-util.h"
 #include "sd-resolve.h"
 #include "string-util.h"
 
@@ -21,58 +27,67 @@ int config_parse_netlog_remote_address(const char *unit,
                                        const char *rvalue,
                                        void *data,
                                        void *userdata) {
-        Manager *m = userdata;
-        char *e;
+        Destination *d = userdata;
         int r;
 
         assert(filename);
         assert(lvalue);
         assert(rvalue);
         assert(data);
-        assert(m);
+        assert(d);
 
-        r = socket_address_parse(&m->address, rvalue);
-        if (r < 0) {
-                const struct addrinfo hints = {
-                        .ai_flags = AI_NUMERICSERV|AI_ADDRCONFIG,
-                        .ai_socktype = SOCK_DGRAM,
-                        .ai_family = socket_ipv6_is_supported() ? AF_UNSPEC : AF_INET,
-                };
-                uint32_t u;
+        /* Every assignment replaces the servers listed before, an empty one goes back to the default */
+        while (d->peers)
+                peer_free(d->peers);
+        d->name = mfree(d->name);
 
-                e = strchr(rvalue, ':');
-                if (e) {
-                        r = safe_atou(e+1, &u);
-                        if (r < 0)
-                                return r;
+        for (const char *p = rvalue;;) {
+                _cleanup_free_ char *word = NULL;
+                Peer *peer;
+                uint32_t u;
+                char *e;
 
-                        if (u <= 0 || u > 0xFFFF)
-                                return -EINVAL;
+                r = extract_first_word(&p, &word, NULL, 0);
+                if (r < 0) {
+                        log_syntax(unit, LOG_WARNING, filename, line, r, "Failed to parse %s= specifier '%s', ignoring: %m", lvalue, rvalue);
+                        return 0;
+                }
+                if (r == 0)
+                        break;
 
-                        m->port = u;
-                        m->server_name = strndup(rvalue, e-rvalue);
-                        if (!m->server_name)
-                                return log_oom();
+                r = peer_new(d, NULL, word, &peer);
+                if (r < 0)
+                        return r;
 
-                        log_debug("Remote server='%s' port: '%u'...", m->server_name, u);
+                r = socket_address_parse(&peer->address, word);
+                if (r >= 0)
+                        continue;
 
-                        /* Tell the resolver to reread /etc/resolv.conf, in
-                         * case it changed. */
-                        res_init();
+                e = strchr(word, ':');
+                if (!e || safe_atou(e+1, &u) < 0 || u <= 0 || u > 0xFFFF) {
+                        log_syntax(unit, LOG_WARNING, filename, line, r, "Failed to parse address '%s' in %s=, ignoring.", word, lvalue);
+                        peer_free(peer);
+                        continue;
+                }
 
-                        log_debug("Resolving %s...", m->server_name);
+                peer->port = u;
+                peer->server_name = strndup(word, e-word);
+                if (!peer->server_name)
+                        return log_oom();
 
-                        r = sd_resolve_getaddrinfo(m->resolve, &m->resolve_query, m->server_name, NULL, &hints, manager_resolve_handler, m);
-                        if (r < 0)
-                                return log_error_errno(r, "Failed to create resolver: %m");
+                log_debug("Remote server='%s' port: '%u'...", peer->server_name, u);
 
-                        m->resolving = true;
-                        return 0;
-                }
+                r = peer_resolve(peer);
+                if (r < 0)
+                        return r;
+        }
 
-                log_syntax(unit, LOG_WARNING, filename, line, -r, "Failed to parse '%s=%s', ignoring.", lvalue, rvalue);
+        if (!d->peers)
                 return 0;
-        }
+
+        d->name = strdup(rvalue);
+        if (!d->name)
+                return log_oom();
 
         return 0;
 }
@@ -87,14 +102,13 @@ int config_parse_protocol(const char *unit,
                              const char *rvalue,
                              void *data,
                              void *userdata) {
-        Manager *m = userdata;
+        SysLogTransmissionProtocol *protocol = data;
         int r;
 
         assert(filename);
         assert(lvalue);
         assert(rvalue);
         assert(data);
-        assert(m);
 
         r = protocol_from_string(rvalue);
         if (r < 0) {
@@ -102,7 +116,35 @@ int config_parse_protocol(const char *unit,
                 return 0;
         }
 
-        m->protocol = r;
+        *protocol = r;
+        return 0;
+}
+
+int config_parse_load_balancing(const char *unit,
+                                const char *filename,
+                                unsigned line,
+                                const char *section,
+                                unsigned section_line,
+                                const char *lvalue,
+                                int ltype,
+                                const char *rvalue,
+                                void *data,
+                                void *userdata) {
+        LoadBalancing *load_balancing = data;
+        int r;
+
+        assert(filename);
+        assert(lvalue);
+        assert(rvalue);
+        assert(data);
+
+        r = load_balancing_from_string(rvalue);
+        if (r < 0) {
+                log_syntax(unit, LOG_WARNING, filename, line, -r, "Failed to parse '%s=%s', ignoring.", lvalue, rvalue);
+                return 0;
+        }
+
+        *load_balancing = r;
         return 0;
 }
 
@@ -116,14 +158,13 @@ int config_parse_log_format(const char *unit,
                             const char *rvalue,
                             void *data,
                             void *userdata) {
-        Manager *m = userdata;
+        SysLogTransmissionLogFormat *log_format = data;
         int r;
 
         assert(filename);
         assert(lvalue);
         assert(rvalue);
         assert(data);
-        assert(m);
 
         r = log_format_from_string(rvalue);
         if (r < 0) {
@@ -131,7 +172,7 @@ int config_parse_log_format(const char *unit,
                 return 0;
         }
 
-        m->log_format = r;
+        *log_format = r;
         return 0;
 }
 
@@ -145,14 +186,13 @@ int config_parse_tls_certificate_auth_mode(const char *unit,
                                            const char *rvalue,
                                            void *data,
                                            void *userdata) {
-        Manager *m = userdata;
+        OpenSSLCertificateAuthMode *auth_mode = data;
         int r;
 
         assert(filename);
         assert(lvalue);
         assert(rvalue);
         assert(data);
-        assert(m);
 
         r = certificate_auth_mode_from_string(rvalue);
         if (r < 0) {
@@ -160,7 +200,63 @@ int config_parse_tls_certificate_auth_mode(const char *unit,
                 return 0;
         }
 
-        m->auth_mode = r;
+        *auth_mode = r;
+        return 0;
+}
+
+int config_parse_tls_session_resumption(const char *unit,
+                                        const char *filename,
+                                        unsigned line,
+                                        const char *section,
+                                        unsigned section_line,
+                                        const char *lvalue,
+                                        int ltype,
+                                        const char *rvalue,
+                                        void *data,
+                                        void *userdata) {
+        SSLSessionResumption *session_resumption = data;
+        int r;
+
+        assert(filename);
+        assert(lvalue);
+        assert(rvalue);
+        assert(data);
+
+        r = ssl_session_resumption_from_string(rvalue);
+        if (r < 0) {
+                log_syntax(unit, LOG_WARNING, filename, line, -r, "Failed to parse '%s=%s', ignoring.", lvalue, rvalue);
+                return 0;
+        }
+
+        *session_resumption = r;
+        return 0;
+}
+
+int config_parse_compression(const char *unit,
+                             const char *filename,
+                             unsigned line,
+                             const char *section,
+                             unsigned section_line,
+                             const char *lvalue,
+                             int ltype,
+                             const char *rvalue,
+                             void *data,
+                             void *userdata) {
+        Compression *compression = data;
+        int r;
+
+        assert(filename);
+        assert(lvalue);
+        assert(rvalue);
+        assert(data);
+
+        r = compression_from_string(rvalue);
+        if (r < 0) {
+                log_syntax(unit, LOG_WARNING, filename, line, -r, "Failed to parse '%s=%s', ignoring.", lvalue, rvalue);
+                return 0;
+        }
+
+        *compression = r;
         return 0;
 }
 
@@ -175,6 +271,8 @@ int config_parse_namespace(const char *unit,
                            void *data,
                            void *userdata) {
         Manager *m = userdata;
+        bool all = false;
+        int r;
 
         assert(filename);
         assert(lvalue);
@@ -182,18 +280,64 @@ int config_parse_namespace(const char *unit,
         assert(data);
         assert(m);
 
-         if (streq(rvalue, "*"))
-                 m->namespace_flags = SD_JOURNAL_ALL_NAMESPACES;
-         else if (startswith(rvalue, "+")) {
-                 m->namespace_flags = SD_JOURNAL_INCLUDE_DEFAULT_NAMESPACE;
-                 m->namespace = strdup(rvalue);
-                 if (!m->namespace)
-                         return log_oom();
-         } else {
-                 m->namespace = strdup(rvalue);
-                 if (!m->namespace)
-                         return log_oom();
-         }
+        /* Every assignment replaces the list of namespaces read so far */
+        while (m->readers)
+                journal_reader_free(m->readers);
+
+        for (const char *p = rvalue;;) {
+                _cleanup_free_ char *word = NULL;
+                const char *namespace;
+                int flags = 0;
+
+                r = extract_first_word(&p, &word, NULL, 0);
+                if (r == -ENOMEM)
+                        return log_oom();
+                if (r < 0) {
+                        log_syntax(unit, LOG_WARNING, filename, line, r, "Failed to parse %s=, ignoring: %s", lvalue, rvalue);
+                        return 0;
+                }
+                if (r == 0)
+                        break;
+
+                if (streq(word, "*")) {
+                        all = true;
+                        continue;
+                }
+
+                namespace = word;
+                if (namespace[0] == '+') {
+                        flags = SD_JOURNAL_INCLUDE_DEFAULT_NAMESPACE;
+                        namespace++;
+                }
+
+                if (isempty(namespace)) {
+                        log_syntax(unit, LOG_WARNING, filename, line, 0, "Empty namespace in %s=, ignoring: %s", lvalue, word);
+                        continue;
+                }
+
+                if (journal_reader_find(m, namespace)) {
+                        log_syntax(unit, LOG_WARNING, filename, line, 0, "Namespace %s listed more than once in %s=, ignoring.", namespace, lvalue);
+                        continue;
+                }
+
+                r = journal_reader_new(m, namespace, flags, NULL);
+                if (r < 0)
+                        return r;
+        }
+
+        if (all) {
+                /* sd-journal interleaves all namespaces itself, including the ones showing up later */
+                if (m->readers) {
+                        log_syntax(unit, LOG_WARNING, filename, line, 0, "%s= lists \"*\" next to other namespaces, reading all namespaces.", lvalue);
+
+                        while (m->readers)
+                                journal_reader_free(m->readers);
+                }
+
+                r = journal_reader_new(m, NULL, SD_JOURNAL_ALL_NAMESPACES, NULL);
+                if (r < 0)
+                        return r;
+        }
 
         return 0;
 }
@@ -282,52 +426,317 @@ int config_parse_syslog_level(const char *unit,
         return 0;
 }
 
-int manager_parse_config_file(Manager *m) {
+int config_parse_filter(const char *unit,
+                        const char *filename,
+                        unsigned line,
+                        const char *section,
+                        unsigned section_line,
+                        const char *lvalue,
+                        int ltype,
+                        const char *rvalue,
+                        void *data,
+                        void *userdata) {
+        FilterAction action = ltype;
+        Filter *f = data;
         int r;
 
+        assert(filename);
+        assert(lvalue);
+        assert(rvalue);
+        assert(data);
+
+        /* Assignments add up, an empty one drops the rules given so far */
+        if (isempty(rvalue)) {
+                filter_clear(f, action);
+                return 0;
+        }
+
+        for (const char *p = rvalue;;) {
+                _cleanup_free_ char *word = NULL;
+
+                r = extract_first_word(&p, &word, NULL, EXTRACT_QUOTES|EXTRACT_RETAIN_ESCAPE);
+                if (r == -ENOMEM)
+                        return log_oom();
+                if (r < 0) {
+                        log_syntax(unit, LOG_WARNING, filename, line, r, "Failed to parse %s=, ignoring: %s", lvalue, rvalue);
+                        return 0;
+                }
+                if (r == 0)
+                        break;
+
+                r = filter_add_rule(f, action, word);
+                if (r == -ENOMEM)
+                        return log_oom();
+                if (r < 0)
+                        log_syntax(unit, LOG_WARNING, filename, line, r,
+                                   "Invalid rule in %s=, expected FIELD=VALUE or FIELD~REGEX, ignoring: %s", lvalue, word);
+        }
+
+        return 0;
+}
+
+/* Settings of a destination go either into a [Destination] section, every one of which adds a destination,
+ * or into [Network] for the single destination of older configurations. The table only carries their
+ * offsets into Destination, which one is meant is decided here once the section is known. */
+static int config_get_destination(Manager *m, const char *filename, unsigned section_line, Destination **ret) {
+        Destination *d;
+
         assert(m);
+        assert(ret);
 
-        r = config_parse_many(PKGSYSCONFDIR "/netlogd.conf",
-                             CONF_PATHS_NULSTR("systemd/netlogd.conf.d"),
-                             "Network\0",
-                             config_item_perf_lookup, netlog_gperf_lookup,
-                             false, m);
+        LIST_FOREACH(destinations, d, m->destinations)
+                if (streq_ptr(d->filename, filename) && d->section_line == section_line) {
+                        *ret = d;
+                        return 0;
+                }
 
+        return destination_new(m, filename, section_line, ret);
+}
+
+static int config_parse_destination_item(const char *unit,
+                                         const char *filename,
+                                         unsigned line,
+                                         const char *section,
+                                         unsigned section_line,
+                                         const char *lvalue,
+                                         int ltype,
+                                         const char *rvalue,
+                                         void *data,
+                                         void *userdata) {
+        const ConfigPerfItem *p = data;
+        Manager *m = userdata;
+        Destination *d;
+        int r;
+
+        assert(filename);
+        assert(section);
+        assert(p);
+        assert(m);
+
+        if (streq(section, "Network"))
+                r = config_get_destination(m, NULL, 0, &d);
+        else
+                r = config_get_destination(m, filename, section_line, &d);
         if (r < 0)
                 return r;
 
-        if (m->connection_retry_usec < 1 * USEC_PER_SEC) {
-                log_warning("Invalid ConnectionRetrySec=. Using default value.");
-                m->connection_retry_usec = DEFAULT_CONNECTION_RETRY_USEC;
+        return p->parse(unit, filename, line, section, section_line, lvalue, p->ltype, rvalue, (uint8_t*) d + p->offset, d);
+}
+
+static int netlog_config_item_lookup(const void *table,
+                                     const char *section,
+                                     const char *lvalue,
+                                     ConfigParserCallback *func,
+                                     int *ltype,
+                                     void **data,
+                                     void *userdata) {
+        const ConfigPerfItem *p;
+        const char *key;
+        int r;
+
+        assert(section);
+        assert(lvalue);
+        assert(func);
+        assert(ltype);
+        assert(data);
+
+        if (streq(section, "Network")) {
+                r = config_item_perf_lookup(table, section, lvalue, func, ltype, data, userdata);
+                if (r != 0)
+                        return r;
         }
 
-        if (m->auth_mode != OPEN_SSL_CERTIFICATE_AUTH_MODE_DENY
-                && m->protocol != SYSLOG_TRANSMISSION_PROTOCOL_TLS
-                && m->protocol != SYSLOG_TRANSMISSION_PROTOCOL_DTLS)
-                log_warning("TLSCertificateAuthMode= set but unencrypted %s connection specified.", protocol_to_string(m->protocol));
+        key = strjoina("Destination.", lvalue);
+        p = netlog_gperf_lookup(key, strlen(key));
+        if (!p)
+                return 0;
 
-        if (m->server_cert
-                && m->protocol != SYSLOG_TRANSMISSION_PROTOCOL_TLS
-                && m->protocol != SYSLOG_TRANSMISSION_PROTOCOL_DTLS)
-                log_warning("TLSServerCertificate= set but unencrypted %s connection specified.", protocol_to_string(m->protocol));
+        *func = config_parse_destination_item;
+        *ltype = 0;
+        *data = (void*) p;
+        return 1;
+}
 
-        if (m->dir && m->namespace)
-                log_warning("Ignoring Namespace= setting since Directory= is set.");
+static void destination_verify(Destination *d) {
+        assert(d);
 
-        if (m->structured_data && m->syslog_structured_data)
-                log_warning("Ignoring UseSysLogStructuredData= since StructuredData= is set.");
+        if (d->connection_retry_usec < 1 * USEC_PER_SEC) {
+                log_warning("Invalid ConnectionRetrySec=. Using default value.");
+                d->connection_retry_usec = DEFAULT_CONNECTION_RETRY_USEC;
+        }
 
-        if (timestamp_is_set(m->keep_alive_time) && !m->keep_alive)
+        if (d->auth_mode != OPEN_SSL_CERTIFICATE_AUTH_MODE_DENY
+                && d->protocol != SYSLOG_TRANSMISSION_PROTOCOL_TLS
+                && d->protocol != SYSLOG_TRANSMISSION_PROTOCOL_DTLS)
+                log_warning("TLSCertificateAuthMode= set but unencrypted %s connection specified.", protocol_to_string(d->protocol));
+
+        if (d->server_cert
+                && d->protocol != SYSLOG_TRANSMISSION_PROTOCOL_TLS
+                && d->protocol != SYSLOG_TRANSMISSION_PROTOCOL_DTLS)
+                log_warning("TLSServerCertificate= set but unencrypted %s connection specified.", protocol_to_string(d->protocol));
+
+        if (timestamp_is_set(d->keep_alive_time) && !d->keep_alive)
                 log_warning("Ignoring KeepAliveTimeSec= since KeepAlive= is not set.");
 
-        if (m->keep_alive_interval > 0 && !m->keep_alive)
+        if (d->keep_alive_interval > 0 && !d->keep_alive)
                 log_warning("Ignoring KeepAliveIntervalSec= since KeepAlive= is not set.");
 
-        if (m->keep_alive_cnt > 0 && !m->keep_alive)
+        if (d->keep_alive_cnt > 0 && !d->keep_alive)
                 log_warning("Ignoring KeepAliveProbes= since KeepAlive= is not set.");
 
-        if (m->send_buffer != 0 && (m->send_buffer < 4096 || m->send_buffer > 128 * 1024 * 1024))
-                log_warning("SendBuffer= set to an suspicious value of %zu.", m->send_buffer);
+        if (d->send_buffer != 0 && (d->send_buffer < 4096 || d->send_buffer > 128 * 1024 * 1024))
+                log_warning("SendBuffer= set to an suspicious value of %zu.", d->send_buffer);
+
+        if (d->batch_size == 0) {
+                log_warning("Invalid BatchSize=0. Using default value.");
+                d->batch_size = DEFAULT_BATCH_SIZE;
+        } else if (d->batch_size > BATCH_SIZE_MAX) {
+                log_warning("BatchSize= too large, limiting to %u.", BATCH_SIZE_MAX);
+                d->batch_size = BATCH_SIZE_MAX;
+        }
+
+        if (d->batch_size > 1 && d->protocol != SYSLOG_TRANSMISSION_PROTOCOL_UDP)
+                log_warning("Ignoring BatchSize= since it is only supported for udp connections.");
+
+        if (d->compression != COMPRESSION_NO) {
+#if HAVE_ZLIB
+                if (!IN_SET(d->protocol, SYSLOG_TRANSMISSION_PROTOCOL_TCP, SYSLOG_TRANSMISSION_PROTOCOL_TLS)) {
+                        log_warning("Ignoring Compression= since it is only supported for tcp and tls connections.");
+                        d->compression = COMPRESSION_NO;
+                }
+#else
+                log_warning("Ignoring Compression= since zlib support is not compiled in.");
+                d->compression = COMPRESSION_NO;
+#endif
+        }
+
+        if (d->compression_level == 0 || d->compression_level > COMPRESSION_LEVEL_MAX) {
+                log_warning("Invalid CompressionLevel=%u. Using default value.", d->compression_level);
+                d->compression_level = DEFAULT_COMPRESSION_LEVEL;
+        }
+
+        if (d->batch_latency_usec > 0 && d->batch_size <= 1 && d->protocol != SYSLOG_TRANSMISSION_PROTOCOL_TLS &&
+            d->compression == COMPRESSION_NO)
+                log_warning("Ignoring BatchLatencySec= since BatchSize= is not set.");
+
+        if (d->relp_window_size == 0) {
+                log_warning("Invalid RELPWindowSize=0. Using default value.");
+                d->relp_window_size = DEFAULT_RELP_WINDOW_SIZE;
+        } else if (d->relp_window_size > RELP_WINDOW_SIZE_MAX) {
+                log_warning("RELPWindowSize= too large, limiting to %u.", RELP_WINDOW_SIZE_MAX);
+                d->relp_window_size = RELP_WINDOW_SIZE_MAX;
+        }
+
+        if (d->relp_window_size != DEFAULT_RELP_WINDOW_SIZE && d->protocol != SYSLOG_TRANSMISSION_PROTOCOL_RELP)
+                log_warning("Ignoring RELPWindowSize= since it is only supported for relp connections.");
+
+        if (d->spool_size > 0 && d->spool_size < SPOOL_SIZE_MIN) {
+                log_warning("SpoolSize= too small, using %llu.", SPOOL_SIZE_MIN);
+                d->spool_size = SPOOL_SIZE_MIN;
+        }
+
+        send_rate_limit_init(&d->rate_limit, d->rate_limit_messages, d->rate_limit_bytes);
+}
+
+int manager_parse_config_file(Manager *m, const char *config_file) {
+        Destination *d, *n;
+        Peer *p;
+        int r;
+
+        assert(m);
+
+        /* A file given on the command line replaces netlogd.conf and its drop-ins */
+        if (config_file) {
+                if (access(config_file, R_OK) < 0)
+                        return log_error_errno(errno, "Failed to access configuration file %s: %m", config_file);
+
+                r = config_parse(NULL, config_file, NULL,
+                                 "Network\0Destination\0",
+                                 netlog_config_item_lookup, netlog_gperf_lookup,
+                                 false, false, true, m);
+        } else
+                r = config_parse_many(PKGSYSCONFDIR "/netlogd.conf",
+                                      CONF_PATHS_NULSTR("systemd/netlogd.conf.d"),
+                                      "Network\0Destination\0",
+                                      netlog_config_item_lookup, netlog_gperf_lookup,
+                                      false, m);
+        if (r < 0)
+                return r;
+
+        /* Without any destination configured, messages go to the default multicast address */
+        if (!m->destinations) {
+                r = destination_new(m, NULL, 0, &d);
+                if (r < 0)
+                        return r;
+        }
+
+        LIST_FOREACH_SAFE(destinations, d, n, m->destinations) {
+                if (!d->name) {
+                        /* Settings in [Network] without an address only make sense if there is no
+                         * [Destination] section */
+                        if (m->n_destinations > 1) {
+                                log_warning("Ignoring [Network] settings of the destination since no Address= is set there.");
+                                destination_free(d);
+                                continue;
+                        }
+
+                        d->name = strdup(DEFAULT_ADDRESS);
+                        if (!d->name)
+                                return log_oom();
+
+                        r = peer_new(d, NULL, DEFAULT_ADDRESS, &p);
+                        if (r < 0)
+                                return r;
+
+                        r = socket_address_parse(&p->address, DEFAULT_ADDRESS);
+                        assert(r == 0);
+                }
+
+                destination_verify(d);
+        }
+
+        /* The journal is read once for all destinations, and is closed for all of them while one without a
+         * spool can't be reached. Rather than have one server hold up the others, refuse to start. */
+        if (m->n_destinations > 1)
+                LIST_FOREACH(destinations, d, m->destinations)
+                        if (d->spool_size == 0) {
+                                log_error("SpoolSize= is not set for %s, every destination needs a spool when there is more than one.",
+                                          d->name);
+                                return -EINVAL;
+                        }
+
+        if (m->dir && m->readers) {
+                log_warning("Ignoring Namespace= setting since Directory= is set.");
+
+                while (m->readers)
+                        journal_reader_free(m->readers);
+        }
+
+        if (!m->readers) {
+                r = journal_reader_new(m, NULL, 0, NULL);
+                if (r < 0)
+                        return r;
+        }
+
+        /* A cursor given on the command line is where the first journal starts */
+        if (m->cursor)
+                free_and_replace(m->readers->last_cursor, m->cursor);
+
+        if (m->structured_data && m->syslog_structured_data)
+                log_warning("Ignoring UseSysLogStructuredData= since StructuredData= is set.");
+
+        if (m->metrics_socket &&
+            (!path_is_absolute(m->metrics_socket) ||
+             strlen(m->metrics_socket) >= sizeof((struct sockaddr_un) {}.sun_path))) {
+                log_warning("MetricsSocket= must be an absolute path of at most %zu characters, not serving metrics.",
+                            sizeof((struct sockaddr_un) {}.sun_path) - 1);
+                m->metrics_socket = mfree(m->metrics_socket);
+        }
+
+        if (m->n_workers > WORKERS_MAX) {
+                log_warning("Workers= too large, limiting to %u.", WORKERS_MAX);
+                m->n_workers = WORKERS_MAX;
+        }
 
         return 0;
 }
@@ -29,6 +29,17 @@ int config_parse_protocol(const char *unit,
                           void *data,
                           void *userdata);
 
+int config_parse_load_balancing(const char *unit,
+                                const char *filename,
+                                unsigned line,
+                                const char *section,
+                                unsigned section_line,
+                                const char *lvalue,
+                                int ltype,
+                                const char *rvalue,
+                                void *data,
+                                void *userdata);
+
 int config_parse_log_format(const char *unit,
                             const char *filename,
                             unsigned line,
@@ -50,6 +61,27 @@ int config_parse_tls_certificate_auth_mode(const char *unit,
                                            const char *rvalue,
                                            void *data,
                                            void *userdata);
+int config_parse_tls_session_resumption(const char *unit,
+                                        const char *filename,
+                                        unsigned line,
+                                        const char *section,
+                                        unsigned section_line,
+                                        const char *lvalue,
+                                        int ltype,
+                                        const char *rvalue,
+                                        void *data,
+                                        void *userdata);
+
+int config_parse_compression(const char *unit,
+                             const char *filename,
+                             unsigned line,
+                             const char *section,
+                             unsigned section_line,
+                             const char *lvalue,
+                             int ltype,
+                             const char *rvalue,
+                             void *data,
+                             void *userdata);
 
 int config_parse_namespace(const char *unit,
                            const char *filename,
@@ -84,4 +116,15 @@ int config_parse_syslog_level(const char *unit,
                               void *data,
                               void *userdata);
 
-int manager_parse_config_file(Manager *m);
+int config_parse_filter(const char *unit,
+                        const char *filename,
+                        unsigned line,
+                        const char *section,
+                        unsigned section_line,
+                        const char *lvalue,
+                        int ltype,
+                        const char *rvalue,
+                        void *data,
+                        void *userdata);
+
+int manager_parse_config_file(Manager *m, const char *config_file);
@@ -0,0 +1,825 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <resolv.h>
+
+#include "netlog-destination.h"
+
+#include "alloc-util.h"
+#include "netlog-journal.h"
+#include "netlog-network.h"
+#include "netlog-protocol.h"
+#include "path-util.h"
+#include "string-table.h"
+#include "string-util.h"
+
+#define RATELIMIT_INTERVAL_USEC (10*USEC_PER_SEC)
+#define RATELIMIT_BURST 10
+
+static const char *const load_balancing_table[_LOAD_BALANCING_MAX] = {
+        [LOAD_BALANCING_FAILOVER]     = "failover",
+        [LOAD_BALANCING_ROUND_ROBIN]  = "round-robin",
+        [LOAD_BALANCING_LEAST_QUEUED] = "least-queued",
+};
+
+DEFINE_STRING_TABLE_LOOKUP(load_balancing, LoadBalancing);
+
+int destination_new(Manager *m, const char *filename, unsigned section_line, Destination **ret) {
+        _cleanup_(destination_freep) Destination *d = NULL;
+
+        assert(m);
+        assert(ret);
+
+        d = new(Destination, 1);
+        if (!d)
+                return log_oom();
+
+        *d = (Destination) {
+                .manager = m,
+                .section_line = section_line,
+                .protocol = SYSLOG_TRANSMISSION_PROTOCOL_UDP,
+                .log_format = SYSLOG_TRANSMISSION_LOG_FORMAT_RFC_5424,
+                .auth_mode = OPEN_SSL_CERTIFICATE_AUTH_MODE_DENY,
+                .session_resumption = SSL_SESSION_RESUMPTION_YES,
+                .connection_retry_usec = DEFAULT_CONNECTION_RETRY_USEC,
+                .batch_size = DEFAULT_BATCH_SIZE,
+                .compression_level = DEFAULT_COMPRESSION_LEVEL,
+                .relp_window_size = DEFAULT_RELP_WINDOW_SIZE,
+                .rate_limit_log = (const RateLimit) {
+                        RATELIMIT_INTERVAL_USEC,
+                        1
+                },
+        };
+
+        /* The destination from [Network] comes first, the others in the order they were configured */
+        if (filename)
+                LIST_APPEND(destinations, m->destinations, d);
+        else
+                LIST_PREPEND(destinations, m->destinations, d);
+        m->n_destinations++;
+
+        if (filename) {
+                d->filename = strdup(filename);
+                if (!d->filename)
+                        return log_oom();
+        }
+
+        *ret = TAKE_PTR(d);
+        return 0;
+}
+
+Destination *destination_free(Destination *d) {
+        if (!d)
+                return NULL;
+
+        if (d->manager) {
+                LIST_REMOVE(destinations, d->manager->destinations, d);
+                d->manager->n_destinations--;
+        }
+
+        while (d->peers)
+                peer_free(d->peers);
+
+        sd_event_source_unref(d->event_spool_drain);
+        spool_free(d->spool);
+
+        ssl_manager_free(d->ssl);
+        free(d->server_cert);
+
+        free(d->name);
+        free(d->filename);
+
+        return mfree(d);
+}
+
+int destination_state_path(Destination *d, const char *prefix, char **ret) {
+        const char *name = prefix;
+        char *p;
+
+        assert(d);
+        assert(prefix);
+        assert(ret);
+
+        /* Files of the destination from [Network] keep their old names, the others get the protocol and
+         * address appended so that they don't collide */
+        if (d->filename) {
+                name = strjoina(prefix, "-", protocol_to_string(d->protocol), "-", d->name);
+                if (!filename_is_valid(name))
+                        return -EINVAL;
+        }
+
+        p = file_in_same_dir(d->manager->state_file, name);
+        if (!p)
+                return -ENOMEM;
+
+        *ret = p;
+        return 0;
+}
+
+int destination_connect(Destination *d) {
+        Peer *p;
+        int r = 0;
+
+        assert(d);
+
+        LIST_FOREACH(peers, p, d->peers) {
+                int k;
+
+                k = peer_connect(p);
+                if (k < 0 && r >= 0)
+                        r = k;
+        }
+
+        return r;
+}
+
+void destination_disconnect(Destination *d) {
+        Peer *p;
+
+        assert(d);
+
+        LIST_FOREACH(peers, p, d->peers)
+                peer_disconnect(p);
+
+        if (d->spool)
+                spool_rewind(d->spool);
+}
+
+bool destination_connected(Destination *d) {
+        Peer *p;
+
+        assert(d);
+
+        LIST_FOREACH(peers, p, d->peers)
+                if (peer_connected(p))
+                        return true;
+
+        return false;
+}
+
+bool destination_blocked(Destination *d) {
+        bool congested = false;
+        Peer *p;
+
+        assert(d);
+
+        if (d->spool_full)
+                return true;
+
+        /* With a spool congested peers only slow down delivery, the journal is read anyway */
+        if (d->spool)
+                return false;
+
+        LIST_FOREACH(peers, p, d->peers) {
+                if (!peer_connected(p))
+                        continue;
+                if (!p->congested)
+                        return false;
+
+                congested = true;
+        }
+
+        return congested;
+}
+
+bool destination_pending(Destination *d) {
+        Peer *p;
+
+        assert(d);
+
+        LIST_FOREACH(peers, p, d->peers)
+                if (peer_pending(p) > 0)
+                        return true;
+
+        return false;
+}
+
+/* Returns true if the message is dropped to stay within RateLimitMessages= and RateLimitBytes= */
+bool destination_rate_limited(Destination *d, int severity, size_t size) {
+        assert(d);
+
+        if (!send_rate_limit_enabled(&d->rate_limit))
+                return false;
+
+        if (send_rate_limit_admit(&d->rate_limit, severity, size, now(CLOCK_MONOTONIC)))
+                return false;
+
+        if (ratelimit_below(&d->rate_limit_log))
+                log_warning("Messages to %s exceed the rate limit, dropping those of low severity (%" PRIu64 " so far).",
+                            d->name, send_rate_limit_dropped(&d->rate_limit));
+
+        return true;
+}
+
+static bool peer_usable(Peer *p) {
+        assert(p);
+
+        if (!peer_connected(p) || p->congested || relp_window_full(p))
+                return false;
+
+        return !p->destination->spool || p->ready;
+}
+
+/* UDP datagrams sent with one sendmmsg(), more while catching up with the journal */
+unsigned destination_batch_size(Destination *d) {
+        assert(d);
+
+        if (d->manager->catching_up)
+                return MAX(d->batch_size, CATCH_UP_BATCH_SIZE);
+
+        return d->batch_size;
+}
+
+Peer *destination_pick_peer(Destination *d) {
+        Peer *p, *best = NULL;
+        unsigned i = 0, best_index = 0;
+
+        assert(d);
+
+        switch (d->load_balancing) {
+                case LOAD_BALANCING_ROUND_ROBIN:
+                        /* The first usable peer after the one which got the previous message, wrapping around */
+                        LIST_FOREACH(peers, p, d->peers) {
+                                if (peer_usable(p) && (!best || (best_index < d->next_peer && i >= d->next_peer))) {
+                                        best = p;
+                                        best_index = i;
+                                }
+
+                                i++;
+                        }
+
+                        if (best)
+                                d->next_peer = best_index + 1;
+                        break;
+
+                case LOAD_BALANCING_LEAST_QUEUED:
+                        LIST_FOREACH(peers, p, d->peers)
+                                if (peer_usable(p) && (!best || peer_pending(p) < peer_pending(best)))
+                                        best = p;
+                        break;
+
+                default:
+                        /* The first usable peer in the order they are listed, the others are standby */
+                        LIST_FOREACH(peers, p, d->peers)
+                                if (peer_usable(p)) {
+                                        best = p;
+                                        break;
+                                }
+                        break;
+        }
+
+        if (best || d->spool)
+                return best;
+
+        /* All peers are congested. The journal is paused by now, but the message being processed has to
+         * go somewhere. */
+        LIST_FOREACH(peers, p, d->peers)
+                if (peer_connected(p))
+                        return p;
+
+        return NULL;
+}
+
+int peer_new(Destination *d, Peer *after, const char *name, Peer **ret) {
+        _cleanup_(peer_freep) Peer *p = NULL;
+
+        assert(d);
+        assert(name);
+
+        p = new(Peer, 1);
+        if (!p)
+                return log_oom();
+
+        *p = (Peer) {
+                .socket = -1,
+                .relp.input_fd = -1,
+                .ratelimit = (const RateLimit) {
+                        RATELIMIT_INTERVAL_USEC,
+                        RATELIMIT_BURST
+                },
+        };
+
+        p->name = strdup(name);
+        if (!p->name)
+                return log_oom();
+
+        /* Peers are tried in the order they were listed, addresses a host name resolved to take its place */
+        if (after)
+                LIST_INSERT_AFTER(peers, d->peers, after, p);
+        else
+                LIST_APPEND(peers, d->peers, p);
+        d->n_peers++;
+        p->destination = d;
+
+        if (ret)
+                *ret = p;
+        TAKE_PTR(p);
+
+        return 0;
+}
+
+Peer *peer_free(Peer *p) {
+        if (!p)
+                return NULL;
+
+        if (p->destination) {
+                LIST_REMOVE(peers, p->destination->peers, p);
+                p->destination->n_peers--;
+
+                p->resolve_query = sd_resolve_query_unref(p->resolve_query);
+                network_close_socket(p);
+        }
+
+        network_batch_free(p);
+        network_queue_free(p);
+        relp_free(p);
+        compressor_free(&p->compressor);
+
+        dtls_manager_free(p->dtls);
+        tls_manager_free(p->tls);
+
+        free(p->server_name);
+        free(p->name);
+
+        sd_event_source_unref(p->event_retry);
+        return mfree(p);
+}
+
+bool peer_connected(Peer *p) {
+        assert(p);
+
+        switch (p->destination->protocol) {
+                case SYSLOG_TRANSMISSION_PROTOCOL_DTLS:
+                        return p->dtls && p->dtls->connected;
+                case SYSLOG_TRANSMISSION_PROTOCOL_TLS:
+                        return p->tls && p->tls->connected;
+                case SYSLOG_TRANSMISSION_PROTOCOL_RELP:
+                        return p->connected && p->relp.state == RELP_STATE_OPEN;
+                default:
+                        return p->connected;
+        }
+}
+
+size_t peer_pending(Peer *p) {
+        assert(p);
+
+        switch (p->destination->protocol) {
+                case SYSLOG_TRANSMISSION_PROTOCOL_TLS:
+                        return (p->tls ? p->tls->output_size : 0) + compressor_pending(&p->compressor);
+                case SYSLOG_TRANSMISSION_PROTOCOL_UDP:
+                        return p->batch_buffer_size;
+                case SYSLOG_TRANSMISSION_PROTOCOL_TCP:
+                        return p->send_queue_size - p->send_queue_offset + compressor_pending(&p->compressor);
+                case SYSLOG_TRANSMISSION_PROTOCOL_RELP:
+                        /* Messages count until the server acknowledged them */
+                        return p->send_queue_size - p->send_queue_offset + relp_unacked_size(p);
+                default:
+                        return 0;
+        }
+}
+
+/* Bytes taken into the output buffers of the peer and written out of them so far */
+static void peer_output_position(Peer *p, uint64_t *ret_queued, uint64_t *ret_written) {
+        assert(p);
+        assert(ret_queued);
+        assert(ret_written);
+
+        if (p->destination->protocol == SYSLOG_TRANSMISSION_PROTOCOL_TLS) {
+                *ret_queued = p->tls ? p->tls->output_queued : 0;
+                *ret_written = p->tls ? p->tls->output_written : 0;
+                return;
+        }
+
+        *ret_queued = p->output_queued;
+        *ret_written = p->output_written;
+}
+
+/* Called for every message handed to a peer of a destination without a spool */
+void peer_number_message(Peer *p) {
+        Manager *m;
+
+        assert(p);
+
+        m = p->destination->manager;
+
+        /* Everything before this message is out already */
+        if (peer_pending(p) == 0) {
+                p->sent_seqnum = m->output_seqnum;
+                p->marked = false;
+        }
+
+        m->output_seqnum++;
+}
+
+/* Notes how far the output has to be written before the messages handed to the peer so far are out. A mark
+ * still waiting to be reached is kept, the messages since are then only out once the buffers were drained or
+ * a later mark is reached. */
+void peer_mark_output(Peer *p) {
+        uint64_t queued, written;
+
+        assert(p);
+
+        if (p->marked || peer_pending(p) == 0)
+                return;
+
+        peer_output_position(p, &queued, &written);
+
+        p->mark_seqnum = p->destination->manager->output_seqnum;
+        p->marked = true;
+
+        /* Compressed messages first have to leave the deflate stream */
+        if (compressor_pending(&p->compressor) > 0) {
+                p->mark_compressed = p->compressor.n_in;
+                p->mark_position = UINT64_MAX;
+        } else
+                p->mark_position = queued;
+}
+
+/* The last message which, along with all before it, left the output buffers of the peer */
+uint64_t peer_sent(Peer *p) {
+        uint64_t queued, written;
+
+        assert(p);
+
+        if (peer_pending(p) == 0)
+                return UINT64_MAX;
+
+        if (p->marked) {
+                peer_output_position(p, &queued, &written);
+
+                /* The flush handed the stream to the connection, possibly along with later output */
+                if (p->mark_position == UINT64_MAX &&
+                    p->compressor.n_in - p->compressor.pending >= p->mark_compressed)
+                        p->mark_position = queued;
+
+                if (written >= p->mark_position) {
+                        p->sent_seqnum = p->mark_seqnum;
+                        p->marked = false;
+                }
+        }
+
+        return p->sent_seqnum;
+}
+
+static bool peer_has_address(Peer *p) {
+        assert(p);
+
+        return IN_SET(p->address.sockaddr.sa.sa_family, AF_INET, AF_INET6);
+}
+
+static int peer_state_path(Peer *p, const char *prefix, char **ret) {
+        const char *name;
+
+        assert(p);
+
+        /* The first peer uses the file of the destination, so that it stays the same for a single server */
+        if (p == p->destination->peers)
+                return destination_state_path(p->destination, prefix, ret);
+
+        name = strjoina(prefix, "-", p->name);
+        return destination_state_path(p->destination, name, ret);
+}
+
+static int peer_ssl_output_handler(SSLManager *ssl, int error, void *userdata) {
+        Peer *p = ASSERT_PTR(userdata);
+
+        if (error < 0) {
+                log_debug_errno(error, "Failed to send via TLS to %s, performing reconnect: %m", p->name);
+                return peer_failed(p);
+        }
+
+        (void) network_update_congestion(p, peer_pending(p));
+
+        /* The cursors held back for the records can be saved now */
+        if (!p->destination->spool)
+                (void) journal_acknowledge(p->destination->manager);
+
+        return 0;
+}
+
+static int peer_setup_ssl(Peer *p) {
+        _cleanup_(ssl_manager_freep) SSLManager *ssl = NULL;
+        _cleanup_free_ char *session_file = NULL;
+        Destination *d;
+        int r;
+
+        assert(p);
+
+        d = p->destination;
+
+        if (!IN_SET(d->protocol, SYSLOG_TRANSMISSION_PROTOCOL_TLS, SYSLOG_TRANSMISSION_PROTOCOL_DTLS) || p->tls || p->dtls)
+                return 0;
+
+        /* The certificates were loaded before dropping privileges, all peers share them */
+        assert(d->ssl);
+
+        r = ssl_manager_clone(d->ssl, &ssl);
+        if (r < 0)
+                return r;
+
+        if (d->session_resumption != SSL_SESSION_RESUMPTION_NO) {
+                /* Persisted sessions live next to the cursor state, so that they survive restarts of the
+                 * daemon */
+                if (d->session_resumption == SSL_SESSION_RESUMPTION_PERSISTENT && d->manager->state_file) {
+                        r = peer_state_path(p, "tls-session", &session_file);
+                        if (r < 0)
+                                return log_error_errno(r, "Failed to determine TLS session file of %s: %m", p->name);
+                }
+
+                r = ssl_manager_enable_session_resumption(ssl, session_file);
+                if (r < 0)
+                        return r;
+        }
+
+        if (d->protocol == SYSLOG_TRANSMISSION_PROTOCOL_TLS) {
+                ssl_set_output_handler(ssl, peer_ssl_output_handler, p);
+                p->tls = TAKE_PTR(ssl);
+        } else
+                p->dtls = TAKE_PTR(ssl);
+
+        return 0;
+}
+
+static int peer_retry_connect(sd_event_source *source, usec_t usec, void *userdata) {
+        Peer *p = ASSERT_PTR(userdata);
+
+        return peer_connect(p);
+}
+
+int peer_start_forwarding(Peer *p) {
+        Destination *d;
+
+        assert(p);
+
+        d = p->destination;
+
+        if (p->failed && d->n_peers > 1)
+                log_info("Connected to %s again, forwarding messages of %s to it.", p->name, d->name);
+        p->failed = false;
+        p->n_connections++;
+
+        /* With a spool the journal is read regardless of the connection, only delivery has to resume */
+        if (d->spool)
+                return protocol_schedule_drain(d, 0);
+
+        return manager_update_input(d->manager);
+}
+
+static int peer_ssl_connect_handler(SSLManager *ssl, int error, void *userdata) {
+        Peer *p = ASSERT_PTR(userdata);
+
+        if (error < 0) {
+                log_warning_errno(error, "Failed to establish %s connection to %s: %m",
+                                  protocol_to_string(p->destination->protocol), p->name);
+                return peer_failed(p);
+        }
+
+        return peer_start_forwarding(p);
+}
+
+int peer_connect(Peer *p) {
+        Destination *d;
+        Manager *m;
+        int r;
+
+        assert(p);
+
+        d = p->destination;
+        m = d->manager;
+
+        if (p->resolving)
+                return 0;
+
+        peer_disconnect(p);
+
+        log_debug("Connecting network to %s ...", p->name);
+
+        p->event_retry = sd_event_source_unref(p->event_retry);
+        if (!ratelimit_below(&p->ratelimit)) {
+                log_debug("Delaying attempts to contact %s.", p->name);
+
+                r = sd_event_add_time_relative(m->event, &p->event_retry, CLOCK_BOOTTIME, d->connection_retry_usec,
+                                               0, peer_retry_connect, p);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to create retry timer: %m");
+
+                return 0;
+        }
+
+        /* A previous attempt to resolve the host name failed */
+        if (p->server_name && !peer_has_address(p))
+                return peer_resolve(p);
+
+        r = peer_setup_ssl(p);
+        if (r < 0)
+                return r;
+
+        switch (d->protocol) {
+                case SYSLOG_TRANSMISSION_PROTOCOL_DTLS:
+                        r = dtls_connect(p->dtls, m->event, &p->address, peer_ssl_connect_handler, p);
+                        break;
+                case SYSLOG_TRANSMISSION_PROTOCOL_TLS:
+                        r = tls_connect(p->tls, m->event, &p->address, peer_ssl_connect_handler, p);
+                        break;
+                default:
+                        r = network_open_socket(p);
+                        break;
+        }
+        if (r < 0) {
+                log_error_errno(r, "Failed to create network socket: %m");
+                return peer_failed(p);
+        }
+
+        /* For TLS and DTLS forwarding only starts once the handshake completed, for TCP once the server
+         * accepted the connection */
+        if (!peer_connected(p))
+                return 0;
+
+        return peer_start_forwarding(p);
+}
+
+void peer_disconnect(Peer *p) {
+        bool unconfirmed, unacknowledged;
+        Destination *d;
+
+        assert(p);
+
+        d = p->destination;
+
+        log_debug("Disconnecting network from %s ...", p->name);
+
+        p->resolve_query = sd_resolve_query_unref(p->resolve_query);
+        p->resolving = false;
+
+        relp_close(p);
+
+        /* Best effort, pending messages are lost if the connection is already broken */
+        (void) protocol_flush_compressed(p);
+        (void) network_batch_flush(p);
+        (void) network_queue_flush(p);
+        if (p->tls)
+                (void) tls_stream_flush(p->tls);
+
+        /* Whether frames taken from the spool since the last commit may be lost with the connection */
+        unconfirmed = p->ready || peer_pending(p) > 0 || p->output_lost;
+        p->ready = false;
+
+        /* Whether the server may not have received messages the journal was read past already, because
+         * they were not acknowledged, are still buffered and discarded with the connection, or could not
+         * be sent. This is what makes failing over to another peer lossless. */
+        unacknowledged = !d->spool && (peer_pending(p) > 0 || p->output_lost);
+
+        p->output_lost = false;
+        p->marked = false;
+
+        network_close_socket(p);
+
+        dtls_disconnect(p->dtls);
+        tls_disconnect(p->tls);
+
+        /* Whatever has not been confirmed as sent is taken from the spool again, and goes to the other
+         * peers if there are any. The journal keeps being read meanwhile. Otherwise reading stops once no
+         * peer is left, and continues from the last saved cursor once one is back. */
+        if (d->spool) {
+                if (unconfirmed) {
+                        spool_rewind(d->spool);
+                        (void) protocol_schedule_drain(d, 0);
+                }
+        } else {
+                if (unacknowledged) {
+                        log_debug("Reading the journal again from the last entry sent to %s.", p->name);
+                        journal_rewind_unacknowledged(d->manager);
+                }
+
+                (void) manager_update_input(d->manager);
+        }
+}
+
+int peer_failed(Peer *p) {
+        Destination *d;
+
+        assert(p);
+
+        d = p->destination;
+
+        p->n_failures++;
+
+        if (d->n_peers > 1 && !p->failed)
+                log_warning("Failed to reach %s, forwarding messages of %s to its other servers.", p->name, d->name);
+        p->failed = true;
+
+        return peer_connect(p);
+}
+
+static Peer *peer_find_address(Destination *d, const struct sockaddr *sa, socklen_t salen) {
+        Peer *p;
+
+        assert(d);
+        assert(sa);
+
+        LIST_FOREACH(peers, p, d->peers)
+                if (p->address.sockaddr.sa.sa_family == sa->sa_family && memcmp(&p->address.sockaddr, sa, salen) == 0)
+                        return p;
+
+        return NULL;
+}
+
+static int peer_resolve_handler(sd_resolve_query *q, int ret, const struct addrinfo *ai, void *userdata) {
+        Peer *p = userdata, *after;
+        Destination *d;
+        int r;
+
+        assert(q);
+        assert(p);
+        assert(p->server_name);
+
+        d = p->destination;
+
+        log_debug("Resolve %s: %s", p->server_name, gai_strerror(ret));
+
+        p->resolve_query = sd_resolve_query_unref(p->resolve_query);
+        p->resolving = false;
+
+        if (ret != 0) {
+                log_debug("Failed to resolve %s: %s", p->server_name, gai_strerror(ret));
+
+                /* Try again later */
+                return peer_connect(p);
+        }
+
+        /* Every address the name resolved to becomes a peer of its own, so that the load is shared and
+         * messages go elsewhere while one of the servers is unavailable */
+        after = p;
+        for (; ai; ai = ai->ai_next) {
+                _cleanup_free_ char *pretty = NULL;
+                union sockaddr_union sockaddr = {};
+                Peer *n;
+
+                assert(ai->ai_addr);
+                assert(ai->ai_addrlen >= offsetof(struct sockaddr, sa_data));
+
+                if (!IN_SET(ai->ai_addr->sa_family, AF_INET, AF_INET6)) {
+                        log_warning("Unsuitable address protocol for %s", p->server_name);
+                        continue;
+                }
+
+                memcpy(&sockaddr, (const union sockaddr_union*) ai->ai_addr, ai->ai_addrlen);
+
+                if (ai->ai_addr->sa_family == AF_INET6)
+                        sockaddr.in6.sin6_port = htobe16((uint16_t) p->port);
+                else
+                        sockaddr.in.sin_port = htobe16((uint16_t) p->port);
+
+                if (peer_find_address(d, &sockaddr.sa, ai->ai_addrlen))
+                        continue;
+
+                (void) sockaddr_pretty(&sockaddr.sa, ai->ai_addrlen, true, true, &pretty);
+
+                log_debug("Resolved address %s for %s.", strna(pretty), p->server_name);
+
+                if (!peer_has_address(p)) {
+                        p->address.sockaddr = sockaddr;
+                        continue;
+                }
+
+                r = peer_new(d, after, pretty ?: p->name, &n);
+                if (r < 0)
+                        return r;
+
+                n->address.sockaddr = sockaddr;
+                after = n;
+
+                (void) peer_connect(n);
+        }
+
+        /* Otherwise resolving is tried again later */
+        if (!peer_has_address(p))
+                log_error("Failed to find suitable address for host %s.", p->server_name);
+
+        return peer_connect(p);
+}
+
+int peer_resolve(Peer *p) {
+        const struct addrinfo hints = {
+                .ai_flags = AI_NUMERICSERV|AI_ADDRCONFIG,
+                .ai_socktype = SOCK_DGRAM,
+                .ai_family = socket_ipv6_is_supported() ? AF_UNSPEC : AF_INET,
+        };
+        int r;
+
+        assert(p);
+        assert(p->server_name);
+
+        /* Tell the resolver to reread /etc/resolv.conf, in case it changed. */
+        res_init();
+
+        log_debug("Resolving %s...", p->server_name);
+
+        p->resolve_query = sd_resolve_query_unref(p->resolve_query);
+        r = sd_resolve_getaddrinfo(p->destination->manager->resolve, &p->resolve_query, p->server_name, NULL,
+                                   &hints, peer_resolve_handler, p);
+        if (r < 0)
+                return log_error_errno(r, "Failed to create resolver: %m");
+
+        p->resolving = true;
+        return 0;
+}
@@ -0,0 +1,210 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+#pragma once
+
+#include "list.h"
+#include "netlog-compress.h"
+#include "netlog-dtls.h"
+#include "netlog-manager.h"
+#include "netlog-ratelimit.h"
+#include "netlog-relp.h"
+#include "netlog-spool.h"
+#include "netlog-tls.h"
+
+/* Where messages go if no Address= is configured */
+#define DEFAULT_ADDRESS "239.0.0.1:6000"
+
+typedef enum LoadBalancing {
+        LOAD_BALANCING_FAILOVER,
+        LOAD_BALANCING_ROUND_ROBIN,
+        LOAD_BALANCING_LEAST_QUEUED,
+        _LOAD_BALANCING_MAX,
+        _LOAD_BALANCING_INVALID = -EINVAL,
+} LoadBalancing;
+
+typedef struct Peer Peer;
+
+/* A single server of a destination, i.e. one of the addresses listed in Address= or one of the addresses a
+ * host name resolved to. Every peer has its own connection and output buffers. */
+struct Peer {
+        Destination *destination;
+
+        LIST_FIELDS(Peer, peers);
+
+        /* The address as configured or as resolved, identifies the peer in logs */
+        char *name;
+
+        /* Retry connections */
+        sd_event_source *event_retry;
+
+        RateLimit ratelimit;
+
+        /* Host name to resolve, NULL for numeric addresses */
+        char *server_name;
+        uint32_t port;
+        sd_resolve_query *resolve_query;
+        bool resolving;
+
+        int socket;
+        SocketAddress address;
+        sd_event_source *event_connect;
+        bool connected;
+
+        DTLSManager *dtls;
+        TLSManager *tls;
+        RelpSession relp;
+
+        /* Deflate stream over the TCP or TLS connection with Compression= */
+        Compressor compressor;
+
+        /* Outgoing UDP datagrams gathered for a single sendmmsg() */
+        sd_event_source *event_batch_flush;
+
+        struct mmsghdr *batch_msgs;
+        struct iovec *batch_iovecs;
+        size_t *batch_offsets;
+        unsigned n_batch;
+        unsigned batch_allocated;
+
+        char *batch_buffer;
+        size_t batch_buffer_size;
+        size_t batch_buffer_allocated;
+
+        /* Bytes taken into the UDP batch or TCP send queue and written out of it or dropped since the peer
+         * was created */
+        uint64_t output_queued;
+        uint64_t output_written;
+
+        /* Without a spool: the messages up to sent_seqnum left the output buffers, those up to mark_seqnum
+         * did once mark_position bytes are written. With compression, mark_position is only known once the
+         * deflate stream was flushed past mark_compressed bytes of input. See Manager.output_seqnum. */
+        uint64_t sent_seqnum;
+        uint64_t mark_seqnum;
+        uint64_t mark_position;
+        uint64_t mark_compressed;
+        bool marked;
+
+        /* Output was dropped since the connection was established, see peer_disconnect() */
+        bool output_lost;
+
+        /* TCP output waiting for the socket to become writable */
+        char *send_queue;
+        size_t send_queue_size;
+        size_t send_queue_offset;
+        size_t send_queue_allocated;
+        sd_event_source *event_send_queue;
+
+        /* More TCP output is waiting than the server keeps up with, messages go to other peers */
+        bool congested;
+
+        /* Whether the peer takes frames from the spool in the current round */
+        bool ready;
+
+        /* Health, for the statistics and to tell when a peer comes back */
+        uint64_t n_sent;
+        uint64_t n_bytes;
+        uint64_t n_lost;
+        unsigned n_failures;
+        unsigned n_connections;
+        bool failed;
+};
+
+/* A server the journal is forwarded to, or a group of servers sharing the load. Every destination has its
+ * own settings, spool and peers, while the journal is read and parsed only once for all of them. */
+struct Destination {
+        Manager *manager;
+
+        LIST_FIELDS(Destination, destinations);
+
+        /* Where the [Destination] section was found. NULL for the one configured in [Network]. */
+        char *filename;
+        unsigned section_line;
+
+        /* The Address= setting as configured, identifies the destination in logs and file names */
+        char *name;
+
+        usec_t connection_retry_usec;
+
+        LIST_HEAD(Peer, peers);
+        unsigned n_peers;
+
+        /* Which peer a message goes to */
+        LoadBalancing load_balancing;
+        unsigned next_peer;
+
+        SysLogTransmissionProtocol protocol;
+        SysLogTransmissionLogFormat log_format;
+        OpenSSLCertificateAuthMode auth_mode;
+        char *server_cert;
+        SSLSessionResumption session_resumption;
+
+        /* Certificates shared by the TLS and DTLS connections of all peers */
+        SSLManager *ssl;
+
+        bool keep_alive;
+        bool no_delay;
+
+        unsigned keep_alive_cnt;
+
+        size_t send_buffer;
+
+        usec_t keep_alive_time;
+        usec_t keep_alive_interval;
+
+        unsigned batch_size;
+        usec_t batch_latency_usec;
+
+        Compression compression;
+        unsigned compression_level;
+
+        /* RELP messages sent to a peer before it has to acknowledge them */
+        unsigned relp_window_size;
+
+        /* Messages and bytes per second, 0 for no limit */
+        unsigned rate_limit_messages;
+        size_t rate_limit_bytes;
+        SendRateLimit rate_limit;
+        RateLimit rate_limit_log;
+
+        /* Formatted messages stored on disk until the server accepts them */
+        size_t spool_size;
+        Spool *spool;
+        sd_event_source *event_spool_drain;
+
+        /* The journal is paused while any destination can't take more messages */
+        bool spool_full;
+};
+
+int destination_new(Manager *m, const char *filename, unsigned section_line, Destination **ret);
+Destination *destination_free(Destination *d);
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(Destination*, destination_free);
+
+int destination_state_path(Destination *d, const char *prefix, char **ret);
+
+int destination_connect(Destination *d);
+void destination_disconnect(Destination *d);
+bool destination_connected(Destination *d);
+bool destination_blocked(Destination *d);
+bool destination_pending(Destination *d);
+bool destination_rate_limited(Destination *d, int severity, size_t size);
+unsigned destination_batch_size(Destination *d);
+Peer *destination_pick_peer(Destination *d);
+
+int peer_new(Destination *d, Peer *after, const char *name, Peer **ret);
+Peer *peer_free(Peer *p);
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(Peer*, peer_free);
+
+int peer_connect(Peer *p);
+void peer_disconnect(Peer *p);
+bool peer_connected(Peer *p);
+int peer_start_forwarding(Peer *p);
+size_t peer_pending(Peer *p);
+void peer_number_message(Peer *p);
+void peer_mark_output(Peer *p);
+uint64_t peer_sent(Peer *p);
+int peer_failed(Peer *p);
+int peer_resolve(Peer *p);
+
+const char *load_balancing_to_string(LoadBalancing v) _const_;
+LoadBalancing load_balancing_from_string(const char *s) _pure_;
@@ -14,8 +14,8 @@ static inline int dtls_manager_init(OpenSSLCertificateAuthMode auth_mode, const
         return ssl_manager_init(SSL_TRANSPORT_DTLS, auth_mode, server_cert, ret);
 }
 
-static inline int dtls_connect(DTLSManager *m, SocketAddress *addr) {
-        return ssl_connect(m, addr);
+static inline int dtls_connect(DTLSManager *m, sd_event *event, SocketAddress *addr, ssl_connect_handler_t handler, void *userdata) {
+        return ssl_connect(m, event, addr, handler, userdata);
 }
 
 static inline void dtls_disconnect(DTLSManager *m) {
@@ -0,0 +1,309 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include "netlog-filter.h"
+
+#include "alloc-util.h"
+#include "log.h"
+#include "string-util.h"
+
+/* Like journald, which doesn't accept longer field names */
+#define FILTER_FIELD_NAME_MAX 64U
+
+static bool filter_field_name_valid(const char *name, size_t len) {
+        if (len == 0 || len > FILTER_FIELD_NAME_MAX)
+                return false;
+
+        if (ascii_isdigit(name[0]))
+                return false;
+
+        for (size_t i = 0; i < len; i++)
+                if (!(name[i] >= 'A' && name[i] <= 'Z') && !ascii_isdigit(name[i]) && name[i] != '_')
+                        return false;
+
+        return true;
+}
+
+/* Orders by length first, so that values taken from the journal need no terminating NUL */
+static int filter_value_compare(const char *a, size_t a_len, const char *b, size_t b_len) {
+        if (a_len != b_len)
+                return a_len < b_len ? -1 : 1;
+
+        return memcmp(a, b, a_len);
+}
+
+/* Returns the index of the value, or where it would have to be inserted with the sign bit flipped */
+static ssize_t filter_value_find(const FilterValue *values, size_t n_values, const char *value, size_t len) {
+        size_t lo = 0, hi = n_values;
+
+        while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                int c;
+
+                c = filter_value_compare(values[mid].value, values[mid].length, value, len);
+                if (c == 0)
+                        return mid;
+                if (c < 0)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        return -(ssize_t) lo - 1;
+}
+
+static FilterField *filter_field_get(Filter *f, const char *name, size_t len) {
+        FilterField *field;
+
+        assert(f);
+        assert(name);
+
+        for (size_t i = 0; i < f->n_fields; i++)
+                if (strlen(f->fields[i].name) == len && memcmp(f->fields[i].name, name, len) == 0)
+                        return &f->fields[i];
+
+        field = reallocarray(f->fields, f->n_fields + 1, sizeof(FilterField));
+        if (!field)
+                return NULL;
+        f->fields = field;
+
+        field = &f->fields[f->n_fields];
+        *field = (FilterField) {
+                .name = strndup(name, len),
+        };
+        if (!field->name)
+                return NULL;
+
+        f->n_fields++;
+        return field;
+}
+
+static int filter_field_add_value(FilterField *field, FilterAction action, const char *value) {
+        _cleanup_free_ char *v = NULL;
+        FilterValue *values;
+        ssize_t i;
+
+        assert(field);
+        assert(value);
+
+        i = filter_value_find(field->values[action], field->n_values[action], value, strlen(value));
+        if (i >= 0)
+                return 0;
+        i = -i - 1;
+
+        v = strdup(value);
+        if (!v)
+                return -ENOMEM;
+
+        values = reallocarray(field->values[action], field->n_values[action] + 1, sizeof(FilterValue));
+        if (!values)
+                return -ENOMEM;
+        field->values[action] = values;
+
+        memmove(values + i + 1, values + i, (field->n_values[action] - i) * sizeof(FilterValue));
+        values[i] = (FilterValue) {
+                .value = TAKE_PTR(v),
+                .length = strlen(value),
+        };
+        field->n_values[action]++;
+
+        return 1;
+}
+
+static int filter_field_add_regex(FilterField *field, FilterAction action, const char *pattern) {
+        regex_t *regexes;
+        int r;
+
+        assert(field);
+        assert(pattern);
+
+        regexes = reallocarray(field->regexes[action], field->n_regexes[action] + 1, sizeof(regex_t));
+        if (!regexes)
+                return -ENOMEM;
+        field->regexes[action] = regexes;
+
+        r = regcomp(&regexes[field->n_regexes[action]], pattern, REG_EXTENDED|REG_NOSUB);
+        if (r == REG_ESPACE)
+                return -ENOMEM;
+        if (r != 0)
+                return -EINVAL;
+
+        field->n_regexes[action]++;
+        return 1;
+}
+
+static bool filter_field_empty(const FilterField *field) {
+        assert(field);
+
+        for (FilterAction a = 0; a < _FILTER_ACTION_MAX; a++)
+                if (field->n_values[a] > 0 || field->n_regexes[a] > 0)
+                        return false;
+
+        return true;
+}
+
+/* Rules look like FIELD=VALUE, matching the whole value, or FIELD~REGEX, matching any part of it with a
+ * POSIX extended regular expression */
+int filter_add_rule(Filter *f, FilterAction action, const char *rule) {
+        FilterField *field;
+        size_t n;
+        int r;
+
+        assert(f);
+        assert(action >= 0 && action < _FILTER_ACTION_MAX);
+        assert(rule);
+
+        n = strcspn(rule, "=~");
+        if (rule[n] == 0 || !filter_field_name_valid(rule, n))
+                return -EINVAL;
+
+        field = filter_field_get(f, rule, n);
+        if (!field)
+                return -ENOMEM;
+
+        if (rule[n] == '=')
+                r = filter_field_add_value(field, action, rule + n + 1);
+        else
+                r = filter_field_add_regex(field, action, rule + n + 1);
+        if (r < 0 && filter_field_empty(field)) {
+                /* Added above, nothing refers to it */
+                free(field->name);
+                f->n_fields--;
+        }
+        if (r <= 0)
+                return r;
+
+        f->n_rules[action]++;
+        return 0;
+}
+
+static void filter_field_clear(FilterField *field, FilterAction action) {
+        assert(field);
+
+        for (size_t i = 0; i < field->n_values[action]; i++)
+                free(field->values[action][i].value);
+        field->values[action] = mfree(field->values[action]);
+        field->n_values[action] = 0;
+
+        for (size_t i = 0; i < field->n_regexes[action]; i++)
+                regfree(&field->regexes[action][i]);
+        field->regexes[action] = mfree(field->regexes[action]);
+        field->n_regexes[action] = 0;
+}
+
+/* Drops the rules of one kind, and the fields no rule refers to anymore */
+void filter_clear(Filter *f, FilterAction action) {
+        size_t n = 0;
+
+        assert(f);
+        assert(action >= 0 && action < _FILTER_ACTION_MAX);
+
+        for (size_t i = 0; i < f->n_fields; i++) {
+                FilterField *field = &f->fields[i];
+
+                filter_field_clear(field, action);
+
+                if (filter_field_empty(field)) {
+                        free(field->name);
+                        continue;
+                }
+
+                f->fields[n++] = *field;
+        }
+
+        f->n_fields = n;
+        if (n == 0)
+                f->fields = mfree(f->fields);
+
+        f->n_rules[action] = 0;
+}
+
+void filter_done(Filter *f) {
+        assert(f);
+
+        for (FilterAction a = 0; a < _FILTER_ACTION_MAX; a++)
+                filter_clear(f, a);
+}
+
+bool filter_empty(const Filter *f) {
+        assert(f);
+
+        return f->n_fields == 0;
+}
+
+/* Whether the include rules can be handed to sd-journal as matches, i.e. there are some and all of them
+ * compare whole values */
+bool filter_include_exact(const Filter *f) {
+        assert(f);
+
+        if (f->n_rules[FILTER_INCLUDE] == 0)
+                return false;
+
+        for (size_t i = 0; i < f->n_fields; i++)
+                if (f->fields[i].n_regexes[FILTER_INCLUDE] > 0)
+                        return false;
+
+        return true;
+}
+
+static bool filter_field_matches(const FilterField *field, FilterAction action, const char *value, size_t len) {
+        assert(field);
+
+        if (filter_value_find(field->values[action], field->n_values[action], value, len) >= 0)
+                return true;
+
+        for (size_t i = 0; i < field->n_regexes[action]; i++) {
+                regmatch_t match = {
+                        .rm_so = 0,
+                        .rm_eo = len,
+                };
+
+                /* The value isn't NUL terminated, its end is passed along instead */
+                if (regexec(&field->regexes[action][i], value, 1, &match, REG_STARTEND) == 0)
+                        return true;
+        }
+
+        return false;
+}
+
+/* Returns 1 if the entry is to be forwarded, 0 if not. Of fields occurring several times in an entry only
+ * the first value is looked at. */
+int filter_match(Filter *f, FilterGetData get_data, void *userdata) {
+        bool included;
+
+        assert(f);
+        assert(get_data);
+
+        included = f->n_rules[FILTER_INCLUDE] == 0;
+
+        for (size_t i = 0; i < f->n_fields; i++) {
+                FilterField *field = &f->fields[i];
+                const void *data;
+                size_t size, prefix;
+                const char *value;
+                int r;
+
+                /* Once included, only exclusions can change the outcome */
+                if (included && field->n_values[FILTER_EXCLUDE] == 0 && field->n_regexes[FILTER_EXCLUDE] == 0)
+                        continue;
+
+                r = get_data(userdata, field->name, &data, &size);
+                if (r == -ENOENT)
+                        continue;
+                if (r < 0)
+                        return r;
+
+                prefix = strlen(field->name) + 1;
+                if (size < prefix)
+                        continue;
+
+                value = (const char*) data + prefix;
+
+                if (filter_field_matches(field, FILTER_EXCLUDE, value, size - prefix))
+                        return 0;
+
+                if (!included && filter_field_matches(field, FILTER_INCLUDE, value, size - prefix))
+                        included = true;
+        }
+
+        return included;
+}
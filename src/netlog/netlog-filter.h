@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+#pragma once
+
+#include <errno.h>
+#include <regex.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum FilterAction {
+        FILTER_INCLUDE,
+        FILTER_EXCLUDE,
+        _FILTER_ACTION_MAX,
+        _FILTER_ACTION_INVALID = -EINVAL,
+} FilterAction;
+
+typedef struct FilterValue {
+        char *value;
+        size_t length;
+} FilterValue;
+
+/* The rules concerning one journal field, so that every field is looked up once per entry however many
+ * rules refer to it */
+typedef struct FilterField {
+        char *name;
+
+        /* Values compared as a whole, sorted so that they are found by bisection */
+        FilterValue *values[_FILTER_ACTION_MAX];
+        size_t n_values[_FILTER_ACTION_MAX];
+
+        regex_t *regexes[_FILTER_ACTION_MAX];
+        size_t n_regexes[_FILTER_ACTION_MAX];
+} FilterField;
+
+/* Entries are forwarded if they match any include rule, or if there are none, and no exclude rule */
+typedef struct Filter {
+        FilterField *fields;
+        size_t n_fields;
+
+        size_t n_rules[_FILTER_ACTION_MAX];
+} Filter;
+
+/* Returns the data of the field as "FIELD=value", -ENOENT if the entry doesn't have it */
+typedef int (*FilterGetData)(void *userdata, const char *field, const void **ret_data, size_t *ret_size);
+
+int filter_add_rule(Filter *f, FilterAction action, const char *rule);
+void filter_clear(Filter *f, FilterAction action);
+void filter_done(Filter *f);
+bool filter_empty(const Filter *f);
+bool filter_include_exact(const Filter *f);
+int filter_match(Filter *f, FilterGetData get_data, void *userdata);
@@ -0,0 +1,88 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include "macro.h"
+#include "netlog-histogram.h"
+#include "util.h"
+
+/* Values up to LATENCY_HISTOGRAM_SUB_COUNT get a bucket each. Above, the bucket is picked by the position of
+ * the highest bit and the LATENCY_HISTOGRAM_SUB_BITS bits following it of the value minus one, so that the
+ * bucket ends with its upper bound rather than starting with it. */
+static unsigned latency_histogram_index(usec_t value) {
+        unsigned e;
+
+        if (value <= LATENCY_HISTOGRAM_SUB_COUNT)
+                return value;
+
+        if (value > LATENCY_HISTOGRAM_MAX_USEC)
+                return LATENCY_HISTOGRAM_BUCKETS - 1;
+
+        value--;
+        e = u64log2(value);
+
+        return (e - LATENCY_HISTOGRAM_SUB_BITS + 1) * LATENCY_HISTOGRAM_SUB_COUNT +
+                ((value >> (e - LATENCY_HISTOGRAM_SUB_BITS)) & (LATENCY_HISTOGRAM_SUB_COUNT - 1)) + 1;
+}
+
+/* The highest value going to the bucket */
+static usec_t latency_histogram_upper(unsigned index) {
+        unsigned e;
+
+        if (index >= LATENCY_HISTOGRAM_BUCKETS - 1)
+                return USEC_INFINITY;
+
+        if (index <= LATENCY_HISTOGRAM_SUB_COUNT)
+                return index;
+
+        e = index / LATENCY_HISTOGRAM_SUB_COUNT + LATENCY_HISTOGRAM_SUB_BITS - 1;
+
+        return (usec_t) (LATENCY_HISTOGRAM_SUB_COUNT + index % LATENCY_HISTOGRAM_SUB_COUNT) << (e - LATENCY_HISTOGRAM_SUB_BITS);
+}
+
+void latency_histogram_record(LatencyHistogram *h, usec_t value) {
+        assert(h);
+
+        h->buckets[latency_histogram_index(value)]++;
+        h->count++;
+        h->sum += value;
+        h->max = MAX(h->max, value);
+}
+
+/* The highest value of the bucket holding the given quantile, so that the result errs on the high side
+ * like HdrHistogram does. 0 if nothing was recorded yet. */
+usec_t latency_histogram_quantile(const LatencyHistogram *h, double q) {
+        uint64_t rank, seen = 0;
+
+        assert(h);
+
+        if (h->count == 0)
+                return 0;
+
+        q = CLAMP(q, 0.0, 1.0);
+        rank = MAX((uint64_t) (q * h->count + 0.5), (uint64_t) 1);
+
+        for (unsigned i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++) {
+                seen += h->buckets[i];
+                if (seen >= rank)
+                        return MIN(latency_histogram_upper(i), h->max);
+        }
+
+        return h->max;
+}
+
+/* Values up to and including the bound, like the le label of Prometheus buckets. Exact if the bound is the
+ * highest value of a bucket, which every power of two is. Otherwise the bucket the bound falls into is left
+ * out. */
+uint64_t latency_histogram_count_at_most(const LatencyHistogram *h, usec_t bound) {
+        uint64_t n = 0;
+
+        assert(h);
+
+        for (unsigned i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++) {
+                if (latency_histogram_upper(i) > bound)
+                        break;
+
+                n += h->buckets[i];
+        }
+
+        return n;
+}
@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+#pragma once
+
+#include <stdint.h>
+
+#include "time-util.h"
+
+/* Latencies are kept in microseconds with 1 << LATENCY_HISTOGRAM_SUB_BITS buckets per power of two, i.e. a
+ * resolution of 1µs up to 16µs and within 6.25% above. Each bucket includes its upper bound, so that every
+ * power of two is the highest value of a bucket. Anything above LATENCY_HISTOGRAM_MAX_USEC, about 12 days,
+ * lands in the last bucket. */
+#define LATENCY_HISTOGRAM_SUB_BITS  4U
+#define LATENCY_HISTOGRAM_SUB_COUNT (1U << LATENCY_HISTOGRAM_SUB_BITS)
+#define LATENCY_HISTOGRAM_MAX_BITS  40U
+#define LATENCY_HISTOGRAM_MAX_USEC  (UINT64_C(1) << LATENCY_HISTOGRAM_MAX_BITS)
+#define LATENCY_HISTOGRAM_BUCKETS   ((LATENCY_HISTOGRAM_MAX_BITS - LATENCY_HISTOGRAM_SUB_BITS + 1) * LATENCY_HISTOGRAM_SUB_COUNT + 1)
+
+/* Log-linear histogram in the manner of HdrHistogram: recording is a few shifts, and quantiles come out
+ * with a bounded relative error regardless of the range of the values */
+typedef struct LatencyHistogram {
+        uint64_t buckets[LATENCY_HISTOGRAM_BUCKETS];
+        uint64_t count;
+        uint64_t sum;
+        usec_t max;
+} LatencyHistogram;
+
+void latency_histogram_record(LatencyHistogram *h, usec_t value);
+usec_t latency_histogram_quantile(const LatencyHistogram *h, double q);
+uint64_t latency_histogram_count_at_most(const LatencyHistogram *h, usec_t bound);
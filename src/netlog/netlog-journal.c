@@ -5,9 +5,14 @@
 #include <systemd/sd-journal.h>
 
 #include "alloc-util.h"
-#include "netlog-manager.h"
+#include "netlog-destination.h"
+#include "netlog-metrics.h"
+#include "netlog-protocol.h"
 #include "netlog-state.h"
+#include "netlog-worker.h"
 #include "parse-util.h"
+#include "stdio-util.h"
+#include "string-util.h"
 
 /* Default severity LOG_NOTICE */
 #define JOURNAL_DEFAULT_SEVERITY LOG_PRI(LOG_NOTICE)
@@ -18,31 +23,56 @@
 #define JOURNAL_FOREACH_DATA_RETVAL(j, data, l, retval)                     \
         for (sd_journal_restart_data(j); ((retval) = sd_journal_enumerate_data((j), &(data), &(l))) > 0; )
 
+/* Entries are either read by enumerating all their fields or by looking up the few fields we need one by
+ * one. Which is cheaper depends on how many fields the entries carry, so both are timed and the cheaper one
+ * is used. The other one is sampled every now and then, in case the mix of entries changes. */
+#define JOURNAL_LOOKUP_PROBE_INTERVAL 4096U
+#define JOURNAL_LOOKUP_PROBE_ENTRIES  64U
+
 typedef struct ParseFieldVec {
+        const char *name;
         const char *field;
         size_t field_len;
-        char **target;
-        size_t *target_len;
+        size_t offset;
 } ParseFieldVec;
 
-#define PARSE_FIELD_VEC_ENTRY(_field, _target, _target_len) {           \
-                .field = (_field),                                      \
-                .field_len = strlen(_field),                            \
-                .target = (_target),                                    \
-                .target_len = (_target_len)                             \
+#define PARSE_FIELD_VEC_ENTRY(_name, _member) {                         \
+                .name = (_name),                                        \
+                .field = (_name "="),                                   \
+                .field_len = sizeof(_name "=") - 1,                     \
+                .offset = offsetof(JournalFields, _member),             \
         }
 
+static const ParseFieldVec journal_fields[] = {
+        PARSE_FIELD_VEC_ENTRY("_PID",                         pid             ),
+        PARSE_FIELD_VEC_ENTRY("MESSAGE",                      message         ),
+        PARSE_FIELD_VEC_ENTRY("PRIORITY",                     priority        ),
+        PARSE_FIELD_VEC_ENTRY("_HOSTNAME",                    hostname        ),
+        PARSE_FIELD_VEC_ENTRY("SYSLOG_FACILITY",              facility        ),
+        PARSE_FIELD_VEC_ENTRY("SYSLOG_IDENTIFIER",            identifier      ),
+        PARSE_FIELD_VEC_ENTRY("SYSLOG_STRUCTURED_DATA",       structured_data ),
+        PARSE_FIELD_VEC_ENTRY("SYSLOG_MSGID",                 msgid           ),
+};
+
+static size_t *journal_field_target(JournalFields *f, const ParseFieldVec *field) {
+        return (size_t *) ((uint8_t *) f + field->offset);
+}
+
+/* The data returned by sd_journal_enumerate_data() is only valid until the next call, hence the values are
+ * collected in a per-Manager buffer which is reused for every entry. Targets hold offsets into it, as the
+ * buffer may move while it grows. */
 static int parse_field(
+                Manager *m,
                 const void *data,
                 size_t length,
                 const char *field,
                 size_t field_len,
-                char **target,
-                size_t *target_len) {
+                size_t *target) {
 
         size_t nl;
-        char *buf;
+        char *p;
 
+        assert(m);
         assert(data);
         assert(field);
         assert(target);
@@ -55,100 +85,201 @@ static int parse_field(
 
         nl = length - field_len;
 
-        buf = newdup_suffix0(char, (const char*) data + field_len, nl);
-        if (!buf)
+        if (!GREEDY_REALLOC(m->entry_buffer, m->entry_buffer_allocated, m->entry_buffer_size + nl + 1))
                 return log_oom();
 
-        free_and_replace(*target, buf);
+        p = m->entry_buffer + m->entry_buffer_size;
+        *(char*) mempcpy_safe(p, (const char*) data + field_len, nl) = 0;
 
-        if (target_len)
-                *target_len = nl;
+        *target = m->entry_buffer_size;
+        m->entry_buffer_size += nl + 1;
 
         return 1;
 }
 
-static int parse_fieldv(
-                const void *data,
-                size_t length,
-                const ParseFieldVec *fields,
-                size_t n_fields) {
+void journal_fields_reset(Manager *m, JournalFields *f) {
+        assert(m);
+        assert(f);
+
+        m->entry_buffer_size = 0;
+
+        *f = (JournalFields) {
+                .message = SIZE_MAX,
+                .identifier = SIZE_MAX,
+                .hostname = SIZE_MAX,
+                .pid = SIZE_MAX,
+                .facility = SIZE_MAX,
+                .priority = SIZE_MAX,
+                .structured_data = SIZE_MAX,
+                .msgid = SIZE_MAX,
+        };
+}
 
+/* Picks the value out of one FIELD=VALUE pair of an entry, if it is one of the fields forwarded */
+int journal_parse_data(Manager *m, JournalFields *f, const void *data, size_t length) {
+        const char *eq;
+
+        assert(m);
+        assert(f);
+        assert(data);
+
+        /* All fields we are interested in have names of different lengths, so comparing the name length
+         * first skips the memcmp() for everything else */
+        eq = memchr(data, '=', length);
+        if (!eq)
+                return 0;
+
+        for (size_t i = 0; i < ELEMENTSOF(journal_fields); i++) {
+                const ParseFieldVec *field = &journal_fields[i];
+
+                if ((size_t) (eq - (const char*) data) + 1 != field->field_len)
+                        continue;
+
+                return parse_field(m, data, length, field->field, field->field_len, journal_field_target(f, field));
+        }
+
+        return 0;
+}
+
+static int journal_enumerate_fields(Manager *m, sd_journal *j, JournalFields *f) {
+        const void *data;
+        size_t length;
         int r;
 
-        for (size_t i = 0; i < n_fields; i++) {
-                const ParseFieldVec *f = &fields[i];
+        assert(m);
+        assert(j);
 
-                r = parse_field(data, length, f->field, f->field_len, f->target, f->target_len);
+        JOURNAL_FOREACH_DATA_RETVAL(j, data, length, r) {
+                r = journal_parse_data(m, f, data, length);
                 if (r < 0)
                         return r;
-                if (r > 0)
-                        break;
         }
 
-        return 0;
+        return r;
 }
 
-static int parse_journal_fields(Manager *m,
-                                char **message,
-                                char **identifier,
-                                char **hostname,
-                                char **pid,
-                                char **facility,
-                                char **priority,
-                                char **structured_data,
-                                char **msgid) {
+static int journal_lookup_fields(Manager *m, sd_journal *j, JournalFields *f) {
         const void *data;
         size_t length;
         int r;
-        size_t hostname_len = 0, identifier_len = 0, message_len = 0, priority_len = 0, facility_len = 0,
-                structured_data_len = 0, msgid_len = 0, pid_len = 0;
-        const ParseFieldVec fields[] = {
-                PARSE_FIELD_VEC_ENTRY("_PID=",                        pid,               &pid_len              ),
-                PARSE_FIELD_VEC_ENTRY("MESSAGE=",                     message,           &message_len          ),
-                PARSE_FIELD_VEC_ENTRY("PRIORITY=",                    priority,          &priority_len         ),
-                PARSE_FIELD_VEC_ENTRY("_HOSTNAME=",                   hostname,          &hostname_len         ),
-                PARSE_FIELD_VEC_ENTRY("SYSLOG_FACILITY=",             facility,          &facility_len         ),
-                PARSE_FIELD_VEC_ENTRY("SYSLOG_IDENTIFIER=",           identifier,        &identifier_len       ),
-                PARSE_FIELD_VEC_ENTRY("SYSLOG_STRUCTURED_DATA=",      structured_data,   &structured_data_len  ),
-                PARSE_FIELD_VEC_ENTRY("SYSLOG_MSGID",                 msgid,             &msgid_len            ),
-        };
 
-        JOURNAL_FOREACH_DATA_RETVAL(m->journal, data, length, r) {
-                r = parse_fieldv(data, length, fields, ELEMENTSOF(fields));
+        assert(m);
+        assert(j);
+
+        for (size_t i = 0; i < ELEMENTSOF(journal_fields); i++) {
+                const ParseFieldVec *field = &journal_fields[i];
+
+                r = sd_journal_get_data(j, field->name, &data, &length);
+                if (r == -ENOENT)
+                        continue;
+                if (r < 0)
+                        return r;
+
+                r = parse_field(m, data, length, field->field, field->field_len, journal_field_target(f, field));
                 if (r < 0)
                         return r;
         }
 
+        return 0;
+}
+
+static JournalLookup journal_lookup_pick(Manager *m) {
+        JournalLookup best;
+
+        assert(m);
+
+        best = m->lookup_cost[JOURNAL_LOOKUP_DIRECT] < m->lookup_cost[JOURNAL_LOOKUP_ENUMERATE] ?
+                JOURNAL_LOOKUP_DIRECT : JOURNAL_LOOKUP_ENUMERATE;
+
+        if (m->n_entries_read % JOURNAL_LOOKUP_PROBE_INTERVAL < JOURNAL_LOOKUP_PROBE_ENTRIES)
+                return best == JOURNAL_LOOKUP_DIRECT ? JOURNAL_LOOKUP_ENUMERATE : JOURNAL_LOOKUP_DIRECT;
+
+        return best;
+}
+
+static void journal_lookup_account(Manager *m, JournalLookup lookup, nsec_t cost) {
+        nsec_t *average;
+
+        assert(m);
+
+        /* Exponentially weighted, so that a single slow entry (e.g. one causing a page fault) does not
+         * flip the decision */
+        average = &m->lookup_cost[lookup];
+        *average = *average == 0 ? cost : (*average * 7 + cost) / 8;
+}
+
+static const char *entry_field(Manager *m, size_t offset) {
+        assert(m);
+
+        return offset == SIZE_MAX ? NULL : m->entry_buffer + offset;
+}
+
+static int parse_journal_fields(Manager *m,
+                                sd_journal *j,
+                                const char **message,
+                                const char **identifier,
+                                const char **hostname,
+                                const char **pid,
+                                const char **facility,
+                                const char **priority,
+                                const char **structured_data,
+                                const char **msgid) {
+        JournalLookup lookup;
+        JournalFields f;
+        nsec_t start;
+        int r;
+
+        journal_fields_reset(m, &f);
+
+        lookup = journal_lookup_pick(m);
+        start = now_nsec(CLOCK_MONOTONIC);
+
+        if (lookup == JOURNAL_LOOKUP_DIRECT)
+                r = journal_lookup_fields(m, j, &f);
+        else
+                r = journal_enumerate_fields(m, j, &f);
+
+        journal_lookup_account(m, lookup, now_nsec(CLOCK_MONOTONIC) - start);
+
         if (IN_SET(r, -EBADMSG, -EADDRNOTAVAIL)) {
                 log_debug_errno(r, "Skipping message we can't read: %m");
                 return 0;
         }
+        if (r < 0)
+                return r;
 
-        return r;
+        *message = entry_field(m, f.message);
+        *identifier = entry_field(m, f.identifier);
+        *hostname = entry_field(m, f.hostname);
+        *pid = entry_field(m, f.pid);
+        *facility = entry_field(m, f.facility);
+        *priority = entry_field(m, f.priority);
+        *structured_data = entry_field(m, f.structured_data);
+        *msgid = entry_field(m, f.msgid);
+
+        return 1;
 }
 
+/* Entries without a valid priority or facility are sent with the default one, and filtered like it. That
+ * way the levels and facilities not excluded can be handed to sd-journal as matches. */
 static int parse_syslog_severity(Manager *m, const char *priority, unsigned *sev) {
         int r;
 
         assert(sev);
 
-        if (!priority)
-                return 0;
-
-        r = safe_atou(priority, sev);
-        if (r < 0) {
-                log_debug("Failed to parse syslog priority: %s", priority);
-                return r;
+        if (priority) {
+                r = safe_atou(priority, sev);
+                if (r < 0 || *sev > LOG_DEBUG) {
+                        log_debug("Failed to parse syslog priority: %s", priority);
+                        *sev = JOURNAL_DEFAULT_SEVERITY;
+                }
         }
 
-        if (*sev < _SYSLOG_LEVEL_MAX && ((UINT8_C(1) << *sev) & m->excluded_syslog_levels)) {
+        if ((UINT8_C(1) << *sev) & m->excluded_syslog_levels) {
                 log_debug("Skipping message with excluded syslog level %s.", syslog_level_to_string(*sev));
                 return 1; /* filtered */
         }
 
-        if (*sev > LOG_DEBUG)
-                *sev = JOURNAL_DEFAULT_SEVERITY;
-
         return 0;
 }
 
@@ -157,45 +288,60 @@ static int parse_syslog_facility(Manager *m, const char *facility, unsigned *fac
 
         assert(fac);
 
-        if (!facility)
-                return 0;
-
-        r = safe_atou(facility, fac);
-        if (r < 0) {
-                log_debug("Failed to parse syslog facility: %s", facility);
-                return r;
+        if (facility) {
+                r = safe_atou(facility, fac);
+                if (r < 0 || *fac >= LOG_NFACILITIES) {
+                        log_debug("Failed to parse syslog facility: %s", facility);
+                        *fac = JOURNAL_DEFAULT_FACILITY;
+                }
         }
 
-        if (*fac < _SYSLOG_FACILITY_MAX && ((UINT32_C(1) << *fac) & m->excluded_syslog_facilities)) {
+        if ((UINT32_C(1) << *fac) & m->excluded_syslog_facilities) {
                 log_debug("Skipping message with excluded syslog facility %s.", syslog_facility_to_string(*fac));
                 return 1; /* filtered */
         }
 
-        if (*fac >= LOG_NFACILITIES)
-                *fac = JOURNAL_DEFAULT_FACILITY;
-
         return 0;
 }
 
-static int journal_read_input(Manager *m) {
-        _cleanup_free_ char *facility = NULL, *identifier = NULL, *priority = NULL, *message = NULL, *pid = NULL,
-                *hostname = NULL, *structured_data = NULL, *msgid = NULL, *cursor = NULL;
+static int journal_filter_get_data(void *userdata, const char *field, const void **ret_data, size_t *ret_size) {
+        return sd_journal_get_data(userdata, field, ret_data, ret_size);
+}
+
+static int journal_read_input(JournalReader *reader) {
+        const char *facility = NULL, *identifier = NULL, *priority = NULL, *message = NULL, *pid = NULL,
+                *hostname = NULL, *structured_data = NULL, *msgid = NULL;
         unsigned sev = JOURNAL_DEFAULT_SEVERITY;
         unsigned fac = JOURNAL_DEFAULT_FACILITY;
         struct timeval tv, *tvp = NULL;
         usec_t realtime;
+        Manager *m;
         int r;
 
-        assert(m);
-        assert(m->journal);
+        assert(reader);
+        assert(reader->journal);
 
-        r = sd_journal_get_cursor(m->journal, &cursor);
-        if (r < 0)
-                return log_error_errno(r, "Failed to get cursor: %m");
+        m = reader->manager;
+        m->n_entries_read++;
+        reader->n_entries_read++;
 
-        log_debug("Reading from journal cursor=%s", cursor);
+        /* Only the fields the rules refer to are looked at, unwanted entries are skipped before all others
+         * are copied */
+        if (!filter_empty(&m->filter)) {
+                r = filter_match(&m->filter, journal_filter_get_data, reader->journal);
+                if (IN_SET(r, -EBADMSG, -EADDRNOTAVAIL)) {
+                        log_debug_errno(r, "Skipping message we can't read: %m");
+                        return 0;
+                }
+                if (r < 0)
+                        return log_error_errno(r, "Failed to get journal fields: %m");
+                if (r == 0) {
+                        m->n_entries_filtered++;
+                        return 0;
+                }
+        }
 
-        r = parse_journal_fields(m, &message, &identifier, &hostname, &pid, &facility, &priority, &structured_data, &msgid);
+        r = parse_journal_fields(m, reader->journal, &message, &identifier, &hostname, &pid, &facility, &priority, &structured_data, &msgid);
         if (r < 0)
                 return log_error_errno(r, "Failed to get journal fields: %m");
         if (r == 0)
@@ -208,7 +354,7 @@ static int journal_read_input(Manager *m) {
 
         log_debug("Received from journal MESSAGE='%s'", message);
 
-        r = sd_journal_get_realtime_usec(m->journal, &realtime);
+        r = sd_journal_get_realtime_usec(reader->journal, &realtime);
         if (r < 0)
                 log_warning_errno(r, "Failed to rerieve realtime from journal: %m");
         else {
@@ -220,43 +366,149 @@ static int journal_read_input(Manager *m) {
         }
 
         r = parse_syslog_facility(m, facility, &fac);
-        if (r > 0) /* filtered */
+        if (r > 0) { /* filtered */
+                m->n_entries_filtered++;
                 return 0;
+        }
 
         r = parse_syslog_severity(m, priority, &sev);
-        if (r > 0) /* filtered */
+        if (r > 0) { /* filtered */
+                m->n_entries_filtered++;
                 return 0;
+        }
+
+        if (m->workers)
+                return worker_pool_append(m->workers,
+                                          reader,
+                                          sev,
+                                          fac,
+                                          tvp,
+                                          identifier,
+                                          message,
+                                          hostname,
+                                          pid,
+                                          structured_data,
+                                          m->syslog_msgid ? msgid : NULL);
+
+        r = manager_push_to_network(m,
+                                    sev,
+                                    fac,
+                                    identifier,
+                                    message, hostname,
+                                    pid,
+                                    tvp,
+                                    structured_data,
+                                    m->syslog_msgid ? msgid : NULL);
+        if (r <= 0)
+                return r;
 
-        return manager_push_to_network(m,
-                                       sev,
-                                       fac,
-                                       identifier,
-                                       message, hostname,
-                                       pid,
-                                       tvp,
-                                       structured_data,
-                                       m->syslog_msgid ? msgid : NULL);
+        /* The entry is out, failing to count it must not get it sent again */
+        (void) journal_reader_forwarded(reader, tvp);
+        return 0;
+}
+
+const char *journal_reader_name(JournalReader *reader) {
+        assert(reader);
+
+        if (reader->manager->dir)
+                return reader->manager->dir;
+
+        if (reader->namespace_flags & SD_JOURNAL_ALL_NAMESPACES)
+                return "all namespaces";
+
+        return reader->namespace ?: "default namespace";
 }
 
-static int journal_process_input(Manager *m) {
+void journal_pause_input(Manager *m) {
+        JournalReader *reader;
+
+        assert(m);
+
+        if (m->journal_paused)
+                return;
+
+        log_debug("Pausing journal input.");
+
+        m->journal_paused = true;
+
+        LIST_FOREACH(readers, reader, m->readers)
+                if (reader->event_input)
+                        (void) sd_event_source_set_enabled(reader->event_input, SD_EVENT_OFF);
+}
+
+/* Called on the first entry of a wakeup, and after reading n entries, the first of them following the one
+ * written at start. Reading only stops before the end of the journal while the output is backed up,
+ * otherwise there's no lag left. */
+static void journal_update_lag(JournalReader *reader, bool end, usec_t start, unsigned n) {
+        usec_t position, head;
+
+        assert(reader);
+        assert(reader->journal);
+
+        if (end) {
+                reader->lag_usec = 0;
+                reader->lag_entries = 0;
+        } else {
+                if (sd_journal_get_realtime_usec(reader->journal, &position) < 0 ||
+                    sd_journal_get_cutoff_realtime_usec(reader->journal, NULL, &head) < 0)
+                        return;
+
+                reader->lag_usec = head > position ? head - position : 0;
+
+                /* Assumes the entries ahead are as dense as the ones just read */
+                if (start != USEC_INFINITY && position > start)
+                        reader->lag_entries = (uint64_t) ((double) reader->lag_usec / (position - start) * n);
+        }
+
+        manager_update_catch_up(reader->manager);
+}
+
+static int journal_process_input(JournalReader *reader) {
         _cleanup_free_ char *cursor = NULL;
+        uint64_t generation;
+        usec_t start;
+        bool end = false;
+        unsigned n = 0;
+        Manager *m;
         int r;
 
-        assert(m);
-        assert(m->journal);
+        assert(reader);
+        assert(reader->journal);
+
+        m = reader->manager;
+
+        /* A destination losing its connection closes the journal, possibly reopening it right away when it
+         * reconnects. Reading then continues from the last saved cursor, not from here. */
+        generation = reader->generation;
+
+        /* Fails right after opening or seeking, then there's no entry read before */
+        if (sd_journal_get_realtime_usec(reader->journal, &start) < 0)
+                start = USEC_INFINITY;
 
         for (;;) {
-                r = sd_journal_next(m->journal);
+                /* Stop reading until the output has caught up */
+                if (m->journal_paused)
+                        break;
+
+                r = sd_journal_next(reader->journal);
                 if (r < 0)
-                        return log_error_errno(r, "Failed to get next entry: %m");
+                        return log_error_errno(r, "Failed to get next entry of %s: %m", journal_reader_name(reader));
 
-                if (r == 0)
+                if (r == 0) {
+                        end = true;
                         break;
+                }
+
+                /* Whether to catch up is decided before sending the first entry of a backlog */
+                if (n++ == 0)
+                        journal_update_lag(reader, false, start, 0);
 
-                r = journal_read_input(m);
+                r = journal_read_input(reader);
+                if (reader->generation != generation)
+                        return 0;
                 if (r < 0) {
                         /* Can't send the message. Seek one entry back. */
-                        r = sd_journal_previous(m->journal);
+                        r = sd_journal_previous(reader->journal);
                         if (r < 0)
                                 log_error_errno(r, "Failed to iterate through journal: %m");
 
@@ -264,26 +516,125 @@ static int journal_process_input(Manager *m) {
                 }
         }
 
-        r = sd_journal_get_cursor(m->journal, &cursor);
+        journal_update_lag(reader, end, start, n);
+
+        /* With worker threads the messages are sent and the cursor is saved once the workers are done */
+        if (m->workers)
+                return worker_pool_submit(m->workers);
+
+        /* Send out whatever was batched during this wakeup */
+        r = manager_flush_output(m);
+        if (reader->generation != generation)
+                return 0;
+        if (r < 0) {
+                log_debug_errno(r, "Failed to flush output, reading again from the last saved cursor: %m");
+                journal_rewind_unacknowledged(m);
+                return 0;
+        }
+
+        /* The cursor is only needed for the checkpoint, which does not move if nothing was read */
+        if (n == 0)
+                return 0;
+
+        r = sd_journal_get_cursor(reader->journal, &cursor);
         if (r < 0) {
                 log_error_errno(r, "Failed to get cursor: %m");
                 cursor = mfree(cursor);
+        } else
+                m->n_cursors++;
+
+        return journal_reader_advance(reader, TAKE_PTR(cursor), n);
+}
+
+int journal_resume_input(Manager *m) {
+        JournalReader *reader;
+        unsigned start;
+        int r;
+
+        assert(m);
+
+        if (!m->journal_paused)
+                return 0;
+
+        /* Another destination may still be unable to take more */
+        if (manager_input_blocked(m))
+                return 0;
+
+        m->journal_paused = false;
+
+        if (m->n_readers == 0)
+                return 0;
+
+        log_debug("Resuming journal input.");
+
+        /* Reading one journal may fill up the output again, the others then stay paused. Start with
+         * another one every time, so that none of them falls behind for good. */
+        start = m->next_reader++ % m->n_readers;
+
+        for (unsigned i = 0; i < m->n_readers; i++) {
+                unsigned k = (start + i) % m->n_readers;
+
+                if (m->journal_paused)
+                        break;
+
+                reader = m->readers;
+                while (k-- > 0)
+                        reader = reader->readers_next;
+
+                if (!reader->journal)
+                        continue;
+
+                r = sd_event_source_set_enabled(reader->event_input, SD_EVENT_ON);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to enable journal input: %m");
+
+                r = journal_process_input(reader);
+                if (r < 0)
+                        return r;
         }
 
-        free(m->last_cursor);
-        m->last_cursor = cursor;
-        cursor = NULL;
+        return 0;
+}
+
+static int journal_read_handler(sd_event_source *s, void *userdata) {
+        JournalReader *reader = ASSERT_PTR(userdata);
+
+        reader->event_read = sd_event_source_disable_unref(reader->event_read);
+
+        /* Resuming reads the journal anyway */
+        if (!reader->journal || reader->manager->journal_paused)
+                return 0;
 
-        return state_update_cursor(m);
+        (void) journal_process_input(reader);
+        return 0;
+}
+
+/* Not done right away, as the journal may be rewound while sending what was read from it */
+static int journal_schedule_read(JournalReader *reader) {
+        int r;
+
+        assert(reader);
+
+        if (reader->event_read)
+                return 0;
+
+        r = sd_event_add_defer(reader->manager->event, &reader->event_read, journal_read_handler, reader);
+        if (r < 0)
+                return log_error_errno(r, "Failed to schedule reading %s: %m", journal_reader_name(reader));
+
+        return 0;
 }
 
 int journal_event_handler(sd_event_source *event, int fd, uint32_t revents, void *userp) {
-        Manager *m = userp;
+        JournalReader *reader = userp;
+        Manager *m;
         int r;
 
-        assert(m);
-        assert(m->journal);
-        assert(m->journal_watch_fd == fd);
+        assert(reader);
+        assert(reader->journal);
+        assert(reader->watch_fd == fd);
+
+        m = reader->manager;
 
         if (revents & EPOLLHUP) {
                 log_debug("Received HUP");
@@ -295,9 +646,16 @@ int journal_event_handler(sd_event_source *event, int fd, uint32_t revents, void
                 return -EINVAL;
         }
 
-        r = sd_journal_process(m->journal);
+        r = sd_journal_process(reader->journal);
         if (r < 0) {
-                log_error_errno(r, "Failed to process journal: %m");
+                log_error_errno(r, "Failed to process %s: %m", journal_reader_name(reader));
+
+                /* With spools the journal is read regardless of the connections, start over right away */
+                if (manager_spooled(m)) {
+                        journal_reader_close(reader);
+                        return manager_update_input(m);
+                }
+
                 manager_disconnect(m);
                 return r;
         }
@@ -305,72 +663,416 @@ int journal_event_handler(sd_event_source *event, int fd, uint32_t revents, void
         if (r == SD_JOURNAL_NOP)
                 return 0;
 
-        return journal_process_input(m);
+        return journal_process_input(reader);
+}
+
+static PendingCursor *pending_cursor_free(PendingCursor *c) {
+        if (!c)
+                return NULL;
+
+        free(c->cursor);
+        free(c->forwarded);
+        return mfree(c);
+}
+
+static void journal_reader_drop_pending(JournalReader *reader) {
+        PendingCursor *c;
+
+        assert(reader);
+
+        while ((c = reader->pending)) {
+                LIST_REMOVE(pending, reader->pending, c);
+                pending_cursor_free(c);
+        }
+
+        /* Those entries are read again */
+        reader->n_forwarded = 0;
+}
+
+void journal_reader_close(JournalReader *reader) {
+        Manager *m;
+
+        assert(reader);
+
+        m = reader->manager;
+
+        reader->event_input = sd_event_source_disable_unref(reader->event_input);
+        reader->event_read = sd_event_source_disable_unref(reader->event_read);
+
+        if (reader->journal) {
+                log_debug("Closing %s.", journal_reader_name(reader));
+
+                sd_journal_close(reader->journal);
+                reader->journal = NULL;
+                reader->watch_fd = -1;
+                reader->generation++;
+        }
+
+        if (m->workers)
+                worker_pool_discard(m->workers, reader);
+
+        journal_reader_drop_pending(reader);
 }
 
 void journal_close_input(Manager *m) {
+        JournalReader *reader;
+
         assert(m);
 
-        if (m->journal) {
-                log_debug("Closing journal input.");
+        LIST_FOREACH(readers, reader, m->readers)
+                journal_reader_close(reader);
+
+        m->journal_paused = false;
+}
+
+/* Called for every entry sent to at least one destination */
+int journal_reader_forwarded(JournalReader *reader, const struct timeval *tv) {
+        assert(reader);
+
+        if (!GREEDY_REALLOC(reader->forwarded, reader->forwarded_allocated, reader->n_forwarded + 1))
+                return log_oom();
 
-                sd_journal_close(m->journal);
-                m->journal = NULL;
-                m->journal_watch_fd = -1;
+        reader->forwarded[reader->n_forwarded++] = tv ? timeval_load(tv) : USEC_INFINITY;
+        return 0;
+}
+
+/* Moves the reader past the entries sent up to the cursor, taking ownership of it. While messages sent so far
+ * still wait in the output buffers of a peer or RELP servers have not acknowledged them, the cursor is only
+ * saved once they left or were acknowledged. */
+int journal_reader_advance(JournalReader *reader, char *cursor, uint64_t n_entries) {
+        _cleanup_free_ char *c = cursor;
+        PendingCursor *pending;
+        Manager *m;
+
+        assert(reader);
+
+        m = reader->manager;
+
+        manager_mark_output(m);
+
+        if (!reader->pending && manager_acknowledged(m) >= m->output_seqnum) {
+                metrics_entries_forwarded(m, reader->forwarded, reader->n_forwarded);
+                reader->n_forwarded = 0;
+
+                free_and_replace(reader->last_cursor, c);
+                return state_checkpoint(m, n_entries);
         }
+
+        pending = new(PendingCursor, 1);
+        if (!pending)
+                return log_oom();
+
+        *pending = (PendingCursor) {
+                .cursor = TAKE_PTR(c),
+                .seqnum = m->output_seqnum,
+                .n_entries = n_entries,
+                .forwarded = TAKE_PTR(reader->forwarded),
+                .n_forwarded = reader->n_forwarded,
+        };
+
+        reader->n_forwarded = reader->forwarded_allocated = 0;
+
+        LIST_APPEND(pending, reader->pending, pending);
+
+        return journal_acknowledge(m);
 }
 
-static int journal_open(Manager *m) {
-        int r;
+/* Saves the cursors of all readers up to the last message which left the output buffers and was acknowledged
+ * by the RELP servers */
+int journal_acknowledge(Manager *m) {
+        JournalReader *reader;
+        uint64_t acked, n = 0;
+
+        assert(m);
+
+        acked = manager_acknowledged(m);
+
+        LIST_FOREACH(readers, reader, m->readers) {
+                PendingCursor *c;
+
+                while ((c = reader->pending) && c->seqnum <= acked) {
+                        LIST_REMOVE(pending, reader->pending, c);
+
+                        if (c->cursor)
+                                free_and_replace(reader->last_cursor, c->cursor);
+                        n += c->n_entries;
+
+                        metrics_entries_forwarded(m, c->forwarded, c->n_forwarded);
+
+                        pending_cursor_free(c);
+                }
+        }
+
+        if (n == 0)
+                return 0;
+
+        return state_checkpoint(m, n);
+}
+
+/* A server went away without acknowledging everything, or output was lost, all readers start over from their
+ * last saved cursor. Messages other servers received since then are sent again. */
+void journal_rewind_unacknowledged(Manager *m) {
+        JournalReader *reader;
 
         assert(m);
 
+        LIST_FOREACH(readers, reader, m->readers)
+                (void) journal_rewind_input(reader);
+}
+
+/* Drops whatever was read after the last saved cursor, so that it is read again */
+int journal_rewind_input(JournalReader *reader) {
+        Manager *m;
+        int r;
+
+        assert(reader);
+
+        m = reader->manager;
+
+        reader->generation++;
+        journal_reader_drop_pending(reader);
+
+        if (m->workers)
+                worker_pool_discard(m->workers, reader);
+
+        if (!reader->journal)
+                return 0;
+
+        if (!reader->last_cursor) {
+                r = sd_journal_seek_head(reader->journal);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to seek to the beginning of %s: %m", journal_reader_name(reader));
+
+                return journal_schedule_read(reader);
+        }
+
+        r = sd_journal_seek_cursor(reader->journal, reader->last_cursor);
+        if (r < 0)
+                return log_error_errno(r, "Failed to seek to cursor %s: %m", reader->last_cursor);
+
+        /* The entry at the cursor itself was sent already */
+        r = sd_journal_next(reader->journal);
+        if (r > 0 && sd_journal_test_cursor(reader->journal, reader->last_cursor) <= 0)
+                r = sd_journal_previous(reader->journal);
+        if (r < 0)
+                return log_error_errno(r, "Failed to iterate through journal: %m");
+
+        return journal_schedule_read(reader);
+}
+
+static int journal_open(JournalReader *reader) {
+        Manager *m;
+        int r;
+
+        assert(reader);
+
+        m = reader->manager;
+
         if (m->dir)
-                r = sd_journal_open_directory(&m->journal, m->dir, 0);
-        else if (m->namespace)
-                r = sd_journal_open_namespace(&m->journal, m->namespace, SD_JOURNAL_LOCAL_ONLY | m->namespace_flags);
+                r = sd_journal_open_directory(&reader->journal, m->dir, 0);
+        else if (reader->namespace || reader->namespace_flags != 0)
+                r = sd_journal_open_namespace(&reader->journal, reader->namespace, SD_JOURNAL_LOCAL_ONLY | reader->namespace_flags);
         else
-                r = sd_journal_open(&m->journal, SD_JOURNAL_LOCAL_ONLY);
+                r = sd_journal_open(&reader->journal, SD_JOURNAL_LOCAL_ONLY);
 
         if (r < 0)
-                log_error_errno(r, "Failed to open %s: %m", m->dir ?: m->namespace ? "namespace journal" : "journal");
+                log_error_errno(r, "Failed to open journal of %s: %m", journal_reader_name(reader));
 
         return r;
 }
 
-int journal_monitor_listen(Manager *m) {
+/* Adds one match per value of the field that isn't excluded. Entries lacking the field are sent with the
+ * default value, which then must be excluded too, as sd-journal can't match on a field being absent. */
+static int journal_add_excluded_matches(sd_journal *j, const char *field, uint32_t excluded, unsigned n, unsigned def) {
+        char match[sizeof("SYSLOG_FACILITY=") + DECIMAL_STR_MAX(unsigned)];
+        int r;
+
+        assert(j);
+        assert(field);
+
+        if (excluded == 0 || !(excluded & (UINT32_C(1) << def)))
+                return 0;
+
+        for (unsigned i = 0; i < n; i++) {
+                if (excluded & (UINT32_C(1) << i))
+                        continue;
+
+                xsprintf(match, "%s=%u", field, i);
+
+                r = sd_journal_add_match(j, match, 0);
+                if (r < 0)
+                        return r;
+        }
+
+        return sd_journal_add_conjunction(j);
+}
+
+/* Matches on the same field are ORed, on different fields ANDed. Every field of the include rules becomes a
+ * term of its own, so that any of them will do. */
+static int journal_add_include_matches(sd_journal *j, const Filter *f) {
+        int r;
+
+        assert(j);
+        assert(f);
+
+        for (size_t i = 0; i < f->n_fields; i++) {
+                const FilterField *field = &f->fields[i];
+
+                if (field->n_values[FILTER_INCLUDE] == 0)
+                        continue;
+
+                for (size_t k = 0; k < field->n_values[FILTER_INCLUDE]; k++) {
+                        _cleanup_free_ char *match = NULL;
+
+                        match = strjoin(field->name, "=", field->values[FILTER_INCLUDE][k].value, NULL);
+                        if (!match)
+                                return -ENOMEM;
+
+                        r = sd_journal_add_match(j, match, 0);
+                        if (r < 0)
+                                return r;
+                }
+
+                r = sd_journal_add_disjunction(j);
+                if (r < 0)
+                        return r;
+        }
+
+        return sd_journal_add_conjunction(j);
+}
+
+/* Lets sd-journal skip unwanted entries by its field indexes, without loading their data. Whatever can't
+ * be expressed as matches, like regexes and exclusions, is still checked per entry by journal_read_input(),
+ * which also gets the final say on the entries sd-journal returns. */
+static void journal_add_matches(JournalReader *reader) {
+        Manager *m;
+        int r = 0;
+
+        assert(reader);
+        assert(reader->journal);
+
+        m = reader->manager;
+
+        if (filter_include_exact(&m->filter))
+                r = journal_add_include_matches(reader->journal, &m->filter);
+        if (r >= 0)
+                r = journal_add_excluded_matches(reader->journal, "PRIORITY", m->excluded_syslog_levels,
+                                                 _SYSLOG_LEVEL_MAX, JOURNAL_DEFAULT_SEVERITY);
+        if (r >= 0)
+                r = journal_add_excluded_matches(reader->journal, "SYSLOG_FACILITY", m->excluded_syslog_facilities,
+                                                 _SYSLOG_FACILITY_MAX, JOURNAL_DEFAULT_FACILITY);
+        if (r < 0) {
+                /* Not fatal, all entries are checked anyway */
+                log_warning_errno(r, "Failed to add journal matches, filtering every entry instead: %m");
+                sd_journal_flush_matches(reader->journal);
+        }
+}
+
+int journal_monitor_listen(JournalReader *reader) {
+        Manager *m;
         int r, events;
 
-        assert(m);
+        assert(reader);
 
-        r = journal_open(m);
+        m = reader->manager;
+
+        r = journal_open(reader);
         if (r < 0)
                 return r;
 
-        r = sd_journal_set_data_threshold(m->journal, 0);
+        journal_add_matches(reader);
+
+        r = sd_journal_set_data_threshold(reader->journal, 0);
         if (r < 0)
                 log_warning_errno(r, "Failed to set journal data field size threshold");
 
-        m->journal_watch_fd = sd_journal_get_fd(m->journal);
-        if (m->journal_watch_fd  < 0)
-                return log_error_errno(m->journal_watch_fd, "Failed to get journal fd: %m");
+        reader->watch_fd = sd_journal_get_fd(reader->journal);
+        if (reader->watch_fd < 0)
+                return log_error_errno(reader->watch_fd, "Failed to get journal fd: %m");
 
-        events = sd_journal_get_events(m->journal);
+        events = sd_journal_get_events(reader->journal);
 
-        r = sd_event_add_io(m->event, &m->event_journal_input, m->journal_watch_fd,
-                            events, journal_event_handler, m);
+        r = sd_event_add_io(m->event, &reader->event_input, reader->watch_fd,
+                            events, journal_event_handler, reader);
         if (r < 0)
                 return log_error_errno(r, "Failed to register input event: %m");
 
+        /* Other readers may be paused already */
+        if (m->journal_paused) {
+                r = sd_event_source_set_enabled(reader->event_input, SD_EVENT_OFF);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to disable journal input: %m");
+        }
+
         /* ignore failure */
-        if (!m->last_cursor)
+        if (!reader->last_cursor)
                 (void) state_load_cursor(m);
 
-        if (m->last_cursor) {
-                r = sd_journal_seek_cursor(m->journal, m->last_cursor);
+        if (reader->last_cursor) {
+                r = sd_journal_seek_cursor(reader->journal, reader->last_cursor);
                 if (r < 0)
-                        return log_error_errno(r, "Failed to seek to cursor %s: %m", m->last_cursor);
+                        return log_error_errno(r, "Failed to seek to cursor %s: %m", reader->last_cursor);
+        }
+
+        return journal_schedule_read(reader);
+}
+
+JournalReader *journal_reader_free(JournalReader *reader) {
+        if (!reader)
+                return NULL;
+
+        journal_reader_close(reader);
+
+        LIST_REMOVE(readers, reader->manager->readers, reader);
+        reader->manager->n_readers--;
+
+        free(reader->namespace);
+        free(reader->last_cursor);
+        free(reader->forwarded);
+
+        return mfree(reader);
+}
+
+int journal_reader_new(Manager *m, const char *namespace, int namespace_flags, JournalReader **ret) {
+        _cleanup_free_ JournalReader *reader = NULL;
+
+        assert(m);
+
+        reader = new(JournalReader, 1);
+        if (!reader)
+                return log_oom();
+
+        *reader = (JournalReader) {
+                .manager = m,
+                .namespace_flags = namespace_flags,
+                .watch_fd = -1,
+        };
+
+        if (namespace) {
+                reader->namespace = strdup(namespace);
+                if (!reader->namespace)
+                        return log_oom();
         }
 
+        /* Keep the configured order, the first reader's cursor is also the one saved as LAST_CURSOR= */
+        LIST_APPEND(readers, m->readers, reader);
+        m->n_readers++;
+
+        if (ret)
+                *ret = reader;
+
+        TAKE_PTR(reader);
         return 0;
 }
+
+JournalReader *journal_reader_find(Manager *m, const char *namespace) {
+        JournalReader *reader;
+
+        assert(m);
+
+        LIST_FOREACH(readers, reader, m->readers)
+                if (streq_ptr(reader->namespace, namespace))
+                        return reader;
+
+        return NULL;
+}
@@ -4,8 +4,97 @@
 #include <systemd/sd-event.h>
 #include <systemd/sd-journal.h>
 
+#include "list.h"
+#include "time-util.h"
+
 typedef struct Manager Manager;
+typedef struct JournalReader JournalReader;
+typedef struct PendingCursor PendingCursor;
+
+/* A position in the journal that is saved once everything sent up to it left the output buffers and the
+ * RELP servers acknowledged it */
+struct PendingCursor {
+        LIST_FIELDS(PendingCursor, pending);
+
+        char *cursor;
+        uint64_t seqnum;
+        uint64_t n_entries;
+
+        /* Journal timestamps of the entries forwarded, see JournalReader.forwarded */
+        usec_t *forwarded;
+        size_t n_forwarded;
+};
+
+/* The fields of the entry being read that are forwarded, as offsets into the entry buffer of the Manager.
+ * SIZE_MAX for fields the entry lacks. */
+typedef struct JournalFields {
+        size_t message;
+        size_t identifier;
+        size_t hostname;
+        size_t pid;
+        size_t facility;
+        size_t priority;
+        size_t structured_data;
+        size_t msgid;
+} JournalFields;
+
+/* One journal, or one namespace of it, read with its own cursor. All readers feed the same destinations. */
+struct JournalReader {
+        Manager *manager;
+
+        LIST_FIELDS(JournalReader, readers);
+
+        /* As configured in Namespace=, NULL for the default namespace or for all of them */
+        char *namespace;
+        int namespace_flags;
+
+        sd_journal *journal;
+        int watch_fd;
+        sd_event_source *event_input;
+
+        /* Reads what is in the journal already after opening or rewinding it, rather than waiting for the
+         * next entry to be written */
+        sd_event_source *event_read;
+
+        /* Bumped whenever the journal is closed or rewound, entries read before are not sent anymore */
+        uint64_t generation;
+
+        char *last_cursor;
+
+        /* Cursors read past already, oldest first, waiting for output to be written or acknowledged */
+        LIST_HEAD(PendingCursor, pending);
+
+        /* Journal timestamps of the entries forwarded since the cursor last moved, USEC_INFINITY if unknown.
+         * They go along with the cursor and are counted once it is saved, i.e. once their messages left. */
+        usec_t *forwarded;
+        size_t n_forwarded;
+        size_t forwarded_allocated;
+
+        /* How far the last entry read is behind the end of the journal, in time and, estimated from the
+         * entries read last, in entries */
+        usec_t lag_usec;
+        uint64_t lag_entries;
+
+        uint64_t n_entries_read;
+        uint64_t stats_entries_read;
+};
+
+int journal_reader_new(Manager *m, const char *namespace, int namespace_flags, JournalReader **ret);
+JournalReader *journal_reader_free(JournalReader *reader);
+JournalReader *journal_reader_find(Manager *m, const char *namespace);
+const char *journal_reader_name(JournalReader *reader);
+void journal_reader_close(JournalReader *reader);
+int journal_reader_forwarded(JournalReader *reader, const struct timeval *tv);
+int journal_reader_advance(JournalReader *reader, char *cursor, uint64_t n_entries);
+
+void journal_fields_reset(Manager *m, JournalFields *f);
+int journal_parse_data(Manager *m, JournalFields *f, const void *data, size_t length);
 
-int journal_monitor_listen(Manager *m);
+int journal_monitor_listen(JournalReader *reader);
+void journal_pause_input(Manager *m);
+int journal_resume_input(Manager *m);
 int journal_event_handler(sd_event_source *event, int fd, uint32_t revents, void *userp);
 void journal_close_input(Manager *m);
+int journal_rewind_input(JournalReader *reader);
+int journal_acknowledge(Manager *m);
+void journal_rewind_unacknowledged(Manager *m);
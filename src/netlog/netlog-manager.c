@@ -5,9 +5,14 @@
 #include "capability-util.h"
 #include "conf-parser.h"
 #include "fd-util.h"
+#include "netlog-destination.h"
 #include "netlog-journal.h"
 #include "netlog-manager.h"
+#include "netlog-metrics.h"
+#include "netlog-network.h"
+#include "netlog-protocol.h"
 #include "netlog-state.h"
+#include "netlog-worker.h"
 #include "network-util.h"
 #include "signal-util.h"
 #include "socket-util.h"
@@ -15,14 +20,14 @@
 #include "string-util.h"
 #include "util.h"
 
-#define RATELIMIT_INTERVAL_USEC (10*USEC_PER_SEC)
-#define RATELIMIT_BURST 10
+#define STATISTICS_INTERVAL_USEC (60*USEC_PER_SEC)
 
 static const char *const protocol_table[_SYSLOG_TRANSMISSION_PROTOCOL_MAX] = {
         [SYSLOG_TRANSMISSION_PROTOCOL_UDP]  = "udp",
         [SYSLOG_TRANSMISSION_PROTOCOL_TCP]  = "tcp",
         [SYSLOG_TRANSMISSION_PROTOCOL_DTLS] = "dtls",
         [SYSLOG_TRANSMISSION_PROTOCOL_TLS]  = "tls",
+        [SYSLOG_TRANSMISSION_PROTOCOL_RELP] = "relp",
 };
 
 DEFINE_STRING_TABLE_LOOKUP(protocol, SysLogTransmissionProtocol);
@@ -91,135 +96,302 @@ static int manager_signal_event_handler(sd_event_source *event, const struct sig
         return 0;
 }
 
-
-static int manager_retry_connect(sd_event_source *source, usec_t usec, void *userdata) {
+static int manager_statistics_handler(sd_event_source *s, uint64_t usec, void *userdata) {
         Manager *m = ASSERT_PTR(userdata);
+        JournalReader *reader;
+        usec_t n, elapsed;
+        Destination *d;
+        Peer *p;
+
+        n = now(CLOCK_MONOTONIC);
+        elapsed = MAX(n - m->stats_timestamp, (usec_t) 1);
+
+        log_debug("Statistics: %" PRIu64 " journal entries read (%" PRIu64 "/s), %" PRIu64 " filtered out, %" PRIu64 " cursors generated (%" PRIu64 "/s).",
+                  m->n_entries_read, (m->n_entries_read - m->stats_entries_read) * USEC_PER_SEC / elapsed,
+                  m->n_entries_filtered,
+                  m->n_cursors, (m->n_cursors - m->stats_cursors) * USEC_PER_SEC / elapsed);
+        log_debug("Statistics: reading fields takes %" PRIu64 "ns per entry by enumeration, %" PRIu64 "ns by lookup.",
+                  m->lookup_cost[JOURNAL_LOOKUP_ENUMERATE], m->lookup_cost[JOURNAL_LOOKUP_DIRECT]);
+
+        if (m->n_readers > 1)
+                LIST_FOREACH(readers, reader, m->readers) {
+                        log_debug("Statistics: %" PRIu64 " entries read from %s (%" PRIu64 "/s)%s.",
+                                  reader->n_entries_read, journal_reader_name(reader),
+                                  (reader->n_entries_read - reader->stats_entries_read) * USEC_PER_SEC / elapsed,
+                                  reader->journal ? "" : ", closed");
+                        reader->stats_entries_read = reader->n_entries_read;
+                }
+
+        LIST_FOREACH(destinations, d, m->destinations) {
+                if (send_rate_limit_enabled(&d->rate_limit)) {
+                        const uint64_t *n_dropped = d->rate_limit.n_dropped;
+
+                        log_debug("Statistics: messages to %s dropped by the rate limit: %" PRIu64 " warning, %" PRIu64 " notice, %" PRIu64 " info, %" PRIu64 " debug.",
+                                  d->name, n_dropped[LOG_WARNING], n_dropped[LOG_NOTICE], n_dropped[LOG_INFO], n_dropped[LOG_DEBUG]);
+                }
+
+                LIST_FOREACH(peers, p, d->peers) {
+                        log_debug("Statistics: %" PRIu64 " messages sent to %s, %u failures%s.",
+                                  p->n_sent, p->name, p->n_failures,
+                                  !peer_connected(p) ? ", not connected" : p->congested ? ", congested" : "");
+
+                        if (d->compression != COMPRESSION_NO)
+                                log_debug("Statistics: %" PRIu64 " bytes compressed to %" PRIu64 " for %s.",
+                                          p->compressor.n_in, p->compressor.n_out, p->name);
+
+                        if (d->protocol == SYSLOG_TRANSMISSION_PROTOCOL_RELP)
+                                log_debug("Statistics: %" PRIu64 " messages acknowledged by %s, %zu awaiting acknowledgement.",
+                                          p->relp.n_acked, p->name, relp_unacked(p));
+                }
+        }
+
+        log_debug("Statistics: %" PRIu64 " checkpoints saved (%" PRIu64 "/s), %" PRIu64 " entries forwarded since the last one, %" PRIu64 "ms ago.",
+                  m->n_checkpoints, (m->n_checkpoints - m->stats_checkpoints) * USEC_PER_SEC / elapsed,
+                  m->n_unsaved_entries, m->unsaved_since > 0 ? (n - m->unsaved_since) / USEC_PER_MSEC : 0);
 
-        return manager_connect(m);
+        if (m->workers)
+                worker_pool_log_statistics(m->workers, elapsed);
+
+        m->stats_entries_read = m->n_entries_read;
+        m->stats_cursors = m->n_cursors;
+        m->stats_checkpoints = m->n_checkpoints;
+        m->stats_timestamp = n;
+
+        return sd_event_source_set_time_relative(s, STATISTICS_INTERVAL_USEC);
 }
 
-int manager_connect(Manager *m) {
+static int manager_statistics_listen(Manager *m) {
         int r;
 
         assert(m);
 
-        if (m->resolving)
+        /* Only of interest when debugging, don't wake up otherwise */
+        if (log_get_max_level() < LOG_DEBUG)
                 return 0;
 
-        manager_disconnect(m);
+        m->stats_timestamp = now(CLOCK_MONOTONIC);
 
-        log_debug("Connecting network ...");
+        r = sd_event_add_time_relative(m->event, &m->event_stats, CLOCK_MONOTONIC, STATISTICS_INTERVAL_USEC, 0,
+                                       manager_statistics_handler, m);
+        if (r < 0)
+                return r;
 
-        m->event_retry = sd_event_source_unref(m->event_retry);
-        if (!ratelimit_below(&m->ratelimit)) {
-                log_debug("Delaying attempts to contact servers.");
+        return sd_event_source_set_enabled(m->event_stats, SD_EVENT_ON);
+}
 
-                r = sd_event_add_time_relative(m->event, &m->event_retry, CLOCK_BOOTTIME, m->connection_retry_usec,
-                                               0, manager_retry_connect, m);
-                if (r < 0)
-                        return log_error_errno(r, "Failed to create retry timer: %m");
+int manager_connect(Manager *m) {
+        Destination *d;
+        int r = 0;
 
-                return 0;
-        }
+        assert(m);
 
-        switch (m->protocol) {
-                case SYSLOG_TRANSMISSION_PROTOCOL_DTLS:
-                        r = dtls_connect(m->dtls, &m->address);
-                        break;
-                case SYSLOG_TRANSMISSION_PROTOCOL_TLS:
-                        r = tls_connect(m->tls, &m->address);
-                        break;
-                default:
-                        r = manager_open_network_socket(m);
-                        break;
-        }
-        if (r < 0) {
-                log_error_errno(r, "Failed to create network socket: %m");
-                return manager_connect(m);
+        LIST_FOREACH(destinations, d, m->destinations) {
+                int k;
+
+                k = destination_connect(d);
+                if (k < 0 && r >= 0)
+                        r = k;
         }
-        r = journal_monitor_listen(m);
-        if (r < 0)
-                return log_error_errno(r, "Failed to monitor journal: %m");
 
-        return 0;
+        return r;
 }
 
 void manager_disconnect(Manager *m) {
+        Destination *d;
+
         assert(m);
 
         log_debug("Disconnecting network ...");
 
-        m->resolve_query = sd_resolve_query_unref(m->resolve_query);
+        LIST_FOREACH(destinations, d, m->destinations)
+                destination_disconnect(d);
 
-        manager_close_network_socket(m);
+        sd_notifyf(false, "STATUS=Idle.");
+}
 
-        dtls_disconnect(m->dtls);
-        tls_disconnect(m->tls);
+bool manager_spooled(Manager *m) {
+        Destination *d;
 
-        m->event_journal_input = sd_event_source_disable_unref(m->event_journal_input);
-        journal_close_input(m);
+        assert(m);
 
-        sd_notifyf(false, "STATUS=Idle.");
+        LIST_FOREACH(destinations, d, m->destinations)
+                if (!d->spool)
+                        return false;
+
+        return true;
 }
 
-int manager_resolve_handler(sd_resolve_query *q, int ret, const struct addrinfo *ai, void *userdata) {
-        Manager *m = userdata;
+/* The last message which, along with all before it, left the output buffers of all peers and, if sent with
+ * RELP, has been acknowledged */
+uint64_t manager_acknowledged(Manager *m) {
+        uint64_t acked;
+        Destination *d;
+        Peer *p;
 
-        assert(q);
         assert(m);
-        assert(m->server_name);
 
-        log_debug("Resolve %s: %s", m->server_name, gai_strerror(ret));
+        acked = m->output_seqnum;
 
-        m->resolve_query = sd_resolve_query_unref(m->resolve_query);
+        LIST_FOREACH(destinations, d, m->destinations) {
+                if (d->spool)
+                        continue;
 
-        if (ret != 0) {
-                log_debug("Failed to resolve %s: %s", m->server_name, gai_strerror(ret));
+                LIST_FOREACH(peers, p, d->peers) {
+                        if (d->protocol == SYSLOG_TRANSMISSION_PROTOCOL_RELP) {
+                                uint64_t oldest = relp_oldest_unacked(p);
 
-                /* Try next host */
-                return manager_connect(m);
+                                if (oldest != UINT64_MAX)
+                                        acked = MIN(acked, oldest - 1);
+                        } else
+                                acked = MIN(acked, peer_sent(p));
+                }
         }
 
-        for (; ai; ai = ai->ai_next) {
-                _cleanup_free_ char *pretty = NULL;
+        return acked;
+}
 
-                assert(ai->ai_addr);
-                assert(ai->ai_addrlen >= offsetof(struct sockaddr, sa_data));
+/* Notes for every peer how much of its output has to be written before the messages sent so far are out */
+void manager_mark_output(Manager *m) {
+        Destination *d;
+        Peer *p;
+
+        assert(m);
 
-                if (!IN_SET(ai->ai_addr->sa_family, AF_INET, AF_INET6)) {
-                        log_warning("Unsuitable address protocol for %s", m->server_name);
+        LIST_FOREACH(destinations, d, m->destinations) {
+                if (d->spool || d->protocol == SYSLOG_TRANSMISSION_PROTOCOL_RELP)
                         continue;
-                }
 
-                memcpy(&m->address.sockaddr, (const union sockaddr_union*) ai->ai_addr, ai->ai_addrlen);
+                LIST_FOREACH(peers, p, d->peers)
+                        peer_mark_output(p);
+        }
+}
 
-                if (ai->ai_addr->sa_family == AF_INET6)
-                        m->address.sockaddr.in6.sin6_port = htobe16((uint16_t) m->port);
-                else
-                        m->address.sockaddr.in.sin_port = htobe16((uint16_t) m->port);
+bool manager_input_blocked(Manager *m) {
+        Destination *d;
+
+        assert(m);
 
-                sockaddr_pretty(&m->address.sockaddr.sa, ai->ai_addrlen, true, true, &pretty);
+        if (m->workers && worker_pool_full(m->workers))
+                return true;
 
-                log_debug("Resolved address %s for %s.", pretty, m->server_name);
+        LIST_FOREACH(destinations, d, m->destinations)
+                if (destination_blocked(d))
+                        return true;
 
-                /* take the first one */
-                break;
+        return false;
+}
+
+/* Sends out whatever was batched, unless a timer waits for more messages. With a spool this is up to the
+ * sender. Returns the first error, the output of the failing peer may be lost then. */
+int manager_flush_output(Manager *m) {
+        Destination *d;
+        int r = 0;
+
+        assert(m);
+
+        LIST_FOREACH(destinations, d, m->destinations) {
+                Peer *p;
+
+                if (d->spool)
+                        continue;
+
+                LIST_FOREACH(peers, p, d->peers) {
+                        int k;
+
+                        if (p->event_batch_flush)
+                                continue;
+
+                        k = protocol_flush(p);
+                        if (k < 0 && r >= 0)
+                                r = k;
+                }
         }
 
-        if (!IN_SET(m->address.sockaddr.sa.sa_family, AF_INET, AF_INET6)) {
-                log_error("Failed to find suitable address for host %s.", m->server_name);
+        return r;
+}
+
+/* Switches to catching up once any journal is further behind than CatchUpThresholdSec=, and back once all of
+ * them are within half of it, so that a lag around the threshold doesn't flip the mode all the time */
+void manager_update_catch_up(Manager *m) {
+        JournalReader *reader;
+        usec_t lag = 0;
+        Destination *d;
+        Peer *p;
+
+        assert(m);
+
+        if (m->catch_up_threshold_usec == 0)
+                return;
+
+        LIST_FOREACH(readers, reader, m->readers)
+                if (reader->journal)
+                        lag = MAX(lag, reader->lag_usec);
+
+        if (!m->catching_up && lag > m->catch_up_threshold_usec) {
+                log_info("Forwarding is %" PRIu64 "s behind the journal, catching up.", lag / USEC_PER_SEC);
+                m->catching_up = true;
+                m->n_catch_ups++;
+        } else if (m->catching_up && lag <= m->catch_up_threshold_usec / 2) {
+                log_info("Caught up with the journal.");
+                m->catching_up = false;
+        } else
+                return;
+
+        LIST_FOREACH(destinations, d, m->destinations)
+                LIST_FOREACH(peers, p, d->peers) {
+                        /* UDP datagrams batched beyond BatchSize= go out before the next one is sent on
+                         * its own */
+                        if (!m->catching_up)
+                                (void) protocol_flush(p);
+
+                        network_update_send_buffer(p);
+                }
+
+        /* Checkpoints were held back meanwhile */
+        if (!m->catching_up)
+                (void) state_flush(m);
+}
+
+/* A destination without a spool can only take messages while any of its peers is connected, hence reading
+ * stops when it goes away entirely, and continues from the last saved cursor once it is back. With more
+ * than one destination all of them have a spool, see manager_parse_config_file(). */
+int manager_update_input(Manager *m) {
+        JournalReader *reader;
+        Destination *d;
+        int r = 0;
+
+        assert(m);
+
+        LIST_FOREACH(destinations, d, m->destinations)
+                if (!d->spool && !destination_connected(d)) {
+                        journal_close_input(m);
+                        return 0;
+                }
+
+        /* The readers are independent, one failing to open doesn't hold up the others */
+        LIST_FOREACH(readers, reader, m->readers) {
+                int k;
+
+                if (reader->journal)
+                        continue;
 
-                /* Try next host */
-                return manager_connect(m);
+                k = journal_monitor_listen(reader);
+                if (k < 0) {
+                        log_error_errno(k, "Failed to monitor %s: %m", journal_reader_name(reader));
+                        journal_reader_close(reader);
+                        if (r >= 0)
+                                r = k;
+                }
         }
 
-        m->resolving = false;
-        return manager_connect(m);
+        return r;
 }
 
 static int manager_network_event_handler(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
         Manager *m = userdata;
         bool connected, online;
+        Destination *d;
+        Peer *p;
         int r;
 
         assert(m);
@@ -229,20 +401,23 @@ static int manager_network_event_handler(sd_event_source *s, int fd, uint32_t re
         /* check if the machine is online */
         online = network_is_online();
 
-        /* check if the socket is currently open*/
-        connected = m->socket >= 0;
+        LIST_FOREACH(destinations, d, m->destinations)
+                LIST_FOREACH(peers, p, d->peers) {
+                        /* check if the socket is currently open*/
+                        connected = p->socket >= 0;
 
-        if (connected && !online) {
-                log_info("No network connectivity, watching for changes.");
-                manager_disconnect(m);
+                        if (connected && !online) {
+                                log_info("No network connectivity, watching for changes.");
+                                peer_disconnect(p);
 
-        } else if (!connected && online) {
-                log_info("Network configuration changed, trying to establish connection.");
+                        } else if (!connected && online) {
+                                log_info("Network configuration changed, trying to establish connection to %s.", p->name);
 
-                r = manager_connect(m);
-                if (r < 0)
-                        return r;
-        }
+                                r = peer_connect(p);
+                                if (r < 0)
+                                        return r;
+                        }
+                }
 
         return 0;
 }
@@ -276,25 +451,37 @@ void manager_free(Manager *m) {
                 return;
 
         manager_disconnect(m);
+        metrics_close(m);
+
+        /* The workers look at the destinations */
+        m->workers = worker_pool_free(m->workers);
+
+        /* Don't forward the entries sent since the last checkpoint again on the next start */
+        (void) state_flush(m);
+        sd_event_source_unref(m->event_checkpoint);
+        safe_close(m->state_fd);
 
-        free(m->dtls);
-        free(m->tls);
-        free(m->server_cert);
+        while (m->readers)
+                journal_reader_free(m->readers);
+        free(m->entry_buffer);
 
-        free(m->server_name);
+        while (m->destinations)
+                destination_free(m->destinations);
 
-        free(m->last_cursor);
+        free(m->cursor);
+        filter_done(&m->filter);
+        output_buffer_done(&m->output);
 
         free(m->state_file);
         free(m->dir);
-        free(m->namespace);
+        free(m->metrics_socket);
 
         sd_resolve_unref(m->resolve);
 
         sd_event_source_unref(m->network_event_source);
         sd_network_monitor_unref(m->network_monitor);
 
-        sd_event_source_unref(m->event_retry);
+        sd_event_source_unref(m->event_stats);
         sd_event_unref(m->event);
         free(m);
 }
@@ -310,28 +497,20 @@ int manager_new(const char *state_file, const char *cursor, Manager **ret) {
                 return log_oom();
 
         *m = (Manager) {
-                .socket = -1,
-                .journal_watch_fd = -1,
                 .state_file = strdup(state_file),
-                .protocol = SYSLOG_TRANSMISSION_PROTOCOL_UDP,
-                .log_format = SYSLOG_TRANSMISSION_LOG_FORMAT_RFC_5424,
-                .auth_mode = OPEN_SSL_CERTIFICATE_AUTH_MODE_DENY,
-                .connection_retry_usec = DEFAULT_CONNECTION_RETRY_USEC,
-                .ratelimit = (const RateLimit) {
-                        RATELIMIT_INTERVAL_USEC,
-                        RATELIMIT_BURST
-                },
+                .state_fd = -1,
+                .metrics_fd = -1,
+                .catch_up_threshold_usec = DEFAULT_CATCH_UP_THRESHOLD_USEC,
+                .checkpoint_entries = DEFAULT_CHECKPOINT_ENTRIES,
+                .checkpoint_usec = DEFAULT_CHECKPOINT_USEC,
             };
 
-        r = socket_address_parse(&m->address, "239.0.0.1:6000");
-        assert(r == 0);
-
         if (!m->state_file)
                 return log_oom();
 
         if (cursor) {
-                m->last_cursor = strdup(cursor);
-                if (!m->last_cursor)
+                m->cursor = strdup(cursor);
+                if (!m->cursor)
                         return log_oom();
         }
 
@@ -361,6 +540,14 @@ int manager_new(const char *state_file, const char *cursor, Manager **ret) {
         if (r < 0)
                 return r;
 
+        r = manager_statistics_listen(m);
+        if (r < 0)
+                log_warning_errno(r, "Failed to set up statistics timer, ignoring: %m");
+
+        r = metrics_status_listen(m);
+        if (r < 0)
+                log_warning_errno(r, "Failed to set up status timer, ignoring: %m");
+
         *ret = TAKE_PTR(m);
         return 0;
 }
@@ -4,20 +4,34 @@
 #include <systemd/sd-event.h>
 #include <systemd/sd-journal.h>
 
-#include "netlog-dtls.h"
-#include "netlog-tls.h"
+#include "list.h"
+#include "netlog-filter.h"
+#include "netlog-histogram.h"
+#include "netlog-ssl-common.h"
 #include "sd-network.h"
 #include "sd-resolve.h"
 #include "socket-util.h"
 #include "ratelimit.h"
 
 #define DEFAULT_CONNECTION_RETRY_USEC   (30 * USEC_PER_SEC)
+#define DEFAULT_BATCH_SIZE              1U
+#define BATCH_SIZE_MAX                  1024U /* UIO_MAXIOV, the kernel limit for sendmmsg() */
+#define DEFAULT_CHECKPOINT_ENTRIES      1000U
+#define DEFAULT_CHECKPOINT_USEC         (1 * USEC_PER_SEC)
+#define DEFAULT_CATCH_UP_THRESHOLD_USEC (10 * USEC_PER_SEC)
+
+/* While catching up with the journal, UDP datagrams are sent in batches of at least this many, send buffers
+ * are raised to at least this size, and the cursors are saved this many times less often */
+#define CATCH_UP_BATCH_SIZE        64U
+#define CATCH_UP_SEND_BUFFER       (4U * 1024U * 1024U)
+#define CATCH_UP_CHECKPOINT_FACTOR 10U
 
 typedef enum SysLogTransmissionProtocol {
         SYSLOG_TRANSMISSION_PROTOCOL_UDP      = 1 << 0,
         SYSLOG_TRANSMISSION_PROTOCOL_TCP      = 1 << 1,
         SYSLOG_TRANSMISSION_PROTOCOL_DTLS     = 1 << 2,
         SYSLOG_TRANSMISSION_PROTOCOL_TLS      = 1 << 3,
+        SYSLOG_TRANSMISSION_PROTOCOL_RELP     = 1 << 4,
         _SYSLOG_TRANSMISSION_PROTOCOL_MAX,
         _SYSLOG_TRANSMISSION_PROTOCOL_INVALID = -EINVAL,
 } SysLogTransmissionProtocol;
@@ -74,72 +88,136 @@ typedef enum SysLogLevel {
         _SYSLOG_LEVEL_INVALID      = -EINVAL,
 } SysLogLevel;
 
+typedef enum JournalLookup {
+        JOURNAL_LOOKUP_ENUMERATE,
+        JOURNAL_LOOKUP_DIRECT,
+        _JOURNAL_LOOKUP_MAX,
+} JournalLookup;
+
+/* The part of an RFC 3339 timestamp which only changes once per second */
+typedef struct TimestampCache {
+        time_t second;
+        bool valid;
+
+        char prefix[sizeof("-2147483648-12-31T23:59:59")];
+        size_t prefix_len;
+        char zone[sizeof("+hh:mm ")];
+        size_t zone_len;
+} TimestampCache;
+
+/* Formatted messages, serialized back to back. The buffer is kept and reused, so that formatting only
+ * allocates while it grows. */
+typedef struct OutputBuffer {
+        char *data;
+        size_t size;
+        size_t allocated;
+} OutputBuffer;
+
 typedef struct Manager Manager;
+typedef struct Destination Destination;
+typedef struct WorkerPool WorkerPool;
+typedef struct JournalReader JournalReader;
+typedef struct MetricsConnection MetricsConnection;
 
 struct Manager {
         sd_resolve *resolve;
         sd_event *event;
 
-        sd_event_source *event_journal_input;
-        usec_t connection_retry_usec;
-
         /* network */
         sd_event_source *network_event_source;
         sd_network_monitor *network_monitor;
 
-        /* Retry connections */
-        sd_event_source *event_retry;
-
-        RateLimit ratelimit;
-
-        /* peer */
-        sd_resolve_query *resolve_query;
-
-        int socket;
-
-        /* Multicast UDP address */
-        SocketAddress address;
-        uint32_t port;
-
-        char *server_name;
+        /* Servers the journal is forwarded to, each with its own connection */
+        LIST_HEAD(Destination, destinations);
+        unsigned n_destinations;
 
         uint32_t excluded_syslog_facilities;
         uint8_t excluded_syslog_levels;
 
-        /* journal  */
-        int journal_watch_fd;
-        int namespace_flags;
+        /* IncludeMatch= and ExcludeMatch=, checked before the fields of an entry are copied */
+        Filter filter;
+
+        /* The journal, or the namespaces of it, messages are read from */
+        LIST_HEAD(JournalReader, readers);
+        unsigned n_readers;
+        unsigned next_reader;
 
-        sd_journal *journal;
+        /* Fields of the journal entry being forwarded */
+        char *entry_buffer;
+        size_t entry_buffer_size;
+        size_t entry_buffer_allocated;
+
+        /* Average time it took to get the fields of an entry, per lookup strategy */
+        nsec_t lookup_cost[_JOURNAL_LOOKUP_MAX];
 
         char *state_file;
-        char *last_cursor;
+        int state_fd;
+        size_t state_size;
+
+        /* The cursors are saved after CheckpointEntries= entries or CheckpointIntervalSec=, not on every
+         * wakeup */
+        unsigned checkpoint_entries;
+        usec_t checkpoint_usec;
+        bool checkpoint_sync;
+        sd_event_source *event_checkpoint;
+        uint64_t n_unsaved_entries;
+        usec_t unsaved_since;
+
         char *structured_data;
         char *dir;
-        char *namespace;
 
-        SysLogTransmissionProtocol protocol;
-        SysLogTransmissionLogFormat log_format;
-        OpenSSLCertificateAuthMode auth_mode;
-        char *server_cert;
+        /* Where the first reader starts, from --cursor= */
+        char *cursor;
 
         bool syslog_structured_data;
         bool syslog_msgid;
 
-        DTLSManager *dtls;
-        TLSManager *tls;
-
-        bool keep_alive;
-        bool no_delay;
-        bool connected;
-        bool resolving;
-
-        unsigned keep_alive_cnt;
-
-        size_t send_buffer;
-
-        usec_t keep_alive_time;
-        usec_t keep_alive_interval;
+        TimestampCache timestamp_cache;
+
+        /* The entry being forwarded, formatted for one destination after the other */
+        OutputBuffer output;
+
+        /* Threads formatting the messages, if enabled with Workers= */
+        unsigned n_workers;
+        WorkerPool *workers;
+
+        bool journal_paused;
+
+        /* Set while the entries being read are more than CatchUpThresholdSec= older than the end of the
+         * journal, the output then goes out in larger chunks */
+        usec_t catch_up_threshold_usec;
+        bool catching_up;
+        uint64_t n_catch_ups;
+
+        /* Messages handed to the peers of destinations without a spool. The journal cursors only move past
+         * them once they left the output buffers of the peers and, with RELP, were acknowledged. */
+        uint64_t output_seqnum;
+
+        /* Counters for the periodic statistics dump when debug logging is enabled */
+        uint64_t n_entries_read;
+        uint64_t n_entries_filtered;
+        uint64_t n_entries_formatted;
+        uint64_t n_entries_forwarded;
+        uint64_t n_cursors;
+        uint64_t n_checkpoints;
+        uint64_t stats_entries_read;
+        uint64_t stats_cursors;
+        uint64_t stats_checkpoints;
+        usec_t stats_timestamp;
+        sd_event_source *event_stats;
+
+        /* Time from an entry being written to the journal until its messages left for all destinations */
+        LatencyHistogram latency;
+
+        /* MetricsSocket=, serving the counters in the Prometheus text format */
+        char *metrics_socket;
+        int metrics_fd;
+        sd_event_source *event_metrics;
+        LIST_HEAD(MetricsConnection, metrics_connections);
+        unsigned n_metrics_connections;
+
+        /* Updates the service status with the counters */
+        sd_event_source *event_status;
 };
 
 int manager_new(const char *state_file, const char *cursor, Manager **ret);
@@ -150,11 +228,13 @@ DEFINE_TRIVIAL_CLEANUP_FUNC(Manager*, manager_free);
 int manager_connect(Manager *m);
 void manager_disconnect(Manager *m);
 
-void manager_close_network_socket(Manager *m);
-int manager_open_network_socket(Manager *m);
-int manager_network_connect_socket(Manager *m);
-
-int manager_resolve_handler(sd_resolve_query *q, int ret, const struct addrinfo *ai, void *userdata);
+int manager_update_input(Manager *m);
+bool manager_input_blocked(Manager *m);
+bool manager_spooled(Manager *m);
+uint64_t manager_acknowledged(Manager *m);
+void manager_mark_output(Manager *m);
+int manager_flush_output(Manager *m);
+void manager_update_catch_up(Manager *m);
 
 int manager_push_to_network(Manager *m,
                             int severity,
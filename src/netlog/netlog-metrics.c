@@ -0,0 +1,579 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <systemd/sd-daemon.h>
+#include <unistd.h>
+
+#include "alloc-util.h"
+#include "fd-util.h"
+#include "fileio.h"
+#include "mkdir.h"
+#include "netlog-destination.h"
+#include "netlog-journal.h"
+#include "netlog-metrics.h"
+#include "socket-util.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "umask-util.h"
+
+typedef struct PeerMetric {
+        const char *name;
+        const char *type;
+        const char *help;
+        uint64_t (*get)(Peer *p);
+
+        /* NULL if the metric applies to all destinations */
+        bool (*applies)(Destination *d);
+} PeerMetric;
+
+static uint64_t peer_metric_sent(Peer *p) {
+        return p->n_sent;
+}
+
+static uint64_t peer_metric_bytes(Peer *p) {
+        return p->n_bytes;
+}
+
+static uint64_t peer_metric_compressed(Peer *p) {
+        return p->compressor.n_out;
+}
+
+static uint64_t peer_metric_lost(Peer *p) {
+        return p->n_lost;
+}
+
+static uint64_t peer_metric_failures(Peer *p) {
+        return p->n_failures;
+}
+
+static uint64_t peer_metric_connections(Peer *p) {
+        return p->n_connections;
+}
+
+static uint64_t peer_metric_up(Peer *p) {
+        return peer_connected(p);
+}
+
+static uint64_t peer_metric_pending(Peer *p) {
+        return peer_pending(p);
+}
+
+static uint64_t peer_metric_acked(Peer *p) {
+        return p->relp.n_acked;
+}
+
+static bool destination_compressed(Destination *d) {
+        return d->compression != COMPRESSION_NO;
+}
+
+static bool destination_relp(Destination *d) {
+        return d->protocol == SYSLOG_TRANSMISSION_PROTOCOL_RELP;
+}
+
+static const PeerMetric peer_metrics[] = {
+        { "netlogd_messages_sent_total",          "counter", "Messages handed to the connection to the server.",                    peer_metric_sent,        NULL                   },
+        { "netlogd_bytes_sent_total",             "counter", "Bytes of the messages handed to the connection, before compression.", peer_metric_bytes,       NULL                   },
+        { "netlogd_bytes_compressed_total",       "counter", "Bytes the messages to the server were compressed to.",               peer_metric_compressed,  destination_compressed },
+        { "netlogd_messages_lost_total",          "counter", "Messages handed to the connection that could not be sent.",          peer_metric_lost,        NULL                   },
+        { "netlogd_send_failures_total",          "counter", "Failures to connect to or to send to the server.",                   peer_metric_failures,    NULL                   },
+        { "netlogd_connections_total",            "counter", "Connections established to the server.",                             peer_metric_connections, NULL                   },
+        { "netlogd_server_up",                    "gauge",   "Whether the connection to the server is established.",               peer_metric_up,          NULL                   },
+        { "netlogd_send_queue_bytes",             "gauge",   "Output waiting for the connection to the server to take it.",        peer_metric_pending,     NULL                   },
+        { "netlogd_relp_messages_acked_total",    "counter", "Messages the server acknowledged.",                                  peer_metric_acked,       destination_relp       },
+};
+
+static void metrics_write_header(FILE *f, const char *name, const char *type, const char *help) {
+        fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void metrics_write_label(FILE *f, const char *label, const char *value) {
+        fprintf(f, "%s=\"", label);
+
+        for (const char *s = value; *s; s++)
+                switch (*s) {
+                        case '\\':
+                                fputs("\\\\", f);
+                                break;
+                        case '"':
+                                fputs("\\\"", f);
+                                break;
+                        case '\n':
+                                fputs("\\n", f);
+                                break;
+                        default:
+                                fputc(*s, f);
+                                break;
+                }
+
+        fputc('"', f);
+}
+
+static void metrics_write_counter(FILE *f, const char *name, const char *help, uint64_t value) {
+        metrics_write_header(f, name, "counter", help);
+        fprintf(f, "%s %" PRIu64 "\n", name, value);
+}
+
+static void metrics_write_seconds(FILE *f, usec_t usec) {
+        fprintf(f, "%" PRIu64 ".%06" PRIu64, usec / USEC_PER_SEC, usec % USEC_PER_SEC);
+}
+
+static void metrics_write_lag(FILE *f, Manager *m) {
+        JournalReader *reader;
+
+        metrics_write_header(f, "netlogd_journal_lag_seconds", "gauge",
+                             "How far the entries being read are behind the end of the journal.");
+        LIST_FOREACH(readers, reader, m->readers) {
+                fputs("netlogd_journal_lag_seconds{", f);
+                metrics_write_label(f, "journal", journal_reader_name(reader));
+                fputs("} ", f);
+                metrics_write_seconds(f, reader->lag_usec);
+                fputc('\n', f);
+        }
+
+        metrics_write_header(f, "netlogd_journal_lag_entries", "gauge",
+                             "Estimated number of entries between the ones being read and the end of the journal.");
+        LIST_FOREACH(readers, reader, m->readers) {
+                fputs("netlogd_journal_lag_entries{", f);
+                metrics_write_label(f, "journal", journal_reader_name(reader));
+                fprintf(f, "} %" PRIu64 "\n", reader->lag_entries);
+        }
+
+        metrics_write_header(f, "netlogd_catching_up", "gauge", "Whether a backlog of the journal is being sent.");
+        fprintf(f, "netlogd_catching_up %i\n", m->catching_up);
+
+        metrics_write_counter(f, "netlogd_catch_ups_total", "Times a backlog of the journal was caught up with.",
+                              m->n_catch_ups);
+}
+
+static void metrics_write_peers(FILE *f, Manager *m, const PeerMetric *metric) {
+        Destination *d;
+        Peer *p;
+
+        metrics_write_header(f, metric->name, metric->type, metric->help);
+
+        LIST_FOREACH(destinations, d, m->destinations) {
+                if (metric->applies && !metric->applies(d))
+                        continue;
+
+                LIST_FOREACH(peers, p, d->peers) {
+                        fprintf(f, "%s{", metric->name);
+                        metrics_write_label(f, "destination", d->name);
+                        fputc(',', f);
+                        metrics_write_label(f, "server", p->name);
+                        fprintf(f, "} %" PRIu64 "\n", metric->get(p));
+                }
+        }
+}
+
+static void metrics_write_dropped(FILE *f, Manager *m) {
+        Destination *d;
+
+        metrics_write_header(f, "netlogd_messages_dropped_total", "counter", "Messages dropped by the rate limit of the destination.");
+
+        LIST_FOREACH(destinations, d, m->destinations) {
+                if (!send_rate_limit_enabled(&d->rate_limit))
+                        continue;
+
+                /* Errors and above are never dropped */
+                for (int level = LOG_WARNING; level <= LOG_DEBUG; level++) {
+                        fputs("netlogd_messages_dropped_total{", f);
+                        metrics_write_label(f, "destination", d->name);
+                        fputc(',', f);
+                        metrics_write_label(f, "level", syslog_level_to_string(level));
+                        fprintf(f, "} %" PRIu64 "\n", d->rate_limit.n_dropped[level]);
+                }
+        }
+}
+
+static void metrics_write_latency(FILE *f, Manager *m) {
+        static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+        const LatencyHistogram *h = &m->latency;
+
+        /* Prometheus buckets have to be few, the quantiles from the finer buckets of the histogram are
+         * exported separately */
+        metrics_write_header(f, "netlogd_forwarding_latency_seconds", "histogram",
+                             "Time from the journal entry being written until its messages left for all destinations.");
+
+        for (unsigned bits = METRICS_LATENCY_BUCKET_MIN_BITS; bits <= METRICS_LATENCY_BUCKET_MAX_BITS; bits++) {
+                usec_t bound = UINT64_C(1) << bits;
+
+                fputs("netlogd_forwarding_latency_seconds_bucket{le=\"", f);
+                metrics_write_seconds(f, bound);
+                fprintf(f, "\"} %" PRIu64 "\n", latency_histogram_count_at_most(h, bound));
+        }
+
+        fprintf(f, "netlogd_forwarding_latency_seconds_bucket{le=\"+Inf\"} %" PRIu64 "\n", h->count);
+        fputs("netlogd_forwarding_latency_seconds_sum ", f);
+        metrics_write_seconds(f, h->sum);
+        fprintf(f, "\nnetlogd_forwarding_latency_seconds_count %" PRIu64 "\n", h->count);
+
+        metrics_write_header(f, "netlogd_forwarding_latency_quantile_seconds", "gauge",
+                             "Quantiles of the forwarding latency since the start, within 6.25%.");
+
+        for (size_t i = 0; i < ELEMENTSOF(quantiles); i++) {
+                fprintf(f, "netlogd_forwarding_latency_quantile_seconds{quantile=\"%g\"} ", quantiles[i]);
+                metrics_write_seconds(f, latency_histogram_quantile(h, quantiles[i]));
+                fputc('\n', f);
+        }
+}
+
+/* The metrics in the Prometheus text format */
+int metrics_format(Manager *m, char **ret, size_t *ret_size) {
+        _cleanup_fclose_ FILE *f = NULL;
+        _cleanup_free_ char *buf = NULL;
+        size_t size = 0;
+        int r;
+
+        assert(m);
+        assert(ret);
+        assert(ret_size);
+
+        f = open_memstream(&buf, &size);
+        if (!f)
+                return -ENOMEM;
+
+        metrics_write_counter(f, "netlogd_journal_entries_read_total", "Journal entries read.", m->n_entries_read);
+        metrics_write_counter(f, "netlogd_journal_entries_filtered_total", "Journal entries skipped by the filters.",
+                              m->n_entries_filtered);
+        metrics_write_counter(f, "netlogd_entries_formatted_total", "Journal entries formatted and sent to any destination.",
+                              m->n_entries_formatted);
+        metrics_write_counter(f, "netlogd_entries_forwarded_total", "Journal entries whose messages left for all destinations.",
+                              m->n_entries_forwarded);
+        metrics_write_counter(f, "netlogd_checkpoints_total", "Journal positions saved to the state file.",
+                              m->n_checkpoints);
+
+        metrics_write_lag(f, m);
+
+        for (size_t i = 0; i < ELEMENTSOF(peer_metrics); i++)
+                metrics_write_peers(f, m, &peer_metrics[i]);
+
+        metrics_write_dropped(f, m);
+        metrics_write_latency(f, m);
+
+        r = fflush_and_check(f);
+        if (r < 0)
+                return r;
+
+        f = safe_fclose(f);
+
+        *ret = TAKE_PTR(buf);
+        *ret_size = size;
+        return 0;
+}
+
+/* Called once the messages of the entries left the output buffers of all destinations, and were
+ * acknowledged by RELP servers, or went to their spools. Takes their journal timestamps, USEC_INFINITY for
+ * entries without one. */
+void metrics_entries_forwarded(Manager *m, const usec_t *timestamps, size_t n) {
+        usec_t t;
+
+        assert(m);
+        assert(timestamps || n == 0);
+
+        if (n == 0)
+                return;
+
+        m->n_entries_forwarded += n;
+        t = now(CLOCK_REALTIME);
+
+        for (size_t i = 0; i < n; i++) {
+                if (timestamps[i] == USEC_INFINITY)
+                        continue;
+
+                /* The realtime clock may have been set back since the entry was written */
+                latency_histogram_record(&m->latency, t > timestamps[i] ? t - timestamps[i] : 0);
+        }
+}
+
+static MetricsConnection *metrics_connection_free(MetricsConnection *c) {
+        if (!c)
+                return NULL;
+
+        if (c->manager) {
+                LIST_REMOVE(connections, c->manager->metrics_connections, c);
+                c->manager->n_metrics_connections--;
+        }
+
+        sd_event_source_disable_unref(c->event_io);
+        sd_event_source_disable_unref(c->event_timeout);
+        safe_close(c->fd);
+        free(c->response);
+
+        return mfree(c);
+}
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(MetricsConnection*, metrics_connection_free);
+
+static int metrics_connection_respond(MetricsConnection *c, bool http) {
+        _cleanup_free_ char *body = NULL;
+        size_t size;
+        int r;
+
+        assert(c);
+
+        r = metrics_format(c->manager, &body, &size);
+        if (r < 0)
+                return r;
+
+        if (http) {
+                r = asprintf(&c->response,
+                             "HTTP/1.0 200 OK\r\n"
+                             "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                             "Content-Length: %zu\r\n"
+                             "Connection: close\r\n"
+                             "\r\n"
+                             "%s",
+                             size, body);
+                if (r < 0) {
+                        c->response = NULL;
+                        return -ENOMEM;
+                }
+
+                c->response_size = r;
+        } else {
+                c->response = TAKE_PTR(body);
+                c->response_size = size;
+        }
+
+        return sd_event_source_set_io_events(c->event_io, EPOLLOUT);
+}
+
+/* HTTP requests are answered once the headers are complete, anything else right away, so that the metrics
+ * can be fetched with a plain socket client too */
+static bool metrics_connection_request_complete(MetricsConnection *c, bool *ret_http) {
+        static const char get[] = "GET ";
+        size_t n;
+
+        assert(c);
+        assert(ret_http);
+
+        n = MIN(c->request_size, sizeof(get) - 1);
+        *ret_http = n > 0 && memcmp(c->request, get, n) == 0;
+        if (!*ret_http)
+                return true;
+
+        return memmem(c->request, c->request_size, "\r\n\r\n", 4) ||
+                memmem(c->request, c->request_size, "\n\n", 2) ||
+                c->request_size >= sizeof(c->request);
+}
+
+static int metrics_connection_handler(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        MetricsConnection *c = ASSERT_PTR(userdata);
+        bool http;
+        ssize_t n;
+        int r;
+
+        if (c->response) {
+                n = send(fd, c->response + c->response_offset, c->response_size - c->response_offset,
+                         MSG_DONTWAIT|MSG_NOSIGNAL);
+                if (n < 0) {
+                        if (IN_SET(errno, EAGAIN, EINTR))
+                                return 0;
+
+                        log_debug_errno(errno, "Failed to send metrics: %m");
+                        metrics_connection_free(c);
+                        return 0;
+                }
+
+                c->response_offset += n;
+                if (c->response_offset >= c->response_size)
+                        metrics_connection_free(c);
+
+                return 0;
+        }
+
+        n = recv(fd, c->request + c->request_size, sizeof(c->request) - c->request_size, MSG_DONTWAIT);
+        if (n < 0) {
+                if (IN_SET(errno, EAGAIN, EINTR))
+                        return 0;
+
+                log_debug_errno(errno, "Failed to read metrics request: %m");
+                metrics_connection_free(c);
+                return 0;
+        }
+
+        c->request_size += n;
+
+        /* A client closing its end gets the metrics regardless of what it sent */
+        if (!metrics_connection_request_complete(c, &http) && n > 0)
+                return 0;
+
+        r = metrics_connection_respond(c, http);
+        if (r < 0) {
+                log_warning_errno(r, "Failed to format metrics: %m");
+                metrics_connection_free(c);
+        }
+
+        return 0;
+}
+
+static int metrics_connection_timeout_handler(sd_event_source *s, uint64_t usec, void *userdata) {
+        MetricsConnection *c = ASSERT_PTR(userdata);
+
+        log_debug("Metrics client timed out, disconnecting.");
+        metrics_connection_free(c);
+
+        return 0;
+}
+
+static int metrics_accept_handler(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        _cleanup_(metrics_connection_freep) MetricsConnection *c = NULL;
+        Manager *m = ASSERT_PTR(userdata);
+        _cleanup_close_ int cfd = -1;
+        int r;
+
+        cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if (cfd < 0) {
+                if (!IN_SET(errno, EAGAIN, EINTR, ECONNABORTED))
+                        log_warning_errno(errno, "Failed to accept metrics connection: %m");
+                return 0;
+        }
+
+        if (m->n_metrics_connections >= METRICS_CONNECTIONS_MAX) {
+                log_debug("Too many metrics clients, refusing connection.");
+                return 0;
+        }
+
+        c = new(MetricsConnection, 1);
+        if (!c) {
+                log_oom();
+                return 0;
+        }
+
+        *c = (MetricsConnection) {
+                .manager = m,
+                .fd = TAKE_FD(cfd),
+        };
+
+        LIST_PREPEND(connections, m->metrics_connections, c);
+        m->n_metrics_connections++;
+
+        r = sd_event_add_io(m->event, &c->event_io, c->fd, EPOLLIN, metrics_connection_handler, c);
+        if (r < 0) {
+                log_warning_errno(r, "Failed to watch metrics connection: %m");
+                return 0;
+        }
+
+        r = sd_event_add_time_relative(m->event, &c->event_timeout, CLOCK_MONOTONIC, METRICS_CONNECTION_TIMEOUT_USEC, 0,
+                                       metrics_connection_timeout_handler, c);
+        if (r < 0) {
+                log_warning_errno(r, "Failed to set up metrics connection timeout: %m");
+                return 0;
+        }
+
+        TAKE_PTR(c);
+        return 0;
+}
+
+/* Binds the socket while still privileged, the runtime directory belongs to root */
+int metrics_listen(Manager *m) {
+        union sockaddr_union sa = {
+                .un.sun_family = AF_UNIX,
+        };
+        _cleanup_close_ int fd = -1;
+        int r;
+
+        assert(m);
+
+        if (!m->metrics_socket)
+                return 0;
+
+        strncpy(sa.un.sun_path, m->metrics_socket, sizeof(sa.un.sun_path) - 1);
+
+        r = mkdir_parents(m->metrics_socket, 0755);
+        if (r < 0)
+                return log_error_errno(r, "Failed to create directory of %s: %m", m->metrics_socket);
+
+        fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+        if (fd < 0)
+                return log_error_errno(errno, "Failed to create metrics socket: %m");
+
+        /* A socket left behind by a previous run */
+        (void) unlink(m->metrics_socket);
+
+        /* Anyone may read the metrics, access is up to the permissions of the directory */
+        RUN_WITH_UMASK(0111)
+                r = bind(fd, &sa.sa, SOCKADDR_UN_LEN(sa.un));
+        if (r < 0)
+                return log_error_errno(errno, "Failed to bind metrics socket %s: %m", m->metrics_socket);
+
+        if (listen(fd, SOMAXCONN) < 0)
+                return log_error_errno(errno, "Failed to listen on metrics socket %s: %m", m->metrics_socket);
+
+        r = sd_event_add_io(m->event, &m->event_metrics, fd, EPOLLIN, metrics_accept_handler, m);
+        if (r < 0)
+                return log_error_errno(r, "Failed to watch metrics socket: %m");
+
+        m->metrics_fd = TAKE_FD(fd);
+
+        log_debug("Serving metrics on %s.", m->metrics_socket);
+        return 0;
+}
+
+void metrics_close(Manager *m) {
+        assert(m);
+
+        while (m->metrics_connections)
+                metrics_connection_free(m->metrics_connections);
+
+        m->event_metrics = sd_event_source_disable_unref(m->event_metrics);
+        m->event_status = sd_event_source_disable_unref(m->event_status);
+
+        if (m->metrics_fd >= 0) {
+                m->metrics_fd = safe_close(m->metrics_fd);
+
+                /* Fails once privileges are dropped, the service manager cleans up the runtime directory
+                 * then */
+                (void) unlink(m->metrics_socket);
+        }
+}
+
+static int metrics_status_handler(sd_event_source *s, uint64_t usec, void *userdata) {
+        Manager *m = ASSERT_PTR(userdata);
+        char catch_up[DECIMAL_STR_MAX(usec_t) + 48] = "";
+        JournalReader *reader;
+        usec_t p50, p99, lag = 0;
+
+        if (m->catching_up) {
+                LIST_FOREACH(readers, reader, m->readers)
+                        lag = MAX(lag, reader->lag_usec);
+
+                xsprintf(catch_up, "Catching up, %" PRIu64 "s behind the journal. ", lag / USEC_PER_SEC);
+        }
+
+        if (m->latency.count > 0) {
+                p50 = latency_histogram_quantile(&m->latency, 0.5);
+                p99 = latency_histogram_quantile(&m->latency, 0.99);
+
+                sd_notifyf(false,
+                           "STATUS=%sForwarded %" PRIu64 " of %" PRIu64 " journal entries read, %" PRIu64 " filtered out. "
+                           "Latency p50 %" PRIu64 ".%03" PRIu64 "ms, p99 %" PRIu64 ".%03" PRIu64 "ms.",
+                           catch_up, m->n_entries_forwarded, m->n_entries_read, m->n_entries_filtered,
+                           p50 / USEC_PER_MSEC, p50 % USEC_PER_MSEC, p99 / USEC_PER_MSEC, p99 % USEC_PER_MSEC);
+        } else
+                sd_notifyf(false,
+                           "STATUS=%sForwarded %" PRIu64 " of %" PRIu64 " journal entries read, %" PRIu64 " filtered out.",
+                           catch_up, m->n_entries_forwarded, m->n_entries_read, m->n_entries_filtered);
+
+        return sd_event_source_set_time_relative(s, METRICS_STATUS_INTERVAL_USEC);
+}
+
+int metrics_status_listen(Manager *m) {
+        int r;
+
+        assert(m);
+
+        /* Don't wake up if nobody listens */
+        if (!getenv("NOTIFY_SOCKET"))
+                return 0;
+
+        r = sd_event_add_time_relative(m->event, &m->event_status, CLOCK_MONOTONIC, METRICS_STATUS_INTERVAL_USEC, 0,
+                                       metrics_status_handler, m);
+        if (r < 0)
+                return r;
+
+        return sd_event_source_set_enabled(m->event_status, SD_EVENT_ON);
+}
@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+#pragma once
+
+#include "list.h"
+#include "netlog-manager.h"
+#include "time-util.h"
+
+/* How often the service status is updated with the counters, if the service manager listens */
+#define METRICS_STATUS_INTERVAL_USEC (10 * USEC_PER_SEC)
+
+/* Clients are dropped if they don't send their request in time or don't read the response */
+#define METRICS_CONNECTION_TIMEOUT_USEC (5 * USEC_PER_SEC)
+#define METRICS_CONNECTIONS_MAX         16U
+#define METRICS_REQUEST_MAX             4096U
+
+/* Range of the buckets the forwarding latency is exported with, powers of two from 128µs to about 19h */
+#define METRICS_LATENCY_BUCKET_MIN_BITS 7U
+#define METRICS_LATENCY_BUCKET_MAX_BITS 36U
+
+typedef struct MetricsConnection MetricsConnection;
+
+/* A client of the metrics socket. It gets the metrics once it sent its request, or closed its end, and is
+ * disconnected after that. */
+struct MetricsConnection {
+        Manager *manager;
+
+        LIST_FIELDS(MetricsConnection, connections);
+
+        int fd;
+        sd_event_source *event_io;
+        sd_event_source *event_timeout;
+
+        char request[METRICS_REQUEST_MAX];
+        size_t request_size;
+
+        char *response;
+        size_t response_size;
+        size_t response_offset;
+};
+
+int metrics_format(Manager *m, char **ret, size_t *ret_size);
+
+void metrics_entries_forwarded(Manager *m, const usec_t *timestamps, size_t n);
+
+int metrics_listen(Manager *m);
+void metrics_close(Manager *m);
+
+int metrics_status_listen(Manager *m);
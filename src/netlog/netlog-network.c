@@ -8,7 +8,9 @@
 #include "alloc-util.h"
 #include "fd-util.h"
 #include "io-util.h"
-#include "netlog-manager.h"
+#include "iovec-util.h"
+#include "netlog-journal.h"
+#include "netlog-destination.h"
 #include "netlog-network.h"
 #include "netlog-protocol.h"
 
@@ -17,16 +19,24 @@
 
 #define SEND_TIMEOUT_USEC (200 * USEC_PER_MSEC)
 
-static int sendmsg_loop(Manager *m, struct msghdr *mh) {
+/* Journal input is paused while more TCP output than this is waiting for the socket, and resumed once it
+ * dropped below the low watermark */
+#define SEND_QUEUE_HIGH_WATERMARK (1024U * 1024U)
+#define SEND_QUEUE_LOW_WATERMARK  (256U * 1024U)
+
+/* While catching up, TCP output is gathered and written in chunks of this size */
+#define SEND_QUEUE_CATCH_UP_CHUNK (64U * 1024U)
+
+static int sendmsg_loop(Peer *p, struct msghdr *mh) {
         ssize_t n;
         int r;
 
-        assert(m);
-        assert(m->socket >= 0);
+        assert(p);
+        assert(p->socket >= 0);
         assert(mh);
 
         for (;;) {
-                n = sendmsg(m->socket, mh, MSG_NOSIGNAL);
+                n = sendmsg(p->socket, mh, MSG_NOSIGNAL);
                 if (n >= 0) {
                         log_debug("Successful sendmsg: %zd bytes", n);
                         return 0;
@@ -38,7 +48,7 @@ static int sendmsg_loop(Manager *m, struct msghdr *mh) {
                 if (errno != EAGAIN)
                         return -errno;
 
-                r = fd_wait_for_event(m->socket, POLLOUT, SEND_TIMEOUT_USEC);
+                r = fd_wait_for_event(p->socket, POLLOUT, SEND_TIMEOUT_USEC);
                 if (r < 0)
                         return r;
                 if (r == 0)
@@ -48,27 +58,423 @@ static int sendmsg_loop(Manager *m, struct msghdr *mh) {
         return 0;
 }
 
-int network_send(Manager *m, struct iovec *iovec, unsigned n_iovec) {
+/* Returns how many datagrams went out also on failure */
+static int sendmmsg_loop(Peer *p, struct mmsghdr *msgs, unsigned n_msgs, unsigned *ret_sent) {
+        unsigned sent = 0;
+        int k, r;
+
+        assert(p);
+        assert(p->socket >= 0);
+        assert(msgs);
+        assert(ret_sent);
+
+        while (sent < n_msgs) {
+                /* sendmmsg() only fails if the very first datagram could not be sent, otherwise it
+                 * returns how many went out and the next call reports the error, if any. */
+                k = sendmmsg(p->socket, msgs + sent, n_msgs - sent, MSG_NOSIGNAL);
+                if (k >= 0) {
+                        sent += k;
+                        continue;
+                }
+
+                if (errno == EINTR)
+                        continue;
+
+                if (errno != EAGAIN) {
+                        r = -errno;
+                        goto finish;
+                }
+
+                r = fd_wait_for_event(p->socket, POLLOUT, SEND_TIMEOUT_USEC);
+                if (r == 0)
+                        r = -ETIMEDOUT;
+                if (r < 0)
+                        goto finish;
+        }
+
+        log_debug("Successful sendmmsg: %u datagrams", n_msgs);
+        r = 0;
+
+finish:
+        *ret_sent = sent;
+        return r;
+}
+
+static int network_address(Peer *p, struct sockaddr **ret_sa, socklen_t *ret_salen) {
+        assert(p);
+        assert(ret_sa);
+        assert(ret_salen);
+
+        switch (p->address.sockaddr.sa.sa_family) {
+                case AF_INET:
+                        *ret_salen = sizeof(p->address.sockaddr.in);
+                        break;
+                case AF_INET6:
+                        *ret_salen = sizeof(p->address.sockaddr.in6);
+                        break;
+                default:
+                        return -EAFNOSUPPORT;
+        }
+
+        *ret_sa = &p->address.sockaddr.sa;
+        return 0;
+}
+
+static size_t network_queue_pending(Peer *p) {
+        assert(p);
+
+        return p->send_queue_size - p->send_queue_offset;
+}
+
+static int network_queue_write(Peer *p) {
+        ssize_t n;
+
+        assert(p);
+        assert(p->socket >= 0);
+
+        while (network_queue_pending(p) > 0) {
+                n = send(p->socket, p->send_queue + p->send_queue_offset, network_queue_pending(p), MSG_NOSIGNAL|MSG_DONTWAIT);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN)
+                                break;
+
+                        return -errno;
+                }
+
+                log_debug("Successful send: %zd bytes", n);
+                p->send_queue_offset += n;
+                p->output_written += n;
+        }
+
+        if (network_queue_pending(p) == 0)
+                p->send_queue_offset = p->send_queue_size = 0;
+
+        return 0;
+}
+
+static int network_queue_handler(sd_event_source *s, int fd, uint32_t revents, void *userdata);
+
+int network_queue_update(Peer *p) {
+        Destination *d;
+        size_t pending;
+        int r;
+
+        assert(p);
+
+        d = p->destination;
+        pending = network_queue_pending(p);
+
+        if (pending > 0 && !p->event_send_queue) {
+                r = sd_event_add_io(d->manager->event, &p->event_send_queue, p->socket, EPOLLOUT, network_queue_handler, p);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to watch socket: %m");
+        } else if (p->event_send_queue) {
+                r = sd_event_source_set_enabled(p->event_send_queue, pending > 0 ? SD_EVENT_ON : SD_EVENT_OFF);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to update socket watch: %m");
+        }
+
+        return network_update_congestion(p, pending);
+}
+
+/* Pauses the journal while the output waiting for the peer is above the high watermark, and resumes it once
+ * below the low one */
+int network_update_congestion(Peer *p, size_t pending) {
+        Destination *d;
+
+        assert(p);
+
+        d = p->destination;
+
+        /* With a spool the output is handed over by the spool sender rather than the journal reader, and
+         * that one doesn't hand out more before everything was written */
+        if (d->spool)
+                return pending == 0 ? protocol_schedule_drain(d, 0) : 0;
+
+        /* A congested peer gets no more messages while other peers of the destination take them. Only
+         * when all of them are congested the journal is paused. */
+        if (pending >= SEND_QUEUE_HIGH_WATERMARK || relp_window_full(p)) {
+                p->congested = true;
+                if (destination_blocked(d))
+                        journal_pause_input(d->manager);
+        } else if (pending < SEND_QUEUE_LOW_WATERMARK && p->congested) {
+                p->congested = false;
+                return journal_resume_input(d->manager);
+        }
+
+        return 0;
+}
+
+static int network_queue_handler(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        Peer *p = ASSERT_PTR(userdata);
+        int r;
+
+        r = network_queue_write(p);
+        if (r < 0) {
+                log_debug_errno(r, "Failed to send queued messages to %s, performing reconnect: %m", p->name);
+                (void) peer_failed(p);
+                return 0;
+        }
+
+        (void) network_queue_update(p);
+
+        /* The cursors held back for the queue can be saved now */
+        if (!p->destination->spool)
+                (void) journal_acknowledge(p->destination->manager);
+
+        return 0;
+}
+
+static int network_queue_send(Peer *p, const struct iovec *iovec, unsigned n_iovec) {
+        struct msghdr mh = {
+                .msg_iov = (struct iovec *) iovec,
+                .msg_iovlen = n_iovec,
+        };
+        size_t size, skip = 0;
+        bool catching_up;
+        ssize_t n;
+        char *q;
+        int r;
+
+        assert(p);
+        assert(p->socket >= 0);
+        assert(iovec);
+
+        size = IOVEC_TOTAL_SIZE(iovec, n_iovec);
+        catching_up = p->destination->manager->catching_up;
+
+        /* Hand the message to the kernel right away unless older ones are still waiting, or a backlog is
+         * being sent, which is cheaper in large chunks */
+        if (network_queue_pending(p) == 0 && !catching_up) {
+                do
+                        n = sendmsg(p->socket, &mh, MSG_NOSIGNAL|MSG_DONTWAIT);
+                while (n < 0 && errno == EINTR);
+                if (n < 0 && errno != EAGAIN)
+                        return -errno;
+                if (n >= 0)
+                        log_debug("Successful sendmsg: %zd bytes", n);
+
+                skip = MAX(n, 0);
+                if (skip == size)
+                        return 0;
+        }
+
+        /* Whatever did not fit into the socket buffer is sent once the socket becomes writable again */
+        if (p->send_queue_offset > 0 && p->send_queue_size + size - skip > p->send_queue_allocated) {
+                memmove(p->send_queue, p->send_queue + p->send_queue_offset, network_queue_pending(p));
+                p->send_queue_size -= p->send_queue_offset;
+                p->send_queue_offset = 0;
+        }
+
+        if (!GREEDY_REALLOC(p->send_queue, p->send_queue_allocated, p->send_queue_size + size - skip))
+                return log_oom();
+
+        q = p->send_queue + p->send_queue_size;
+        for (unsigned i = 0; i < n_iovec; i++) {
+                size_t k = MIN(skip, iovec[i].iov_len);
+
+                q = mempcpy_safe(q, (const char *) iovec[i].iov_base + k, iovec[i].iov_len - k);
+                skip -= k;
+        }
+        p->output_queued += q - (p->send_queue + p->send_queue_size);
+        p->send_queue_size = q - p->send_queue;
+
+        /* Anything left is written at the end of the journal wakeup */
+        if (catching_up && network_queue_pending(p) >= SEND_QUEUE_CATCH_UP_CHUNK) {
+                r = network_queue_write(p);
+                if (r < 0)
+                        return r;
+        }
+
+        return network_queue_update(p);
+}
+
+int network_queue_flush(Peer *p) {
+        int r;
+
+        assert(p);
+
+        if (network_queue_pending(p) == 0)
+                return 0;
+
+        if (p->socket < 0)
+                return -ENOTCONN;
+
+        r = network_queue_write(p);
+        if (r < 0)
+                return r;
+
+        return network_queue_update(p);
+}
+
+int network_send(Peer *p, struct iovec *iovec, unsigned n_iovec) {
         struct msghdr mh = {
                 .msg_iov = iovec,
                 .msg_iovlen = n_iovec,
         };
+        int r;
 
-        assert(m);
+        assert(p);
         assert(iovec);
         assert(n_iovec > 0);
 
-        if (m->address.sockaddr.sa.sa_family == AF_INET) {
-                mh.msg_name = &m->address.sockaddr.sa;
-                mh.msg_namelen = sizeof(m->address.sockaddr.in);
-        } else if (m->address.sockaddr.sa.sa_family == AF_INET6) {
-                mh.msg_name = &m->address.sockaddr.sa;
-                mh.msg_namelen = sizeof(m->address.sockaddr.in6);
-        } else
-                return -EAFNOSUPPORT;
+        /* A full TCP socket must not stall the event loop, the output is queued instead */
+        if (IN_SET(p->destination->protocol, SYSLOG_TRANSMISSION_PROTOCOL_TCP, SYSLOG_TRANSMISSION_PROTOCOL_RELP))
+                return network_queue_send(p, iovec, n_iovec);
 
-        return sendmsg_loop(m, &mh);
+        r = network_address(p, (struct sockaddr **) &mh.msg_name, &mh.msg_namelen);
+        if (r < 0)
+                return r;
+
+        return sendmsg_loop(p, &mh);
+}
+
+/* Batches grow when catching up starts. The datagrams gathered so far keep their offsets, the headers are
+ * only filled in when sending. */
+static int network_batch_allocate(Peer *p, unsigned n) {
+        size_t *offsets;
+
+        assert(p);
+
+        if (p->batch_allocated >= n)
+                return 0;
+
+        offsets = realloc_multiply(p->batch_offsets, sizeof(size_t), n + 1);
+        if (!offsets)
+                return log_oom();
+        if (!p->batch_offsets)
+                offsets[0] = 0;
+        p->batch_offsets = offsets;
+
+        free(p->batch_msgs);
+        free(p->batch_iovecs);
+        p->batch_msgs = new0(struct mmsghdr, n);
+        p->batch_iovecs = new0(struct iovec, n);
+        if (!p->batch_msgs || !p->batch_iovecs) {
+                network_batch_free(p);
+                return log_oom();
+        }
+
+        p->batch_allocated = n;
+        return 0;
+}
+
+int network_batch_append(Peer *p, const struct iovec *iovec, unsigned n_iovec) {
+        unsigned batch_size;
+        size_t size;
+        char *q;
+        int r;
+
+        assert(p);
+        assert(iovec);
+        assert(n_iovec > 0);
+
+        batch_size = destination_batch_size(p->destination);
+        assert(batch_size > 1);
+
+        r = network_batch_allocate(p, batch_size);
+        if (r < 0)
+                return r;
+
+        /* The iovecs point into the OutputBuffer the message was formatted into, which is reused for the
+         * next destination or entry as soon as this returns, hence the datagram is copied out here. */
+        size = IOVEC_TOTAL_SIZE(iovec, n_iovec);
+        if (!GREEDY_REALLOC(p->batch_buffer, p->batch_buffer_allocated, p->batch_buffer_size + size))
+                return log_oom();
+
+        q = p->batch_buffer + p->batch_buffer_size;
+        for (unsigned i = 0; i < n_iovec; i++)
+                q = mempcpy_safe(q, iovec[i].iov_base, iovec[i].iov_len);
+
+        p->batch_buffer_size += size;
+        p->batch_offsets[++p->n_batch] = p->batch_buffer_size;
+        p->output_queued += size;
+
+        if (p->n_batch >= batch_size)
+                return network_batch_flush(p);
+
+        return 0;
+}
+
+int network_batch_flush(Peer *p) {
+        struct sockaddr *sa;
+        socklen_t salen;
+        unsigned n, sent;
+        int r;
+
+        assert(p);
+
+        if (p->n_batch == 0)
+                return 0;
+
+        p->event_batch_flush = sd_event_source_disable_unref(p->event_batch_flush);
+
+        /* The batch is gone after this, whether it could be sent or not */
+        n = p->n_batch;
+        p->output_written += p->batch_buffer_size;
+        p->n_batch = 0;
+        p->batch_buffer_size = 0;
+
+        if (p->socket < 0) {
+                p->n_lost += n;
+                p->output_lost = true;
+                return -ENOTCONN;
+        }
+
+        r = network_address(p, &sa, &salen);
+        if (r < 0) {
+                p->n_lost += n;
+                p->output_lost = true;
+                return r;
+        }
+
+        /* The buffer is not reallocated any more at this point, so it is now safe to point into it. */
+        for (unsigned i = 0; i < n; i++) {
+                p->batch_iovecs[i] = IOVEC_MAKE(p->batch_buffer + p->batch_offsets[i],
+                                                p->batch_offsets[i + 1] - p->batch_offsets[i]);
+                p->batch_msgs[i] = (struct mmsghdr) {
+                        .msg_hdr = {
+                                .msg_name = sa,
+                                .msg_namelen = salen,
+                                .msg_iov = &p->batch_iovecs[i],
+                                .msg_iovlen = 1,
+                        },
+                };
+        }
+
+        r = sendmmsg_loop(p, p->batch_msgs, n, &sent);
+        if (r < 0) {
+                p->n_lost += n - sent;
+                p->output_lost = true;
+        }
+
+        return r;
 }
+
+void network_batch_free(Peer *p) {
+        assert(p);
+
+        p->event_batch_flush = sd_event_source_disable_unref(p->event_batch_flush);
+
+        p->batch_msgs = mfree(p->batch_msgs);
+        p->batch_iovecs = mfree(p->batch_iovecs);
+        p->batch_offsets = mfree(p->batch_offsets);
+        p->batch_buffer = mfree(p->batch_buffer);
+        p->batch_buffer_size = p->batch_buffer_allocated = 0;
+        p->n_batch = p->batch_allocated = 0;
+}
+
+void network_queue_free(Peer *p) {
+        assert(p);
+
+        p->event_send_queue = sd_event_source_disable_unref(p->event_send_queue);
+
+        p->send_queue = mfree(p->send_queue);
+        p->send_queue_size = p->send_queue_offset = p->send_queue_allocated = 0;
+}
+
 int manager_push_to_network(Manager *m,
                             int severity,
                             int facility,
@@ -80,140 +486,211 @@ int manager_push_to_network(Manager *m,
                             const char *syslog_structured_data,
                             const char *syslog_msgid) {
 
-        int r;
+        bool sent = false;
+        Destination *d;
+        int r = 0;
 
         assert(m);
 
-        switch (m->protocol) {
-                case SYSLOG_TRANSMISSION_PROTOCOL_DTLS:
-                        if (!m->dtls->connected) {
-                                log_debug("DTLS not connected, performing reconnect");
-                                r = manager_connect(m);
-                                if (r < 0)
-                                        return r;
-                        }
+        /* Every destination gets the message in its own format. A failing destination doesn't keep the
+         * message from the others, the first error is returned though so that the entry is read again.
+         * Returns 1 if the message went to any destination, 0 if all skipped it. */
+        LIST_FOREACH(destinations, d, m->destinations) {
+                int k;
 
-                        break;
-                case SYSLOG_TRANSMISSION_PROTOCOL_TLS:
-                        if (!m->tls->connected) {
-                                log_debug("TLS not connected, performing reconnect");
-                                r = manager_connect(m);
-                                if (r < 0)
-                                        return r;
-                        }
-                        break;
-                default:
-                        if (!m->connected) {
-                                log_debug("%s not connected, performing reconnect", protocol_to_string(m->protocol));
-                                r = manager_connect(m);
-                                if (r < 0)
-                                        return r;
-                        }
-                        break;
+                m->output.size = 0;
+
+                k = format_message(d, &m->timestamp_cache, &m->output, severity, facility, identifier, message, hostname,
+                                   pid, tv, syslog_structured_data, syslog_msgid);
+                if (k == -EMSGSIZE) {
+                        /* Reading the entry again would not make it fit, skip it like the workers do */
+                        log_debug("Skipping message too large for %s.", log_format_to_string(d->log_format));
+                        continue;
+                }
+                if (k >= 0) {
+                        struct iovec iovec = IOVEC_MAKE(m->output.data, m->output.size);
+
+                        if (destination_rate_limited(d, severity, iovec.iov_len))
+                                continue;
+
+                        sent = true;
+                        k = protocol_send(d, &iovec, 1);
+                }
+                if (k < 0 && r >= 0)
+                        r = k;
         }
 
-        if (m->log_format == SYSLOG_TRANSMISSION_LOG_FORMAT_RFC_5424 || m->log_format == SYSLOG_TRANSMISSION_LOG_FORMAT_RFC_5425)
-               r = format_rfc5424(m, severity, facility, identifier, message, hostname, pid, tv, syslog_structured_data, syslog_msgid);
-        else
-               r = format_rfc3164(m, severity, facility, identifier, message, hostname, pid, tv);
+        if (!sent)
+                return r;
 
-        if (r < 0)
-               return r;
+        m->n_entries_formatted++;
 
-        return 0;
+        return r < 0 ? r : 1;
 }
 
-void manager_close_network_socket(Manager *m) {
-       assert(m);
+void network_close_socket(Peer *p) {
+       assert(p);
 
-        if (m->protocol == SYSLOG_TRANSMISSION_PROTOCOL_TCP && m->socket >= 0) {
-                int r = shutdown(m->socket, SHUT_RDWR);
+        if (IN_SET(p->destination->protocol, SYSLOG_TRANSMISSION_PROTOCOL_TCP, SYSLOG_TRANSMISSION_PROTOCOL_RELP) &&
+            p->socket >= 0 && p->connected) {
+                int r = shutdown(p->socket, SHUT_RDWR);
                 if (r < 0)
                         log_error_errno(errno, "Failed to shutdown netlog socket: %m");
         }
 
-        m->connected = false;
-        m->socket = safe_close(m->socket);
+        p->event_connect = sd_event_source_disable_unref(p->event_connect);
+        p->connected = false;
+        p->socket = safe_close(p->socket);
+
+        /* Whatever is still buffered is dropped. peer_disconnect() reads it again from the journal or the
+         * spool. */
+        p->event_batch_flush = sd_event_source_disable_unref(p->event_batch_flush);
+        p->n_batch = 0;
+        p->batch_buffer_size = 0;
+
+        /* The next connection starts a new stream */
+        compressor_reset(&p->compressor);
+
+        p->event_send_queue = sd_event_source_disable_unref(p->event_send_queue);
+        p->send_queue_size = p->send_queue_offset = 0;
+        p->output_written = p->output_queued;
+        p->congested = false;
+
+        relp_reset(p);
 }
 
-int manager_network_connect_socket(Manager *m) {
+static int network_connect_socket(Peer *p) {
         _cleanup_free_ char *pretty = NULL;
         const char *protocol;
         socklen_t salen;
         int r;
 
-        assert(m);
-        assert(m->socket >= 0);
+        assert(p);
+        assert(p->socket >= 0);
 
-        switch (m->address.sockaddr.sa.sa_family) {
+        switch (p->address.sockaddr.sa.sa_family) {
                 case AF_INET:
-                        salen = sizeof(m->address.sockaddr.in);
+                        salen = sizeof(p->address.sockaddr.in);
                         break;
                 case AF_INET6:
-                        salen = sizeof(m->address.sockaddr.in6);
+                        salen = sizeof(p->address.sockaddr.in6);
                         break;
                 default:
                         return -EAFNOSUPPORT;
         }
 
-        r = sockaddr_pretty(&m->address.sockaddr.sa, salen, true, true, &pretty);
+        r = sockaddr_pretty(&p->address.sockaddr.sa, salen, true, true, &pretty);
         if (r < 0)
                 return r;
 
-        protocol = protocol_to_string(m->protocol);
+        protocol = protocol_to_string(p->destination->protocol);
 
         log_debug("Connecting to remote server: '%s/%s'", pretty, protocol);
 
-        r = connect(m->socket, &m->address.sockaddr.sa, salen);
+        r = connect(p->socket, &p->address.sockaddr.sa, salen);
         if (r < 0 && errno != EINPROGRESS)
                 return log_error_errno(errno, "Failed to connect to remote server='%s/%s': %m", pretty, protocol);
 
-        if (errno != EINPROGRESS)
+        if (r >= 0) {
                 log_debug("Connected to remote server: '%s/%s'", pretty, protocol);
-        else
-                log_debug("Connection in progress to remote server: '%s/%s'", pretty, protocol);
+                return 1;
+        }
 
+        log_debug("Connection in progress to remote server: '%s/%s'", pretty, protocol);
         return 0;
 }
 
-static int apply_tcp_socket_options(Manager *m){
-        int r;
+static int network_connect_handler(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        Peer *p = ASSERT_PTR(userdata);
+        int r, error;
 
-        assert(m);
-        assert(m->socket >= 0);
+        p->event_connect = sd_event_source_disable_unref(p->event_connect);
+
+        r = getsockopt_int(fd, SOL_SOCKET, SO_ERROR, &error);
+        if (r < 0)
+                error = -r;
+        if (error != 0) {
+                /* Don't repeat this for every retry */
+                log_full_errno(p->failed ? LOG_DEBUG : LOG_WARNING, error, "Failed to connect to %s: %m", p->name);
+                return peer_failed(p);
+        }
+
+        log_debug("Connected to %s.", p->name);
 
-        if (m->no_delay) {
-                r = setsockopt_int(m->socket, IPPROTO_TCP, TCP_NODELAY, true);
+        p->connected = true;
+
+        /* With RELP forwarding starts once the server accepted the session */
+        if (p->destination->protocol == SYSLOG_TRANSMISSION_PROTOCOL_RELP) {
+                r = relp_open(p);
                 if (r < 0)
-                        log_debug_errno(r, "Failed to enable TCP_NODELAY mode, ignoring: %m");
+                        return peer_failed(p);
+
+                return 0;
         }
 
-        if (m->send_buffer > 0) {
-                r = fd_set_sndbuf(m->socket, m->send_buffer, false);
+        return peer_start_forwarding(p);
+}
+
+/* SendBuffer=, or a larger buffer while catching up. After catching up the kernel does not go back to
+ * sizing the buffer by itself, it stays as large until the next connection. */
+void network_update_send_buffer(Peer *p) {
+        Destination *d;
+        int r;
+
+        assert(p);
+
+        d = p->destination;
+
+        if (p->socket < 0)
+                return;
+
+        if (d->manager->catching_up)
+                r = fd_set_sndbuf(p->socket, MAX(d->send_buffer, CATCH_UP_SEND_BUFFER), true);
+        else if (d->send_buffer > 0)
+                r = fd_set_sndbuf(p->socket, d->send_buffer, false);
+        else
+                return;
+        if (r < 0)
+                log_debug_errno(r, "%s: SO_SNDBUF/SO_SNDBUFFORCE failed: %m", protocol_to_string(d->protocol));
+}
+
+static int apply_tcp_socket_options(Peer *p){
+        Destination *d;
+        int r;
+
+        assert(p);
+        assert(p->socket >= 0);
+
+        d = p->destination;
+
+        if (d->no_delay) {
+                r = setsockopt_int(p->socket, IPPROTO_TCP, TCP_NODELAY, true);
                 if (r < 0)
-                        log_debug_errno(r, "TCP: SO_SNDBUF/SO_SNDBUFFORCE failed: %m");
+                        log_debug_errno(r, "Failed to enable TCP_NODELAY mode, ignoring: %m");
         }
 
-        if (m->keep_alive) {
-                r = setsockopt_int(m->socket, SOL_SOCKET, SO_KEEPALIVE, true);
+        network_update_send_buffer(p);
+
+        if (d->keep_alive) {
+                r = setsockopt_int(p->socket, SOL_SOCKET, SO_KEEPALIVE, true);
                 if (r < 0)
                         log_debug_errno(r, "Failed to enable SO_KEEPALIVE: %m");
         }
 
-        if (timestamp_is_set(m->keep_alive_time)) {
-                r = setsockopt_int(m->socket, SOL_TCP, TCP_KEEPIDLE, m->keep_alive_time / USEC_PER_SEC);
+        if (timestamp_is_set(d->keep_alive_time)) {
+                r = setsockopt_int(p->socket, SOL_TCP, TCP_KEEPIDLE, d->keep_alive_time / USEC_PER_SEC);
                 if (r < 0)
                         log_debug_errno(r, "TCP_KEEPIDLE failed: %m");
         }
 
-        if (m->keep_alive_interval > 0) {
-                r = setsockopt_int(m->socket, SOL_TCP, TCP_KEEPINTVL, m->keep_alive_interval / USEC_PER_SEC);
+        if (d->keep_alive_interval > 0) {
+                r = setsockopt_int(p->socket, SOL_TCP, TCP_KEEPINTVL, d->keep_alive_interval / USEC_PER_SEC);
                 if (r < 0)
                         log_debug_errno(r, "TCP_KEEPINTVL failed: %m");
         }
 
-        if (m->keep_alive_cnt > 0) {
-                r = setsockopt_int(m->socket, SOL_TCP, TCP_KEEPCNT, m->keep_alive_cnt);
+        if (d->keep_alive_cnt > 0) {
+                r = setsockopt_int(p->socket, SOL_TCP, TCP_KEEPCNT, d->keep_alive_cnt);
                 if (r < 0)
                         log_debug_errno(r, "TCP_KEEPCNT failed: %m");
         }
@@ -221,44 +698,46 @@ static int apply_tcp_socket_options(Manager *m){
         return 0;
 }
 
-int manager_open_network_socket(Manager *m) {
+int network_open_socket(Peer *p) {
+        Destination *d;
         int r;
 
-        assert(m);
+        assert(p);
 
-        if (!IN_SET(m->address.sockaddr.sa.sa_family, AF_INET, AF_INET6))
+        d = p->destination;
+
+        if (!IN_SET(p->address.sockaddr.sa.sa_family, AF_INET, AF_INET6))
                 return -EAFNOSUPPORT;
 
-        switch (m->protocol) {
+        switch (d->protocol) {
                 case SYSLOG_TRANSMISSION_PROTOCOL_UDP:
-                        m->socket = socket(m->address.sockaddr.sa.sa_family, SOCK_DGRAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0);
+                        p->socket = socket(p->address.sockaddr.sa.sa_family, SOCK_DGRAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0);
                         break;
                 case SYSLOG_TRANSMISSION_PROTOCOL_TCP:
-                        m->socket = socket(m->address.sockaddr.sa.sa_family, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0);
+                case SYSLOG_TRANSMISSION_PROTOCOL_RELP:
+                        p->socket = socket(p->address.sockaddr.sa.sa_family, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0);
                         break;
                 default:
                         return -EPROTONOSUPPORT;
         }
-        if (m->socket < 0)
+        if (p->socket < 0)
                 return log_error_errno(errno, "Failed to create socket: %m");
 
-        log_debug("Successfully created socket with fd='%d'", m->socket);
+        log_debug("Successfully created socket with fd='%d'", p->socket);
 
-        switch (m->protocol) {
+        switch (d->protocol) {
                 case SYSLOG_TRANSMISSION_PROTOCOL_UDP: {
-                        r = setsockopt_int(m->socket, IPPROTO_IP, IP_MULTICAST_LOOP, true);
+                        r = setsockopt_int(p->socket, IPPROTO_IP, IP_MULTICAST_LOOP, true);
                         if (r < 0)
                                 log_debug_errno(errno, "UDP: Failed to set IP_MULTICAST_LOOP: %m");
 
-                        if (m->send_buffer > 0) {
-                                r = fd_set_sndbuf(m->socket, m->send_buffer, false);
-                                if (r < 0)
-                                        log_debug_errno(r, "UDP: SO_SNDBUF/SO_SNDBUFFORCE failed: %m");
-                        }}
+                        network_update_send_buffer(p);
+                }
 
                         break;
-                case SYSLOG_TRANSMISSION_PROTOCOL_TCP: {
-                        r = apply_tcp_socket_options(m);
+                case SYSLOG_TRANSMISSION_PROTOCOL_TCP:
+                case SYSLOG_TRANSMISSION_PROTOCOL_RELP: {
+                        r = apply_tcp_socket_options(p);
                         if (r < 0)
                                 return r;
                 }
@@ -267,18 +746,39 @@ int manager_open_network_socket(Manager *m) {
                         break;
         }
 
-        r = fd_nonblock(m->socket, true);
+        r = fd_nonblock(p->socket, true);
         if (r < 0)
-                log_debug_errno(errno, "Failed to set socket='%d' nonblock: %m", m->socket);
+                log_debug_errno(errno, "Failed to set socket='%d' nonblock: %m", p->socket);
 
-        r = manager_network_connect_socket(m);
+        r = network_connect_socket(p);
         if (r < 0)
                 goto fail;
 
-        m->connected = true;
+        /* Messages only go to the peer once the server accepted the connection, other peers take them
+         * meanwhile */
+        if (r == 0) {
+                r = sd_event_add_io(d->manager->event, &p->event_connect, p->socket, EPOLLOUT, network_connect_handler, p);
+                if (r < 0) {
+                        log_error_errno(r, "Failed to watch socket: %m");
+                        goto fail;
+                }
+
+                return 0;
+        }
+
+        p->connected = true;
+
+        if (d->protocol == SYSLOG_TRANSMISSION_PROTOCOL_RELP) {
+                r = relp_open(p);
+                if (r < 0) {
+                        network_close_socket(p);
+                        return r;
+                }
+        }
+
         return 0;
 
  fail:
-        m->socket = safe_close(m->socket);
+        p->socket = safe_close(p->socket);
         return r;
 }
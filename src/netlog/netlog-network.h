@@ -2,6 +2,20 @@
 
 #pragma once
 
-#include "netlog-manager.h"
+#include "netlog-destination.h"
 
-int network_send(Manager *m, struct iovec *iovec, unsigned n_iovec);
+int network_send(Peer *p, struct iovec *iovec, unsigned n_iovec);
+
+int network_batch_append(Peer *p, const struct iovec *iovec, unsigned n_iovec);
+int network_batch_flush(Peer *p);
+void network_batch_free(Peer *p);
+
+int network_queue_flush(Peer *p);
+int network_queue_update(Peer *p);
+int network_update_congestion(Peer *p, size_t pending);
+void network_queue_free(Peer *p);
+
+void network_update_send_buffer(Peer *p);
+
+int network_open_socket(Peer *p);
+void network_close_socket(Peer *p);
@@ -8,44 +8,368 @@
 #include "alloc-util.h"
 #include "fd-util.h"
 #include "io-util.h"
+#include "iovec-util.h"
+#include "netlog-destination.h"
+#include "netlog-journal.h"
 #include "netlog-protocol.h"
 #include "netlog-network.h"
 
 #define RFC_5424_NILVALUE "-"
 #define RFC_5424_PROTOCOL 1
 
+/* Messages framed with RFC5425 carry at most a six digit length */
+#define RFC_5425_MSGLEN_MAX 999999U
+
 #define SEND_TIMEOUT_USEC (200 * USEC_PER_MSEC)
 
-int protocol_send(Manager *m, struct iovec *iovec, unsigned n_iovec) {
+/* Frames sent from the spool per event loop iteration, and the delay before retrying when the server
+ * does not keep up */
+#define SPOOL_DRAIN_MAX 1024U
+#define SPOOL_RETRY_USEC (100 * USEC_PER_MSEC)
+
+/* Output the socket does not take right away waits in the TLS buffer and is written from the event loop, the
+ * journal is paused like with a full TCP send queue */
+static int protocol_tls_writev(Peer *p, const struct iovec *iovec, unsigned n_iovec) {
+        int r;
+
+        assert(p);
+        assert(p->tls);
+
+        r = tls_stream_writev(p->tls, iovec, n_iovec);
+        if (r < 0 && r != -EAGAIN)
+                return r;
+
+        (void) network_update_congestion(p, peer_pending(p));
+        return r;
+}
+
+/* Hands the compressed output to the TLS or TCP connection, which copy what they can't send right away.
+ * Unless flushing, the output is collected until a chunk is complete. */
+static int protocol_write_compressed(Peer *p, bool all) {
+        Compressor *c;
+        struct iovec iovec;
+        int r;
+
+        assert(p);
+
+        c = &p->compressor;
+
+        if (c->output_size == 0 || (!all && c->output_size < COMPRESSOR_CHUNK_SIZE))
+                return 0;
+
+        iovec = IOVEC_MAKE(c->output, c->output_size);
+
+        if (p->destination->protocol == SYSLOG_TRANSMISSION_PROTOCOL_TLS)
+                r = protocol_tls_writev(p, &iovec, 1);
+        else
+                r = network_send(p, &iovec, 1);
+        if (r < 0 && r != -EAGAIN)
+                p->output_lost = true;
+
+        c->output_size = 0;
+        return r;
+}
+
+int protocol_flush_compressed(Peer *p) {
+        int r;
+
+        assert(p);
+
+        if (p->destination->compression == COMPRESSION_NO || !peer_connected(p))
+                return 0;
+
+        r = compressor_flush(&p->compressor);
+        if (r < 0)
+                return r;
+
+        return protocol_write_compressed(p, true);
+}
+
+static int protocol_transmit(Peer *p, struct iovec *iovec, unsigned n_iovec) {
+        Destination *d;
         int r;
 
-        switch (m->protocol) {
+        assert(p);
+
+        d = p->destination;
+
+        if (!d->spool)
+                peer_number_message(p);
+
+        /* Compressed messages go through the deflate stream, the connection gets its output in chunks and
+         * once flushed */
+        if (d->compression != COMPRESSION_NO) {
+                r = compressor_write(&p->compressor, d->compression_level, iovec, n_iovec);
+                if (r >= 0)
+                        r = protocol_write_compressed(p, false);
+                if (r < 0 && r != -EAGAIN) {
+                        log_debug_errno(r, "Failed to send compressed messages to %s, performing reconnect: %m", p->name);
+                        peer_failed(p);
+                        return r;
+                }
+
+                p->n_sent++;
+                p->n_bytes += IOVEC_TOTAL_SIZE(iovec, n_iovec);
+
+                (void) protocol_arm_flush_timer(p);
+                return 0;
+        }
+
+        switch (d->protocol) {
                 case SYSLOG_TRANSMISSION_PROTOCOL_DTLS:
-                        r = dtls_datagram_writev(m->dtls, iovec, n_iovec);
+                        r = dtls_datagram_writev(p->dtls, iovec, n_iovec);
                         if (r < 0 && r != -EAGAIN) {
-                                log_debug_errno(r, "Failed to send via DTLS, performing reconnect: %m");
-                                manager_connect(m);
+                                log_debug_errno(r, "Failed to send via DTLS to %s, performing reconnect: %m", p->name);
+                                peer_failed(p);
                                 return r;
                         }
                         break;
                 case SYSLOG_TRANSMISSION_PROTOCOL_TLS:
-                        r = tls_stream_writev(m->tls, iovec, n_iovec);
+                        r = protocol_tls_writev(p, iovec, n_iovec);
                         if (r < 0 && r != -EAGAIN) {
-                                log_debug_errno(r, "Failed to send via TLS, performing reconnect: %m");
-                                manager_connect(m);
+                                log_debug_errno(r, "Failed to send via TLS to %s, performing reconnect: %m", p->name);
+                                peer_failed(p);
+                                return r;
+                        }
+                        break;
+                case SYSLOG_TRANSMISSION_PROTOCOL_RELP:
+                        r = relp_send(p, iovec, n_iovec);
+                        if (r < 0) {
+                                log_debug_errno(r, "Failed to send via RELP to %s, performing reconnect: %m", p->name);
+                                peer_failed(p);
                                 return r;
                         }
                         break;
                 default:
-                       r = network_send(m, iovec, n_iovec);
+                        if (d->protocol == SYSLOG_TRANSMISSION_PROTOCOL_UDP && destination_batch_size(d) > 1)
+                                r = network_batch_append(p, iovec, n_iovec);
+                        else
+                                r = network_send(p, iovec, n_iovec);
                         if (r < 0 && r != -EAGAIN) {
-                                log_debug_errno(r, "Failed to send via %s, performing reconnect: %m", protocol_to_string(m->protocol));
-                                manager_connect(m);
+                                log_debug_errno(r, "Failed to send via %s to %s, performing reconnect: %m", protocol_to_string(d->protocol), p->name);
+                                peer_failed(p);
                                 return r;
                         }
                         break;
         }
 
+        p->n_sent++;
+        p->n_bytes += IOVEC_TOTAL_SIZE(iovec, n_iovec);
+
+        (void) protocol_arm_flush_timer(p);
+        return 0;
+}
+
+int protocol_send(Destination *d, struct iovec *iovec, unsigned n_iovec) {
+        int r;
+
+        assert(d);
+
+        if (!d->spool) {
+                r = -ENOTCONN;
+
+                /* A peer failing to take the message is reconnected, and the message goes to the next one */
+                for (unsigned i = 0; i < d->n_peers; i++) {
+                        Peer *p;
+
+                        p = destination_pick_peer(d);
+                        if (!p)
+                                break;
+
+                        r = protocol_transmit(p, iovec, n_iovec);
+                        if (r >= 0)
+                                return 0;
+                }
+
+                if (r == -ENOTCONN)
+                        log_debug("No server of %s is connected.", d->name);
+
+                return r;
+        }
+
+        r = spool_append(d->spool, iovec, n_iovec);
+        if (r == -EMSGSIZE) {
+                log_warning("Message of %zu bytes does not fit into the spool, dropping.", IOVEC_TOTAL_SIZE(iovec, n_iovec));
+                return 0;
+        }
+        if (r == -ENOBUFS) {
+                /* Continue once the sender made some room */
+                log_debug("Spool of %s is full.", d->name);
+                d->spool_full = true;
+                journal_pause_input(d->manager);
+        }
+        if (r < 0)
+                return r;
+
+        return protocol_schedule_drain(d, 0);
+}
+
+int protocol_flush(Peer *p) {
+        int r;
+
+        assert(p);
+
+        if (peer_pending(p) == 0)
+                return 0;
+
+        /* The deflate stream goes first, its output is flushed along with the connection */
+        r = protocol_flush_compressed(p);
+        if (r < 0 && r != -EAGAIN) {
+                log_debug_errno(r, "Failed to flush compressed messages to %s, performing reconnect: %m", p->name);
+                peer_failed(p);
+                return r;
+        }
+
+        switch (p->destination->protocol) {
+                case SYSLOG_TRANSMISSION_PROTOCOL_TLS:
+                        r = tls_stream_flush(p->tls);
+                        if (r >= 0 || r == -EAGAIN)
+                                (void) network_update_congestion(p, peer_pending(p));
+                        break;
+                case SYSLOG_TRANSMISSION_PROTOCOL_TCP:
+                case SYSLOG_TRANSMISSION_PROTOCOL_RELP:
+                        r = network_queue_flush(p);
+                        break;
+                default:
+                        r = network_batch_flush(p);
+                        break;
+        }
+        if (r < 0 && r != -EAGAIN) {
+                log_debug_errno(r, "Failed to flush pending messages to %s, performing reconnect: %m", p->name);
+                peer_failed(p);
+                return r;
+        }
+
+        return 0;
+}
+
+static int protocol_flush_timer_handler(sd_event_source *s, uint64_t usec, void *userdata) {
+        Peer *p = ASSERT_PTR(userdata);
+
+        p->event_batch_flush = sd_event_source_disable_unref(p->event_batch_flush);
+
+        if (protocol_flush(p) < 0 || p->destination->spool)
+                return 0;
+
+        /* The cursors held back for the batch can be saved now */
+        (void) journal_acknowledge(p->destination->manager);
+        return 0;
+}
+
+static int protocol_drain_spool(Destination *d) {
+        unsigned n = 0;
+        Peer *p;
+        int r;
+
+        assert(d);
+        assert(d->spool);
+
+        /* Delivery continues once the connection is established again */
+        if (!destination_connected(d))
+                return 0;
+
+        /* Don't pile up more data on peers whose server has not accepted the previous round yet, the
+         * others take over meanwhile */
+        LIST_FOREACH(peers, p, d->peers)
+                p->ready = peer_connected(p) && peer_pending(p) == 0;
+
+        for (; n < SPOOL_DRAIN_MAX; n++) {
+                struct iovec iovec;
+
+                p = destination_pick_peer(d);
+                if (!p)
+                        break;
+
+                r = spool_peek(d->spool, &iovec);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to read from spool: %m");
+                if (r == 0)
+                        break;
+
+                r = protocol_transmit(p, &iovec, 1);
+                if (r < 0)
+                        goto fail;
+
+                spool_advance(d->spool);
+        }
+
+        LIST_FOREACH(peers, p, d->peers) {
+                r = protocol_flush(p);
+                if (r < 0)
+                        goto fail;
+        }
+
+        if (destination_pending(d))
+                return protocol_schedule_drain(d, SPOOL_RETRY_USEC);
+
+        /* Everything up to here has been handed to the kernel, don't send it again */
+        spool_commit(d->spool);
+
+        /* Rounds end at segment boundaries too, keep going until nothing is left */
+        if (n > 0) {
+                r = protocol_schedule_drain(d, 0);
+                if (r < 0)
+                        return r;
+        }
+
+        /* Delivery frees up room in the spool */
+        d->spool_full = false;
+        return journal_resume_input(d->manager);
+
+ fail:
+        /* The connection was reset, start over with the first frame not known to be sent. Other peers may
+         * take it meanwhile. */
+        spool_rewind(d->spool);
+        (void) protocol_schedule_drain(d, SPOOL_RETRY_USEC);
+        return r;
+}
+
+static int protocol_drain_handler(sd_event_source *s, uint64_t usec, void *userdata) {
+        Destination *d = ASSERT_PTR(userdata);
+
+        d->event_spool_drain = sd_event_source_disable_unref(d->event_spool_drain);
+
+        (void) protocol_drain_spool(d);
+        return 0;
+}
+
+int protocol_schedule_drain(Destination *d, usec_t usec) {
+        int r;
+
+        assert(d);
+
+        if (!d->spool || d->event_spool_drain)
+                return 0;
+
+        /* The default accuracy of 250ms would throttle delivery */
+        r = sd_event_add_time_relative(d->manager->event, &d->event_spool_drain, CLOCK_MONOTONIC, usec,
+                                       1, protocol_drain_handler, d);
+        if (r < 0)
+                return log_error_errno(r, "Failed to create spool timer: %m");
+
+        return 0;
+}
+
+int protocol_arm_flush_timer(Peer *p) {
+        Destination *d;
+        int r;
+
+        assert(p);
+
+        d = p->destination;
+
+        /* Without a latency bound pending messages are flushed once the current journal wakeup has been
+         * processed. Otherwise they may wait for more messages up to BatchLatencySec=, which also bounds how
+         * long compressed messages sit in the deflate stream. */
+        if (d->batch_latency_usec == 0 || p->event_batch_flush || peer_pending(p) == 0)
+                return 0;
+
+        /* BatchLatencySec= is an upper bound, don't let the default accuracy of 250ms add to it */
+        r = sd_event_add_time_relative(d->manager->event, &p->event_batch_flush, CLOCK_MONOTONIC, d->batch_latency_usec,
+                                       1, protocol_flush_timer_handler, p);
+        if (r < 0)
+                return log_error_errno(r, "Failed to create batch flush timer: %m");
+
         return 0;
 }
 
@@ -81,169 +405,347 @@ void format_rfc3339_timestamp(const struct timeval *tv, char *header_time, size_
         assert(r > 0 && (size_t)r < header_size);
 }
 
-static void set_priority_version_field(int severity, int facility, char *header_priority, size_t size, struct iovec *iov, int *n) {
-        uint8_t makepri = (facility << 3) + severity;
+static void timestamp_cache_update(TimestampCache *c, time_t t) {
+        char gm_buf[sizeof("+0530") + 1];
+        struct tm tm;
         int r;
 
-        r = snprintf(header_priority, size, "<%i>%i ", makepri, RFC_5424_PROTOCOL);
-        assert(r > 0 && (size_t)r < size);
-        IOVEC_SET_STRING(iov[(*n)++], header_priority);
+        assert(c);
+
+        /* localtime_r() doesn't notice a changed timezone on its own, tzset() checks whether $TZ or
+         * /etc/localtime changed. This happens once per second at most, as long as entries arrive in
+         * order. */
+        tzset();
+        localtime_r(&t, &tm);
+
+        c->prefix_len = strftime(c->prefix, sizeof(c->prefix), "%Y-%m-%dT%T", &tm);
+        assert(c->prefix_len != 0);
+
+        xstrftime(gm_buf, "%z", &tm);
+        r = snprintf(c->zone, sizeof(c->zone), "%.3s:%.2s ", gm_buf, gm_buf + 3);
+        assert(r > 0 && (size_t) r < sizeof(c->zone));
+        c->zone_len = r;
+
+        c->second = t;
+        c->valid = true;
 }
 
-static void set_timestamp_field(const struct timeval *tv, char *header_time, size_t size, struct iovec *iov, int *n) {
-        format_rfc3339_timestamp(tv, header_time, size);
-        IOVEC_SET_STRING(iov[(*n)++], header_time);
+/* Same as format_rfc3339_timestamp(), but only formats the date and time zone when the second changed.
+ * Returns the length of the timestamp. */
+size_t format_rfc3339_timestamp_cached(TimestampCache *c, const struct timeval *tv, char *header_time, size_t header_size) {
+        char *p = header_time;
+        time_t t;
+
+        assert(c);
+        assert(header_time);
+        assert(header_size >= sizeof(c->prefix) + sizeof(".000000") - 1 + sizeof(c->zone));
+
+        t = tv ? tv->tv_sec : ((time_t) (now(CLOCK_REALTIME) / USEC_PER_SEC));
+        if (!c->valid || c->second != t)
+                timestamp_cache_update(c, t);
+
+        p = mempcpy(p, c->prefix, c->prefix_len);
+
+        /* add fractional part */
+        if (tv) {
+                unsigned long long usec = tv->tv_usec;
+
+                *p++ = '.';
+                for (size_t i = 6; i > 0; i--) {
+                        p[i - 1] = '0' + usec % 10;
+                        usec /= 10;
+                }
+                p += 6;
+        }
+
+        memcpy(p, c->zone, c->zone_len + 1);
+
+        return p - header_time + c->zone_len;
 }
 
-static void set_string_field_with_separator(const char *value, struct iovec *iov, int *n) {
-        if (value)
-                IOVEC_SET_STRING(iov[(*n)++], value);
-        else
-                IOVEC_SET_STRING(iov[(*n)++], RFC_5424_NILVALUE);
+static size_t field_length(const char *value) {
+        return strlen(value ?: RFC_5424_NILVALUE);
+}
+
+static char *put_value(char *p, const char *value, size_t length) {
+        return mempcpy(p, value ?: RFC_5424_NILVALUE, length);
+}
+
+static char *put_field(char *p, const char *value, size_t length) {
+        p = put_value(p, value, length);
+        *p++ = ' ';
+        return p;
+}
+
+static char *put_priority(char *p, int severity, int facility) {
+        uint8_t makepri = (facility << 3) + severity;
 
-        IOVEC_SET_STRING(iov[(*n)++], " ");
+        *p++ = '<';
+        if (makepri >= 100)
+                *p++ = '0' + makepri / 100;
+        if (makepri >= 10)
+                *p++ = '0' + makepri / 10 % 10;
+        *p++ = '0' + makepri % 10;
+        *p++ = '>';
+
+        return p;
 }
 
-static void set_structured_data_field(Manager *m, const char *syslog_structured_data, struct iovec *iov, int *n) {
+static const char *structured_data_field(Manager *m, const char *syslog_structured_data) {
         if (m->structured_data)
-                IOVEC_SET_STRING(iov[(*n)++], m->structured_data);
-        else if (m->syslog_structured_data && syslog_structured_data)
-                IOVEC_SET_STRING(iov[(*n)++], syslog_structured_data);
-        else
-                IOVEC_SET_STRING(iov[(*n)++], RFC_5424_NILVALUE);
+                return m->structured_data;
+        if (m->syslog_structured_data && syslog_structured_data)
+                return syslog_structured_data;
 
-        IOVEC_SET_STRING(iov[(*n)++], " ");
+        return NULL;
 }
 
-static int set_message_length_field(Manager *m, char *header_msglen, size_t size, struct iovec *iov, int n, int msglen_idx) {
-        size_t msglen_len;
+/* Fills in the RFC5425 message length in front of the message. The room reserved for it was sized for an
+ * upper bound of the length, if the length turns out to have fewer digits the message moves up. */
+static int put_message_length(char *start, size_t reserved, char **end) {
+        char header[DECIMAL_STR_MAX(size_t) + 1];
+        size_t length;
+        int n;
 
-        if (m->log_format != SYSLOG_TRANSMISSION_LOG_FORMAT_RFC_5425)
-                return 0;
+        assert(start);
+        assert(end);
 
-        msglen_len = snprintf(header_msglen, size, "%zi ", IOVEC_TOTAL_SIZE(iov, n));
-        if (msglen_len >= size)
+        length = *end - start - reserved;
+        if (length > RFC_5425_MSGLEN_MAX)
                 return -EMSGSIZE;
 
-        iov[msglen_idx].iov_base = header_msglen;
-        iov[msglen_idx].iov_len = msglen_len;
+        n = snprintf(header, sizeof(header), "%zu ", length);
+        assert(n > 0 && (size_t) n <= reserved);
+
+        if ((size_t) n < reserved) {
+                memmove(start + n, start + reserved, length);
+                *end -= reserved - n;
+        }
 
+        memcpy(start, header, n);
         return 0;
 }
 
 /* The Syslog Protocol RFC5424 format :
  * <pri>version sp timestamp sp hostname sp app-name sp procid sp msgid sp [sd-id]s sp msg
  */
-int format_rfc5424(Manager *m,
-                   int severity,
-                   int facility,
-                   const char *identifier,
-                   const char *message,
-                   const char *hostname,
-                   const char *pid,
-                   const struct timeval *tv,
-                   const char *syslog_structured_data,
-                   const char *syslog_msgid) {
-
-        char header_time[FORMAT_TIMESTAMP_MAX];
-        char header_priority[sizeof("<   >1 ")];
-        char header_msglen[1 + sizeof("99999 ")];
-        struct iovec iov[15];
-        int n = 0, msglen_idx = 0, r;
+static int format_rfc5424_buffer(Destination *d,
+                                 TimestampCache *c,
+                                 OutputBuffer *b,
+                                 int severity,
+                                 int facility,
+                                 const char *identifier,
+                                 const char *message,
+                                 const char *hostname,
+                                 const char *pid,
+                                 const struct timeval *tv,
+                                 const char *syslog_structured_data,
+                                 const char *syslog_msgid) {
+
+        size_t hostname_len, identifier_len, pid_len, msgid_len, sd_len, message_len, size, reserved = 0;
+        const char *sd;
+        char *start, *p;
+        int r;
 
-        assert(m);
+        assert(d);
+        assert(c);
+        assert(b);
         assert(message);
 
+        sd = structured_data_field(d->manager, syslog_structured_data);
+
+        hostname_len = field_length(hostname);
+        identifier_len = field_length(identifier);
+        pid_len = field_length(pid);
+        msgid_len = field_length(syslog_msgid);
+        sd_len = field_length(sd);
+        message_len = strlen(message);
+
+        /* Everything but the timestamp is of known length, the message is written in one go */
+        size = sizeof("<255>1 ") - 1 + FORMAT_TIMESTAMP_MAX +
+                hostname_len + identifier_len + pid_len + msgid_len + sd_len + 5 +
+                message_len + 1;
+
         /* Reserve space for RFC5425 message length (will be filled at the end) */
-        if (m->log_format == SYSLOG_TRANSMISSION_LOG_FORMAT_RFC_5425) {
-                msglen_idx = n;
-                IOVEC_SET_STRING(iov[n++], "");
-        }
+        if (d->log_format == SYSLOG_TRANSMISSION_LOG_FORMAT_RFC_5425)
+                reserved = DECIMAL_STR_WIDTH(size) + 1;
+
+        if (!GREEDY_REALLOC(b->data, b->allocated, b->size + reserved + size))
+                return -ENOMEM;
+
+        start = b->data + b->size;
+        p = start + reserved;
 
         /* Build RFC5424 message components */
-        set_priority_version_field(severity, facility, header_priority, sizeof(header_priority), iov, &n);
-        set_timestamp_field(tv, header_time, sizeof(header_time), iov, &n);
-        set_string_field_with_separator(hostname, iov, &n);
-        set_string_field_with_separator(identifier, iov, &n);
-        set_string_field_with_separator(pid, iov, &n);
-        set_string_field_with_separator(syslog_msgid, iov, &n);
-        set_structured_data_field(m, syslog_structured_data, iov, &n);
+        p = put_priority(p, severity, facility);
+        *p++ = '0' + RFC_5424_PROTOCOL;
+        *p++ = ' ';
+        p += format_rfc3339_timestamp_cached(c, tv, p, FORMAT_TIMESTAMP_MAX);
+        p = put_field(p, hostname, hostname_len);
+        p = put_field(p, identifier, identifier_len);
+        p = put_field(p, pid, pid_len);
+        p = put_field(p, syslog_msgid, msgid_len);
+        p = put_field(p, sd, sd_len);
 
         /* Add message payload */
-        IOVEC_SET_STRING(iov[n++], message);
+        p = mempcpy(p, message, message_len);
 
         /* Add newline separator for TCP/TLS (not needed for UDP) */
-        if (m->log_format == SYSLOG_TRANSMISSION_LOG_FORMAT_RFC_5424 &&
-            (m->protocol == SYSLOG_TRANSMISSION_PROTOCOL_TCP || m->protocol == SYSLOG_TRANSMISSION_PROTOCOL_TLS))
-                IOVEC_SET_STRING(iov[n++], "\n");
+        if (d->log_format == SYSLOG_TRANSMISSION_LOG_FORMAT_RFC_5424 &&
+            (d->protocol == SYSLOG_TRANSMISSION_PROTOCOL_TCP || d->protocol == SYSLOG_TRANSMISSION_PROTOCOL_TLS))
+                *p++ = '\n';
 
         /* Compute message length for RFC5425 framing */
-        r = set_message_length_field(m, header_msglen, sizeof(header_msglen), iov, n, msglen_idx);
-        if (r < 0)
-                return r;
+        if (reserved > 0) {
+                r = put_message_length(start, reserved, &p);
+                if (r < 0)
+                        return r;
+        }
 
-        return protocol_send(m, iov, n);
+        assert(p <= start + reserved + size);
+        b->size = p - b->data;
+        return 0;
 }
 
-static void set_priority_field(int severity, int facility, char *header_priority, size_t size, struct iovec *iov, int *n) {
-        uint8_t makepri = (facility << 3) + severity;
-        int r;
+/* RFC3164 format: <pri>timestamp hostname identifier[pid]: message */
+static int format_rfc3164_buffer(Destination *d,
+                                 TimestampCache *c,
+                                 OutputBuffer *b,
+                                 int severity,
+                                 int facility,
+                                 const char *identifier,
+                                 const char *message,
+                                 const char *hostname,
+                                 const char *pid,
+                                 const struct timeval *tv) {
+
+        size_t hostname_len, identifier_len, pid_len, message_len, size;
+        char *p;
+
+        assert(d);
+        assert(c);
+        assert(b);
+        assert(message);
+
+        hostname_len = field_length(hostname);
+        identifier_len = field_length(identifier);
+        pid_len = field_length(pid);
+        message_len = strlen(message);
+
+        size = sizeof("<255>") - 1 + FORMAT_TIMESTAMP_MAX +
+                hostname_len + 1 + identifier_len + 1 + pid_len + sizeof("]: ") - 1 +
+                message_len + 1;
 
-        r = snprintf(header_priority, size, "<%i>", makepri);
-        assert(r > 0 && (size_t)r < size);
-        IOVEC_SET_STRING(iov[(*n)++], header_priority);
+        if (!GREEDY_REALLOC(b->data, b->allocated, b->size + size))
+                return -ENOMEM;
+
+        p = b->data + b->size;
+
+        p = put_priority(p, severity, facility);
+        p += format_rfc3339_timestamp_cached(c, tv, p, FORMAT_TIMESTAMP_MAX);
+        p = put_field(p, hostname, hostname_len);
+
+        /* Identifier[pid]: */
+        p = put_value(p, identifier, identifier_len);
+        *p++ = '[';
+        p = put_value(p, pid, pid_len);
+        p = mempcpy(p, "]: ", sizeof("]: ") - 1);
+
+        /* Message payload */
+        p = mempcpy(p, message, message_len);
+
+        /* Add newline separator for TCP/TLS (not needed for UDP) */
+        if (d->protocol == SYSLOG_TRANSMISSION_PROTOCOL_TCP || d->protocol == SYSLOG_TRANSMISSION_PROTOCOL_TLS)
+                *p++ = '\n';
+
+        b->size = p - b->data;
+        return 0;
 }
 
-int format_rfc3164(Manager *m,
+/* Formats the message the way the destination expects it, after the messages already in the buffer */
+int format_message(Destination *d,
+                   TimestampCache *c,
+                   OutputBuffer *b,
                    int severity,
                    int facility,
                    const char *identifier,
                    const char *message,
                    const char *hostname,
                    const char *pid,
-                   const struct timeval *tv) {
+                   const struct timeval *tv,
+                   const char *syslog_structured_data,
+                   const char *syslog_msgid) {
 
-        char header_priority[sizeof("<   >1 ")];
-        char header_time[FORMAT_TIMESTAMP_MAX];
-        struct iovec iov[14];
-        int n = 0;
+        assert(d);
 
-        assert(m);
-        assert(message);
+        if (IN_SET(d->log_format, SYSLOG_TRANSMISSION_LOG_FORMAT_RFC_5424, SYSLOG_TRANSMISSION_LOG_FORMAT_RFC_5425))
+                return format_rfc5424_buffer(d, c, b, severity, facility, identifier, message, hostname, pid, tv,
+                                             syslog_structured_data, syslog_msgid);
 
-        /* RFC3164 format: <pri>timestamp hostname identifier[pid]: message */
-        set_priority_field(severity, facility, header_priority, sizeof(header_priority), iov, &n);
-        set_timestamp_field(tv, header_time, sizeof(header_time), iov, &n);
+        return format_rfc3164_buffer(d, c, b, severity, facility, identifier, message, hostname, pid, tv);
+}
 
-        /* Hostname */
-        if (hostname)
-                IOVEC_SET_STRING(iov[n++], hostname);
-        else
-                IOVEC_SET_STRING(iov[n++], RFC_5424_NILVALUE);
+static int protocol_send_output(Destination *d, OutputBuffer *b) {
+        struct iovec iovec = IOVEC_MAKE(b->data, b->size);
 
-        IOVEC_SET_STRING(iov[n++], " ");
+        return protocol_send(d, &iovec, 1);
+}
 
-        /* Identifier[pid]: */
-        if (identifier)
-                IOVEC_SET_STRING(iov[n++], identifier);
-        else
-                IOVEC_SET_STRING(iov[n++], RFC_5424_NILVALUE);
+int format_rfc5424(Destination *d,
+                   int severity,
+                   int facility,
+                   const char *identifier,
+                   const char *message,
+                   const char *hostname,
+                   const char *pid,
+                   const struct timeval *tv,
+                   const char *syslog_structured_data,
+                   const char *syslog_msgid) {
 
-        IOVEC_SET_STRING(iov[n++], "[");
+        OutputBuffer *b;
+        int r;
 
-        if (pid)
-                IOVEC_SET_STRING(iov[n++], pid);
-        else
-                IOVEC_SET_STRING(iov[n++], RFC_5424_NILVALUE);
+        assert(d);
 
-        IOVEC_SET_STRING(iov[n++], "]: ");
+        b = &d->manager->output;
+        b->size = 0;
 
-        /* Message payload */
-        IOVEC_SET_STRING(iov[n++], message);
+        r = format_rfc5424_buffer(d, &d->manager->timestamp_cache, b, severity, facility, identifier, message,
+                                  hostname, pid, tv, syslog_structured_data, syslog_msgid);
+        if (r < 0)
+                return r;
 
-        /* Add newline separator for TCP/TLS (not needed for UDP) */
-        if (m->protocol == SYSLOG_TRANSMISSION_PROTOCOL_TCP || m->protocol == SYSLOG_TRANSMISSION_PROTOCOL_TLS)
-                IOVEC_SET_STRING(iov[n++], "\n");
+        return protocol_send_output(d, b);
+}
+
+int format_rfc3164(Destination *d,
+                   int severity,
+                   int facility,
+                   const char *identifier,
+                   const char *message,
+                   const char *hostname,
+                   const char *pid,
+                   const struct timeval *tv) {
+
+        OutputBuffer *b;
+        int r;
+
+        assert(d);
+
+        b = &d->manager->output;
+        b->size = 0;
+
+        r = format_rfc3164_buffer(d, &d->manager->timestamp_cache, b, severity, facility, identifier, message,
+                                  hostname, pid, tv);
+        if (r < 0)
+                return r;
+
+        return protocol_send_output(d, b);
+}
+
+void output_buffer_done(OutputBuffer *b) {
+        assert(b);
 
-        return protocol_send(m, iov, n);
+        b->data = mfree(b->data);
+        b->size = b->allocated = 0;
 }
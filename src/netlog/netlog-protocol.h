@@ -2,11 +2,20 @@
 
 #pragma once
 
-#include "netlog-manager.h"
+#include "netlog-destination.h"
 
-int protocol_send(Manager *m, struct iovec *iovec, unsigned n_iovec);
+int protocol_send(Destination *d, struct iovec *iovec, unsigned n_iovec);
+int protocol_flush(Peer *p);
+int protocol_flush_compressed(Peer *p);
+int protocol_arm_flush_timer(Peer *p);
+int protocol_schedule_drain(Destination *d, usec_t usec);
 void format_rfc3339_timestamp(const struct timeval *tv, char *header_time, size_t header_size);
-int format_rfc5424(Manager *m, int severity, int facility, const char *identifier, const char *message, const char *hostname,
+size_t format_rfc3339_timestamp_cached(TimestampCache *c, const struct timeval *tv, char *header_time, size_t header_size);
+int format_rfc5424(Destination *d, int severity, int facility, const char *identifier, const char *message, const char *hostname,
                    const char *pid, const struct timeval *tv, const char *syslog_structured_data, const char *syslog_msgid);
-int format_rfc3164(Manager *m, int severity, int facility, const char *identifier, const char *message, const char *hostname,
+int format_rfc3164(Destination *d, int severity, int facility, const char *identifier, const char *message, const char *hostname,
                    const char *pid, const struct timeval *tv);
+int format_message(Destination *d, TimestampCache *c, OutputBuffer *b, int severity, int facility, const char *identifier,
+                   const char *message, const char *hostname, const char *pid, const struct timeval *tv,
+                   const char *syslog_structured_data, const char *syslog_msgid);
+void output_buffer_done(OutputBuffer *b);
@@ -0,0 +1,126 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include "netlog-ratelimit.h"
+
+#include "macro.h"
+
+static void token_bucket_init(TokenBucket *b, uint64_t rate) {
+        assert(b);
+
+        /* Keeps tokens * USEC_PER_SEC well within range */
+        rate = MIN(rate, (uint64_t) INT64_MAX / USEC_PER_SEC / 4);
+
+        *b = (TokenBucket) {
+                .rate = rate,
+                .tokens = (int64_t) (rate * USEC_PER_SEC),
+        };
+}
+
+static int64_t token_bucket_capacity(const TokenBucket *b) {
+        assert(b);
+
+        return (int64_t) (b->rate * USEC_PER_SEC);
+}
+
+static void token_bucket_refill(TokenBucket *b, usec_t now) {
+        usec_t elapsed;
+
+        assert(b);
+
+        if (b->timestamp == 0 || now <= b->timestamp) {
+                b->timestamp = MAX(b->timestamp, now);
+                return;
+        }
+
+        /* More than a second refills the bucket completely anyway */
+        elapsed = MIN(now - b->timestamp, USEC_PER_SEC);
+        b->timestamp = now;
+
+        b->tokens = MIN(b->tokens + (int64_t) (elapsed * b->rate), token_bucket_capacity(b));
+}
+
+/* The share of the bucket kept back from messages of the given severity, in quarters. Debug messages only
+ * use the top quarter of the budget, warnings all of it. */
+static unsigned severity_reserve(int severity) {
+        switch (severity) {
+                case LOG_DEBUG:
+                        return 3;
+                case LOG_INFO:
+                        return 2;
+                case LOG_NOTICE:
+                        return 1;
+                default:
+                        return 0;
+        }
+}
+
+static bool token_bucket_has(const TokenBucket *b, uint64_t n, int severity) {
+        int64_t need;
+
+        assert(b);
+
+        if (b->rate == 0)
+                return true;
+
+        need = (int64_t) MIN(n, b->rate) * (int64_t) USEC_PER_SEC + token_bucket_capacity(b) / 4 * severity_reserve(severity);
+
+        return b->tokens >= need;
+}
+
+static void token_bucket_take(TokenBucket *b, uint64_t n) {
+        assert(b);
+
+        if (b->rate == 0)
+                return;
+
+        /* Overdrawing is limited to one second worth, so that the others aren't starved for longer */
+        b->tokens = MAX(b->tokens - (int64_t) MIN(n, b->rate) * (int64_t) USEC_PER_SEC, -token_bucket_capacity(b));
+}
+
+void send_rate_limit_init(SendRateLimit *l, uint64_t messages_per_sec, uint64_t bytes_per_sec) {
+        assert(l);
+
+        *l = (SendRateLimit) {};
+
+        token_bucket_init(&l->messages, messages_per_sec);
+        token_bucket_init(&l->bytes, bytes_per_sec);
+}
+
+bool send_rate_limit_enabled(const SendRateLimit *l) {
+        assert(l);
+
+        return l->messages.rate > 0 || l->bytes.rate > 0;
+}
+
+/* Returns false if the message is to be dropped */
+bool send_rate_limit_admit(SendRateLimit *l, int severity, size_t size, usec_t now) {
+        assert(l);
+
+        if (!send_rate_limit_enabled(l))
+                return true;
+
+        token_bucket_refill(&l->messages, now);
+        token_bucket_refill(&l->bytes, now);
+
+        if (severity > LOG_ERR &&
+            (!token_bucket_has(&l->messages, 1, severity) || !token_bucket_has(&l->bytes, size, severity))) {
+                l->n_dropped[MIN(severity, LOG_DEBUG)]++;
+                return false;
+        }
+
+        token_bucket_take(&l->messages, 1);
+        token_bucket_take(&l->bytes, size);
+
+        return true;
+}
+
+uint64_t send_rate_limit_dropped(const SendRateLimit *l) {
+        uint64_t n = 0;
+
+        assert(l);
+
+        for (size_t i = 0; i < ELEMENTSOF(l->n_dropped); i++)
+                n += l->n_dropped[i];
+
+        return n;
+}
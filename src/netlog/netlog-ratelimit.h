@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <syslog.h>
+
+#include "time-util.h"
+
+/* Refills at rate tokens per second and holds up to one second worth of them. Tokens are kept in units of
+ * 1/USEC_PER_SEC so that refilling needs no division. */
+typedef struct TokenBucket {
+        uint64_t rate;
+        int64_t tokens;
+        usec_t timestamp;
+} TokenBucket;
+
+/* Caps the messages and bytes sent per second. Before the budget runs out, messages of low severity are
+ * dropped so that the remaining budget goes to the more important ones. Errors and above are never
+ * dropped, they may overdraw the budget instead. */
+typedef struct SendRateLimit {
+        TokenBucket messages;
+        TokenBucket bytes;
+
+        uint64_t n_dropped[LOG_DEBUG + 1];
+} SendRateLimit;
+
+void send_rate_limit_init(SendRateLimit *l, uint64_t messages_per_sec, uint64_t bytes_per_sec);
+bool send_rate_limit_enabled(const SendRateLimit *l);
+bool send_rate_limit_admit(SendRateLimit *l, int severity, size_t size, usec_t now);
+uint64_t send_rate_limit_dropped(const SendRateLimit *l);
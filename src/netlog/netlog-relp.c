@@ -0,0 +1,556 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#include "netlog-relp.h"
+
+#include "alloc-util.h"
+#include "fd-util.h"
+#include "io-util.h"
+#include "iovec-util.h"
+#include "netlog-destination.h"
+#include "netlog-journal.h"
+#include "netlog-network.h"
+#include "netlog-protocol.h"
+#include "string-util.h"
+
+#define RELP_COMMAND_MAX 32U
+#define RELP_NUMBER_MAX  9U
+
+/* Largest response taken from the server, the ones to "open" are the longest */
+#define RELP_FRAME_MAX (64U * 1024U)
+#define RELP_READ_SIZE 4096U
+
+/* librelp gives up on a silent peer after the same time */
+#define RELP_TIMEOUT_USEC (90 * USEC_PER_SEC)
+
+#define RELP_OFFERS "relp_version=0\nrelp_software=systemd-netlogd\ncommands=syslog"
+
+static int relp_parse_number(const char *buf, size_t size, size_t *i, uint32_t *ret) {
+        uint32_t v = 0;
+        size_t n = 0;
+
+        for (; *i < size && ascii_isdigit(buf[*i]); (*i)++, n++) {
+                if (n >= RELP_NUMBER_MAX)
+                        return -EBADMSG;
+
+                v = v * 10 + (buf[*i] - '0');
+        }
+
+        if (*i == size)
+                return 0;
+        if (n == 0)
+                return -EBADMSG;
+
+        *ret = v;
+        return 1;
+}
+
+/* Frames look like "TXNR SP COMMAND SP DATALEN [SP DATA] LF". Returns the size of the frame at the
+ * beginning of the buffer, or 0 if it isn't complete yet. */
+int relp_parse_frame(const char *buf, size_t size, RelpFrame *ret) {
+        uint32_t txnr, data_len;
+        const char *command;
+        size_t i = 0, n;
+        int r;
+
+        assert(buf || size == 0);
+        assert(ret);
+
+        r = relp_parse_number(buf, size, &i, &txnr);
+        if (r <= 0)
+                return r;
+        if (buf[i++] != ' ')
+                return -EBADMSG;
+
+        command = buf + i;
+        for (n = 0; i < size && ascii_isalpha(buf[i]); i++, n++)
+                if (n >= RELP_COMMAND_MAX)
+                        return -EBADMSG;
+        if (i == size)
+                return 0;
+        if (n == 0 || buf[i++] != ' ')
+                return -EBADMSG;
+
+        r = relp_parse_number(buf, size, &i, &data_len);
+        if (r <= 0)
+                return r;
+
+        /* Without data the separator is left out */
+        if (data_len > 0) {
+                if (buf[i++] != ' ')
+                        return -EBADMSG;
+        }
+
+        if (size - i < (size_t) data_len + 1)
+                return 0;
+        if (buf[i + data_len] != '\n')
+                return -EBADMSG;
+
+        *ret = (RelpFrame) {
+                .txnr = txnr,
+                .command = command,
+                .command_len = n,
+                .data = buf + i,
+                .data_len = data_len,
+        };
+
+        return i + data_len + 1;
+}
+
+/* The data of "rsp" frames starts with a three digit status code and a text, optionally followed by a line
+ * feed and further data */
+int relp_parse_response(const RelpFrame *f, unsigned *ret_code, const char **ret_text, size_t *ret_text_len) {
+        const char *text, *eol;
+
+        assert(f);
+        assert(ret_code);
+
+        if (f->data_len < 3 || !ascii_isdigit(f->data[0]) || !ascii_isdigit(f->data[1]) || !ascii_isdigit(f->data[2]))
+                return -EBADMSG;
+        if (f->data_len > 3 && f->data[3] != ' ' && f->data[3] != '\n')
+                return -EBADMSG;
+
+        *ret_code = (f->data[0] - '0') * 100 + (f->data[1] - '0') * 10 + (f->data[2] - '0');
+
+        text = f->data + MIN(f->data_len, (size_t) 4);
+        eol = memchr(text, '\n', f->data + f->data_len - text);
+
+        if (ret_text)
+                *ret_text = text;
+        if (ret_text_len)
+                *ret_text_len = (eol ?: f->data + f->data_len) - text;
+
+        return 0;
+}
+
+static bool relp_command_is(const RelpFrame *f, const char *command) {
+        assert(f);
+        assert(command);
+
+        return f->command_len == strlen(command) && memcmp(f->command, command, f->command_len) == 0;
+}
+
+static int relp_send_frame(Peer *p, const char *command, const struct iovec *iovec, unsigned n_iovec, uint32_t *ret_txnr) {
+        RelpSession *s;
+        struct iovec *v;
+        char header[sizeof("999999999 ") + RELP_COMMAND_MAX + DECIMAL_STR_MAX(size_t) + 1];
+        size_t size;
+        uint32_t txnr;
+        int r;
+
+        assert(p);
+        assert(command);
+
+        s = &p->relp;
+
+        txnr = s->next_txnr;
+        s->next_txnr = txnr >= RELP_TXNR_MAX ? 1 : txnr + 1;
+
+        size = IOVEC_TOTAL_SIZE(iovec, n_iovec);
+        if (size > 0)
+                (void) snprintf(header, sizeof(header), "%" PRIu32 " %s %zu ", txnr, command, size);
+        else
+                (void) snprintf(header, sizeof(header), "%" PRIu32 " %s 0", txnr, command);
+
+        v = newa(struct iovec, n_iovec + 2);
+        v[0] = IOVEC_MAKE_STRING(header);
+        for (unsigned i = 0; i < n_iovec; i++)
+                v[i + 1] = iovec[i];
+        v[n_iovec + 1] = IOVEC_MAKE_STRING("\n");
+
+        r = network_send(p, v, n_iovec + 2);
+        if (r < 0)
+                return r;
+
+        if (ret_txnr)
+                *ret_txnr = txnr;
+
+        return 0;
+}
+
+static bool relp_outstanding(Peer *p) {
+        assert(p);
+
+        return p->relp.state == RELP_STATE_OPENING || relp_unacked(p) > 0;
+}
+
+static int relp_timeout_handler(sd_event_source *s, uint64_t usec, void *userdata) {
+        Peer *p = ASSERT_PTR(userdata);
+
+        log_warning("%s did not respond within %s, reconnecting.", p->name,
+                    p->relp.state == RELP_STATE_OPENING ? "the session setup time" : "the acknowledgement time");
+
+        return peer_failed(p);
+}
+
+/* Gives the server RELP_TIMEOUT_USEC to answer the oldest transaction, starting over whenever it answered
+ * one */
+static int relp_update_timeout(Peer *p, bool progress) {
+        RelpSession *s;
+        int r;
+
+        assert(p);
+
+        s = &p->relp;
+
+        if (!relp_outstanding(p))
+                return s->event_timeout ? sd_event_source_set_enabled(s->event_timeout, SD_EVENT_OFF) : 0;
+
+        if (!s->event_timeout) {
+                r = sd_event_add_time_relative(p->destination->manager->event, &s->event_timeout, CLOCK_MONOTONIC,
+                                               RELP_TIMEOUT_USEC, 0, relp_timeout_handler, p);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to create RELP timer: %m");
+
+                return 0;
+        }
+
+        if (!progress && sd_event_source_get_enabled(s->event_timeout, NULL) > 0)
+                return 0;
+
+        r = sd_event_source_set_time_relative(s->event_timeout, RELP_TIMEOUT_USEC);
+        if (r < 0)
+                return log_error_errno(r, "Failed to update RELP timer: %m");
+
+        return sd_event_source_set_enabled(s->event_timeout, SD_EVENT_ONESHOT);
+}
+
+static int relp_acknowledge(Peer *p, uint32_t txnr) {
+        RelpSession *s;
+        size_t i;
+
+        assert(p);
+
+        s = &p->relp;
+
+        /* Servers answer in order, the transaction is usually the oldest one */
+        for (i = s->window_start; i < s->window_end; i++)
+                if (s->window[i].txnr == txnr && !s->window[i].acked)
+                        break;
+        if (i == s->window_end) {
+                log_debug("Ignoring response of %s to unknown transaction %" PRIu32 ".", p->name, txnr);
+                return 0;
+        }
+
+        s->window[i].acked = true;
+        s->n_acked++;
+
+        while (s->window_start < s->window_end && s->window[s->window_start].acked) {
+                s->window_bytes -= s->window[s->window_start].size;
+                s->window_start++;
+        }
+
+        if (s->window_start == s->window_end)
+                s->window_start = s->window_end = 0;
+
+        return 1;
+}
+
+/* Returns 1 if messages were acknowledged, 2 once the session is open */
+static int relp_process_frame(Peer *p, const RelpFrame *f) {
+        RelpSession *s;
+        const char *text;
+        size_t text_len;
+        unsigned code;
+        int r;
+
+        assert(p);
+        assert(f);
+
+        s = &p->relp;
+
+        if (relp_command_is(f, "serverclose"))
+                return log_debug_errno(SYNTHETIC_ERRNO(ECONNRESET), "%s is closing the RELP session.", p->name);
+
+        if (!relp_command_is(f, "rsp")) {
+                log_debug("Ignoring RELP command '%.*s' from %s.", (int) f->command_len, f->command, p->name);
+                return 0;
+        }
+
+        r = relp_parse_response(f, &code, &text, &text_len);
+        if (r < 0)
+                return log_warning_errno(r, "Received malformed RELP response from %s.", p->name);
+
+        if (s->state == RELP_STATE_OPENING) {
+                if (f->txnr != s->open_txnr)
+                        return log_warning_errno(SYNTHETIC_ERRNO(EPROTO), "Received RELP response from %s before the session was opened.", p->name);
+
+                if (code != 200)
+                        return log_warning_errno(SYNTHETIC_ERRNO(EPROTO), "%s refused the RELP session: %u %.*s",
+                                                 p->name, code, (int) text_len, text);
+
+                log_debug("RELP session with %s is open.", p->name);
+
+                s->state = RELP_STATE_OPEN;
+                return 2;
+        }
+
+        /* The server can't take the message. Sending it again after reconnecting is all that can be done
+         * about that. */
+        if (code != 200)
+                return log_warning_errno(SYNTHETIC_ERRNO(EPROTO), "%s rejected a message: %u %.*s",
+                                         p->name, code, (int) text_len, text);
+
+        return relp_acknowledge(p, f->txnr);
+}
+
+static int relp_acknowledged(Peer *p) {
+        Destination *d;
+        int r;
+
+        assert(p);
+
+        d = p->destination;
+
+        (void) relp_update_timeout(p, true);
+
+        /* The spool is committed once every message of the round was acknowledged, go on with the next
+         * round right away rather than when polling next */
+        if (d->spool) {
+                if (peer_pending(p) > 0)
+                        return 0;
+
+                d->event_spool_drain = sd_event_source_disable_unref(d->event_spool_drain);
+                return protocol_schedule_drain(d, 0);
+        }
+
+        r = journal_acknowledge(d->manager);
+        if (r < 0)
+                return r;
+
+        /* Room in the window, take further messages */
+        return network_queue_update(p);
+}
+
+static int relp_input_handler(sd_event_source *source, int fd, uint32_t revents, void *userdata) {
+        Peer *p = ASSERT_PTR(userdata);
+        bool acked = false, opened = false;
+        RelpSession *s = &p->relp;
+        size_t offset = 0;
+        ssize_t n;
+        int r;
+
+        if (!GREEDY_REALLOC(s->input, s->input_allocated, s->input_size + RELP_READ_SIZE))
+                return log_oom();
+
+        n = recv(fd, s->input + s->input_size, s->input_allocated - s->input_size, MSG_DONTWAIT);
+        if (n < 0) {
+                if (IN_SET(errno, EAGAIN, EINTR))
+                        return 0;
+
+                log_debug_errno(errno, "Failed to receive RELP responses from %s, performing reconnect: %m", p->name);
+                return peer_failed(p);
+        }
+        if (n == 0) {
+                log_debug("%s closed the RELP connection, performing reconnect.", p->name);
+                return peer_failed(p);
+        }
+
+        s->input_size += n;
+
+        for (;;) {
+                RelpFrame f;
+
+                r = relp_parse_frame(s->input + offset, s->input_size - offset, &f);
+                if (r < 0) {
+                        log_warning_errno(r, "Received malformed RELP frame from %s, performing reconnect: %m", p->name);
+                        return peer_failed(p);
+                }
+                if (r == 0)
+                        break;
+
+                offset += r;
+
+                /* The peer is reconnected once the frames at hand are done with, that frees the buffer */
+                r = relp_process_frame(p, &f);
+                if (r < 0)
+                        return peer_failed(p);
+                if (r == 1)
+                        acked = true;
+                if (r == 2)
+                        opened = true;
+        }
+
+        memmove(s->input, s->input + offset, s->input_size - offset);
+        s->input_size -= offset;
+
+        if (s->input_size > RELP_FRAME_MAX) {
+                log_warning("RELP frame from %s too large, performing reconnect.", p->name);
+                return peer_failed(p);
+        }
+
+        /* Forwarding reads the journal and sends further messages, it comes last */
+        if (opened) {
+                (void) relp_update_timeout(p, true);
+                return peer_start_forwarding(p);
+        }
+
+        if (acked)
+                return relp_acknowledged(p);
+
+        return 0;
+}
+
+/* Starts the session once the TCP connection is established. Messages go to the peer once the server
+ * accepted it. */
+int relp_open(Peer *p) {
+        struct iovec iovec = IOVEC_MAKE_STRING(RELP_OFFERS);
+        RelpSession *s;
+        int r;
+
+        assert(p);
+        assert(p->socket >= 0);
+
+        s = &p->relp;
+
+        relp_reset(p);
+
+        s->input_fd = fcntl(p->socket, F_DUPFD_CLOEXEC, 3);
+        if (s->input_fd < 0)
+                return log_error_errno(errno, "Failed to duplicate socket: %m");
+
+        r = sd_event_add_io(p->destination->manager->event, &s->event_input, s->input_fd, EPOLLIN, relp_input_handler, p);
+        if (r < 0)
+                return log_error_errno(r, "Failed to watch socket: %m");
+
+        s->next_txnr = 1;
+        s->state = RELP_STATE_OPENING;
+
+        r = relp_send_frame(p, "open", &iovec, 1, &s->open_txnr);
+        if (r < 0)
+                return r;
+
+        log_debug("Opening RELP session with %s.", p->name);
+
+        return relp_update_timeout(p, true);
+}
+
+int relp_send(Peer *p, const struct iovec *iovec, unsigned n_iovec) {
+        Manager *m;
+        RelpSession *s;
+        RelpTransaction *t;
+        uint32_t txnr;
+        int r;
+
+        assert(p);
+        assert(iovec);
+
+        s = &p->relp;
+        m = p->destination->manager;
+
+        if (s->state != RELP_STATE_OPEN)
+                return -ENOTCONN;
+
+        /* Make room at the end, moving the transactions still waiting to the front */
+        if (s->window_end >= s->window_allocated && s->window_start > 0) {
+                memmove(s->window, s->window + s->window_start, (s->window_end - s->window_start) * sizeof(RelpTransaction));
+                s->window_end -= s->window_start;
+                s->window_start = 0;
+        }
+
+        if (!GREEDY_REALLOC(s->window, s->window_allocated, s->window_end + 1))
+                return log_oom();
+
+        r = relp_send_frame(p, "syslog", iovec, n_iovec, &txnr);
+        if (r < 0)
+                return r;
+
+        t = &s->window[s->window_end++];
+        *t = (RelpTransaction) {
+                .txnr = txnr,
+                .seqnum = p->destination->spool ? 0 : m->output_seqnum,
+                .size = IOVEC_TOTAL_SIZE(iovec, n_iovec),
+        };
+        s->window_bytes += t->size;
+
+        (void) relp_update_timeout(p, false);
+
+        /* The window filled up, other peers take the messages meanwhile */
+        if (relp_window_full(p))
+                return network_queue_update(p);
+
+        return 0;
+}
+
+/* Tells the server the session ends. Whatever wasn't acknowledged is sent again regardless. */
+void relp_close(Peer *p) {
+        assert(p);
+
+        if (p->relp.state != RELP_STATE_OPEN || p->socket < 0)
+                return;
+
+        (void) relp_send_frame(p, "close", NULL, 0, NULL);
+}
+
+void relp_reset(Peer *p) {
+        RelpSession *s;
+
+        assert(p);
+
+        s = &p->relp;
+
+        s->event_input = sd_event_source_disable_unref(s->event_input);
+        s->input_fd = safe_close(s->input_fd);
+        s->input_size = 0;
+
+        s->window_start = s->window_end = 0;
+        s->window_bytes = 0;
+
+        if (s->event_timeout)
+                (void) sd_event_source_set_enabled(s->event_timeout, SD_EVENT_OFF);
+
+        s->state = RELP_STATE_CLOSED;
+}
+
+void relp_free(Peer *p) {
+        RelpSession *s;
+
+        assert(p);
+
+        s = &p->relp;
+
+        relp_reset(p);
+
+        s->event_timeout = sd_event_source_unref(s->event_timeout);
+        s->input = mfree(s->input);
+        s->input_allocated = 0;
+        s->window = mfree(s->window);
+        s->window_allocated = 0;
+}
+
+size_t relp_unacked(Peer *p) {
+        assert(p);
+
+        return p->relp.window_end - p->relp.window_start;
+}
+
+size_t relp_unacked_size(Peer *p) {
+        assert(p);
+
+        return p->relp.window_bytes;
+}
+
+/* The seqnum of the oldest message the server did not acknowledge yet, UINT64_MAX if there is none */
+uint64_t relp_oldest_unacked(Peer *p) {
+        RelpSession *s;
+
+        assert(p);
+
+        s = &p->relp;
+
+        for (size_t i = s->window_start; i < s->window_end; i++)
+                if (!s->window[i].acked)
+                        return s->window[i].seqnum;
+
+        return UINT64_MAX;
+}
+
+bool relp_window_full(Peer *p) {
+        assert(p);
+
+        return p->destination->protocol == SYSLOG_TRANSMISSION_PROTOCOL_RELP &&
+                relp_unacked(p) >= p->destination->relp_window_size;
+}
@@ -0,0 +1,84 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <systemd/sd-event.h>
+
+/* Transactions sent before waiting for the server to acknowledge them */
+#define DEFAULT_RELP_WINDOW_SIZE 1024U
+#define RELP_WINDOW_SIZE_MAX     65536U
+
+/* Transaction numbers run from 1 to 999999999 and start over at 1 */
+#define RELP_TXNR_MAX 999999999U
+
+typedef struct Peer Peer;
+
+typedef enum RelpState {
+        RELP_STATE_CLOSED,
+        RELP_STATE_OPENING,
+        RELP_STATE_OPEN,
+} RelpState;
+
+/* A message sent to the server and not acknowledged yet */
+typedef struct RelpTransaction {
+        uint32_t txnr;
+
+        /* Position among all messages awaiting acknowledgement, see Manager.output_seqnum. 0 for destinations
+         * with a spool, those acknowledge the journal entries once spooled. */
+        uint64_t seqnum;
+
+        size_t size;
+        bool acked;
+} RelpTransaction;
+
+/* RELP session on top of the TCP connection of a peer */
+typedef struct RelpSession {
+        RelpState state;
+        uint32_t next_txnr;
+        uint32_t open_txnr;
+
+        /* Responses are read through a descriptor of their own, sd-event only takes a descriptor once and the
+         * send queue watches the socket itself */
+        int input_fd;
+        sd_event_source *event_input;
+        char *input;
+        size_t input_size;
+        size_t input_allocated;
+
+        /* Transactions awaiting their response, oldest first, starting at window_start */
+        RelpTransaction *window;
+        size_t window_start;
+        size_t window_end;
+        size_t window_allocated;
+        size_t window_bytes;
+
+        /* The server is given up on if the oldest transaction isn't answered in time */
+        sd_event_source *event_timeout;
+
+        uint64_t n_acked;
+} RelpSession;
+
+/* A frame received from the server, pointing into the input buffer */
+typedef struct RelpFrame {
+        uint32_t txnr;
+        const char *command;
+        size_t command_len;
+        const char *data;
+        size_t data_len;
+} RelpFrame;
+
+int relp_parse_frame(const char *buf, size_t size, RelpFrame *ret);
+int relp_parse_response(const RelpFrame *f, unsigned *ret_code, const char **ret_text, size_t *ret_text_len);
+
+int relp_open(Peer *p);
+int relp_send(Peer *p, const struct iovec *iovec, unsigned n_iovec);
+void relp_close(Peer *p);
+void relp_reset(Peer *p);
+void relp_free(Peer *p);
+
+size_t relp_unacked(Peer *p);
+size_t relp_unacked_size(Peer *p);
+uint64_t relp_oldest_unacked(Peer *p);
+bool relp_window_full(Peer *p);
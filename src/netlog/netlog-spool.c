@@ -0,0 +1,596 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include "netlog-spool.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "alloc-util.h"
+#include "dirent-util.h"
+#include "fd-util.h"
+#include "iovec-util.h"
+#include "log.h"
+#include "mkdir.h"
+#include "parse-util.h"
+#include "sparse-endian.h"
+#include "string-util.h"
+#include "unaligned.h"
+#include "util.h"
+
+/* The spool is a queue of formatted frames, stored in a sequence of fixed size segment files which are
+ * mapped into memory. New frames are appended to the tail segment, the sender consumes them from the head
+ * segment. Once a segment has been delivered completely it is removed.
+ *
+ * Each segment starts with a header, followed by records consisting of the frame length as 32-bit little
+ * endian integer and the frame itself. Segments are allocated zeroed, hence a zero length marks the end of
+ * the written records. The header carries the offset of the first record not yet delivered, so that a
+ * restarted daemon continues where the previous one left off. */
+
+#define SPOOL_SIGNATURE ((const uint8_t[]) { 'N', 'L', 'S', 'P', 'O', 'O', 'L', '1' })
+#define SPOOL_SEGMENT_SUFFIX ".segment"
+#define SPOOL_RECORD_HEADER_SIZE sizeof(le32_t)
+
+typedef struct SpoolSegmentHeader {
+        uint8_t signature[8];
+        le64_t read_offset;
+} _packed_ SpoolSegmentHeader;
+
+typedef struct SpoolSegment {
+        uint64_t seqnum;
+        int fd;
+        uint8_t *map;
+        size_t size;
+        size_t write_offset;
+        /* Frames before this offset are on disk */
+        size_t sync_offset;
+} SpoolSegment;
+
+struct Spool {
+        char *directory;
+        uint64_t max_size;
+        size_t segment_size;
+
+        SpoolSegment *head;
+        SpoolSegment *tail;
+
+        /* Position of the sender in the head segment. It only becomes persistent with spool_commit(). */
+        size_t read_offset;
+        size_t peek_size;
+
+        /* First segment which may hold frames not yet on disk */
+        uint64_t sync_seqnum;
+};
+
+static SpoolSegment *segment_free(SpoolSegment *g) {
+        if (!g)
+                return NULL;
+
+        if (g->map)
+                (void) munmap(g->map, g->size);
+
+        safe_close(g->fd);
+        return mfree(g);
+}
+
+static SpoolSegmentHeader *segment_header(SpoolSegment *g) {
+        assert(g);
+
+        return (SpoolSegmentHeader *) g->map;
+}
+
+static size_t segment_committed(SpoolSegment *g) {
+        return le64toh(segment_header(g)->read_offset);
+}
+
+static int segment_path(Spool *s, uint64_t seqnum, char **ret) {
+        assert(s);
+        assert(ret);
+
+        if (asprintf(ret, "%s/%020" PRIu64 SPOOL_SEGMENT_SUFFIX, s->directory, seqnum) < 0)
+                return -ENOMEM;
+
+        return 0;
+}
+
+static void segment_unlink(Spool *s, uint64_t seqnum) {
+        _cleanup_free_ char *path = NULL;
+
+        if (segment_path(s, seqnum, &path) < 0)
+                return;
+
+        if (unlink(path) < 0 && errno != ENOENT)
+                log_warning_errno(errno, "Failed to remove spool segment %s: %m", path);
+}
+
+/* Returns the size of the record at the specified offset, or 0 if there is none */
+static size_t segment_record_size(SpoolSegment *g, size_t offset) {
+        uint32_t size;
+
+        assert(g);
+
+        if (offset + SPOOL_RECORD_HEADER_SIZE > g->size)
+                return 0;
+
+        size = unaligned_read_le32(g->map + offset);
+        if (size == 0 || size > g->size - offset - SPOOL_RECORD_HEADER_SIZE)
+                return 0;
+
+        return size;
+}
+
+static int segment_map(SpoolSegment *g) {
+        void *p;
+
+        assert(g);
+        assert(g->fd >= 0);
+
+        p = mmap(NULL, g->size, PROT_READ|PROT_WRITE, MAP_SHARED, g->fd, 0);
+        if (p == MAP_FAILED)
+                return -errno;
+
+        g->map = p;
+        return 0;
+}
+
+static int segment_create(Spool *s, uint64_t seqnum, size_t size, SpoolSegment **ret) {
+        _cleanup_free_ SpoolSegment *g = NULL;
+        _cleanup_free_ char *path = NULL;
+        SpoolSegmentHeader *h;
+        int r;
+
+        assert(s);
+        assert(ret);
+
+        r = segment_path(s, seqnum, &path);
+        if (r < 0)
+                return r;
+
+        g = new(SpoolSegment, 1);
+        if (!g)
+                return -ENOMEM;
+
+        *g = (SpoolSegment) {
+                .seqnum = seqnum,
+                .size = size,
+                .write_offset = sizeof(SpoolSegmentHeader),
+        };
+
+        g->fd = open(path, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0600);
+        if (g->fd < 0)
+                return log_error_errno(errno, "Failed to create spool segment %s: %m", path);
+
+        /* Allocate the blocks right away: running out of disk space on a write to the mapping would
+         * otherwise get us killed by SIGBUS. */
+        r = posix_fallocate(g->fd, 0, size);
+        if (r == 0)
+                r = segment_map(g);
+        else
+                r = -r;
+        if (r < 0) {
+                log_error_errno(r, "Failed to allocate spool segment %s: %m", path);
+                (void) unlink(path);
+                segment_free(TAKE_PTR(g));
+                return r;
+        }
+
+        h = segment_header(g);
+        memcpy(h->signature, SPOOL_SIGNATURE, sizeof(h->signature));
+        h->read_offset = htole64(sizeof(SpoolSegmentHeader));
+
+        log_debug("Created spool segment %s.", path);
+
+        *ret = TAKE_PTR(g);
+        return 0;
+}
+
+static int segment_open(Spool *s, uint64_t seqnum, SpoolSegment **ret) {
+        _cleanup_free_ SpoolSegment *g = NULL;
+        _cleanup_free_ char *path = NULL;
+        size_t offset, size;
+        struct stat st;
+        int r;
+
+        assert(s);
+        assert(ret);
+
+        r = segment_path(s, seqnum, &path);
+        if (r < 0)
+                return r;
+
+        g = new(SpoolSegment, 1);
+        if (!g)
+                return -ENOMEM;
+
+        *g = (SpoolSegment) {
+                .seqnum = seqnum,
+        };
+
+        g->fd = open(path, O_RDWR|O_CLOEXEC);
+        if (g->fd < 0)
+                return -errno;
+
+        if (fstat(g->fd, &st) < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        if (st.st_size < (off_t) (sizeof(SpoolSegmentHeader) + SPOOL_RECORD_HEADER_SIZE) || (uint64_t) st.st_size > SIZE_MAX) {
+                r = -EBADMSG;
+                goto fail;
+        }
+
+        g->size = st.st_size;
+
+        r = segment_map(g);
+        if (r < 0)
+                goto fail;
+
+        offset = segment_committed(g);
+        if (memcmp(segment_header(g)->signature, SPOOL_SIGNATURE, sizeof(SPOOL_SIGNATURE)) != 0 ||
+            offset < sizeof(SpoolSegmentHeader) || offset > g->size) {
+                r = -EBADMSG;
+                goto fail;
+        }
+
+        /* Find the end of the written records */
+        offset = sizeof(SpoolSegmentHeader);
+        while ((size = segment_record_size(g, offset)) > 0)
+                offset += SPOOL_RECORD_HEADER_SIZE + size;
+
+        g->write_offset = offset;
+
+        *ret = TAKE_PTR(g);
+        return 0;
+
+ fail:
+        segment_free(TAKE_PTR(g));
+        return r;
+}
+
+/* Opens the segment, dropping it if it turns out to be unusable */
+static int segment_open_or_drop(Spool *s, uint64_t seqnum, SpoolSegment **ret) {
+        int r;
+
+        r = segment_open(s, seqnum, ret);
+        if (r == -ENOENT)
+                return 0;
+        if (r < 0) {
+                log_warning_errno(r, "Failed to open spool segment %" PRIu64 ", removing: %m", seqnum);
+                segment_unlink(s, seqnum);
+                return 0;
+        }
+
+        return 1;
+}
+
+Spool *spool_free(Spool *s) {
+        if (!s)
+                return NULL;
+
+        if (s->tail != s->head)
+                segment_free(s->tail);
+        segment_free(s->head);
+
+        free(s->directory);
+        return mfree(s);
+}
+
+static int spool_load(Spool *s) {
+        _cleanup_closedir_ DIR *d = NULL;
+        uint64_t first = UINT64_MAX, last = 0;
+        struct dirent *de;
+        int r;
+
+        assert(s);
+
+        d = opendir(s->directory);
+        if (!d)
+                return log_error_errno(errno, "Failed to open spool directory %s: %m", s->directory);
+
+        FOREACH_DIRENT(de, d, return log_error_errno(errno, "Failed to read spool directory %s: %m", s->directory)) {
+                unsigned long long seqnum;
+                char *e;
+
+                e = endswith(de->d_name, SPOOL_SEGMENT_SUFFIX);
+                if (!e)
+                        continue;
+
+                if (safe_atollu(strndupa(de->d_name, e - de->d_name), &seqnum) < 0)
+                        continue;
+
+                first = MIN(first, (uint64_t) seqnum);
+                last = MAX(last, (uint64_t) seqnum);
+        }
+
+        if (first == UINT64_MAX)
+                return 0;
+
+        /* The newest segment keeps receiving frames */
+        for (uint64_t i = last + 1; i > first; i--) {
+                r = segment_open_or_drop(s, i - 1, &s->tail);
+                if (r < 0)
+                        return r;
+                if (r > 0)
+                        break;
+        }
+        if (!s->tail)
+                return 0;
+
+        for (uint64_t i = first; i < s->tail->seqnum; i++) {
+                r = segment_open_or_drop(s, i, &s->head);
+                if (r < 0)
+                        return r;
+                if (r > 0)
+                        break;
+        }
+        if (!s->head)
+                s->head = s->tail;
+
+        s->read_offset = segment_committed(s->head);
+
+        log_debug("Loaded spool segments %" PRIu64 "-%" PRIu64 " from %s.", s->head->seqnum, s->tail->seqnum, s->directory);
+        return 1;
+}
+
+int spool_open(const char *directory, uint64_t max_size, Spool **ret) {
+        _cleanup_(spool_freep) Spool *s = NULL;
+        int r;
+
+        assert(directory);
+        assert(max_size >= SPOOL_SIZE_MIN);
+        assert(ret);
+
+        s = new(Spool, 1);
+        if (!s)
+                return log_oom();
+
+        *s = (Spool) {
+                .directory = strdup(directory),
+                .max_size = max_size,
+                .segment_size = PAGE_ALIGN(max_size / SPOOL_SEGMENTS_MAX),
+        };
+        if (!s->directory)
+                return log_oom();
+
+        r = mkdir_p(directory, 0700);
+        if (r < 0)
+                return log_error_errno(r, "Failed to create spool directory %s: %m", directory);
+
+        r = spool_load(s);
+        if (r < 0)
+                return r;
+        if (r == 0) {
+                r = segment_create(s, 0, s->segment_size, &s->head);
+                if (r < 0)
+                        return r;
+
+                s->tail = s->head;
+                s->read_offset = sizeof(SpoolSegmentHeader);
+        }
+
+        s->sync_seqnum = s->tail->seqnum;
+
+        *ret = TAKE_PTR(s);
+        return 0;
+}
+
+static bool spool_delivered(Spool *s) {
+        assert(s);
+
+        return s->head == s->tail &&
+                s->read_offset == s->tail->write_offset &&
+                segment_committed(s->head) == s->read_offset;
+}
+
+static int spool_extend(Spool *s, size_t need) {
+        SpoolSegment *g;
+        size_t size;
+        int r;
+
+        assert(s);
+
+        /* Frames which don't fit into a regular segment get one of their own */
+        size = MAX(s->segment_size, PAGE_ALIGN(sizeof(SpoolSegmentHeader) + need));
+        if (size > s->max_size)
+                return -EMSGSIZE;
+
+        if (!spool_delivered(s) &&
+            (s->tail->seqnum - s->head->seqnum + 1) * s->segment_size + size > s->max_size)
+                return -ENOBUFS;
+
+        r = segment_create(s, s->tail->seqnum + 1, size, &g);
+        if (r < 0)
+                return r;
+
+        if (spool_delivered(s)) {
+                /* Nothing left to send in the old segment, so it can go right away */
+                segment_unlink(s, s->head->seqnum);
+                segment_free(s->head);
+
+                s->head = g;
+                s->read_offset = sizeof(SpoolSegmentHeader);
+        } else if (s->tail != s->head)
+                /* Stays on disk until the sender gets to it */
+                segment_free(s->tail);
+
+        s->tail = g;
+        return 0;
+}
+
+int spool_append(Spool *s, const struct iovec *iovec, size_t n_iovec) {
+        size_t size, need;
+        uint8_t *p;
+        int r;
+
+        assert(s);
+        assert(iovec);
+
+        size = iovec_total_size(iovec, n_iovec);
+        if (size == 0)
+                return 0;
+        if (size > UINT32_MAX)
+                return -EMSGSIZE;
+
+        need = SPOOL_RECORD_HEADER_SIZE + size;
+        if (s->tail->write_offset + need > s->tail->size) {
+                r = spool_extend(s, need);
+                if (r < 0)
+                        return r;
+        }
+
+        /* Store the length last, the record only becomes visible once it is complete */
+        p = s->tail->map + s->tail->write_offset;
+        for (size_t i = 0, pos = SPOOL_RECORD_HEADER_SIZE; i < n_iovec; pos += iovec[i].iov_len, i++)
+                memcpy_safe(p + pos, iovec[i].iov_base, iovec[i].iov_len);
+        unaligned_write_le32(p, size);
+
+        s->tail->write_offset += need;
+        return 0;
+}
+
+/* Segments filled up since the last sync are no longer mapped, unless it is the head */
+static int segment_sync(Spool *s, uint64_t seqnum) {
+        _cleanup_free_ char *path = NULL;
+        _cleanup_close_ int fd = -1;
+        int r;
+
+        assert(s);
+
+        if (seqnum == s->head->seqnum) {
+                if (fdatasync(s->head->fd) < 0)
+                        return -errno;
+
+                return 0;
+        }
+
+        r = segment_path(s, seqnum, &path);
+        if (r < 0)
+                return r;
+
+        fd = open(path, O_RDONLY|O_CLOEXEC);
+        if (fd < 0)
+                /* Delivered and removed already */
+                return errno == ENOENT ? 0 : -errno;
+
+        if (fdatasync(fd) < 0)
+                return -errno;
+
+        return 0;
+}
+
+/* Writes the frames appended since the last call to disk, including the directory entries of new segments */
+int spool_sync(Spool *s) {
+        SpoolSegment *t;
+        size_t offset;
+        int r;
+
+        assert(s);
+
+        t = s->tail;
+        if (s->sync_seqnum == t->seqnum && t->sync_offset == t->write_offset)
+                return 0;
+
+        for (uint64_t i = s->sync_seqnum; i < t->seqnum; i++) {
+                r = segment_sync(s, i);
+                if (r < 0)
+                        return r;
+        }
+
+        offset = t->sync_offset & ~(page_size() - 1);
+        if (msync(t->map + offset, t->write_offset - offset, MS_SYNC) < 0)
+                return -errno;
+
+        if (s->sync_seqnum != t->seqnum || t->sync_offset == 0) {
+                _cleanup_close_ int fd = -1;
+
+                fd = open(s->directory, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+                if (fd < 0)
+                        return -errno;
+
+                if (fsync(fd) < 0)
+                        return -errno;
+        }
+
+        s->sync_seqnum = t->seqnum;
+        t->sync_offset = t->write_offset;
+        return 0;
+}
+
+static int spool_rotate_head(Spool *s) {
+        SpoolSegment *g = NULL;
+        int r;
+
+        assert(s);
+        assert(s->head != s->tail);
+
+        for (uint64_t i = s->head->seqnum + 1; i < s->tail->seqnum; i++) {
+                r = segment_open_or_drop(s, i, &g);
+                if (r < 0)
+                        return r;
+                if (r > 0)
+                        break;
+        }
+
+        segment_unlink(s, s->head->seqnum);
+        segment_free(s->head);
+
+        s->head = g ?: s->tail;
+        s->read_offset = segment_committed(s->head);
+
+        return 0;
+}
+
+int spool_peek(Spool *s, struct iovec *ret) {
+        int r;
+
+        assert(s);
+        assert(ret);
+
+        for (;;) {
+                size_t end = s->head == s->tail ? s->tail->write_offset : s->head->size;
+
+                if (s->read_offset < end) {
+                        s->peek_size = segment_record_size(s->head, s->read_offset);
+                        if (s->peek_size > 0) {
+                                *ret = IOVEC_MAKE(s->head->map + s->read_offset + SPOOL_RECORD_HEADER_SIZE, s->peek_size);
+                                return 1;
+                        }
+                }
+
+                if (s->head == s->tail)
+                        return 0;
+
+                /* Only move on to the next segment once everything read so far is committed, so that
+                 * spool_rewind() never has to go back across segments. */
+                if (segment_committed(s->head) != s->read_offset)
+                        return 0;
+
+                r = spool_rotate_head(s);
+                if (r < 0)
+                        return r;
+        }
+}
+
+void spool_advance(Spool *s) {
+        assert(s);
+        assert(s->peek_size > 0);
+
+        s->read_offset += SPOOL_RECORD_HEADER_SIZE + s->peek_size;
+        s->peek_size = 0;
+}
+
+void spool_commit(Spool *s) {
+        assert(s);
+
+        segment_header(s->head)->read_offset = htole64(s->read_offset);
+}
+
+void spool_rewind(Spool *s) {
+        assert(s);
+
+        s->read_offset = segment_committed(s->head);
+        s->peek_size = 0;
+}
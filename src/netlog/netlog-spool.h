@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+#pragma once
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "macro.h"
+
+/* Smallest SpoolSize= accepted, it has to hold a few segments */
+#define SPOOL_SIZE_MIN     (1024ULL * 1024ULL)
+#define SPOOL_SEGMENTS_MAX 8U
+
+typedef struct Spool Spool;
+
+int spool_open(const char *directory, uint64_t max_size, Spool **ret);
+Spool *spool_free(Spool *s);
+
+int spool_append(Spool *s, const struct iovec *iovec, size_t n_iovec);
+int spool_sync(Spool *s);
+
+int spool_peek(Spool *s, struct iovec *ret);
+void spool_advance(Spool *s);
+void spool_commit(Spool *s);
+void spool_rewind(Spool *s);
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(Spool*, spool_free);
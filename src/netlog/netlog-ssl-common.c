@@ -6,14 +6,19 @@
 #include <netinet/in.h>
 #include <openssl/bio.h>
 #include <openssl/err.h>
+#include <openssl/pem.h>
+#include <poll.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 
 #include "alloc-util.h"
 #include "fd-util.h"
+#include "fileio.h"
 #include "io-util.h"
 #include "iovec-util.h"
 #include "string-table.h"
+#include "string-util.h"
+#include "time-util.h"
 
 #include "netlog-ssl.h"
 
@@ -26,6 +31,14 @@ static const char *const certificate_auth_mode_table[_OPEN_SSL_CERTIFICATE_AUTH_
 
 DEFINE_STRING_TABLE_LOOKUP(certificate_auth_mode, OpenSSLCertificateAuthMode);
 
+static const char *const ssl_session_resumption_table[_SSL_SESSION_RESUMPTION_MAX] = {
+        [SSL_SESSION_RESUMPTION_NO]         = "no",
+        [SSL_SESSION_RESUMPTION_YES]        = "yes",
+        [SSL_SESSION_RESUMPTION_PERSISTENT] = "persistent",
+};
+
+DEFINE_STRING_TABLE_LOOKUP_WITH_BOOLEAN(ssl_session_resumption, SSLSessionResumption, SSL_SESSION_RESUMPTION_YES);
+
 static const char *const ssl_transport_type_table[] = {
         [SSL_TRANSPORT_TLS]  = "TLS",
         [SSL_TRANSPORT_DTLS] = "DTLS",
@@ -50,37 +63,137 @@ static int ssl_write(SSLManager *m, const char *buf, size_t count) {
 
         proto = ssl_transport_type_to_string(m->transport_type);
 
-        ERR_clear_error();
-        r = SSL_write(m->ssl, buf, count);
-        if (r <= 0) {
-                int error = SSL_get_error(m->ssl, r);
-                if (IN_SET(error, SSL_ERROR_WANT_READ, SSL_ERROR_WANT_WRITE))
-                        return log_info_errno(SYNTHETIC_ERRNO(EAGAIN), "%s: Failed to invoke SSL_write to %s: %s", proto, m->pretty_address, TLS_ERROR_STRING(error));
-                else
+        for (;;) {
+                int error;
+
+                ERR_clear_error();
+                r = SSL_write(m->ssl, buf, count);
+                if (r > 0)
+                        break;
+
+                error = SSL_get_error(m->ssl, r);
+                if (!IN_SET(error, SSL_ERROR_WANT_READ, SSL_ERROR_WANT_WRITE))
                         return log_error_errno(SYNTHETIC_ERRNO(EPIPE), "%s: Failed to invoke SSL_write to %s: %s", proto, m->pretty_address, TLS_ERROR_STRING(error));
+
+                /* A TLS stream doesn't stall the event loop, the record is written again once the socket
+                 * is ready, see ssl_io_handler(). A DTLS datagram is dropped after a short wait instead. */
+                if (m->transport_type == SSL_TRANSPORT_TLS) {
+                        if (!m->event_io)
+                                return log_debug_errno(SYNTHETIC_ERRNO(ECONNRESET), "%s: Connection to %s closed by peer", proto, m->pretty_address);
+
+                        r = sd_event_source_set_io_events(m->event_io, error == SSL_ERROR_WANT_WRITE ? EPOLLIN|EPOLLOUT : EPOLLIN);
+                        if (r < 0)
+                                return log_error_errno(r, "%s: Failed to update I/O events: %m", proto);
+
+                        return log_debug_errno(SYNTHETIC_ERRNO(EAGAIN), "%s: Waiting for %s to take more output", proto, m->pretty_address);
+                }
+
+                r = fd_wait_for_event(m->fd, error == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT, SSL_SEND_TIMEOUT_USEC);
+                if (r < 0)
+                        return log_error_errno(r, "%s: Failed to wait for %s: %m", proto, m->pretty_address);
+                if (r == 0)
+                        return log_info_errno(SYNTHETIC_ERRNO(EAGAIN), "%s: Failed to invoke SSL_write to %s: %s", proto, m->pretty_address, TLS_ERROR_STRING(error));
         }
 
         return log_debug("%s: Successful SSL_write: %d bytes", proto, r);
 }
 
+static int ssl_write_records(SSLManager *m, bool all) {
+        size_t done = 0;
+        int r = 0;
+
+        assert(m);
+
+        /* A write that failed with SSL_ERROR_WANT_{READ,WRITE} must be retried with the same length, even
+         * though more data may have been appended to the buffer in the meantime. */
+        while (m->output_size - done >= SSL_RECORD_MAX || (all && done < m->output_size)) {
+                size_t n = m->output_retry ?: MIN(m->output_size - done, (size_t) SSL_RECORD_MAX);
+
+                r = ssl_write(m, m->output + done, n);
+                if (r < 0) {
+                        m->output_retry = r == -EAGAIN ? n : 0;
+                        break;
+                }
+
+                m->output_retry = 0;
+                done += n;
+        }
+
+        m->output_written += done;
+
+        if (done > 0) {
+                memmove(m->output, m->output + done, m->output_size - done);
+                m->output_size -= done;
+        }
+
+        if (r < 0)
+                return r;
+
+        /* Nothing waits for the socket any more */
+        if (m->output_retry == 0 && m->event_io && m->connected)
+                (void) sd_event_source_set_io_events(m->event_io, EPOLLIN);
+
+        return 0;
+}
+
+void ssl_set_output_handler(SSLManager *m, ssl_output_handler_t handler, void *userdata) {
+        assert(m);
+
+        m->output_handler = handler;
+        m->output_userdata = userdata;
+}
+
 int ssl_writev(SSLManager *m, const struct iovec *iov, size_t iovcnt) {
         _cleanup_free_ char *buf = NULL;
         size_t count;
+        char *p;
 
         assert(m);
         assert(iov);
 
-        /* single buffer. Suboptimal, but better than multiple SSL_write calls. */
         count = iovec_total_size(iov, iovcnt);
         assert(count > 0);
-        buf = new(char, count);
-        if (!buf)
+
+        /* Each DTLS record is a datagram of its own and carries exactly one message. Messages are formatted
+         * into one piece, only gather those that are not. */
+        if (m->transport_type == SSL_TRANSPORT_DTLS) {
+                if (iovcnt == 1)
+                        return ssl_write(m, iov[0].iov_base, count);
+
+                buf = new(char, count);
+                if (!buf)
+                        return log_oom();
+
+                for (size_t i = 0, pos = 0; i < iovcnt; pos += iov[i].iov_len, i++)
+                        memcpy(buf + pos, iov[i].iov_base, iov[i].iov_len);
+
+                return ssl_write(m, buf, count);
+        }
+
+        /* The syslog frames are self-delimiting, so on a TLS stream many of them are packed into a
+         * single record. Complete records are written out right away, the rest waits for ssl_flush(). */
+        if (!GREEDY_REALLOC(m->output, m->output_allocated, m->output_size + count))
                 return log_oom();
 
-        for (size_t i = 0, pos = 0; i < iovcnt; pos += iov[i].iov_len, i++)
-                memcpy(buf + pos, iov[i].iov_base, iov[i].iov_len);
+        p = m->output + m->output_size;
+        for (size_t i = 0; i < iovcnt; i++)
+                p = mempcpy_safe(p, iov[i].iov_base, iov[i].iov_len);
+        m->output_size += count;
+        m->output_queued += count;
+
+        return ssl_write_records(m, false);
+}
+
+int ssl_flush(SSLManager *m) {
+        assert(m);
+
+        if (m->output_size == 0)
+                return 0;
+
+        if (!m->ssl)
+                return -ENOTCONN;
 
-        return ssl_write(m, buf, count);
+        return ssl_write_records(m, true);
 }
 
 static int ssl_setup_certificate_verification(SSLManager *m, SSL *ssl, const char *pretty) {
@@ -92,12 +205,12 @@ static int ssl_setup_certificate_verification(SSLManager *m, SSL *ssl, const cha
 
         proto = ssl_transport_type_to_string(m->transport_type);
 
+        SSL_set_ex_data(ssl, EX_DATA_TLSMANAGER, m);
+        SSL_set_ex_data(ssl, EX_DATA_PRETTYADDRESS, (void *) pretty);
+
         if (m->auth_mode != OPEN_SSL_CERTIFICATE_AUTH_MODE_NONE) {
                 log_debug("%s: enable certificate verification with mode %s", proto, certificate_auth_mode_to_string(m->auth_mode));
 
-                SSL_set_ex_data(ssl, EX_DATA_TLSMANAGER, m);
-                SSL_set_ex_data(ssl, EX_DATA_PRETTYADDRESS, (void *) pretty);
-
                 SSL_set_verify(ssl, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, ssl_verify_certificate_validity);
         } else {
                 log_debug("%s: disable certificate verification", proto);
@@ -138,100 +251,338 @@ static int ssl_log_connection_info(SSLManager *m, SSL *ssl) {
         return 0;
 }
 
-static int ssl_connect_tls(SSLManager *m, SocketAddress *address, const char *pretty, int fd) {
+static SSL *ssl_setup_tls(SSLManager *m, int fd) {
         _cleanup_(SSL_freep) SSL *ssl = NULL;
         const char *proto;
         int r;
 
         assert(m);
         assert(m->ctx);
-        assert(address);
-        assert(pretty);
         assert(fd >= 0);
 
         proto = ssl_transport_type_to_string(m->transport_type);
 
         ssl = SSL_new(m->ctx);
-        if (!ssl)
-                return log_error_errno(SYNTHETIC_ERRNO(ENOMEM),
-                                       "%s: Failed to allocate memory for ssl: %s",
-                                       proto, ERR_error_string(ERR_get_error(), NULL));
+        if (!ssl) {
+                log_error("%s: Failed to allocate memory for ssl: %s", proto, ERR_error_string(ERR_get_error(), NULL));
+                return NULL;
+        }
 
         r = SSL_set_fd(ssl, fd);
-        if (r <= 0)
-                return log_error_errno(SYNTHETIC_ERRNO(EIO),
-                                       "%s: Failed to SSL_set_fd: %s",
-                                       proto, ERR_error_string(ERR_get_error(), NULL));
-
-        ssl_setup_certificate_verification(m, ssl, pretty);
-
-        SSL_set_mode(ssl, SSL_MODE_AUTO_RETRY);
-
-        r = SSL_connect(ssl);
-        if (r <= 0)
-                return log_error_errno(SYNTHETIC_ERRNO(ENOMEM),
-                                       "%s: Failed to SSL_connect: %s",
-                                       proto, ERR_error_string(ERR_get_error(), NULL));
+        if (r <= 0) {
+                log_error("%s: Failed to SSL_set_fd: %s", proto, ERR_error_string(ERR_get_error(), NULL));
+                return NULL;
+        }
 
-        ssl_log_connection_info(m, ssl);
+        SSL_set_mode(ssl, SSL_MODE_AUTO_RETRY | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 
-        m->ssl = TAKE_PTR(ssl);
-        return 0;
+        return TAKE_PTR(ssl);
 }
 
-static int ssl_connect_dtls(SSLManager *m, SocketAddress *address, const char *pretty, int fd) {
+static SSL *ssl_setup_dtls(SSLManager *m, SocketAddress *address, int fd) {
         _cleanup_(BIO_freep) BIO *bio = NULL;
         _cleanup_(SSL_freep) SSL *ssl = NULL;
         const char *proto;
-        struct timeval timeout = {
-                .tv_sec = 3,
-                .tv_usec = 0,
-        };
-        int r;
 
         assert(m);
         assert(m->ctx);
         assert(address);
-        assert(pretty);
         assert(fd >= 0);
 
         proto = ssl_transport_type_to_string(m->transport_type);
 
-        /* Create BIO from socket */
+        /* Create BIO from socket. Retransmissions are driven by ssl_dtls_timer_handler() since the socket is
+         * non-blocking, hence no receive timeout is set on the BIO. */
         bio = BIO_new_dgram(fd, BIO_NOCLOSE);
-        if (!bio)
-                return log_error_errno(SYNTHETIC_ERRNO(ENOMEM),
-                                       "%s: Failed to allocate memory for bio: %m", proto);
+        if (!bio) {
+                log_error("%s: Failed to allocate memory for bio", proto);
+                return NULL;
+        }
 
         BIO_ctrl(bio, BIO_CTRL_DGRAM_SET_CONNECTED, 0, &address->sockaddr.sa);
-        /* Set and activate timeouts */
-        BIO_ctrl(bio, BIO_CTRL_DGRAM_SET_RECV_TIMEOUT, 0, &timeout);
 
         ssl = SSL_new(m->ctx);
-        if (!ssl)
-                return log_error_errno(SYNTHETIC_ERRNO(ENOMEM),
-                                       "%s: Failed to allocate memory for ssl: %s",
-                                       proto, ERR_error_string(ERR_get_error(), NULL));
+        if (!ssl) {
+                log_error("%s: Failed to allocate memory for ssl: %s", proto, ERR_error_string(ERR_get_error(), NULL));
+                return NULL;
+        }
 
         SSL_set_bio(ssl, bio, bio);
         TAKE_PTR(bio); /* SSL takes ownership */
 
-        ssl_setup_certificate_verification(m, ssl, pretty);
+        return TAKE_PTR(ssl);
+}
 
-        r = SSL_connect(ssl);
-        if (r <= 0)
-                return log_error_errno(SYNTHETIC_ERRNO(ENOMEM),
-                                       "%s: Failed to SSL_connect: %s",
-                                       proto, ERR_error_string(ERR_get_error(), NULL));
+static int ssl_session_save(SSLManager *m) {
+        _cleanup_free_ char *temp_path = NULL;
+        _cleanup_fclose_ FILE *f = NULL;
+        int r;
 
-        ssl_log_connection_info(m, ssl);
+        assert(m);
+        assert(m->session);
 
-        m->ssl = TAKE_PTR(ssl);
+        if (!m->session_file)
+                return 0;
+
+        r = fopen_temporary(m->session_file, &f, &temp_path);
+        if (r < 0)
+                goto finish;
+
+        /* The session carries the resumption secret, keep it private */
+        if (fchmod(fileno(f), 0600) < 0) {
+                r = -errno;
+                goto finish;
+        }
+
+        if (PEM_write_SSL_SESSION(f, m->session) != 1) {
+                r = -EIO;
+                goto finish;
+        }
+
+        r = fflush_and_check(f);
+        if (r < 0)
+                goto finish;
+
+        if (rename(temp_path, m->session_file) < 0) {
+                r = -errno;
+                goto finish;
+        }
+
+ finish:
+        if (r < 0)
+                log_warning_errno(r, "Failed to save TLS session %s: %m", m->session_file);
+
+        if (temp_path)
+                (void) unlink(temp_path);
+
+        return r;
+}
+
+static int ssl_session_load(SSLManager *m) {
+        _cleanup_(SSL_SESSION_freep) SSL_SESSION *session = NULL;
+        _cleanup_fclose_ FILE *f = NULL;
+
+        assert(m);
+        assert(m->session_file);
+
+        f = fopen(m->session_file, "re");
+        if (!f) {
+                if (errno == ENOENT)
+                        return 0;
+
+                return log_warning_errno(errno, "Failed to open TLS session %s: %m", m->session_file);
+        }
+
+        session = PEM_read_SSL_SESSION(f, NULL, NULL, NULL);
+        if (!session || !SSL_SESSION_is_resumable(session)) {
+                log_debug("Ignoring unusable TLS session %s.", m->session_file);
+                return 0;
+        }
+
+        log_debug("Loaded TLS session %s.", m->session_file);
+
+        SSL_SESSION_free(m->session);
+        m->session = TAKE_PTR(session);
+
+        return 1;
+}
+
+static int ssl_new_session(SSL *ssl, SSL_SESSION *session) {
+        SSLManager *m;
+
+        m = SSL_get_ex_data(ssl, EX_DATA_TLSMANAGER);
+        if (!m || !SSL_SESSION_is_resumable(session))
+                return 0;
+
+        /* TLS 1.3 servers may hand out several tickets, the most recent one is as good as any other */
+        SSL_SESSION_free(m->session);
+        m->session = session;
+
+        (void) ssl_session_save(m);
+
+        /* We took over the reference */
+        return 1;
+}
+
+static void ssl_handshake_release(SSLManager *m) {
+        assert(m);
+
+        m->event_retransmit = sd_event_source_disable_unref(m->event_retransmit);
+        m->event_timeout = sd_event_source_disable_unref(m->event_timeout);
+}
+
+static int ssl_handshake_finish(SSLManager *m, int error) {
+        ssl_connect_handler_t handler;
+        void *userdata;
+
+        assert(m);
+
+        handler = TAKE_PTR(m->connect_handler);
+        userdata = TAKE_PTR(m->userdata);
+
+        ssl_handshake_release(m);
+
+        /* Keep watching the socket for input once connected: TLS 1.3 servers send their session tickets
+         * only after the handshake. */
+        if (error >= 0)
+                error = sd_event_source_set_io_events(m->event_io, EPOLLIN);
+
+        if (error < 0)
+                ssl_disconnect(m);
+        else
+                m->connected = true;
+
+        /* The handler may well tear down this connection and start over, hence don't touch the object
+         * afterwards. */
+        return handler ? handler(m, error, userdata) : 0;
+}
+
+static int ssl_dtls_timer_handler(sd_event_source *s, uint64_t usec, void *userdata);
+
+static int ssl_handshake_step(SSLManager *m) {
+        struct timeval tv;
+        const char *proto;
+        uint32_t events;
+        int r, error;
+
+        assert(m);
+        assert(m->ssl);
+
+        proto = ssl_transport_type_to_string(m->transport_type);
+
+        ERR_clear_error();
+        r = SSL_connect(m->ssl);
+        if (r > 0) {
+                log_debug("%s: Handshake with %s completed%s", proto, m->pretty_address,
+                          SSL_session_reused(m->ssl) ? ", session resumed" : "");
+                ssl_log_connection_info(m, m->ssl);
+
+                return ssl_handshake_finish(m, 0);
+        }
+
+        error = SSL_get_error(m->ssl, r);
+        switch (error) {
+                case SSL_ERROR_WANT_READ:
+                        events = EPOLLIN;
+                        break;
+                case SSL_ERROR_WANT_WRITE:
+                        events = EPOLLOUT;
+                        break;
+                case SSL_ERROR_SYSCALL:
+                        r = errno > 0 ? -errno : -ECONNRESET;
+                        log_error_errno(r, "%s: Failed to SSL_connect to %s: %m", proto, m->pretty_address);
+                        return ssl_handshake_finish(m, r);
+                default:
+                        log_error("%s: Failed to SSL_connect to %s: %s", proto, m->pretty_address, ERR_error_string(ERR_get_error(), NULL));
+
+                        /* Don't offer the same session again in case it is what the server choked on */
+                        SSL_SESSION_free(m->session);
+                        m->session = NULL;
+                        return ssl_handshake_finish(m, -ECONNABORTED);
+        }
+
+        r = sd_event_source_set_io_events(m->event_io, events);
+        if (r < 0) {
+                log_error_errno(r, "%s: Failed to update I/O events: %m", proto);
+                return ssl_handshake_finish(m, r);
+        }
+
+        /* DTLS needs to retransmit lost handshake packets itself */
+        m->event_retransmit = sd_event_source_disable_unref(m->event_retransmit);
+        if (m->transport_type == SSL_TRANSPORT_DTLS && DTLSv1_get_timeout(m->ssl, &tv) > 0) {
+                r = sd_event_add_time_relative(m->event, &m->event_retransmit, CLOCK_MONOTONIC, timeval_load(&tv),
+                                               0, ssl_dtls_timer_handler, m);
+                if (r < 0) {
+                        log_error_errno(r, "%s: Failed to create retransmission timer: %m", proto);
+                        return ssl_handshake_finish(m, r);
+                }
+        }
+
+        return 0;
+}
+
+static void ssl_read_discard(SSLManager *m) {
+        char buf[4096];
+        int r, error;
+
+        assert(m);
+        assert(m->ssl);
+
+        /* Syslog receivers don't talk back. Reading only lets OpenSSL process post-handshake messages,
+         * such as session tickets, anything else is dropped. */
+        for (;;) {
+                ERR_clear_error();
+                r = SSL_read(m->ssl, buf, sizeof(buf));
+                if (r > 0)
+                        continue;
+
+                error = SSL_get_error(m->ssl, r);
+                if (IN_SET(error, SSL_ERROR_WANT_READ, SSL_ERROR_WANT_WRITE))
+                        return;
+
+                /* The connection is gone, the next write will notice and trigger a reconnect */
+                log_debug("%s: Connection to %s closed by peer: %s", ssl_transport_type_to_string(m->transport_type),
+                          m->pretty_address, TLS_ERROR_STRING(error));
+                m->event_io = sd_event_source_disable_unref(m->event_io);
+                return;
+        }
+}
+
+static int ssl_io_handler(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        SSLManager *m = ASSERT_PTR(userdata);
+        int r;
+
+        if (!m->connected) {
+                (void) ssl_handshake_step(m);
+                return 0;
+        }
+
+        ssl_read_discard(m);
+
+        /* Retry the write the socket did not take before */
+        if (m->output_retry == 0)
+                return 0;
+
+        r = ssl_write_records(m, true);
+        if (r == -EAGAIN)
+                return 0;
+
+        /* The handler may tear down this connection, hence don't touch the object afterwards */
+        if (m->output_handler)
+                (void) m->output_handler(m, r, m->output_userdata);
+
+        return 0;
+}
+
+static int ssl_dtls_timer_handler(sd_event_source *s, uint64_t usec, void *userdata) {
+        SSLManager *m = ASSERT_PTR(userdata);
+
+        m->event_retransmit = sd_event_source_disable_unref(m->event_retransmit);
+
+        if (DTLSv1_handle_timeout(m->ssl) < 0) {
+                log_error("%s: Failed to retransmit handshake to %s: %s",
+                          ssl_transport_type_to_string(m->transport_type), m->pretty_address,
+                          ERR_error_string(ERR_get_error(), NULL));
+                (void) ssl_handshake_finish(m, -ECONNABORTED);
+                return 0;
+        }
+
+        (void) ssl_handshake_step(m);
         return 0;
 }
 
-int ssl_connect(SSLManager *m, SocketAddress *address) {
+static int ssl_timeout_handler(sd_event_source *s, uint64_t usec, void *userdata) {
+        SSLManager *m = ASSERT_PTR(userdata);
+
+        log_error("%s: Handshake with %s timed out", ssl_transport_type_to_string(m->transport_type), m->pretty_address);
+
+        (void) ssl_handshake_finish(m, -ETIMEDOUT);
+        return 0;
+}
+
+int ssl_connect(SSLManager *m, sd_event *event, SocketAddress *address, ssl_connect_handler_t handler, void *userdata) {
         _cleanup_free_ char *pretty = NULL;
+        _cleanup_(SSL_freep) SSL *ssl = NULL;
         _cleanup_close_ int fd = -1;
         const char *proto;
         socklen_t salen;
@@ -239,6 +590,7 @@ int ssl_connect(SSLManager *m, SocketAddress *address) {
 
         assert(m);
         assert(m->ctx);
+        assert(event);
         assert(address);
 
         proto = ssl_transport_type_to_string(m->transport_type);
@@ -256,7 +608,8 @@ int ssl_connect(SSLManager *m, SocketAddress *address) {
 
         sock_type = m->transport_type == SSL_TRANSPORT_TLS ? SOCK_STREAM : SOCK_DGRAM;
 
-        fd = socket(AF_INET, sock_type, m->transport_type == SSL_TRANSPORT_TLS ? IPPROTO_TCP : 0);
+        fd = socket(address->sockaddr.sa.sa_family, sock_type|SOCK_CLOEXEC|SOCK_NONBLOCK,
+                    m->transport_type == SSL_TRANSPORT_TLS ? IPPROTO_TCP : 0);
         if (fd < 0)
                 return log_error_errno(errno, "%s: Failed to allocate socket: %m", proto);
 
@@ -268,19 +621,41 @@ int ssl_connect(SSLManager *m, SocketAddress *address) {
         if (r < 0 && errno != EINPROGRESS)
                 return log_error_errno(errno, "%s: Failed to connect to remote server='%s': %m", proto, pretty);
 
-        log_debug("%s: Connected to remote server: '%s'", proto, pretty);
+        log_debug("%s: Connecting to remote server: '%s'", proto, pretty);
 
         if (m->transport_type == SSL_TRANSPORT_TLS)
-                r = ssl_connect_tls(m, address, pretty, fd);
+                ssl = ssl_setup_tls(m, fd);
         else
-                r = ssl_connect_dtls(m, address, pretty, fd);
+                ssl = ssl_setup_dtls(m, address, fd);
+        if (!ssl)
+                return -EIO;
 
+        ssl_setup_certificate_verification(m, ssl, pretty);
+
+        if (m->session && SSL_set_session(ssl, m->session) != 1)
+                log_debug("%s: Failed to offer cached session to %s, doing a full handshake: %s",
+                          proto, pretty, ERR_error_string(ERR_get_error(), NULL));
+
+        /* The handshake is driven from the event loop. Wait until the socket becomes writable, i.e. the TCP
+         * connection has been established, before sending the ClientHello. */
+        r = sd_event_add_io(event, &m->event_io, fd, EPOLLOUT, ssl_io_handler, m);
         if (r < 0)
-                return r;
+                return log_error_errno(r, "%s: Failed to watch socket: %m", proto);
+
+        r = sd_event_add_time_relative(event, &m->event_timeout, CLOCK_MONOTONIC, SSL_HANDSHAKE_TIMEOUT_USEC,
+                                       0, ssl_timeout_handler, m);
+        if (r < 0) {
+                m->event_io = sd_event_source_disable_unref(m->event_io);
+                return log_error_errno(r, "%s: Failed to create handshake timer: %m", proto);
+        }
+
+        m->event = event;
+        m->connect_handler = handler;
+        m->userdata = userdata;
 
+        m->ssl = TAKE_PTR(ssl);
         m->fd = TAKE_FD(fd);
         m->pretty_address = TAKE_PTR(pretty);
-        m->connected = true;
 
         return 0;
 }
@@ -289,10 +664,16 @@ void ssl_disconnect(SSLManager *m) {
         if (!m)
                 return;
 
+        ssl_handshake_release(m);
+        m->event_io = sd_event_source_disable_unref(m->event_io);
+        m->connect_handler = NULL;
+        m->userdata = NULL;
+
         ERR_clear_error();
 
         if (m->ssl) {
-                SSL_shutdown(m->ssl);
+                if (m->connected)
+                        SSL_shutdown(m->ssl);
                 SSL_free(m->ssl);
                 m->ssl = NULL;
         }
@@ -300,6 +681,11 @@ void ssl_disconnect(SSLManager *m) {
         m->pretty_address = mfree(m->pretty_address);
         m->fd = safe_close(m->fd);
         m->connected = false;
+
+        /* Whatever is still buffered never reaches the server, it is up to the caller to send it again */
+        m->output_written = m->output_queued;
+        m->output_size = 0;
+        m->output_retry = 0;
 }
 
 void ssl_manager_free(SSLManager *m) {
@@ -309,6 +695,9 @@ void ssl_manager_free(SSLManager *m) {
         if (m->ctx)
                 SSL_CTX_free(m->ctx);
 
+        SSL_SESSION_free(m->session);
+        free(m->session_file);
+        free(m->output);
         free(m);
 }
 
@@ -356,3 +745,54 @@ int ssl_manager_init(SSLTransportType type, OpenSSLCertificateAuthMode auth, con
         *ret = TAKE_PTR(m);
         return 0;
 }
+
+int ssl_manager_clone(SSLManager *m, SSLManager **ret) {
+        SSLManager *n;
+
+        assert(m);
+        assert(m->ctx);
+        assert(ret);
+
+        /* The context carries the certificates, which can't be loaded any more once privileges are
+         * dropped. The new manager shares it, everything else is per connection. */
+        n = new(SSLManager, 1);
+        if (!n)
+                return log_oom();
+
+        if (SSL_CTX_up_ref(m->ctx) != 1) {
+                free(n);
+                return -ENOMEM;
+        }
+
+        *n = (SSLManager) {
+           .auth_mode = m->auth_mode,
+           .ctx = m->ctx,
+           .fd = -1,
+           .transport_type = m->transport_type,
+        };
+
+        *ret = n;
+        return 0;
+}
+
+int ssl_manager_enable_session_resumption(SSLManager *m, const char *session_file) {
+        assert(m);
+        assert(m->ctx);
+
+        /* Sessions are not looked up by OpenSSL on the client side anyway, we keep the one of the single
+         * server we talk to ourselves. */
+        SSL_CTX_set_session_cache_mode(m->ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(m->ctx, ssl_new_session);
+
+        if (!session_file)
+                return 0;
+
+        free(m->session_file);
+        m->session_file = strdup(session_file);
+        if (!m->session_file)
+                return log_oom();
+
+        (void) ssl_session_load(m);
+
+        return 0;
+}
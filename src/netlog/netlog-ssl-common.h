@@ -3,6 +3,7 @@
 
 #include <openssl/ssl.h>
 #include <stdbool.h>
+#include <systemd/sd-event.h>
 
 #include "socket-util.h"
 #include "openssl-util.h"
@@ -16,13 +17,33 @@ typedef enum OpenSSLCertificateAuthMode {
         _OPEN_SSL_CERTIFICATE_AUTH_MODE_INVALID = -EINVAL,
 } OpenSSLCertificateAuthMode;
 
+typedef enum SSLSessionResumption {
+        SSL_SESSION_RESUMPTION_NO,
+        SSL_SESSION_RESUMPTION_YES,
+        SSL_SESSION_RESUMPTION_PERSISTENT,
+        _SSL_SESSION_RESUMPTION_MAX,
+        _SSL_SESSION_RESUMPTION_INVALID = -EINVAL,
+} SSLSessionResumption;
+
 typedef enum SSLTransportType {
         SSL_TRANSPORT_TLS,
         SSL_TRANSPORT_DTLS,
 } SSLTransportType;
 
+/* Largest plaintext payload of a single TLS record */
+#define SSL_RECORD_MAX 16384U
+
+#define SSL_HANDSHAKE_TIMEOUT_USEC (10 * USEC_PER_SEC)
+#define SSL_SEND_TIMEOUT_USEC (200 * USEC_PER_MSEC)
+
 typedef struct SSLManager SSLManager;
 
+/* Invoked once the handshake completed, or failed with a negative errno */
+typedef int (*ssl_connect_handler_t)(SSLManager *m, int error, void *userdata);
+
+/* Invoked once TLS output the socket did not take earlier was written, or failed with a negative errno */
+typedef int (*ssl_output_handler_t)(SSLManager *m, int error, void *userdata);
+
 struct SSLManager {
         SSL_CTX *ctx;
         SSL *ssl;
@@ -30,6 +51,31 @@ struct SSLManager {
         char *pretty_address;
         int fd;
 
+        /* Non-blocking handshake */
+        sd_event *event;
+        sd_event_source *event_io;
+        sd_event_source *event_retransmit;
+        sd_event_source *event_timeout;
+        ssl_connect_handler_t connect_handler;
+        void *userdata;
+
+        /* Session of the last connection, offered again on reconnect */
+        SSL_SESSION *session;
+        char *session_file;
+
+        /* TLS output coalesced into full records. A record the socket did not take is written from the
+         * event loop, the output handler is told once that happened. */
+        ssl_output_handler_t output_handler;
+        void *output_userdata;
+        char *output;
+        size_t output_size;
+        size_t output_allocated;
+        size_t output_retry;
+
+        /* Bytes taken into the output buffer and written out of it or discarded since creation */
+        uint64_t output_queued;
+        uint64_t output_written;
+
         bool connected;
         OpenSSLCertificateAuthMode auth_mode;
         SSLTransportType transport_type;
@@ -37,15 +83,22 @@ struct SSLManager {
 
 void ssl_manager_free(SSLManager *m);
 int ssl_manager_init(SSLTransportType type, OpenSSLCertificateAuthMode auth, const char *server_cert, SSLManager **ret);
+int ssl_manager_clone(SSLManager *m, SSLManager **ret);
+int ssl_manager_enable_session_resumption(SSLManager *m, const char *session_file);
 
-int ssl_connect(SSLManager *m, SocketAddress *addr);
+int ssl_connect(SSLManager *m, sd_event *event, SocketAddress *addr, ssl_connect_handler_t handler, void *userdata);
 void ssl_disconnect(SSLManager *m);
 
+void ssl_set_output_handler(SSLManager *m, ssl_output_handler_t handler, void *userdata);
 int ssl_writev(SSLManager *m, const struct iovec *iov, size_t iovcnt);
+int ssl_flush(SSLManager *m);
 
 const char *certificate_auth_mode_to_string(OpenSSLCertificateAuthMode v) _const_;
 OpenSSLCertificateAuthMode certificate_auth_mode_from_string(const char *s) _pure_;
 
 const char *ssl_transport_type_to_string(SSLTransportType type) _const_;
 
+const char *ssl_session_resumption_to_string(SSLSessionResumption v) _const_;
+SSLSessionResumption ssl_session_resumption_from_string(const char *s) _pure_;
+
 DEFINE_TRIVIAL_CLEANUP_FUNC(SSLManager*, ssl_manager_free);
@@ -8,64 +8,329 @@
 #include "fileio.h"
 #include "log.h"
 #include "macro.h"
+#include "netlog-destination.h"
+#include "netlog-journal.h"
 #include "netlog-manager.h"
+#include "netlog-spool.h"
 #include "string-util.h"
+#include "strv.h"
 
-int state_update_cursor(Manager *m) {
-        _cleanup_free_ char *temp_path = NULL;
+/* The state file is updated in place, padded with empty lines to a multiple of this */
+#define STATE_FILE_BLOCK_SIZE 4096U
+
+static int state_format(Manager *m, char **ret, size_t *ret_size) {
         _cleanup_fclose_ FILE *f = NULL;
+        _cleanup_free_ char *buf = NULL;
+        JournalReader *reader;
+        size_t size = 0;
         int r;
 
         assert(m);
+        assert(ret);
+        assert(ret_size);
 
-        if (!m->state_file || !m->last_cursor)
-                return 0;
+        f = open_memstream(&buf, &size);
+        if (!f)
+                return log_oom();
 
-        r = fopen_temporary(m->state_file, &f, &temp_path);
+        fputs("# This is private data. Do not parse.\n", f);
+
+        /* The first reader's cursor is also saved the way it was before namespaces got their own ones, so
+         * that a single reader finds it regardless of its namespace */
+        if (m->readers->last_cursor)
+                fprintf(f, "LAST_CURSOR=%s\n", m->readers->last_cursor);
+
+        LIST_FOREACH(readers, reader, m->readers)
+                if (reader->namespace && reader->last_cursor)
+                        fprintf(f, "NAMESPACE_CURSOR=%s %s\n", reader->namespace, reader->last_cursor);
+
+        r = fflush_and_check(f);
         if (r < 0)
-                goto finish;
+                return r;
+
+        f = safe_fclose(f);
+
+        *ret = TAKE_PTR(buf);
+        *ret_size = size;
+        return 0;
+}
+
+static int state_write(int fd, const char *buf, size_t size, bool sync) {
+        ssize_t n;
 
-        r = fchmod(fileno(f), 0644);
+        assert(fd >= 0);
+        assert(buf);
+
+        n = pwrite(fd, buf, size, 0);
+        if (n < 0)
+                return -errno;
+        if ((size_t) n != size)
+                return -EIO;
+
+        if (sync && fdatasync(fd) < 0)
+                return -errno;
+
+        return 0;
+}
+
+/* Writes the state to a new file and replaces the old one with it. The new file stays open, later
+ * checkpoints overwrite it in place. */
+static int state_replace(Manager *m, const char *buf, size_t size) {
+        _cleanup_free_ char *temp_path = NULL;
+        _cleanup_close_ int fd = -1;
+        int r;
+
+        assert(m);
+        assert(buf);
+
+        r = tempfn_xxxxxx(m->state_file, NULL, &temp_path);
         if (r < 0)
+                return r;
+
+        fd = mkostemp_safe(temp_path, O_RDWR|O_CLOEXEC);
+        if (fd < 0)
+                return fd;
+
+        if (fchmod(fd, 0644) < 0)
                 log_warning_errno(errno, "Failed to set mode of state %s: %m", m->state_file);
 
-        fprintf(f,
-                "# This is private data. Do not parse.\n"
-                "LAST_CURSOR=%s\n",
-                m->last_cursor);
+        r = posix_fallocate(fd, 0, size);
+        if (r > 0)
+                r = -r;
+        if (r == 0)
+                r = state_write(fd, buf, size, m->checkpoint_sync);
+        if (r == 0 && rename(temp_path, m->state_file) < 0)
+                r = -errno;
+        if (r < 0) {
+                (void) unlink(temp_path);
+                return r;
+        }
 
-        r = fflush_and_check(f);
+        safe_close(m->state_fd);
+        m->state_fd = TAKE_FD(fd);
+        m->state_size = size;
+
+        return 0;
+}
+
+/* The cursors cover entries which were only written to a spool so far, those have to be on disk first */
+static int state_sync_spools(Manager *m) {
+        Destination *d;
+        int r;
+
+        assert(m);
+
+        LIST_FOREACH(destinations, d, m->destinations) {
+                if (!d->spool)
+                        continue;
+
+                r = spool_sync(d->spool);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to sync spool of %s, not saving state: %m", d->name);
+        }
+
+        return 0;
+}
+
+int state_update_cursor(Manager *m) {
+        _cleanup_free_ char *buf = NULL;
+        JournalReader *reader;
+        size_t size = 0, allocated;
+        char *p;
+        int r;
+
+        assert(m);
+
+        m->event_checkpoint = sd_event_source_disable_unref(m->event_checkpoint);
+
+        if (!m->state_file || !m->readers)
+                return 0;
+
+        /* Nothing read yet, keep what is there */
+        LIST_FOREACH(readers, reader, m->readers)
+                if (reader->last_cursor)
+                        break;
+        if (!reader)
+                return 0;
+
+        if (m->checkpoint_sync) {
+                r = state_sync_spools(m);
+                if (r < 0)
+                        return r;
+        }
+
+        r = state_format(m, &buf, &size);
         if (r < 0)
                 goto finish;
 
-        if (rename(temp_path, m->state_file) < 0) {
-                r = -errno;
+        /* Cursors are about the same length every time, so the state usually fits into the file written
+         * before and goes to the same blocks on disk. Empty lines pad over what the previous state left. */
+        if (m->state_fd >= 0 && size < m->state_size)
+                allocated = m->state_size;
+        else
+                allocated = ALIGN_TO(size + 1, STATE_FILE_BLOCK_SIZE);
+
+        p = realloc(buf, allocated);
+        if (!p) {
+                r = log_oom();
                 goto finish;
         }
+        buf = p;
+        memset(buf + size, '\n', allocated - size);
+
+        if (allocated == m->state_size)
+                r = state_write(m->state_fd, buf, allocated, m->checkpoint_sync);
+        else
+                r = state_replace(m, buf, allocated);
 
  finish:
-        if (r < 0)
+        if (r < 0) {
                 log_error_errno(r, "Failed to save state %s: %m", m->state_file);
 
-        if (temp_path)
-                (void) unlink(temp_path);
+                /* Start over with a new file next time */
+                m->state_fd = safe_close(m->state_fd);
+                m->state_size = 0;
+                return r;
+        }
 
-        return r;
+        m->n_checkpoints++;
+        m->n_unsaved_entries = 0;
+        m->unsaved_since = 0;
+
+        return 0;
+}
+
+static int state_checkpoint_handler(sd_event_source *s, uint64_t usec, void *userdata) {
+        Manager *m = ASSERT_PTR(userdata);
+
+        (void) state_update_cursor(m);
+        return 0;
+}
+
+/* Called after the cursors moved past n_entries more entries. Saves them once CheckpointEntries= entries
+ * piled up or CheckpointIntervalSec= passed, whatever comes first. While catching up with the journal both
+ * are stretched, the cursors are saved once catching up is done. */
+int state_checkpoint(Manager *m, uint64_t n_entries) {
+        uint64_t entries;
+        usec_t usec;
+        int r;
+
+        assert(m);
+
+        entries = m->checkpoint_entries;
+        usec = m->checkpoint_usec;
+        if (m->catching_up) {
+                entries *= CATCH_UP_CHECKPOINT_FACTOR;
+                usec *= CATCH_UP_CHECKPOINT_FACTOR;
+        }
+
+        if (m->n_unsaved_entries == 0)
+                m->unsaved_since = now(CLOCK_MONOTONIC);
+
+        m->n_unsaved_entries += n_entries;
+
+        if (usec == 0 || (entries > 0 && m->n_unsaved_entries >= entries))
+                return state_update_cursor(m);
+
+        if (m->event_checkpoint)
+                return 0;
+
+        r = sd_event_add_time_relative(m->event, &m->event_checkpoint, CLOCK_MONOTONIC, usec, 0,
+                                       state_checkpoint_handler, m);
+        if (r < 0) {
+                log_warning_errno(r, "Failed to create checkpoint timer, saving state right away: %m");
+                return state_update_cursor(m);
+        }
+
+        return 0;
+}
+
+/* Saves whatever was forwarded since the last checkpoint, when shutting down */
+int state_flush(Manager *m) {
+        assert(m);
+
+        if (m->n_unsaved_entries == 0)
+                return 0;
+
+        return state_update_cursor(m);
+}
+
+static int state_set_cursor(JournalReader *reader, const char *cursor) {
+        assert(reader);
+        assert(cursor);
+
+        /* A cursor given on the command line or loaded already wins */
+        if (reader->last_cursor)
+                return 0;
+
+        reader->last_cursor = strdup(cursor);
+        if (!reader->last_cursor)
+                return log_oom();
+
+        log_debug("Last cursor of %s was %s.", journal_reader_name(reader), reader->last_cursor);
+        return 0;
 }
 
 int state_load_cursor(Manager *m) {
+        _cleanup_strv_free_ char **lines = NULL;
+        _cleanup_free_ char *contents = NULL;
+        const char *last_cursor = NULL;
+        JournalReader *reader;
+        char **line;
         int r;
 
         assert(m);
 
-        if (!m->state_file)
+        if (!m->state_file || !m->readers)
                 return 0;
 
-        r = parse_env_file(m->state_file, NEWLINE, "LAST_CURSOR", &m->last_cursor, NULL);
-        if (r < 0 && r != -ENOENT)
+        r = read_full_file(m->state_file, &contents, NULL);
+        if (r == -ENOENT) {
+                log_debug("Last cursor was not available.");
+                return 0;
+        }
+        if (r < 0)
                 return r;
 
-        log_debug("Last cursor was %s.", m->last_cursor ? m->last_cursor : "not available");
+        lines = strv_split(contents, NEWLINE);
+        if (!lines)
+                return log_oom();
+
+        STRV_FOREACH(line, lines) {
+                _cleanup_free_ char *namespace = NULL;
+                const char *value;
+                size_t n;
+
+                value = startswith(*line, "LAST_CURSOR=");
+                if (value) {
+                        last_cursor = value;
+                        continue;
+                }
+
+                value = startswith(*line, "NAMESPACE_CURSOR=");
+                if (!value)
+                        continue;
+
+                n = strcspn(value, WHITESPACE);
+                if (value[n] == 0)
+                        continue;
+
+                namespace = strndup(value, n);
+                if (!namespace)
+                        return log_oom();
+
+                reader = journal_reader_find(m, namespace);
+                if (!reader)
+                        continue;
+
+                r = state_set_cursor(reader, value + n + strspn(value + n, WHITESPACE));
+                if (r < 0)
+                        return r;
+        }
+
+        /* Also covers state files written with a single namespace */
+        if (last_cursor)
+                return state_set_cursor(m->readers, last_cursor);
 
         return 0;
 }
@@ -1,7 +1,11 @@
 /* SPDX-License-Identifier: LGPL-2.1-or-later */
 #pragma once
 
+#include <stdint.h>
+
 typedef struct Manager Manager;
 
 int state_update_cursor(Manager *m);
+int state_checkpoint(Manager *m, uint64_t n_entries);
+int state_flush(Manager *m);
 int state_load_cursor(Manager *m);
@@ -14,8 +14,8 @@ static inline int tls_manager_init(OpenSSLCertificateAuthMode auth, const char *
         return ssl_manager_init(SSL_TRANSPORT_TLS, auth, server_cert, ret);
 }
 
-static inline int tls_connect(TLSManager *m, SocketAddress *addr) {
-        return ssl_connect(m, addr);
+static inline int tls_connect(TLSManager *m, sd_event *event, SocketAddress *addr, ssl_connect_handler_t handler, void *userdata) {
+        return ssl_connect(m, event, addr, handler, userdata);
 }
 
 static inline void tls_disconnect(TLSManager *m) {
@@ -26,4 +26,8 @@ static inline int tls_stream_writev(TLSManager *m, const struct iovec *iov, size
         return ssl_writev(m, iov, iovcnt);
 }
 
+static inline int tls_stream_flush(TLSManager *m) {
+        return ssl_flush(m);
+}
+
 DEFINE_TRIVIAL_CLEANUP_FUNC(TLSManager*, tls_manager_free);
@@ -0,0 +1,571 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <signal.h>
+#include <sys/eventfd.h>
+
+#include "netlog-worker.h"
+
+#include "alloc-util.h"
+#include "fd-util.h"
+#include "io-util.h"
+#include "iovec-util.h"
+#include "netlog-destination.h"
+#include "netlog-journal.h"
+#include "netlog-protocol.h"
+#include "netlog-state.h"
+
+static WorkerBatch *worker_batch_free(WorkerBatch *b) {
+        if (!b)
+                return NULL;
+
+        for (unsigned i = 0; i < b->n_outputs; i++) {
+                output_buffer_done(&b->outputs[i].buffer);
+                free(b->outputs[i].messages);
+        }
+
+        free(b->outputs);
+        free(b->fields);
+        free(b->entries);
+        free(b->cursor);
+
+        return mfree(b);
+}
+
+static void worker_batch_free_all(WorkerBatch **head) {
+        assert(head);
+
+        while (*head) {
+                WorkerBatch *b = *head;
+
+                LIST_REMOVE(batches, *head, b);
+                worker_batch_free(b);
+        }
+}
+
+static int worker_batch_get(WorkerPool *pool, JournalReader *reader, WorkerBatch **ret) {
+        Manager *m;
+        WorkerBatch *b;
+
+        assert(pool);
+        assert(reader);
+        assert(ret);
+
+        m = pool->manager;
+
+        /* Batches are reused, so that their buffers only grow once */
+        b = pool->unused;
+        if (b)
+                LIST_REMOVE(batches, pool->unused, b);
+        else {
+                b = new0(WorkerBatch, 1);
+                if (!b)
+                        return log_oom();
+
+                b->outputs = new0(WorkerOutput, m->n_destinations);
+                if (!b->outputs) {
+                        free(b);
+                        return log_oom();
+                }
+
+                b->n_outputs = m->n_destinations;
+        }
+
+        b->reader = reader;
+        b->generation = reader->generation;
+        b->fields_size = 0;
+        b->n_entries = 0;
+        b->cursor = mfree(b->cursor);
+        b->error = 0;
+
+        *ret = b;
+        return 0;
+}
+
+static void worker_batch_release(WorkerPool *pool, WorkerBatch *b) {
+        assert(pool);
+        assert(b);
+
+        LIST_PREPEND(batches, pool->unused, b);
+}
+
+static int worker_batch_add_field(WorkerBatch *b, const char *value, size_t *ret) {
+        size_t l;
+
+        assert(b);
+        assert(ret);
+
+        if (!value) {
+                *ret = SIZE_MAX;
+                return 0;
+        }
+
+        l = strlen(value) + 1;
+
+        if (!GREEDY_REALLOC(b->fields, b->fields_allocated, b->fields_size + l))
+                return -ENOMEM;
+
+        memcpy(b->fields + b->fields_size, value, l);
+        *ret = b->fields_size;
+        b->fields_size += l;
+
+        return 0;
+}
+
+static const char *worker_batch_field(WorkerBatch *b, size_t offset) {
+        assert(b);
+
+        return offset == SIZE_MAX ? NULL : b->fields + offset;
+}
+
+/* Runs on a worker thread. Only the settings of the destinations are looked at, which don't change while
+ * running. */
+static int worker_format_batch(WorkerPool *pool, TimestampCache *cache, WorkerBatch *b) {
+        Destination *d;
+        unsigned i = 0;
+        int r;
+
+        assert(pool);
+        assert(cache);
+        assert(b);
+
+        LIST_FOREACH(destinations, d, pool->manager->destinations) {
+                WorkerOutput *o = &b->outputs[i++];
+
+                o->buffer.size = o->n_messages = 0;
+
+                for (size_t j = 0; j < b->n_entries; j++) {
+                        const WorkerEntry *e = &b->entries[j];
+                        size_t start = o->buffer.size;
+
+                        if (!GREEDY_REALLOC(o->messages, o->messages_allocated, o->n_messages + 1))
+                                return -ENOMEM;
+
+                        /* The messages are formatted right behind each other */
+                        r = format_message(d, cache, &o->buffer, e->severity, e->facility,
+                                           worker_batch_field(b, e->identifier),
+                                           worker_batch_field(b, e->message),
+                                           worker_batch_field(b, e->hostname),
+                                           worker_batch_field(b, e->pid),
+                                           e->has_tv ? &e->tv : NULL,
+                                           worker_batch_field(b, e->structured_data),
+                                           worker_batch_field(b, e->msgid));
+                        if (r == -EMSGSIZE) {
+                                log_debug("Skipping message too large for %s.", log_format_to_string(d->log_format));
+                                continue;
+                        }
+                        if (r < 0)
+                                return r;
+
+                        o->messages[o->n_messages++] = (WorkerMessage) {
+                                .length = o->buffer.size - start,
+                                .severity = e->severity,
+                                .entry = j,
+                        };
+                }
+        }
+
+        return 0;
+}
+
+static void *worker_thread(void *userdata) {
+        WorkerPool *pool = ASSERT_PTR(userdata);
+        TimestampCache cache = {};
+
+        (void) pthread_setname_np(pthread_self(), "netlog-worker");
+
+        assert_se(pthread_mutex_lock(&pool->lock) == 0);
+
+        for (;;) {
+                WorkerBatch *b, *i, *prev = NULL;
+                nsec_t start;
+
+                while (!pool->queued && !pool->quit)
+                        assert_se(pthread_cond_wait(&pool->cond, &pool->lock) == 0);
+
+                if (pool->quit)
+                        break;
+
+                b = pool->queued;
+                LIST_REMOVE(batches, pool->queued, b);
+
+                assert_se(pthread_mutex_unlock(&pool->lock) == 0);
+
+                start = now_nsec(CLOCK_MONOTONIC);
+                b->error = worker_format_batch(pool, &cache, b);
+                b->format_nsec = now_nsec(CLOCK_MONOTONIC) - start;
+
+                assert_se(pthread_mutex_lock(&pool->lock) == 0);
+
+                /* Workers finish in any order, the event loop picks up the batches in the order they were
+                 * read */
+                LIST_FOREACH(batches, i, pool->done) {
+                        if (i->seqnum > b->seqnum)
+                                break;
+                        prev = i;
+                }
+
+                if (prev)
+                        LIST_INSERT_AFTER(batches, pool->done, prev, b);
+                else
+                        LIST_PREPEND(batches, pool->done, b);
+
+                pool->n_entries_formatted += b->n_entries;
+                pool->format_nsec += b->format_nsec;
+
+                (void) eventfd_write(pool->event_fd, 1);
+        }
+
+        assert_se(pthread_mutex_unlock(&pool->lock) == 0);
+
+        return NULL;
+}
+
+static int worker_send_batch(WorkerPool *pool, WorkerBatch *b) {
+        Destination *d;
+        unsigned i = 0;
+        int r = 0;
+
+        assert(pool);
+        assert(b);
+
+        /* Like manager_push_to_network(), a failing destination doesn't keep the messages from the others */
+        LIST_FOREACH(destinations, d, pool->manager->destinations) {
+                WorkerOutput *o = &b->outputs[i++];
+                char *p = o->buffer.data;
+
+                for (size_t j = 0; j < o->n_messages; j++) {
+                        struct iovec iovec = IOVEC_MAKE(p, o->messages[j].length);
+                        int k;
+
+                        p += o->messages[j].length;
+
+                        if (destination_rate_limited(d, o->messages[j].severity, iovec.iov_len))
+                                continue;
+
+                        b->entries[o->messages[j].entry].forwarded = true;
+                        k = protocol_send(d, &iovec, 1);
+                        if (k < 0) {
+                                if (r >= 0)
+                                        r = k;
+                                break;
+                        }
+                }
+        }
+
+        return r;
+}
+
+static WorkerBatch *worker_pool_next_done(WorkerPool *pool) {
+        WorkerBatch *b;
+
+        assert(pool);
+
+        assert_se(pthread_mutex_lock(&pool->lock) == 0);
+
+        b = pool->done;
+        if (b && b->seqnum == pool->next_send)
+                LIST_REMOVE(batches, pool->done, b);
+        else
+                b = NULL;
+
+        assert_se(pthread_mutex_unlock(&pool->lock) == 0);
+
+        return b;
+}
+
+static int worker_done_handler(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        WorkerPool *pool = ASSERT_PTR(userdata);
+        Manager *m = pool->manager;
+        WorkerBatch *b;
+        eventfd_t v;
+        int r;
+
+        (void) eventfd_read(fd, &v);
+
+        while ((b = worker_pool_next_done(pool))) {
+                nsec_t start;
+
+                pool->next_send++;
+                pool->n_in_flight--;
+
+                /* Read before the journal was reopened or rewound, the entries are read again */
+                if (b->generation != b->reader->generation) {
+                        worker_batch_release(pool, b);
+                        continue;
+                }
+
+                start = now_nsec(CLOCK_MONOTONIC);
+                r = b->error < 0 ? b->error : worker_send_batch(pool, b);
+                pool->send_nsec += now_nsec(CLOCK_MONOTONIC) - start;
+                pool->n_entries_sent += b->n_entries;
+
+                /* Entries too large or rate limited everywhere were not forwarded */
+                for (size_t i = 0; i < b->n_entries; i++)
+                        if (b->entries[i].forwarded)
+                                m->n_entries_formatted++;
+
+                if (r < 0) {
+                        log_debug_errno(r, "Failed to forward messages, reading again from the last saved cursor: %m");
+                        worker_batch_release(pool, b);
+                        (void) journal_rewind_input(b->reader);
+                        continue;
+                }
+
+                /* A server going away while sending may have rewound the journal */
+                if (b->generation == b->reader->generation) {
+                        for (size_t i = 0; i < b->n_entries; i++)
+                                if (b->entries[i].forwarded)
+                                        (void) journal_reader_forwarded(b->reader,
+                                                                        b->entries[i].has_tv ? &b->entries[i].tv : NULL);
+
+                        if (b->cursor)
+                                (void) journal_reader_advance(b->reader, TAKE_PTR(b->cursor), b->n_entries);
+                }
+
+                worker_batch_release(pool, b);
+        }
+
+        r = manager_flush_output(m);
+        if (r < 0) {
+                log_debug_errno(r, "Failed to flush output, reading again from the last saved cursor: %m");
+                journal_rewind_unacknowledged(m);
+        }
+
+        /* Reading may have been paused while all workers were busy */
+        return journal_resume_input(m);
+}
+
+int worker_pool_append(
+                WorkerPool *pool,
+                JournalReader *reader,
+                int severity,
+                int facility,
+                const struct timeval *tv,
+                const char *identifier,
+                const char *message,
+                const char *hostname,
+                const char *pid,
+                const char *syslog_structured_data,
+                const char *syslog_msgid) {
+
+        WorkerEntry *e;
+        WorkerBatch *b;
+        int r;
+
+        assert(pool);
+        assert(reader);
+        assert(message);
+
+        /* A batch only holds entries of one reader, as it ends at that reader's cursor */
+        if (pool->current && pool->current->reader != reader) {
+                r = worker_pool_submit(pool);
+                if (r < 0)
+                        return r;
+        }
+
+        if (!pool->current) {
+                r = worker_batch_get(pool, reader, &pool->current);
+                if (r < 0)
+                        return r;
+        }
+
+        b = pool->current;
+
+        if (!GREEDY_REALLOC(b->entries, b->entries_allocated, b->n_entries + 1))
+                return log_oom();
+
+        e = &b->entries[b->n_entries];
+        *e = (WorkerEntry) {
+                .severity = severity,
+                .facility = facility,
+                .tv = tv ? *tv : (struct timeval) {},
+                .has_tv = tv,
+        };
+
+        /* The fields only live until the next entry is read, the batch keeps copies */
+        if (worker_batch_add_field(b, identifier, &e->identifier) < 0 ||
+            worker_batch_add_field(b, message, &e->message) < 0 ||
+            worker_batch_add_field(b, hostname, &e->hostname) < 0 ||
+            worker_batch_add_field(b, pid, &e->pid) < 0 ||
+            worker_batch_add_field(b, syslog_structured_data, &e->structured_data) < 0 ||
+            worker_batch_add_field(b, syslog_msgid, &e->msgid) < 0)
+                return log_oom();
+
+        b->n_entries++;
+
+        if (b->n_entries >= WORKER_BATCH_ENTRIES)
+                return worker_pool_submit(pool);
+
+        return 0;
+}
+
+/* Hands the entries read so far to the workers */
+int worker_pool_submit(WorkerPool *pool) {
+        Manager *m;
+        WorkerBatch *b;
+        int r;
+
+        assert(pool);
+
+        m = pool->manager;
+        b = pool->current;
+
+        if (!b || b->n_entries == 0)
+                return 0;
+
+        assert(b->reader->journal);
+
+        r = sd_journal_get_cursor(b->reader->journal, &b->cursor);
+        if (r < 0)
+                log_error_errno(r, "Failed to get cursor: %m");
+        else
+                m->n_cursors++;
+
+        b->seqnum = pool->next_seqnum++;
+        pool->current = NULL;
+        pool->n_in_flight++;
+        pool->n_batches++;
+
+        assert_se(pthread_mutex_lock(&pool->lock) == 0);
+        LIST_APPEND(batches, pool->queued, b);
+        assert_se(pthread_cond_signal(&pool->cond) == 0);
+        assert_se(pthread_mutex_unlock(&pool->lock) == 0);
+
+        /* Don't read further ahead than the workers and the servers keep up with */
+        if (worker_pool_full(pool))
+                journal_pause_input(m);
+
+        return 0;
+}
+
+/* Forgets the entries of a reader not handed to the workers yet, after its journal was closed or rewound */
+void worker_pool_discard(WorkerPool *pool, JournalReader *reader) {
+        assert(pool);
+        assert(reader);
+
+        if (!pool->current || pool->current->reader != reader)
+                return;
+
+        worker_batch_release(pool, pool->current);
+        pool->current = NULL;
+}
+
+bool worker_pool_full(WorkerPool *pool) {
+        assert(pool);
+
+        return pool->n_in_flight >= pool->n_threads * WORKER_BATCHES_PER_THREAD;
+}
+
+void worker_pool_log_statistics(WorkerPool *pool, usec_t elapsed) {
+        uint64_t formatted;
+        nsec_t format_nsec;
+
+        assert(pool);
+
+        assert_se(pthread_mutex_lock(&pool->lock) == 0);
+        formatted = pool->n_entries_formatted;
+        format_nsec = pool->format_nsec;
+        assert_se(pthread_mutex_unlock(&pool->lock) == 0);
+
+        log_debug("Statistics: %u workers formatted %" PRIu64 " entries (%" PRIu64 "/s, %" PRIu64 "ns per entry), "
+                  "%" PRIu64 " sent (%" PRIu64 "/s, %" PRIu64 "ns per entry), %u of %" PRIu64 " batches in flight.",
+                  pool->n_threads,
+                  formatted, (formatted - pool->stats_entries_formatted) * USEC_PER_SEC / elapsed,
+                  formatted > 0 ? format_nsec / formatted : 0,
+                  pool->n_entries_sent, (pool->n_entries_sent - pool->stats_entries_sent) * USEC_PER_SEC / elapsed,
+                  pool->n_entries_sent > 0 ? pool->send_nsec / pool->n_entries_sent : 0,
+                  pool->n_in_flight, pool->n_batches);
+
+        pool->stats_entries_formatted = formatted;
+        pool->stats_entries_sent = pool->n_entries_sent;
+}
+
+WorkerPool *worker_pool_free(WorkerPool *pool) {
+        if (!pool)
+                return NULL;
+
+        assert_se(pthread_mutex_lock(&pool->lock) == 0);
+        pool->quit = true;
+        assert_se(pthread_cond_broadcast(&pool->cond) == 0);
+        assert_se(pthread_mutex_unlock(&pool->lock) == 0);
+
+        for (unsigned i = 0; i < pool->n_threads; i++)
+                (void) pthread_join(pool->threads[i], NULL);
+
+        free(pool->threads);
+
+        worker_batch_free(pool->current);
+        worker_batch_free_all(&pool->queued);
+        worker_batch_free_all(&pool->done);
+        worker_batch_free_all(&pool->unused);
+
+        sd_event_source_disable_unref(pool->event_done);
+        safe_close(pool->event_fd);
+
+        assert_se(pthread_cond_destroy(&pool->cond) == 0);
+        assert_se(pthread_mutex_destroy(&pool->lock) == 0);
+
+        return mfree(pool);
+}
+
+int worker_pool_new(Manager *m, unsigned n_threads, WorkerPool **ret) {
+        _cleanup_(worker_pool_freep) WorkerPool *pool = NULL;
+        sigset_t ss, saved_ss;
+        int r, k;
+
+        assert(m);
+        assert(n_threads > 0);
+        assert(ret);
+
+        pool = new(WorkerPool, 1);
+        if (!pool)
+                return log_oom();
+
+        *pool = (WorkerPool) {
+                .manager = m,
+                .event_fd = -1,
+                .lock = PTHREAD_MUTEX_INITIALIZER,
+                .cond = PTHREAD_COND_INITIALIZER,
+        };
+
+        pool->threads = new(pthread_t, n_threads);
+        if (!pool->threads)
+                return log_oom();
+
+        pool->event_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if (pool->event_fd < 0)
+                return log_error_errno(errno, "Failed to create eventfd: %m");
+
+        r = sd_event_add_io(m->event, &pool->event_done, pool->event_fd, EPOLLIN, worker_done_handler, pool);
+        if (r < 0)
+                return log_error_errno(r, "Failed to watch worker threads: %m");
+
+        if (sigfillset(&ss) < 0)
+                return log_error_errno(errno, "Failed to fill signal set: %m");
+
+        /* Signals are handled by the event loop, the workers never see them */
+        r = pthread_sigmask(SIG_BLOCK, &ss, &saved_ss);
+        if (r > 0)
+                return log_error_errno(r, "Failed to block signals: %m");
+
+        while (pool->n_threads < n_threads) {
+                r = pthread_create(&pool->threads[pool->n_threads], NULL, worker_thread, pool);
+                if (r > 0) {
+                        r = -r;
+                        break;
+                }
+
+                pool->n_threads++;
+        }
+
+        k = pthread_sigmask(SIG_SETMASK, &saved_ss, NULL);
+        if (k > 0 && r >= 0)
+                r = -k;
+        if (r < 0)
+                return log_error_errno(r, "Failed to start worker threads: %m");
+
+        log_debug("Formatting messages on %u worker threads.", pool->n_threads);
+
+        *ret = TAKE_PTR(pool);
+        return 0;
+}
@@ -0,0 +1,136 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+#pragma once
+
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "list.h"
+#include "netlog-manager.h"
+
+#define WORKERS_MAX 64U
+
+/* Entries handed to a worker at once, and batches in flight per worker before reading is paused */
+#define WORKER_BATCH_ENTRIES      256U
+#define WORKER_BATCHES_PER_THREAD 4U
+
+typedef struct WorkerEntry {
+        int severity;
+        int facility;
+        struct timeval tv;
+        bool has_tv;
+
+        /* Set when sending the batch, if any destination took the entry */
+        bool forwarded;
+
+        /* Offsets into the fields of the batch, SIZE_MAX if the entry lacks the field */
+        size_t identifier;
+        size_t message;
+        size_t hostname;
+        size_t pid;
+        size_t structured_data;
+        size_t msgid;
+} WorkerEntry;
+
+typedef struct WorkerMessage {
+        size_t length;
+        int severity;
+        size_t entry;
+} WorkerMessage;
+
+/* The messages of a batch formatted for one destination, back to back */
+typedef struct WorkerOutput {
+        OutputBuffer buffer;
+
+        WorkerMessage *messages;
+        size_t n_messages;
+        size_t messages_allocated;
+} WorkerOutput;
+
+typedef struct WorkerBatch WorkerBatch;
+
+struct WorkerBatch {
+        LIST_FIELDS(WorkerBatch, batches);
+
+        /* Batches are sent in the order they were read, and dropped if the journal was reopened since */
+        uint64_t seqnum;
+        JournalReader *reader;
+        uint64_t generation;
+
+        /* The journal fields of all entries, as collected by the reader */
+        char *fields;
+        size_t fields_size;
+        size_t fields_allocated;
+
+        WorkerEntry *entries;
+        size_t n_entries;
+        size_t entries_allocated;
+
+        /* Position of the last entry in the reader's journal, saved once the batch has been sent */
+        char *cursor;
+
+        /* One per destination, in the order of the destination list */
+        WorkerOutput *outputs;
+        unsigned n_outputs;
+
+        nsec_t format_nsec;
+        int error;
+};
+
+/* Formats journal entries on worker threads. The journal is read and the messages are sent on the event
+ * loop thread, as neither sd-journal nor the connections may be used from several threads. */
+typedef struct WorkerPool {
+        Manager *manager;
+
+        pthread_t *threads;
+        unsigned n_threads;
+
+        int event_fd;
+        sd_event_source *event_done;
+
+        /* Protects the queues, the counters of the workers, and quit */
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        bool quit;
+
+        /* Batches waiting for a worker, and formatted batches waiting to be sent, ordered by seqnum */
+        LIST_HEAD(WorkerBatch, queued);
+        LIST_HEAD(WorkerBatch, done);
+
+        /* Only touched by the event loop thread */
+        LIST_HEAD(WorkerBatch, unused);
+        WorkerBatch *current;
+        uint64_t next_seqnum;
+        uint64_t next_send;
+        unsigned n_in_flight;
+
+        /* Counters per stage for the statistics */
+        uint64_t n_batches;
+        uint64_t n_entries_formatted;
+        nsec_t format_nsec;
+        uint64_t n_entries_sent;
+        nsec_t send_nsec;
+        uint64_t stats_entries_formatted;
+        uint64_t stats_entries_sent;
+} WorkerPool;
+
+int worker_pool_new(Manager *m, unsigned n_threads, WorkerPool **ret);
+WorkerPool *worker_pool_free(WorkerPool *pool);
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(WorkerPool*, worker_pool_free);
+
+int worker_pool_append(
+                WorkerPool *pool,
+                JournalReader *reader,
+                int severity,
+                int facility,
+                const struct timeval *tv,
+                const char *identifier,
+                const char *message,
+                const char *hostname,
+                const char *pid,
+                const char *syslog_structured_data,
+                const char *syslog_msgid);
+int worker_pool_submit(WorkerPool *pool);
+void worker_pool_discard(WorkerPool *pool, JournalReader *reader);
+bool worker_pool_full(WorkerPool *pool);
+void worker_pool_log_statistics(WorkerPool *pool, usec_t elapsed);
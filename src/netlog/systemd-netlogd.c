@@ -13,7 +13,11 @@
 #include "fs-util.h"
 #include "mkdir.h"
 #include "netlog-conf.h"
+#include "netlog-destination.h"
+#include "netlog-journal.h"
 #include "netlog-manager.h"
+#include "netlog-metrics.h"
+#include "netlog-worker.h"
 #include "network-util.h"
 #include "path-util.h"
 #include "user-util.h"
@@ -23,6 +27,7 @@
 
 static const char *arg_cursor = NULL;
 static const char *arg_save_state = STATE_FILE;
+static const char *arg_config = NULL;
 
 static int setup_cursor_state_file(Manager *m, uid_t uid, gid_t gid) {
         _cleanup_fclose_ FILE *f = NULL;
@@ -72,6 +77,8 @@ static void help(void) {
                "     --cursor=CURSOR        Start at the specified cursor\n"
                "     --save-state[=FILE]    Save uploaded cursors (default \n"
                "                            " STATE_FILE ")\n"
+               "     --config=FILE          Read the configuration from FILE instead of\n"
+               "                            netlogd.conf and its drop-ins\n"
                "  -h --help                 Show this help and exit\n"
                "     --version              Print version string and exit\n"
                , program_invocation_short_name);
@@ -82,6 +89,7 @@ static int parse_argv(int argc, char *argv[]) {
                 ARG_VERSION = 0x100,
                 ARG_CURSOR,
                 ARG_SAVE_STATE,
+                ARG_CONFIG,
         };
 
         static const struct option options[] = {
@@ -89,6 +97,7 @@ static int parse_argv(int argc, char *argv[]) {
                 { "version",      no_argument,       NULL, ARG_VERSION        },
                 { "cursor",       required_argument, NULL, ARG_CURSOR         },
                 { "save-state",   optional_argument, NULL, ARG_SAVE_STATE     },
+                { "config",       required_argument, NULL, ARG_CONFIG         },
                 {}
         };
 
@@ -124,6 +133,10 @@ static int parse_argv(int argc, char *argv[]) {
                         arg_save_state = optarg ?: STATE_FILE;
                         break;
 
+                case ARG_CONFIG:
+                        arg_config = optarg;
+                        break;
+
                 case '?':
                         log_error("Unknown option %s.", argv[optind-1]);
                         return -EINVAL;
@@ -163,21 +176,56 @@ static int resolve_user_credentials(uid_t *uid, gid_t *gid) {
         return 0;
 }
 
-static int initialize_ssl_manager(Manager *m) {
-        int r = 0;
+static int initialize_ssl_manager(Destination *d) {
+        assert(d);
 
-        switch (m->protocol) {
+        /* The certificates are loaded while still privileged. The connections to the peers are set up
+         * later, they share them. */
+        switch (d->protocol) {
                 case SYSLOG_TRANSMISSION_PROTOCOL_DTLS:
-                        r = dtls_manager_init(m->auth_mode, m->server_cert, &m->dtls);
-                        break;
+                        return dtls_manager_init(d->auth_mode, d->server_cert, &d->ssl);
                 case SYSLOG_TRANSMISSION_PROTOCOL_TLS:
-                        r = tls_manager_init(m->auth_mode, m->server_cert, &m->tls);
-                        break;
+                        return tls_manager_init(d->auth_mode, d->server_cert, &d->ssl);
                 default:
-                        break;
+                        return 0;
         }
+}
 
-        return r;
+static int initialize_spool(Destination *d) {
+        _cleanup_free_ char *directory = NULL;
+        int r;
+
+        assert(d);
+
+        if (d->spool_size == 0)
+                return 0;
+
+        /* The spool lives next to the cursor state, the journal is only read up to what it holds */
+        r = destination_state_path(d, "spool", &directory);
+        if (r < 0)
+                return log_error_errno(r, "Failed to determine spool directory of %s: %m", d->name);
+
+        r = spool_open(directory, d->spool_size, &d->spool);
+        if (r < 0)
+                return log_error_errno(r, "Failed to open spool %s: %m", directory);
+
+        return 0;
+}
+
+static int initialize_destinations(Manager *m, int (*initialize)(Destination *d)) {
+        Destination *d;
+        int r;
+
+        assert(m);
+        assert(initialize);
+
+        LIST_FOREACH(destinations, d, m->destinations) {
+                r = initialize(d);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
 }
 
 static int run_event_loop(Manager *m) {
@@ -225,13 +273,13 @@ int main(int argc, char **argv) {
                 goto finish;
         }
 
-        r = manager_parse_config_file(m);
+        r = manager_parse_config_file(m, arg_config);
         if (r < 0) {
                 log_error_errno(r, "Failed to parse configuration file: %m");
                 goto finish;
         }
 
-        r = initialize_ssl_manager(m);
+        r = initialize_destinations(m, initialize_ssl_manager);
         if (r < 0)
                 goto finish;
 
@@ -239,6 +287,10 @@ int main(int argc, char **argv) {
         if (r < 0)
                 goto cleanup;
 
+        r = metrics_listen(m);
+        if (r < 0)
+                goto cleanup;
+
         r = drop_privileges(uid, gid,
                             (1ULL << CAP_NET_ADMIN) |
                             (1ULL << CAP_NET_BIND_SERVICE) |
@@ -246,6 +298,23 @@ int main(int argc, char **argv) {
         if (r < 0)
                 goto finish;
 
+        /* Spool segments have to be owned by the unprivileged user */
+        r = initialize_destinations(m, initialize_spool);
+        if (r < 0)
+                goto cleanup;
+
+        if (m->n_workers > 0) {
+                r = worker_pool_new(m, m->n_workers, &m->workers);
+                if (r < 0)
+                        goto cleanup;
+        }
+
+        /* If all destinations have a spool, messages are queued right away, regardless of whether the
+         * servers are reachable */
+        r = manager_update_input(m);
+        if (r < 0)
+                goto cleanup;
+
         r = run_event_loop(m);
 
  cleanup:
@@ -24,4 +24,5 @@ static inline char *tls_error_string(int ssl_error, char *buf, size_t count) {
 DEFINE_TRIVIAL_CLEANUP_FUNC_FULL(SSL*, SSL_free, NULL);
 DEFINE_TRIVIAL_CLEANUP_FUNC_FULL(BIO*, BIO_free, NULL);
 DEFINE_TRIVIAL_CLEANUP_FUNC_FULL(X509*, X509_free, NULL);
+DEFINE_TRIVIAL_CLEANUP_FUNC_FULL(SSL_SESSION*, SSL_SESSION_free, NULL);
 DEFINE_TRIVIAL_CLEANUP_FUNC_FULL_MACRO(void *, OPENSSL_free, NULL);
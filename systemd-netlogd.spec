@@ -16,6 +16,7 @@ BuildRequires:  gperf
 BuildRequires:  libcap-devel
 BuildRequires:  systemd-devel >= 230
 BuildRequires:  openssl-devel
+BuildRequires:  zlib-devel
 BuildRequires:  python3-sphinx
 BuildRequires:  python3-devel
 BuildRequires:  python3-lxml
@@ -0,0 +1,158 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "netlog-compress.h"
+#include "stdio-util.h"
+
+/* The server side: a zlib stream taking the output in whatever pieces it arrives */
+typedef struct Receiver {
+        z_stream stream;
+        char data[256 * 1024];
+        size_t size;
+} Receiver;
+
+static void receiver_init(Receiver *r) {
+        *r = (Receiver) {};
+        assert_int_equal(inflateInit(&r->stream), Z_OK);
+}
+
+static void receiver_feed(Receiver *r, const char *data, size_t size) {
+        r->stream.next_in = (Bytef *) data;
+        r->stream.avail_in = size;
+        r->stream.next_out = (Bytef *) r->data + r->size;
+        r->stream.avail_out = sizeof(r->data) - r->size;
+
+        assert_int_equal(inflate(&r->stream, Z_SYNC_FLUSH), Z_OK);
+        assert_int_equal(r->stream.avail_in, 0);
+
+        r->size = sizeof(r->data) - r->stream.avail_out;
+}
+
+static void receiver_done(Receiver *r) {
+        inflateEnd(&r->stream);
+}
+
+static void compress_message(Compressor *c, const char *message) {
+        struct iovec iovec[2] = {
+                { .iov_base = (char *) message, .iov_len = strlen(message) },
+                { .iov_base = (char *) "\n", .iov_len = 1 },
+        };
+
+        assert_int_equal(compressor_write(c, DEFAULT_COMPRESSION_LEVEL, iovec, 2), 0);
+}
+
+/* Test that the messages can be decompressed after every flush */
+static void test_compressor_flush(void **state) {
+        Compressor c = {};
+        Receiver r;
+
+        receiver_init(&r);
+
+        assert_int_equal(compressor_pending(&c), 0);
+
+        compress_message(&c, "<14>1 2026-01-01T00:00:00+00:00 host app 1 - - first");
+        compress_message(&c, "<14>1 2026-01-01T00:00:00+00:00 host app 1 - - second");
+        assert_int_equal(c.pending, 107);
+        assert_true(compressor_pending(&c) > 0);
+
+        assert_int_equal(compressor_flush(&c), 0);
+        assert_int_equal(c.pending, 0);
+        assert_true(c.output_size > 0);
+
+        receiver_feed(&r, c.output, c.output_size);
+        c.output_size = 0;
+        assert_int_equal(r.size, 107);
+        assert_memory_equal(r.data, "<14>1 2026-01-01T00:00:00+00:00 host app 1 - - first\n", 53);
+
+        /* Flushing without new input produces nothing */
+        assert_int_equal(compressor_flush(&c), 0);
+        assert_int_equal(c.output_size, 0);
+
+        /* The stream goes on where it was */
+        compress_message(&c, "<14>1 2026-01-01T00:00:00+00:00 host app 1 - - third");
+        assert_int_equal(compressor_flush(&c), 0);
+        receiver_feed(&r, c.output, c.output_size);
+        assert_int_equal(r.size, 160);
+        assert_memory_equal(r.data + 107, "<14>1 2026-01-01T00:00:00+00:00 host app 1 - - third\n", 53);
+
+        assert_int_equal(c.n_in, 160);
+
+        receiver_done(&r);
+        compressor_free(&c);
+}
+
+/* Test that repetitive messages shrink, and that the output can be taken in any pieces */
+static void test_compressor_ratio(void **state) {
+        Compressor c = {};
+        Receiver r;
+        char message[128];
+
+        receiver_init(&r);
+
+        for (unsigned i = 0; i < 2000; i++) {
+                xsprintf(message, "<30>1 2026-01-01T00:00:%02u.%06u+00:00 host nginx 812 - - GET /index.html 200", i % 60, i);
+                compress_message(&c, message);
+        }
+
+        assert_int_equal(compressor_flush(&c), 0);
+        assert_true(c.n_out * 5 < c.n_in);
+
+        for (size_t i = 0; i < c.output_size; i += 1000)
+                receiver_feed(&r, c.output + i, MIN(c.output_size - i, (size_t) 1000));
+
+        assert_int_equal(r.size, c.n_in);
+        assert_memory_equal(r.data + r.size - 5, " 200\n", 5);
+
+        receiver_done(&r);
+        compressor_free(&c);
+}
+
+/* Test that a reset starts a new stream, as needed for a new connection */
+static void test_compressor_reset(void **state) {
+        Compressor c = {};
+        Receiver r;
+
+        compress_message(&c, "before");
+        assert_int_equal(compressor_flush(&c), 0);
+
+        compressor_reset(&c);
+        assert_int_equal(compressor_pending(&c), 0);
+
+        receiver_init(&r);
+        compress_message(&c, "after");
+        assert_int_equal(compressor_flush(&c), 0);
+        receiver_feed(&r, c.output, c.output_size);
+        assert_int_equal(r.size, 6);
+        assert_memory_equal(r.data, "after\n", 6);
+
+        receiver_done(&r);
+        compressor_free(&c);
+}
+
+static void test_compression_string_table(void **state) {
+        assert_string_equal(compression_to_string(COMPRESSION_NO), "no");
+        assert_string_equal(compression_to_string(COMPRESSION_ZLIB), "zlib");
+
+        assert_int_equal(compression_from_string("zlib"), COMPRESSION_ZLIB);
+        assert_int_equal(compression_from_string("yes"), COMPRESSION_ZLIB);
+        assert_int_equal(compression_from_string("off"), COMPRESSION_NO);
+
+        assert_true(compression_from_string("zstd") < 0);
+}
+
+int main(void) {
+        const struct CMUnitTest tests[] = {
+                cmocka_unit_test(test_compressor_flush),
+                cmocka_unit_test(test_compressor_ratio),
+                cmocka_unit_test(test_compressor_reset),
+                cmocka_unit_test(test_compression_string_table),
+        };
+
+        return cmocka_run_group_tests(tests, NULL, NULL);
+}
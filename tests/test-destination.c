@@ -0,0 +1,155 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "netlog-destination.h"
+
+#define N_PEERS 3U
+
+typedef struct Group {
+        Manager manager;
+        Destination destination;
+        Peer peers[N_PEERS];
+} Group;
+
+/* Three connected UDP peers in the order they were configured, with nothing pending */
+static void group_init(Group *g, LoadBalancing load_balancing) {
+        *g = (Group) {
+                .destination = {
+                        .name = (char *) "test",
+                        .protocol = SYSLOG_TRANSMISSION_PROTOCOL_UDP,
+                        .load_balancing = load_balancing,
+                        .n_peers = N_PEERS,
+                },
+        };
+
+        g->destination.manager = &g->manager;
+
+        for (unsigned i = N_PEERS; i > 0; i--) {
+                Peer *p = &g->peers[i - 1];
+
+                *p = (Peer) {
+                        .destination = &g->destination,
+                        .name = (char *) "test",
+                        .socket = -1,
+                        .connected = true,
+                };
+
+                LIST_PREPEND(peers, g->destination.peers, p);
+        }
+}
+
+/* The index of the peer picked for the next message, -1 if there is none */
+static int pick_peer(Group *g) {
+        Peer *p;
+
+        p = destination_pick_peer(&g->destination);
+        if (!p)
+                return -1;
+
+        return p - g->peers;
+}
+
+/* Test that failover sticks to the first peer listed and only moves on while it is unusable */
+static void test_pick_peer_failover(void **state) {
+        Group g;
+
+        group_init(&g, LOAD_BALANCING_FAILOVER);
+
+        assert_int_equal(pick_peer(&g), 0);
+        assert_int_equal(pick_peer(&g), 0);
+
+        /* Failed peers are disconnected until they are back */
+        g.peers[0].connected = false;
+        assert_int_equal(pick_peer(&g), 1);
+
+        g.peers[1].congested = true;
+        assert_int_equal(pick_peer(&g), 2);
+
+        g.peers[0].connected = true;
+        assert_int_equal(pick_peer(&g), 0);
+}
+
+/* Test that round-robin takes the peers in turn, wrapping around and skipping unusable ones */
+static void test_pick_peer_round_robin(void **state) {
+        Group g;
+
+        group_init(&g, LOAD_BALANCING_ROUND_ROBIN);
+
+        for (unsigned i = 0; i < 2 * N_PEERS; i++)
+                assert_int_equal(pick_peer(&g), i % N_PEERS);
+
+        g.peers[1].connected = false;
+        assert_int_equal(pick_peer(&g), 0);
+        assert_int_equal(pick_peer(&g), 2);
+        assert_int_equal(pick_peer(&g), 0);
+
+        g.peers[2].congested = true;
+        assert_int_equal(pick_peer(&g), 0);
+        assert_int_equal(pick_peer(&g), 0);
+
+        g.peers[1].connected = true;
+        assert_int_equal(pick_peer(&g), 1);
+        assert_int_equal(pick_peer(&g), 0);
+}
+
+/* Test that least-queued picks the peer with the least output pending, the first one listed on ties */
+static void test_pick_peer_least_queued(void **state) {
+        Group g;
+
+        group_init(&g, LOAD_BALANCING_LEAST_QUEUED);
+
+        assert_int_equal(pick_peer(&g), 0);
+
+        g.peers[0].batch_buffer_size = 300;
+        g.peers[1].batch_buffer_size = 200;
+        g.peers[2].batch_buffer_size = 100;
+        assert_int_equal(pick_peer(&g), 2);
+
+        g.peers[2].congested = true;
+        assert_int_equal(pick_peer(&g), 1);
+
+        g.peers[1].connected = false;
+        assert_int_equal(pick_peer(&g), 0);
+
+        g.peers[1].connected = true;
+        g.peers[1].batch_buffer_size = 300;
+        assert_int_equal(pick_peer(&g), 0);
+}
+
+/* Test that with all peers congested the message still goes to a connected one, unless there is a spool to
+ * keep it, and that nothing is picked without a connection */
+static void test_pick_peer_unusable(void **state) {
+        Group g;
+
+        for (LoadBalancing l = 0; l < _LOAD_BALANCING_MAX; l++) {
+                group_init(&g, l);
+
+                g.peers[0].connected = false;
+                g.peers[1].congested = true;
+                g.peers[2].congested = true;
+                assert_int_equal(pick_peer(&g), 1);
+
+                g.peers[1].connected = g.peers[2].connected = false;
+                assert_int_equal(pick_peer(&g), -1);
+        }
+
+        group_init(&g, LOAD_BALANCING_FAILOVER);
+        g.destination.spool = (Spool *) &g;
+        g.peers[0].congested = g.peers[1].congested = g.peers[2].congested = true;
+        assert_int_equal(pick_peer(&g), -1);
+}
+
+int main(void) {
+        const struct CMUnitTest tests[] = {
+                cmocka_unit_test(test_pick_peer_failover),
+                cmocka_unit_test(test_pick_peer_round_robin),
+                cmocka_unit_test(test_pick_peer_least_queued),
+                cmocka_unit_test(test_pick_peer_unusable),
+        };
+
+        return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,125 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <string.h>
+
+#include "netlog-filter.h"
+
+/* A journal entry as a NULL terminated list of FIELD=value strings */
+static int entry_get_data(void *userdata, const char *field, const void **ret_data, size_t *ret_size) {
+        const char **entry = userdata;
+        size_t n = strlen(field);
+
+        for (; *entry; entry++)
+                if (strncmp(*entry, field, n) == 0 && (*entry)[n] == '=') {
+                        *ret_data = *entry;
+                        *ret_size = strlen(*entry);
+                        return 0;
+                }
+
+        return -ENOENT;
+}
+
+static int match(Filter *f, const char **entry) {
+        return filter_match(f, entry_get_data, entry);
+}
+
+/* Test that rules are parsed and invalid ones refused */
+static void test_filter_add_rule(void **state) {
+        Filter f = {};
+
+        assert_true(filter_empty(&f));
+
+        assert_int_equal(filter_add_rule(&f, FILTER_INCLUDE, "_SYSTEMD_UNIT=nginx.service"), 0);
+        assert_int_equal(filter_add_rule(&f, FILTER_INCLUDE, "_SYSTEMD_UNIT=sshd.service"), 0);
+        assert_int_equal(filter_add_rule(&f, FILTER_EXCLUDE, "MESSAGE~^DEBUG"), 0);
+        assert_int_equal(filter_add_rule(&f, FILTER_EXCLUDE, "PRIORITY="), 0);
+        assert_int_equal(f.n_fields, 3);
+        assert_int_equal(f.n_rules[FILTER_INCLUDE], 2);
+        assert_int_equal(f.n_rules[FILTER_EXCLUDE], 2);
+
+        /* Duplicates are merged */
+        assert_int_equal(filter_add_rule(&f, FILTER_INCLUDE, "_SYSTEMD_UNIT=nginx.service"), 0);
+        assert_int_equal(f.n_rules[FILTER_INCLUDE], 2);
+
+        assert_int_equal(filter_add_rule(&f, FILTER_INCLUDE, "MESSAGE"), -EINVAL);
+        assert_int_equal(filter_add_rule(&f, FILTER_INCLUDE, "=x"), -EINVAL);
+        assert_int_equal(filter_add_rule(&f, FILTER_INCLUDE, "message=x"), -EINVAL);
+        assert_int_equal(filter_add_rule(&f, FILTER_INCLUDE, "1FIELD=x"), -EINVAL);
+        assert_int_equal(filter_add_rule(&f, FILTER_INCLUDE, "NEW_FIELD~("), -EINVAL);
+        assert_int_equal(f.n_fields, 3);
+
+        filter_clear(&f, FILTER_INCLUDE);
+        assert_int_equal(f.n_fields, 2);
+        assert_int_equal(f.n_rules[FILTER_INCLUDE], 0);
+
+        filter_done(&f);
+        assert_true(filter_empty(&f));
+}
+
+/* Test include and exclude rules on exact values */
+static void test_filter_match_values(void **state) {
+        const char *nginx[] = { "_SYSTEMD_UNIT=nginx.service", "_TRANSPORT=journal", "MESSAGE=GET /", NULL };
+        const char *sshd[] = { "_SYSTEMD_UNIT=sshd.service", "_TRANSPORT=syslog", "MESSAGE=Accepted", NULL };
+        const char *kernel[] = { "_TRANSPORT=kernel", "MESSAGE=Oops", NULL };
+        const char *prefix[] = { "_SYSTEMD_UNIT=nginx.servic", NULL };
+        Filter f = {};
+
+        /* Without rules everything is forwarded */
+        assert_int_equal(match(&f, nginx), 1);
+        assert_false(filter_include_exact(&f));
+
+        assert_int_equal(filter_add_rule(&f, FILTER_EXCLUDE, "_TRANSPORT=kernel"), 0);
+        assert_int_equal(match(&f, nginx), 1);
+        assert_int_equal(match(&f, kernel), 0);
+
+        assert_int_equal(filter_add_rule(&f, FILTER_INCLUDE, "_SYSTEMD_UNIT=nginx.service"), 0);
+        assert_int_equal(filter_add_rule(&f, FILTER_INCLUDE, "_SYSTEMD_UNIT=cron.service"), 0);
+        assert_int_equal(match(&f, nginx), 1);
+        assert_int_equal(match(&f, sshd), 0);
+        assert_int_equal(match(&f, kernel), 0);
+        assert_int_equal(match(&f, prefix), 0);
+
+        /* Any include rule will do, also on another field */
+        assert_int_equal(filter_add_rule(&f, FILTER_INCLUDE, "_TRANSPORT=syslog"), 0);
+        assert_int_equal(match(&f, sshd), 1);
+
+        /* Exclusions win */
+        assert_int_equal(filter_add_rule(&f, FILTER_EXCLUDE, "_SYSTEMD_UNIT=sshd.service"), 0);
+        assert_int_equal(match(&f, sshd), 0);
+
+        filter_done(&f);
+}
+
+/* Test rules with regular expressions */
+static void test_filter_match_regex(void **state) {
+        const char *debug[] = { "MESSAGE=DEBUG: connection reset", NULL };
+        const char *error[] = { "MESSAGE=connection reset by peer", NULL };
+        const char *other[] = { "MESSAGE=started", NULL };
+        Filter f = {};
+
+        assert_int_equal(filter_add_rule(&f, FILTER_INCLUDE, "_TRANSPORT=kernel"), 0);
+        assert_true(filter_include_exact(&f));
+        assert_int_equal(filter_add_rule(&f, FILTER_INCLUDE, "MESSAGE~connection (reset|refused)"), 0);
+        assert_false(filter_include_exact(&f));
+        assert_int_equal(filter_add_rule(&f, FILTER_EXCLUDE, "MESSAGE~^DEBUG:"), 0);
+
+        assert_int_equal(match(&f, debug), 0);
+        assert_int_equal(match(&f, error), 1);
+        assert_int_equal(match(&f, other), 0);
+
+        filter_done(&f);
+}
+
+int main(void) {
+        const struct CMUnitTest tests[] = {
+                cmocka_unit_test(test_filter_add_rule),
+                cmocka_unit_test(test_filter_match_values),
+                cmocka_unit_test(test_filter_match_regex),
+        };
+
+        return cmocka_run_group_tests(tests, NULL, NULL);
+}
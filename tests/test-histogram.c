@@ -0,0 +1,103 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "netlog-histogram.h"
+
+/* Test that an empty histogram reports nothing */
+static void test_histogram_empty(void **state) {
+        LatencyHistogram h = {};
+
+        assert_int_equal(latency_histogram_quantile(&h, 0.5), 0);
+        assert_int_equal(latency_histogram_quantile(&h, 1.0), 0);
+        assert_int_equal(latency_histogram_count_at_most(&h, USEC_PER_SEC), 0);
+}
+
+/* Test that small values get a bucket each */
+static void test_histogram_small(void **state) {
+        LatencyHistogram h = {};
+
+        for (usec_t v = 0; v < 32; v++)
+                latency_histogram_record(&h, v);
+
+        assert_int_equal(h.count, 32);
+        assert_int_equal(h.sum, 31 * 32 / 2);
+        assert_int_equal(h.max, 31);
+
+        assert_int_equal(latency_histogram_quantile(&h, 0.0), 0);
+        assert_int_equal(latency_histogram_quantile(&h, 0.5), 15);
+        assert_int_equal(latency_histogram_quantile(&h, 1.0), 31);
+
+        for (usec_t v = 0; v <= 32; v++)
+                assert_int_equal(latency_histogram_count_at_most(&h, v), MIN(v + 1, (usec_t) 32));
+}
+
+/* Test that quantiles err on the high side by no more than the bucket width */
+static void test_histogram_quantile_error(void **state) {
+        static const double quantiles[] = { 0.1, 0.5, 0.9, 0.99, 0.999 };
+        LatencyHistogram h = {};
+
+        for (usec_t v = 1; v <= 1000000; v++)
+                latency_histogram_record(&h, v);
+
+        for (size_t i = 0; i < ELEMENTSOF(quantiles); i++) {
+                usec_t exact = quantiles[i] * 1000000, q;
+
+                q = latency_histogram_quantile(&h, quantiles[i]);
+                assert_true(q >= exact);
+                assert_true(q <= exact + exact / LATENCY_HISTOGRAM_SUB_COUNT);
+        }
+
+        assert_int_equal(latency_histogram_quantile(&h, 1.0), 1000000);
+}
+
+/* Test that powers of two are exact bucket boundaries, with values equal to them counted */
+static void test_histogram_count_at_most(void **state) {
+        LatencyHistogram h = {};
+
+        for (usec_t v = 0; v < 100000; v++)
+                latency_histogram_record(&h, v * 37);
+
+        for (unsigned bits = 0; bits < 30; bits++) {
+                usec_t bound = UINT64_C(1) << bits;
+
+                assert_int_equal(latency_histogram_count_at_most(&h, bound), MIN(bound / 37 + 1, (usec_t) 100000));
+        }
+
+        /* Right on the bound and just past it */
+        h = (LatencyHistogram) {};
+        latency_histogram_record(&h, 1024);
+        latency_histogram_record(&h, 1025);
+        assert_int_equal(latency_histogram_count_at_most(&h, 512), 0);
+        assert_int_equal(latency_histogram_count_at_most(&h, 1024), 1);
+        assert_int_equal(latency_histogram_count_at_most(&h, 2048), 2);
+}
+
+/* Test that values beyond the range end up in the last bucket */
+static void test_histogram_overflow(void **state) {
+        LatencyHistogram h = {};
+
+        latency_histogram_record(&h, 5);
+        latency_histogram_record(&h, LATENCY_HISTOGRAM_MAX_USEC * 4);
+
+        assert_int_equal(h.count, 2);
+        assert_int_equal(latency_histogram_quantile(&h, 0.5), 5);
+        assert_int_equal(latency_histogram_quantile(&h, 1.0), LATENCY_HISTOGRAM_MAX_USEC * 4);
+        assert_int_equal(latency_histogram_count_at_most(&h, LATENCY_HISTOGRAM_MAX_USEC), 1);
+        assert_int_equal(h.buckets[LATENCY_HISTOGRAM_BUCKETS - 1], 1);
+}
+
+int main(void) {
+        const struct CMUnitTest tests[] = {
+                cmocka_unit_test(test_histogram_empty),
+                cmocka_unit_test(test_histogram_small),
+                cmocka_unit_test(test_histogram_quantile_error),
+                cmocka_unit_test(test_histogram_count_at_most),
+                cmocka_unit_test(test_histogram_overflow),
+        };
+
+        return cmocka_run_group_tests(tests, NULL, NULL);
+}
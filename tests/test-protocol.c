@@ -5,17 +5,21 @@
 #include <setjmp.h>
 #include <cmocka.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/time.h>
+#include <syslog.h>
 #include <time.h>
 
+#include "alloc-util.h"
+#include "fd-util.h"
 #include "macro.h"
+#include "netlog-destination.h"
+#include "netlog-network.h"
+#include "netlog-protocol.h"
+#include "parse-util.h"
+#include "stdio-util.h"
 #include "time-util.h"
 
-#define FORMAT_TIMESTAMP_MAX ((4*4+1)+11+9+4+1) /* weekdays can be unicode */
-
-/* Forward declaration from netlog-protocol.c */
-void format_rfc3339_timestamp(const struct timeval *tv, char *header_time, size_t header_size);
-
 /* Test RFC 3339 timestamp formatting */
 static void test_format_rfc3339_timestamp(void **state) {
         char buf[FORMAT_TIMESTAMP_MAX];
@@ -62,11 +66,219 @@ static void test_rfc3339_timestamp_structure(void **state) {
         assert_non_null(strstr(buf, ".500000"));
 }
 
+/* Test that the cached formatter produces the same output as the uncached one */
+static void test_format_rfc3339_timestamp_cached(void **state) {
+        char buf[FORMAT_TIMESTAMP_MAX], cached[FORMAT_TIMESTAMP_MAX];
+        TimestampCache cache = {};
+        const struct timeval tvs[] = {
+                { .tv_sec = 1609459200, .tv_usec = 500000 },
+                { .tv_sec = 1609459200, .tv_usec = 7 },
+                { .tv_sec = 1609459201, .tv_usec = 0 },
+                { .tv_sec = 1234567890, .tv_usec = 999999 },
+                { .tv_sec = 1609459200, .tv_usec = 123456 },
+        };
+
+        for (size_t i = 0; i < ELEMENTSOF(tvs); i++) {
+                format_rfc3339_timestamp(&tvs[i], buf, sizeof(buf));
+                format_rfc3339_timestamp_cached(&cache, &tvs[i], cached, sizeof(cached));
+                assert_string_equal(cached, buf);
+        }
+
+        format_rfc3339_timestamp_cached(&cache, NULL, cached, sizeof(cached));
+        assert_null(strchr(cached, '.'));
+}
+
+/* Test RFC 5424 formatting, with missing fields as NILVALUE and the newline framing of TCP */
+static void test_format_message_rfc5424(void **state) {
+        char ts[FORMAT_TIMESTAMP_MAX], expected[256];
+        TimestampCache cache = {};
+        OutputBuffer b = {};
+        Manager m = {};
+        Destination d = {
+                .manager = &m,
+                .protocol = SYSLOG_TRANSMISSION_PROTOCOL_TCP,
+                .log_format = SYSLOG_TRANSMISSION_LOG_FORMAT_RFC_5424,
+        };
+        struct timeval tv = {
+                .tv_sec = 1609459200,
+                .tv_usec = 500000,
+        };
+
+        format_rfc3339_timestamp(&tv, ts, sizeof(ts));
+
+        assert_int_equal(format_message(&d, &cache, &b, LOG_INFO, LOG_DAEMON >> 3, "test", "hello", "host", "42", &tv,
+                                        NULL, NULL), 0);
+
+        xsprintf(expected, "<30>1 %shost test 42 - - hello\n", ts);
+        assert_int_equal(b.size, strlen(expected));
+        assert_memory_equal(b.data, expected, b.size);
+
+        output_buffer_done(&b);
+}
+
+/* Test that the RFC 5425 length is right around the widths of the length, where the room reserved for it
+ * turns out too large */
+static void test_format_message_rfc5425(void **state) {
+        _cleanup_free_ char *message = NULL;
+        TimestampCache cache = {};
+        OutputBuffer b = {};
+        Manager m = {};
+        Destination d = {
+                .manager = &m,
+                .protocol = SYSLOG_TRANSMISSION_PROTOCOL_TLS,
+                .log_format = SYSLOG_TRANSMISSION_LOG_FORMAT_RFC_5425,
+        };
+        struct timeval tv = {
+                .tv_sec = 1609459200,
+                .tv_usec = 7,
+        };
+
+        message = malloc(1100);
+        assert_non_null(message);
+
+        for (size_t n = 0; n < 1100; n++) {
+                unsigned length;
+                char *space;
+
+                memset(message, 'x', n);
+                message[n] = 0;
+
+                b.size = 0;
+                assert_int_equal(format_message(&d, &cache, &b, LOG_INFO, LOG_DAEMON >> 3, "test", message, "host", NULL,
+                                                &tv, NULL, NULL), 0);
+
+                space = memchr(b.data, ' ', b.size);
+                assert_non_null(space);
+                *space = 0;
+                assert_int_equal(safe_atou(b.data, &length), 0);
+                assert_int_equal(length, b.size - (space - b.data) - 1);
+                assert_memory_equal(space + 1, "<30>1 ", 6);
+                assert_memory_equal(b.data + b.size - n, message, n);
+        }
+
+        output_buffer_done(&b);
+}
+
+/* Test that RFC 5425 refuses messages whose length doesn't fit, and leaves the buffer as it was */
+static void test_format_message_rfc5425_too_large(void **state) {
+        _cleanup_free_ char *message = NULL;
+        TimestampCache cache = {};
+        OutputBuffer b = {};
+        Manager m = {};
+        size_t size;
+        Destination d = {
+                .manager = &m,
+                .protocol = SYSLOG_TRANSMISSION_PROTOCOL_TCP,
+                .log_format = SYSLOG_TRANSMISSION_LOG_FORMAT_RFC_5425,
+        };
+
+        message = malloc(1000001);
+        assert_non_null(message);
+        memset(message, 'x', 1000000);
+        message[1000000] = 0;
+
+        assert_int_equal(format_message(&d, &cache, &b, LOG_INFO, LOG_DAEMON >> 3, "test", "hello", NULL, NULL, NULL,
+                                        NULL, NULL), 0);
+        size = b.size;
+
+        assert_int_equal(format_message(&d, &cache, &b, LOG_INFO, LOG_DAEMON >> 3, "test", message, NULL, NULL, NULL,
+                                        NULL, NULL), -EMSGSIZE);
+        assert_int_equal(b.size, size);
+
+        output_buffer_done(&b);
+}
+
+/* Test that RFC 3164 messages are serialized back to back */
+static void test_format_message_rfc3164_back_to_back(void **state) {
+        char ts[FORMAT_TIMESTAMP_MAX], expected[512];
+        TimestampCache cache = {};
+        OutputBuffer b = {};
+        Manager m = {};
+        Destination d = {
+                .manager = &m,
+                .protocol = SYSLOG_TRANSMISSION_PROTOCOL_UDP,
+                .log_format = SYSLOG_TRANSMISSION_LOG_FORMAT_RFC_3164,
+        };
+        struct timeval tv = {
+                .tv_sec = 1234567890,
+                .tv_usec = 123456,
+        };
+
+        format_rfc3339_timestamp(&tv, ts, sizeof(ts));
+
+        assert_int_equal(format_message(&d, &cache, &b, LOG_ERR, LOG_AUTH >> 3, "sshd", "first", "host", "1", &tv,
+                                        NULL, NULL), 0);
+        assert_int_equal(format_message(&d, &cache, &b, LOG_DEBUG, 0, NULL, "second", NULL, NULL, &tv,
+                                        NULL, NULL), 0);
+
+        xsprintf(expected, "<35>%shost sshd[1]: first<7>%s- -[-]: second", ts, ts);
+        assert_int_equal(b.size, strlen(expected));
+        assert_memory_equal(b.data, expected, b.size);
+
+        output_buffer_done(&b);
+}
+
+/* Test that a message too large for RFC 5425 is skipped when sending without workers, rather than failing the
+ * entry, which would have the journal read it over and over again */
+static void test_push_to_network_too_large(void **state) {
+        _cleanup_free_ char *message = NULL;
+        char buf[256];
+        Manager m = {};
+        int pair[2];
+        Destination d = {
+                .manager = &m,
+                .name = (char *) "test",
+                .protocol = SYSLOG_TRANSMISSION_PROTOCOL_TCP,
+                .log_format = SYSLOG_TRANSMISSION_LOG_FORMAT_RFC_5425,
+        };
+        Peer p = {
+                .destination = &d,
+                .name = (char *) "test",
+                .connected = true,
+        };
+        ssize_t n;
+
+        assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, pair), 0);
+        p.socket = pair[0];
+
+        LIST_PREPEND(peers, d.peers, &p);
+        d.n_peers = 1;
+        LIST_PREPEND(destinations, m.destinations, &d);
+
+        message = malloc(1000001);
+        assert_non_null(message);
+        memset(message, 'x', 1000000);
+        message[1000000] = 0;
+
+        assert_int_equal(manager_push_to_network(&m, LOG_INFO, LOG_DAEMON >> 3, "test", message, "host", NULL, NULL,
+                                                 NULL, NULL), 0);
+        assert_int_equal(manager_push_to_network(&m, LOG_INFO, LOG_DAEMON >> 3, "test", "hello", "host", NULL, NULL,
+                                                 NULL, NULL), 1);
+
+        /* Only the second message went out, and only it counts */
+        n = recv(pair[1], buf, sizeof(buf), MSG_DONTWAIT);
+        assert_true(n > 0);
+        assert_int_equal(p.n_sent, 1);
+        assert_int_equal(m.n_entries_formatted, 1);
+        assert_true((size_t) n > strlen("hello"));
+        assert_memory_equal(buf + n - strlen("hello"), "hello", strlen("hello"));
+
+        output_buffer_done(&m.output);
+        safe_close(pair[0]);
+        safe_close(pair[1]);
+}
+
 int main(void) {
         const struct CMUnitTest tests[] = {
                 cmocka_unit_test(test_format_rfc3339_timestamp),
                 cmocka_unit_test(test_format_rfc3339_timestamp_null),
                 cmocka_unit_test(test_rfc3339_timestamp_structure),
+                cmocka_unit_test(test_format_rfc3339_timestamp_cached),
+                cmocka_unit_test(test_format_message_rfc5424),
+                cmocka_unit_test(test_format_message_rfc5425),
+                cmocka_unit_test(test_format_message_rfc5425_too_large),
+                cmocka_unit_test(test_format_message_rfc3164_back_to_back),
+                cmocka_unit_test(test_push_to_network_too_large),
         };
 
         return cmocka_run_group_tests(tests, NULL, NULL);
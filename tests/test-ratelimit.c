@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "netlog-ratelimit.h"
+
+#define T0 (100 * USEC_PER_SEC)
+
+static unsigned admit_many(SendRateLimit *l, int severity, size_t size, unsigned n, usec_t now) {
+        unsigned admitted = 0;
+
+        for (unsigned i = 0; i < n; i++)
+                if (send_rate_limit_admit(l, severity, size, now))
+                        admitted++;
+
+        return admitted;
+}
+
+/* Test that everything passes without limits */
+static void test_rate_limit_disabled(void **state) {
+        SendRateLimit l;
+
+        send_rate_limit_init(&l, 0, 0);
+        assert_false(send_rate_limit_enabled(&l));
+        assert_int_equal(admit_many(&l, LOG_DEBUG, 1000, 10000, T0), 10000);
+        assert_int_equal(send_rate_limit_dropped(&l), 0);
+}
+
+/* Test that a full bucket takes one second worth of messages, and refills over time */
+static void test_rate_limit_messages(void **state) {
+        SendRateLimit l;
+
+        send_rate_limit_init(&l, 100, 0);
+        assert_true(send_rate_limit_enabled(&l));
+
+        assert_int_equal(admit_many(&l, LOG_WARNING, 10, 150, T0), 100);
+        assert_int_equal(l.n_dropped[LOG_WARNING], 50);
+
+        assert_int_equal(admit_many(&l, LOG_WARNING, 10, 100, T0 + USEC_PER_SEC / 10), 10);
+
+        /* Refilling stops once the bucket is full */
+        assert_int_equal(admit_many(&l, LOG_WARNING, 10, 1000, T0 + 60 * USEC_PER_SEC), 100);
+}
+
+/* Test that the byte budget applies too, with oversized messages costing one second worth */
+static void test_rate_limit_bytes(void **state) {
+        SendRateLimit l;
+
+        send_rate_limit_init(&l, 0, 1000);
+
+        assert_int_equal(admit_many(&l, LOG_WARNING, 100, 20, T0), 10);
+        assert_int_equal(admit_many(&l, LOG_WARNING, 100000, 2, T0 + USEC_PER_SEC), 1);
+}
+
+/* Test that low severities are shed first and errors are never dropped */
+static void test_rate_limit_severity(void **state) {
+        SendRateLimit l;
+
+        send_rate_limit_init(&l, 100, 0);
+
+        /* Debug only gets the top quarter of the budget, info the top half */
+        assert_int_equal(admit_many(&l, LOG_DEBUG, 10, 100, T0), 25);
+        assert_int_equal(admit_many(&l, LOG_INFO, 10, 100, T0), 25);
+        assert_int_equal(admit_many(&l, LOG_NOTICE, 10, 100, T0), 25);
+        assert_int_equal(admit_many(&l, LOG_WARNING, 10, 100, T0), 25);
+
+        assert_int_equal(admit_many(&l, LOG_ERR, 10, 100, T0), 100);
+        assert_int_equal(admit_many(&l, LOG_EMERG, 10, 100, T0), 100);
+
+        assert_int_equal(l.n_dropped[LOG_DEBUG], 75);
+        assert_int_equal(l.n_dropped[LOG_INFO], 75);
+        assert_int_equal(l.n_dropped[LOG_ERR], 0);
+        assert_int_equal(send_rate_limit_dropped(&l), 300);
+
+        /* Errors overdraw the budget by at most one second worth */
+        assert_int_equal(admit_many(&l, LOG_WARNING, 10, 100, T0 + USEC_PER_SEC), 0);
+        assert_int_equal(admit_many(&l, LOG_WARNING, 10, 100, T0 + USEC_PER_SEC + USEC_PER_SEC / 10), 10);
+}
+
+int main(void) {
+        const struct CMUnitTest tests[] = {
+                cmocka_unit_test(test_rate_limit_disabled),
+                cmocka_unit_test(test_rate_limit_messages),
+                cmocka_unit_test(test_rate_limit_bytes),
+                cmocka_unit_test(test_rate_limit_severity),
+        };
+
+        return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,103 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <errno.h>
+#include <string.h>
+
+#include "netlog-relp.h"
+
+#define PARSE(s, f) relp_parse_frame((s), strlen(s), (f))
+
+/* Test parsing of complete frames */
+static void test_relp_parse_frame(void **state) {
+        const char *buf = "12 rsp 6 200 OK\n1 serverclose 0\n";
+        RelpFrame f;
+        int n;
+
+        n = PARSE(buf, &f);
+        assert_int_equal(n, strlen("12 rsp 6 200 OK\n"));
+        assert_int_equal(f.txnr, 12);
+        assert_int_equal(f.command_len, 3);
+        assert_memory_equal(f.command, "rsp", 3);
+        assert_int_equal(f.data_len, 6);
+        assert_memory_equal(f.data, "200 OK", 6);
+
+        /* Frames without data leave out the separator */
+        assert_int_equal(PARSE(buf + n, &f), strlen("1 serverclose 0\n"));
+        assert_int_equal(f.txnr, 1);
+        assert_int_equal(f.command_len, strlen("serverclose"));
+        assert_int_equal(f.data_len, 0);
+
+        /* The data may contain line feeds */
+        assert_int_equal(PARSE("1 rsp 8 200 OK\nx\n", &f), 17);
+        assert_int_equal(f.data_len, 8);
+}
+
+/* Test that incomplete frames ask for more data */
+static void test_relp_parse_frame_incomplete(void **state) {
+        const char *buf = "12 rsp 6 200 OK\n";
+        RelpFrame f;
+
+        for (size_t i = 0; i < strlen(buf); i++)
+                assert_int_equal(relp_parse_frame(buf, i, &f), 0);
+
+        assert_int_equal(relp_parse_frame(NULL, 0, &f), 0);
+}
+
+/* Test that malformed frames are refused */
+static void test_relp_parse_frame_invalid(void **state) {
+        RelpFrame f;
+
+        assert_int_equal(PARSE(" rsp 6 200 OK\n", &f), -EBADMSG);
+        assert_int_equal(PARSE("x rsp 6 200 OK\n", &f), -EBADMSG);
+        assert_int_equal(PARSE("12  6 200 OK\n", &f), -EBADMSG);
+        assert_int_equal(PARSE("12 rsp x 200 OK\n", &f), -EBADMSG);
+        assert_int_equal(PARSE("12 rsp 6 200 OK!\n", &f), -EBADMSG);
+        assert_int_equal(PARSE("1234567890 rsp 0\n", &f), -EBADMSG);
+        assert_int_equal(PARSE("1 rspppppppppppppppppppppppppppppppppppppp 0\n", &f), -EBADMSG);
+}
+
+/* Test parsing of responses */
+static void test_relp_parse_response(void **state) {
+        const char *text;
+        size_t text_len;
+        unsigned code;
+        RelpFrame f;
+
+        assert_true(PARSE("1 rsp 6 200 OK\n", &f) > 0);
+        assert_int_equal(relp_parse_response(&f, &code, &text, &text_len), 0);
+        assert_int_equal(code, 200);
+        assert_int_equal(text_len, 2);
+        assert_memory_equal(text, "OK", 2);
+
+        /* The offers following the text of the response to "open" are not part of it */
+        assert_true(PARSE("1 rsp 31 200 OK\nrelp_version=0\ncommands=\n", &f) > 0);
+        assert_int_equal(relp_parse_response(&f, &code, &text, &text_len), 0);
+        assert_int_equal(code, 200);
+        assert_int_equal(text_len, 2);
+
+        assert_true(PARSE("2 rsp 3 500\n", &f) > 0);
+        assert_int_equal(relp_parse_response(&f, &code, NULL, &text_len), 0);
+        assert_int_equal(code, 500);
+        assert_int_equal(text_len, 0);
+
+        assert_true(PARSE("2 rsp 2 20\n", &f) > 0);
+        assert_int_equal(relp_parse_response(&f, &code, NULL, NULL), -EBADMSG);
+
+        assert_true(PARSE("2 rsp 4 2000\n", &f) > 0);
+        assert_int_equal(relp_parse_response(&f, &code, NULL, NULL), -EBADMSG);
+}
+
+int main(void) {
+        const struct CMUnitTest tests[] = {
+                cmocka_unit_test(test_relp_parse_frame),
+                cmocka_unit_test(test_relp_parse_frame_incomplete),
+                cmocka_unit_test(test_relp_parse_frame_invalid),
+                cmocka_unit_test(test_relp_parse_response),
+        };
+
+        return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,209 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "iovec-util.h"
+#include "netlog-spool.h"
+
+static void remove_spool(const char *directory) {
+        struct dirent *de;
+        DIR *d;
+
+        d = opendir(directory);
+        if (!d)
+                return;
+
+        while ((de = readdir(d)))
+                if (de->d_name[0] != '.')
+                        (void) unlinkat(dirfd(d), de->d_name, 0);
+
+        closedir(d);
+        (void) rmdir(directory);
+}
+
+static int setup(void **state) {
+        char *directory;
+
+        directory = strdup("/tmp/test-spool-XXXXXX");
+        if (!directory || !mkdtemp(directory))
+                return -1;
+
+        *state = directory;
+        return 0;
+}
+
+static int teardown(void **state) {
+        char *directory = *state;
+
+        remove_spool(directory);
+        free(directory);
+        return 0;
+}
+
+static void append_message(Spool *s, unsigned i, int expected) {
+        char buf[64];
+        struct iovec iovec[2];
+
+        snprintf(buf, sizeof(buf), "%u", i);
+        iovec[0] = IOVEC_MAKE_STRING("<13>1 - host app - - - message ");
+        iovec[1] = IOVEC_MAKE_STRING(buf);
+
+        assert_int_equal(spool_append(s, iovec, 2), expected);
+}
+
+static unsigned read_message(Spool *s) {
+        struct iovec iovec;
+        char buf[64] = {};
+        unsigned i;
+
+        assert_int_equal(spool_peek(s, &iovec), 1);
+        assert_true(iovec.iov_len < sizeof(buf));
+        memcpy(buf, iovec.iov_base, iovec.iov_len);
+        assert_int_equal(sscanf(buf, "<13>1 - host app - - - message %u", &i), 1);
+        spool_advance(s);
+
+        return i;
+}
+
+/* Test that messages come out in order, and rewinding goes back to the last commit */
+static void test_spool_append_peek(void **state) {
+        _cleanup_(spool_freep) Spool *s = NULL;
+        struct iovec iovec;
+
+        assert_int_equal(spool_open(*state, SPOOL_SIZE_MIN, &s), 0);
+        assert_int_equal(spool_peek(s, &iovec), 0);
+
+        for (unsigned i = 0; i < 10; i++)
+                append_message(s, i, 0);
+
+        for (unsigned i = 0; i < 5; i++)
+                assert_int_equal(read_message(s), i);
+        spool_commit(s);
+
+        assert_int_equal(read_message(s), 5);
+        assert_int_equal(read_message(s), 6);
+        spool_rewind(s);
+
+        for (unsigned i = 5; i < 10; i++)
+                assert_int_equal(read_message(s), i);
+        assert_int_equal(spool_peek(s, &iovec), 0);
+}
+
+/* Test that the spool refuses messages once full, and takes them again after delivery */
+static void test_spool_full(void **state) {
+        _cleanup_(spool_freep) Spool *s = NULL;
+        struct iovec iovec;
+        unsigned n = 0;
+
+        assert_int_equal(spool_open(*state, SPOOL_SIZE_MIN, &s), 0);
+
+        for (;; n++) {
+                char buf[64];
+                int r;
+
+                snprintf(buf, sizeof(buf), "<13>1 - host app - - - message %u", n);
+                r = spool_append(s, &IOVEC_MAKE_STRING(buf), 1);
+                if (r < 0) {
+                        assert_int_equal(r, -ENOBUFS);
+                        break;
+                }
+        }
+        assert_true(n > 1000);
+
+        for (unsigned i = 0; i < n; i++) {
+                assert_int_equal(read_message(s), i);
+                spool_commit(s);
+        }
+        assert_int_equal(spool_peek(s, &iovec), 0);
+
+        append_message(s, n, 0);
+        assert_int_equal(read_message(s), n);
+}
+
+/* Test that the read position survives reopening the spool */
+static void test_spool_reopen(void **state) {
+        _cleanup_(spool_freep) Spool *s = NULL;
+        struct iovec iovec;
+
+        assert_int_equal(spool_open(*state, SPOOL_SIZE_MIN, &s), 0);
+
+        for (unsigned i = 0; i < 10; i++)
+                append_message(s, i, 0);
+
+        assert_int_equal(read_message(s), 0);
+        assert_int_equal(read_message(s), 1);
+        spool_commit(s);
+        assert_int_equal(read_message(s), 2);
+
+        s = spool_free(s);
+        assert_int_equal(spool_open(*state, SPOOL_SIZE_MIN, &s), 0);
+
+        for (unsigned i = 2; i < 10; i++)
+                assert_int_equal(read_message(s), i);
+        assert_int_equal(spool_peek(s, &iovec), 0);
+}
+
+/* Test that syncing covers segments filled up, delivered and removed in the meantime */
+static void test_spool_sync(void **state) {
+        _cleanup_(spool_freep) Spool *s = NULL;
+        struct iovec iovec;
+
+        assert_int_equal(spool_open(*state, SPOOL_SIZE_MIN, &s), 0);
+        assert_int_equal(spool_sync(s), 0);
+
+        append_message(s, 0, 0);
+        assert_int_equal(spool_sync(s), 0);
+        assert_int_equal(spool_sync(s), 0);
+
+        for (unsigned i = 1; i < 10000; i++)
+                append_message(s, i, 0);
+
+        for (unsigned i = 0; i < 5000; i++) {
+                assert_int_equal(read_message(s), i);
+                spool_commit(s);
+        }
+
+        assert_int_equal(spool_sync(s), 0);
+
+        s = spool_free(s);
+        assert_int_equal(spool_open(*state, SPOOL_SIZE_MIN, &s), 0);
+
+        for (unsigned i = 5000; i < 10000; i++) {
+                assert_int_equal(read_message(s), i);
+                spool_commit(s);
+        }
+        assert_int_equal(spool_peek(s, &iovec), 0);
+}
+
+/* Test that messages larger than the whole spool are refused */
+static void test_spool_too_large(void **state) {
+        _cleanup_(spool_freep) Spool *s = NULL;
+        _cleanup_free_ char *buf = NULL;
+
+        assert_int_equal(spool_open(*state, SPOOL_SIZE_MIN, &s), 0);
+
+        buf = calloc(1, SPOOL_SIZE_MIN);
+        assert_non_null(buf);
+
+        assert_int_equal(spool_append(s, &IOVEC_MAKE(buf, SPOOL_SIZE_MIN), 1), -EMSGSIZE);
+}
+
+int main(void) {
+        const struct CMUnitTest tests[] = {
+                cmocka_unit_test_setup_teardown(test_spool_append_peek, setup, teardown),
+                cmocka_unit_test_setup_teardown(test_spool_full, setup, teardown),
+                cmocka_unit_test_setup_teardown(test_spool_reopen, setup, teardown),
+                cmocka_unit_test_setup_teardown(test_spool_sync, setup, teardown),
+                cmocka_unit_test_setup_teardown(test_spool_too_large, setup, teardown),
+        };
+
+        return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -6,6 +6,7 @@
 #include <cmocka.h>
 #include <string.h>
 
+#include "netlog-destination.h"
 #include "netlog-manager.h"
 
 /* Test protocol string table conversions */
@@ -14,11 +15,13 @@ static void test_protocol_string_table(void **state) {
         assert_string_equal(protocol_to_string(SYSLOG_TRANSMISSION_PROTOCOL_TCP), "tcp");
         assert_string_equal(protocol_to_string(SYSLOG_TRANSMISSION_PROTOCOL_DTLS), "dtls");
         assert_string_equal(protocol_to_string(SYSLOG_TRANSMISSION_PROTOCOL_TLS), "tls");
+        assert_string_equal(protocol_to_string(SYSLOG_TRANSMISSION_PROTOCOL_RELP), "relp");
 
         assert_int_equal(protocol_from_string("udp"), SYSLOG_TRANSMISSION_PROTOCOL_UDP);
         assert_int_equal(protocol_from_string("tcp"), SYSLOG_TRANSMISSION_PROTOCOL_TCP);
         assert_int_equal(protocol_from_string("dtls"), SYSLOG_TRANSMISSION_PROTOCOL_DTLS);
         assert_int_equal(protocol_from_string("tls"), SYSLOG_TRANSMISSION_PROTOCOL_TLS);
+        assert_int_equal(protocol_from_string("relp"), SYSLOG_TRANSMISSION_PROTOCOL_RELP);
 
         /* Test invalid protocol - returns -1 when not found */
         assert_true(protocol_from_string("invalid") < 0);
@@ -40,6 +43,36 @@ static void test_log_format_string_table(void **state) {
         assert_null(log_format_to_string(999));
 }
 
+/* Test TLS session resumption string table conversions */
+static void test_ssl_session_resumption_string_table(void **state) {
+        assert_string_equal(ssl_session_resumption_to_string(SSL_SESSION_RESUMPTION_NO), "no");
+        assert_string_equal(ssl_session_resumption_to_string(SSL_SESSION_RESUMPTION_YES), "yes");
+        assert_string_equal(ssl_session_resumption_to_string(SSL_SESSION_RESUMPTION_PERSISTENT), "persistent");
+
+        assert_int_equal(ssl_session_resumption_from_string("persistent"), SSL_SESSION_RESUMPTION_PERSISTENT);
+
+        /* Booleans are accepted too */
+        assert_int_equal(ssl_session_resumption_from_string("false"), SSL_SESSION_RESUMPTION_NO);
+        assert_int_equal(ssl_session_resumption_from_string("on"), SSL_SESSION_RESUMPTION_YES);
+
+        assert_true(ssl_session_resumption_from_string("invalid") < 0);
+        assert_null(ssl_session_resumption_to_string(999));
+}
+
+/* Test load balancing string table conversions */
+static void test_load_balancing_string_table(void **state) {
+        assert_string_equal(load_balancing_to_string(LOAD_BALANCING_FAILOVER), "failover");
+        assert_string_equal(load_balancing_to_string(LOAD_BALANCING_ROUND_ROBIN), "round-robin");
+        assert_string_equal(load_balancing_to_string(LOAD_BALANCING_LEAST_QUEUED), "least-queued");
+
+        assert_int_equal(load_balancing_from_string("failover"), LOAD_BALANCING_FAILOVER);
+        assert_int_equal(load_balancing_from_string("round-robin"), LOAD_BALANCING_ROUND_ROBIN);
+        assert_int_equal(load_balancing_from_string("least-queued"), LOAD_BALANCING_LEAST_QUEUED);
+
+        assert_true(load_balancing_from_string("invalid") < 0);
+        assert_null(load_balancing_to_string(999));
+}
+
 /* Test syslog facility string table conversions */
 static void test_syslog_facility_string_table(void **state) {
         assert_string_equal(syslog_facility_to_string(SYSLOG_FACILITY_KERN), "kern");
@@ -82,6 +115,8 @@ int main(void) {
         const struct CMUnitTest tests[] = {
                 cmocka_unit_test(test_protocol_string_table),
                 cmocka_unit_test(test_log_format_string_table),
+                cmocka_unit_test(test_ssl_session_resumption_string_table),
+                cmocka_unit_test(test_load_balancing_string_table),
                 cmocka_unit_test(test_syslog_facility_string_table),
                 cmocka_unit_test(test_syslog_level_string_table),
         };
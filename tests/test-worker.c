@@ -0,0 +1,146 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <syslog.h>
+#include <systemd/sd-event.h>
+#include <unistd.h>
+
+#include "fd-util.h"
+#include "netlog-destination.h"
+#include "netlog-journal.h"
+#include "netlog-network.h"
+#include "netlog-protocol.h"
+#include "netlog-worker.h"
+
+#define N_BATCHES      8U
+#define LARGE_ENTRIES  WORKER_BATCH_ENTRIES
+#define LARGE_SIZE     2048U
+#define N_MESSAGES     (LARGE_ENTRIES + N_BATCHES - 1)
+
+/* Pulls the message numbers out of the newline framed RFC 5424 messages received so far */
+static void parse_messages(char *buf, size_t *size, unsigned *numbers, unsigned *n) {
+        char *p = buf, *nl;
+
+        while ((nl = memchr(p, '\n', buf + *size - p))) {
+                char *m;
+
+                *nl = 0;
+                m = strstr(p, " - - m");
+                assert_non_null(m);
+                assert_true(*n < N_MESSAGES);
+                numbers[(*n)++] = strtoul(m + strlen(" - - m"), NULL, 10);
+                p = nl + 1;
+        }
+
+        *size -= p - buf;
+        memmove(buf, p, *size);
+}
+
+/* Test that batches formatted by the workers in whatever order are sent in the order they were read, and
+ * that reading is paused with four batches per worker in flight and resumed once they are sent */
+static void test_worker_pool_order(void **state) {
+        _cleanup_(worker_pool_freep) WorkerPool *pool = NULL;
+        char directory[] = "/tmp/test-worker-XXXXXX";
+        unsigned numbers[N_MESSAGES], n = 0, k = 0;
+        static char buf[256 * 1024];
+        size_t size = 0;
+        int pair[2];
+        Manager m = {};
+        Destination d = {
+                .manager = &m,
+                .name = (char *) "test",
+                .protocol = SYSLOG_TRANSMISSION_PROTOCOL_TCP,
+                .log_format = SYSLOG_TRANSMISSION_LOG_FORMAT_RFC_5424,
+        };
+        Peer p = {
+                .destination = &d,
+                .name = (char *) "test",
+                .connected = true,
+        };
+        JournalReader reader = {
+                .manager = &m,
+        };
+
+        assert_int_equal(sd_event_new(&m.event), 0);
+        assert_non_null(mkdtemp(directory));
+        assert_int_equal(sd_journal_open_directory(&reader.journal, directory, 0), 0);
+
+        assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0, pair), 0);
+        p.socket = pair[0];
+
+        LIST_PREPEND(peers, d.peers, &p);
+        d.n_peers = 1;
+        LIST_PREPEND(destinations, m.destinations, &d);
+        m.n_destinations = 1;
+
+        assert_int_equal(worker_pool_new(&m, 2, &pool), 0);
+        m.workers = pool;
+
+        /* The first batch takes the longest to format, the workers likely finish the others first */
+        for (unsigned b = 0; b < N_BATCHES; b++) {
+                unsigned entries = b == 0 ? LARGE_ENTRIES : 1;
+
+                for (unsigned i = 0; i < entries; i++) {
+                        char message[LARGE_SIZE];
+                        int w;
+
+                        w = snprintf(message, sizeof(message), "m%u ", k++);
+                        if (b == 0) {
+                                memset(message + w, 'x', sizeof(message) - w - 1);
+                                message[sizeof(message) - 1] = 0;
+                        }
+
+                        assert_int_equal(worker_pool_append(pool, &reader, LOG_INFO, LOG_DAEMON >> 3, NULL, "test",
+                                                            message, "host", NULL, NULL, NULL), 0);
+                }
+
+                if (b == 0)
+                        assert_null(pool->current);
+                else
+                        assert_int_equal(worker_pool_submit(pool), 0);
+        }
+
+        assert_true(worker_pool_full(pool));
+        assert_true(m.journal_paused);
+
+        while (n < N_MESSAGES) {
+                ssize_t l;
+
+                assert_true(sd_event_run(m.event, 5 * USEC_PER_SEC) >= 0);
+
+                while ((l = recv(pair[1], buf + size, sizeof(buf) - size, 0)) > 0) {
+                        size += l;
+                        parse_messages(buf, &size, numbers, &n);
+                }
+        }
+
+        for (unsigned i = 0; i < N_MESSAGES; i++)
+                assert_int_equal(numbers[i], i);
+
+        assert_int_equal(pool->n_in_flight, 0);
+        assert_false(m.journal_paused);
+
+        pool = worker_pool_free(pool);
+        sd_journal_close(reader.journal);
+        (void) rmdir(directory);
+        output_buffer_done(&m.output);
+        network_queue_free(&p);
+        safe_close(pair[0]);
+        safe_close(pair[1]);
+        sd_event_unref(m.event);
+}
+
+int main(void) {
+        const struct CMUnitTest tests[] = {
+                cmocka_unit_test(test_worker_pool_order),
+        };
+
+        return cmocka_run_group_tests(tests, NULL, NULL);
+}